@@ -0,0 +1,46 @@
+/*
+ *  Copyright (C) 2000-2011, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef _AGENT_H_
+#define _AGENT_H_
+
+#include "types.h"
+
+/* Exec agent control socket and its lock, per CT */
+#define AGENT_SOCK		"/var/run/vzctl-agent.%d.sock"
+#define AGENT_LOCK		"/var/run/vzctl-agent.%d.lck"
+/* Agent exits after being idle that long, in seconds */
+#define AGENT_IDLE_TIMEOUT	600
+
+/** Execute command inside CT by the exec agent.
+ * The agent is a helper process which enters CT once and then
+ * runs commands on request. It is started on demand, and exits
+ * after AGENT_IDLE_TIMEOUT seconds of inactivity. If the agent
+ * can not be used, falls back to vps_exec().
+ *
+ * @param h		CT handler.
+ * @param veid		CT ID.
+ * @param root		CT root.
+ * @param exec_mode	execution mode (MODE_EXEC, MODE_BASH).
+ * @param argv		argv array.
+ * @param envp		command environment array.
+ * @return		command exit code, or error code.
+ */
+int vps_agent_exec(vps_handler *h, envid_t veid, const char *root,
+	int exec_mode, char *argv[], char *const envp[]);
+
+#endif /* _AGENT_H_ */
@@ -37,6 +37,8 @@ int vps_parse_opt(envid_t veid, struct option *opts, vps_param *param,
 	int opt, char *rval, struct mod_action *action);
 int vps_save_config(envid_t veid, char *path, vps_param *new_p,
 	vps_param *old_p, struct mod_action *action);
+int vps_write_config(envid_t veid, char *src, char *dst, vps_param *new_p,
+	vps_param *old_p, const char **drop, struct mod_action *action);
 
 vps_param *init_vps_param();
 ub_res *get_ub_res(ub_param *ub, int res_id);
@@ -46,4 +48,8 @@ int merge_global_param(vps_param *dst, vps_param *src);
 void free_vps_param(vps_param *param);
 int get_veid_by_name(const char *name);
 int set_name(int veid, char *new_name, char *old_name);
+vps_param *get_sample_config(const char *name, struct mod_action *action);
+int merge_sample_config(envid_t veid, const char *name, vps_param *dst,
+	struct mod_action *action);
+void free_sample_configs(void);
 #endif
@@ -13,6 +13,12 @@
 #define CMD_KILL		10
 #define CMD_RESUME		11
 
+/* Dump compression, 0 means not set */
+#define CPT_COMPRESS_NONE	1
+#define CPT_COMPRESS_LZ4	2
+#define CPT_COMPRESS_ZSTD	3
+#define CPT_COMPRESS_GZIP	4
+
 typedef struct {
 	char *dumpdir;
 	char *dumpfile;
@@ -20,6 +26,9 @@ typedef struct {
 	unsigned int cpu_flags;
 	int cmd;
 	int rst_fd;
+	int compress;		/**< CPT_COMPRESS_* */
+	int stream_fd;		/**< dump to/restore from this stream, -1 - not set */
+	char *dumpsock;		/**< UNIX socket to dump to */
 } cpt_param;
 
 struct vps_param;
@@ -31,4 +40,11 @@ int vps_restore(vps_handler *h, envid_t veid, struct vps_param *vps_p, int cmd,
 	cpt_param *param);
 void clean_hardlink_dir(const char *mntdir);
 
+/** Get dump compression by name.
+ *
+ * @param name		"none", "lz4", "zstd" or "gzip".
+ * @return		CPT_COMPRESS_*, -1 if unknown.
+ */
+int cpt_compress_id(const char *name);
+
 #endif
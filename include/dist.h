@@ -65,4 +65,8 @@ int read_dist_actions(char *dist_name, char *dir, dist_actions *dist);
 char *get_dist_name(tmpl_param *tmpl);
 void free_dist_actions(dist_actions *dist);
 
+/** Free distribution configs cached by read_dist_actions().
+ */
+void free_dist_confs(void);
+
 #endif
@@ -66,6 +66,14 @@ void vz_close(vps_handler *h);
  */
 int vps_is_run(vps_handler *h, envid_t veid);
 
+/** Get IDs of all running CTs at once, sorted.
+ *
+ * @param h		CT handler.
+ * @param ids		returned array of CT IDs, to be freed by the caller.
+ * @return		number of running CTs, or -1 on error.
+ */
+int vps_get_run_list(vps_handler *h, envid_t **ids);
+
 /** Start CT.
  *
  * @param h		CT handler.
@@ -95,6 +103,20 @@ int vps_start_custom(vps_handler *h, envid_t veid, vps_param *param,
 int vps_stop(vps_handler *h, envid_t veid, vps_param *param, int stop_mode,
 	skipFlags skip, struct mod_action *action);
 
+/** Restart CT, keeping its file system mounted and quota on,
+ * so only the environment itself is destroyed and recreated.
+ *
+ * @param h		CT handler.
+ * @param veid		CT ID.
+ * @param param		CT parameters.
+ * @param stop_mode	stop mode one of (M_REBOOT M_HALT M_KILL).
+ * @param skip		flags to skip CT setup and action scripts.
+ * @param action	modules list.
+ * @return		0 on success.
+ */
+int vps_restart(vps_handler *h, envid_t veid, vps_param *param,
+	int stop_mode, skipFlags skip, struct mod_action *action);
+
 /** Change root to specified directory
  *
  * @param		CT root
@@ -18,6 +18,7 @@
 #ifndef	_EXEC_H_
 #define	_EXEC_H_
 
+#include <signal.h>
 
 #include "types.h"
 
@@ -47,7 +48,44 @@ int execvep(const char *path, char *const argv[], char *const envp[]);
 int vps_exec(vps_handler *h, envid_t veid, const char *root, int exec_mode,
 	char *argv[], char *const envp[], char *std_in, int timeout);
 
-/** Read script and execute it in CT.
+/** Same as vps_exec(), but also pass a descriptor to the command.
+ *
+ * @param keep_fd	descriptor left open for the command, -1 for none.
+ */
+int vps_exec_fd(vps_handler *h, envid_t veid, const char *root,
+	int exec_mode, char *argv[], char *const envp[], char *std_in,
+	int timeout, int keep_fd);
+
+/** Callback producing command stdin for vps_exec_src().
+ *
+ * @param data		exec_stdin.data.
+ * @param buf		buffer to fill.
+ * @param len		buffer size.
+ * @return		number of bytes put into buf, 0 at end of data,
+ *			-1 on error (errno set).
+ */
+typedef int (* stdinFn)(void *data, char *buf, int len);
+
+/** Source of command stdin, either a descriptor or a callback.
+ * Data is streamed to the command as it takes it, while its output
+ * is being relayed, so it never has to be in memory as a whole.
+ */
+struct exec_stdin {
+	int fd;			/**< read from descriptor, -1 to use fn */
+	stdinFn fn;		/**< callback, if fd is -1 */
+	void *data;		/**< callback data */
+};
+
+/** Same as vps_exec_fd(), but stdin is streamed from a source.
+ *
+ * @param src		stdin source, NULL to relay STDIN_FILENO.
+ */
+int vps_exec_src(vps_handler *h, envid_t veid, const char *root,
+	int exec_mode, char *argv[], char *const envp[],
+	struct exec_stdin *src, int timeout, int keep_fd);
+
+/** Execute script in CT, streaming it with the function file
+ * (if any, from the script directory) to bash stdin.
  *
  * @param h		CT handler.
  * @param veid		CT ID.
@@ -68,6 +106,37 @@ int vps_execFn(vps_handler *h, envid_t veid, const char *root,
 
 int env_wait(int pid);
 
+/** Descriptor which becomes readable when a child process exits,
+ * for use with poll() or epoll. It is a pidfd if the kernel has them,
+ * otherwise a signalfd for SIGCHLD, which is blocked until
+ * child_watch_close().
+ */
+struct child_watch {
+	int pid;
+	int fd;
+	int sigfd;		/* fd is a signalfd */
+	sigset_t oldmask;
+};
+
+/** Start watching for child exit.
+ *
+ * @param w		watch to set up.
+ * @param pid		child process ID.
+ * @return		0 on success.
+ */
+int child_watch_init(struct child_watch *w, int pid);
+
+/** Check if the child exited, without reaping it.
+ * To be called when w->fd is readable, and once after
+ * child_watch_init(), since the child could exit before.
+ *
+ * @return		1 - exited, 0 - still running.
+ */
+int child_watch_exited(struct child_watch *w);
+
+/** Stop watching, restoring the signal mask if it was changed. */
+void child_watch_close(struct child_watch *w);
+
 struct vps_param;
 int vps_run_script(vps_handler *h, envid_t veid, char *script,
 	struct vps_param *vps_p);
@@ -29,6 +29,20 @@
  */
 int vps_lock(envid_t veid, char *dir, char *status);
 
+/** Lock CT, waiting for the lock if it is taken.
+ * Waiters are queued in $dir/$veid.lck.queue and get the lock
+ * in order of arrival.
+ * @param veid		CT ID.
+ * @param dir		lock directory.
+ * @param status	transition status.
+ * @param timeout	seconds to wait, 0 - do not wait.
+ * @return		0 - success
+ *			1 - locked
+ *			-1- error.
+ */
+int vps_lock_wait(envid_t veid, char *dir, char *status,
+		unsigned long timeout);
+
 /** Unlock CT.
  *
  * @param veid		CT ID.
@@ -0,0 +1,64 @@
+/*
+ *  Copyright (C) 2000-2011, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef	_RELAY_H_
+#define	_RELAY_H_
+
+/* Pipe size asked for by relay_grow_pipe() */
+#define RELAY_PIPE_SIZE		(1024 * 1024)
+
+/** Data stream from one descriptor to another.
+ */
+struct relay {
+	int rdfd;
+	int wrfd;
+	int splice;	/**< data is moved by splice() */
+	int nonblock;	/**< rdfd is in non-blocking mode */
+};
+
+/** Set up a stream, finding out if it can be moved by splice()
+ * (one end is a pipe, the other one is a pipe, file or socket).
+ * Should be called after rdfd is put into non-blocking mode, if ever.
+ *
+ * @param r		stream to set up.
+ * @param rdfd		descriptor to read from.
+ * @param wrfd		descriptor to write to.
+ */
+void relay_init(struct relay *r, int rdfd, int wrfd);
+
+/** Move available data, writing all that was read.
+ *
+ * @param r		stream.
+ * @return		0 - some data moved
+ *			1 - no data available (non-blocking rdfd)
+ *			-1 - end of file or error.
+ */
+int relay_move(struct relay *r);
+
+/** Enlarge pipe buffer up to RELAY_PIPE_SIZE, so that fewer
+ * wakeups and calls are needed to move a stream. Errors are ignored.
+ *
+ * @param fd		any end of a pipe.
+ */
+void relay_grow_pipe(int fd);
+
+/** Allow or disallow splice() for streams set up afterwards
+ * (on by default), to compare with copying through a buffer.
+ */
+void relay_use_splice(int on);
+
+#endif /* _RELAY_H_ */
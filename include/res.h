@@ -56,6 +56,7 @@ typedef struct {
 	char *description;
 	int onboot;
 	unsigned long *bootorder;
+	unsigned long *stop_timeout;
 	int wait;
 } misc_param;
 
@@ -106,10 +107,16 @@ typedef struct {
 	int setmode;
 	char *config;
 	char *origin_sample;
+	char *base_sample;
+	int inherit_sample;
 	char *lockdir;
+	unsigned long *lock_timeout;
+	char *timing_log;
 	char *apply_cfg;
 	int apply_cfg_map;
 	int reset_ub;
+	int exec_agent;
+	int keep_mounted;
 } vps_opt;
 
 struct log_s {
@@ -143,6 +150,31 @@ typedef struct vps_param vps_param;
 int vps_setup_res(vps_handler *h, envid_t veid, dist_actions *actions,
 	fs_param *fs, vps_param *param, int vps_state, skipFlags skip,
 	struct mod_action *action);
+
+/* CT subsystems, for vps_res_changes() */
+#define VPS_RES_UB		(1 << 0)
+#define VPS_RES_NET		(1 << 1)
+#define VPS_RES_NETDEV		(1 << 2)
+#define VPS_RES_CPU		(1 << 3)
+#define VPS_RES_DEV		(1 << 4)
+#define VPS_RES_PCI		(1 << 5)
+#define VPS_RES_FS		(1 << 6)
+#define VPS_RES_MEMINFO		(1 << 7)
+#define VPS_RES_IO		(1 << 8)
+#define VPS_RES_QUOTA		(1 << 9)
+#define VPS_RES_CONFIGURE	(1 << 10)
+#define VPS_RES_VETH		(1 << 11)
+#define VPS_RES_ALL		(~0)
+
+/** Setting changed CT resources only.
+ *
+ * Same as vps_setup_res(), but only subsystems from changes mask
+ * are set up.
+ */
+int vps_setup_res_changed(vps_handler *h, envid_t veid,
+	dist_actions *actions, fs_param *fs, vps_param *param, int changes,
+	int vps_state, skipFlags skip, struct mod_action *action);
+int vps_res_changes(vps_param *new);
 int setup_resource_management(vps_handler *h, envid_t veid, vps_res *res);
 int need_configure(vps_res *res);
 
@@ -0,0 +1,52 @@
+/*
+ *  Copyright (C) 2000-2011, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef _SPAN_H_
+#define _SPAN_H_
+
+#include "types.h"
+
+/* Maximum number of phases recorded per operation */
+#define MAX_SPANS	64
+
+/** Start recording phase timings of an operation.
+ *
+ * @param veid		CT ID.
+ * @param op		operation name, e.g. "start".
+ * @param file		file to append records to, or NULL.
+ */
+void span_start(envid_t veid, const char *op, const char *file);
+
+/** Begin a phase. Phases can be nested.
+ *
+ * @param name		phase name.
+ */
+void span_begin(const char *name);
+
+/** End the innermost phase.
+ * If no operation is being recorded, phase time is logged immediately.
+ */
+void span_end(void);
+
+/** Stop recording, print per-phase breakdown in verbose mode
+ * and append records to the file given to span_start().
+ *
+ * @param ret		operation return code.
+ */
+void span_finish(int ret);
+
+#endif /* _SPAN_H_ */
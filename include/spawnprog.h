@@ -0,0 +1,60 @@
+/*
+ *  Copyright (C) 2000-2011, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef	_SPAWNPROG_H_
+#define	_SPAWNPROG_H_
+
+#include <sys/types.h>
+
+/* Special values for spawn_prog() stdio descriptors */
+#define SPAWN_NULL	-1	/**< redirect to /dev/null */
+#define SPAWN_KEEP	-2	/**< inherit from the caller */
+
+/** Start a host program, without copying the caller's address space
+ * (posix_spawn(), which is vfork() + exec in glibc). Descriptors other
+ * than stdio are not passed to the program if the C library can close
+ * them; the program gets an empty signal mask and default SIGPIPE.
+ *
+ * @param path		program path.
+ * @param argv		argv array.
+ * @param envp		environment array.
+ * @param in		stdin descriptor, SPAWN_NULL or SPAWN_KEEP.
+ * @param out		stdout descriptor, SPAWN_NULL or SPAWN_KEEP.
+ * @param err		stderr descriptor, SPAWN_NULL or SPAWN_KEEP.
+ * @return		program pid, -1 on error (logged).
+ */
+pid_t spawn_prog(const char *path, char *const argv[], char *const envp[],
+	int in, int out, int err);
+
+/** Find a program by name in DEF_PATH.
+ *
+ * @param name		program name, or path if it has a slash.
+ * @param buf		buffer for program path.
+ * @param len		buffer size.
+ * @return		0 if found, -1 otherwise.
+ */
+int spawn_find(const char *name, char *buf, int len);
+
+/** Wait for a spawned program to finish.
+ *
+ * @param pid		program pid.
+ * @param path		program path, for messages.
+ * @return		program exit code, VZ_SYSTEM_ERROR if killed.
+ */
+int spawn_wait(pid_t pid, const char *path);
+
+#endif /* _SPAWNPROG_H_ */
@@ -0,0 +1,130 @@
+/*
+ *  Copyright (C) 2000-2011, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef _STATUS_H_
+#define _STATUS_H_
+
+#include "types.h"
+#include "res.h"
+
+/* Status table file, in LOCKDIR */
+#define CT_STATUS_FILE		"ct-status"
+
+/* CT state flags */
+#define CT_ST_RUNNING		0x1
+#define CT_ST_MOUNTED		0x2
+#define CT_ST_SUSPENDED		0x4
+
+/* CT transitions */
+enum {
+	CT_TR_NONE = 0,
+	CT_TR_STARTING,
+	CT_TR_STOPPING,
+	CT_TR_MOUNTING,
+	CT_TR_UMOUNTING,
+	CT_TR_SUSPENDING,
+	CT_TR_RESTORING,
+	CT_TR_CREATING,
+	CT_TR_DESTROYING,
+	CT_TR_CHANGING,
+};
+
+struct ct_status {
+	envid_t veid;
+	int state;		/* CT_ST_* flags */
+	int transition;		/* CT_TR_* */
+	int lock_pid;		/* process doing the transition, or 0 */
+	time_t mtime;		/* last update */
+	unsigned int seq;	/* for ct_status_refresh() */
+};
+
+/** Map the status table in lockdir, creating it if needed.
+ * Without a mapped table other ct_status_* functions do nothing
+ * and ct_status_get() always reports the data as stale.
+ *
+ * @param lockdir	lock directory.
+ * @return		0 on success.
+ */
+int ct_status_init(const char *lockdir);
+
+/** Unmap the status table. */
+void ct_status_close(void);
+
+/** Mark the table as kept up to date by the event daemon (vzeventd).
+ * Entries are only trusted while the daemon is alive, and only the
+ * ones written since it started, so that changes which happened
+ * behind vzctl's back (like CT halt from inside) are not missed.
+ */
+void ct_status_attach(void);
+
+/** Record start of a CT transition by the current process. */
+void ct_status_begin(envid_t veid, int transition);
+
+/** Record end of a CT transition.
+ *
+ * @param state		CT_ST_* flags, as found after the transition.
+ */
+void ct_status_end(envid_t veid, int state);
+
+/** Set or clear state flags on an event (used by vzeventd).
+ * Stale entries are not changed.
+ */
+void ct_status_event(envid_t veid, int set, int clear);
+
+/** Read CT status from the table, without locking.
+ *
+ * @param veid		CT ID.
+ * @param st		filled status.
+ * @return		0 - status is valid
+ *			1 - no valid status, use the slow probes
+ */
+int ct_status_get(envid_t veid, struct ct_status *st);
+
+/** Store the result of the slow probes after ct_status_get() failed.
+ * Nothing is stored if the entry was changed after it was read.
+ *
+ * @param st		status as returned by ct_status_get().
+ * @param state		CT_ST_* flags found by probing.
+ */
+void ct_status_refresh(struct ct_status *st, int state);
+
+/** Recheck the flags vzeventd does not track after ct_status_get()
+ * succeeded. A manual umount or a removed dump file leaves MOUNTED or
+ * SUSPENDED stale, so both are checked the cheap way: a device change
+ * at CT root instead of a /proc/mounts scan, and a stat() of the dump
+ * file. The entry is updated if they were wrong.
+ *
+ * @param st		status as returned by ct_status_get().
+ * @param root		CT root.
+ * @param dumpdir	dump directory, or NULL.
+ * @return		CT_ST_* flags.
+ */
+int ct_status_check(struct ct_status *st, const char *root,
+	const char *dumpdir);
+
+/** Find out CT state the slow way: ioctl, /proc/mounts, dump file.
+ *
+ * @param h		CT handler, or NULL to skip the running check.
+ * @param veid		CT ID.
+ * @param root		CT root.
+ * @param dumpdir	dump directory, or NULL.
+ * @return		CT_ST_* flags.
+ */
+int ct_status_probe(vps_handler *h, envid_t veid, const char *root,
+	const char *dumpdir);
+
+#endif /* _STATUS_H_ */
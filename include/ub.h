@@ -22,6 +22,7 @@
 
 #define PROCUBC		"/proc/user_beancounters"
 #define PROC_BC_RES	"/proc/bc/resources"
+#define PROC_BC_DIR	"/proc/bc"
 
 #ifndef UB_KMEMSIZE
 #define UB_KMEMSIZE	0	/* Unswappable kernel memory size including
@@ -148,6 +149,17 @@ typedef struct ub_struct ub_param;
 int vps_set_ublimit(vps_handler *h, envid_t veid, ub_param *ubc);
 int set_ublimit(vps_handler *h, envid_t veid, ub_param *ubc);
 
+/** Apply UBC resources which differ from the current ones.
+ *
+ * @param h		CT handler.
+ * @param veid		CT ID.
+ * @param ubc		UBC parameters
+ * @param changed	number of resources actually changed, or NULL.
+ * @return		0 on success
+ */
+int set_ublimit_changed(vps_handler *h, envid_t veid, ub_param *ubc,
+	int *changed);
+
 /** Check that all required parameters are specified in ub.
  *
  * @param ub		UBC parameters.
@@ -163,13 +175,22 @@ int check_ub(ub_param *ub);
  */
 int add_ub_param(ub_param *ub, ub_res *res);
 
-/** Read UBC resources current usage from /proc/user_beancounters
+/** Read UBC resources current usage from /proc/bc/<veid>/resources
+ * or /proc/user_beancounters
  *
  * @param veid		CT ID.
  * @param ub		UBC parameters.
  * @return		0 on success.
  */
 int vps_read_ubc(envid_t veid, ub_param *ub);
+
+/** Read UBC resources current barrier:limit values, same as vps_read_ubc
+ *
+ * @param veid		CT ID.
+ * @param ub		UBC parameters.
+ * @return		0 on success.
+ */
+int vps_read_ub_limits(envid_t veid, ub_param *ub);
 int get_ub_resid(char *name);
 const char *get_ub_name(unsigned int res_id);
 void add_ub_limit(struct ub_struct *ub, int res_id, unsigned long *limit);
@@ -35,4 +35,20 @@ int vps_configure(vps_handler *h, envid_t veid, dist_actions *actions,
 int vps_ip_configure(vps_handler *h, envid_t veid, dist_actions *actions,
 	const char *root, int op, net_param *net, int state);
 const char *state2str(int state);
+
+/** Start a configure session. Until vps_configure_end() is called,
+ * action scripts are collected instead of being run.
+ */
+void vps_configure_begin(void);
+
+/** Run all action scripts collected in a configure session
+ * by a single shell inside CT.
+ *
+ * @param h		CT handler.
+ * @param veid		CT ID.
+ * @param root		CT root.
+ * @return		0 on success, or the first failed script exit code.
+ *			Failures of vps_configure() scripts are only logged.
+ */
+int vps_configure_end(vps_handler *h, envid_t veid, const char *root);
 #endif
@@ -38,7 +38,9 @@ typedef enum {
 	ACTION_RESTORE,
 	ACTION_QUOTAON,
 	ACTION_QUOTAOFF,
-	ACTION_QUOTAINIT
+	ACTION_QUOTAINIT,
+	ACTION_START_ALL,
+	ACTION_STOP_ALL
 } act_t;
 
 /* default cpu units values */
@@ -138,6 +138,16 @@
 #define PARAM_PCI_DEL		366
 #define PARAM_RAM		367
 #define PARAM_SWAP		368
+#define PARAM_BASE_SAMPLE	369
+#define PARAM_INHERIT_SAMPLE	370
+#define PARAM_STOP_TIMEOUT	371
+#define PARAM_TIMING_LOG	372
+#define PARAM_KEEP_MOUNTED	373
+#define PARAM_LOCK_TIMEOUT	374
+#define PARAM_DUMP_COMPRESS	375
+#define PARAM_DUMP_TO_FD	376
+#define PARAM_DUMP_TO_SOCKET	377
+#define PARAM_FROM_FD		378
 
 #define PARAM_LINE		"e:p:f:t:i:l:k:a:b:n:x:h"
 #endif
@@ -0,0 +1,283 @@
+/*
+ *  Copyright (C) 2000-2011, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef _VZMIGRATE_H_
+#define _VZMIGRATE_H_
+
+#include <stdint.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "types.h"
+
+/* Exit codes, same as of the old shell vzmigrate */
+#define MIG_ERR_USAGE		1
+#define MIG_ERR_VPS_IS_STOPPED	2
+#define MIG_ERR_CANT_CONNECT	4
+#define MIG_ERR_COPY		6
+#define MIG_ERR_START_VPS	7
+#define MIG_ERR_STOP_SOURCE	8
+#define MIG_ERR_EXISTS		9
+#define MIG_ERR_NOEXIST		10
+#define MIG_ERR_IP_IN_USE	12
+#define MIG_ERR_QUOTA		13
+#define MIG_ERR_OVZ_NOT_RUNNING	14
+#define MIG_ERR_APPLY_CONFIG	15
+#define MIG_ERR_CHECKPOINT	MIG_ERR_STOP_SOURCE
+#define MIG_ERR_MOUNT_VPS	MIG_ERR_START_VPS
+#define MIG_ERR_RESTORE_VPS	MIG_ERR_START_VPS
+#define MIG_ERR_PROTO		MIG_ERR_CANT_CONNECT
+
+#define MIG_VERSION		2
+
+/* Data is compared and moved in blocks of this size */
+#define MIG_BLOCK		(64 * 1024)
+/* Files are split into units of this size to spread them over streams */
+#define MIG_UNIT		(64 * 1024 * 1024)
+/* Max message payload */
+#define MIG_MSG_MAX		(4 * 1024 * 1024)
+
+/* Messages, all but MIG_REPLY go from the sender to the receiver */
+enum {
+	MIG_HELLO = 1,		/* struct mig_hello */
+	MIG_REPLY,		/* int32 code */
+	/* control channel */
+	MIG_CHECK,		/* struct mig_check, CT config file */
+	MIG_SCRIPT,		/* uint32 mode, suffix '\0', action script */
+	MIG_PREPARE,		/* make dirs, set up quota */
+	MIG_TREE,		/* packed tree entries */
+	MIG_TREE_END,		/* uint32 MIG_TREE_* flags, reply is MIG_TODO */
+	MIG_TODO,		/* bitmap of files to sync, by entry number */
+	MIG_DELETE,		/* paths to remove, '\0' separated */
+	MIG_ATTRS,		/* set attributes of all tree entries */
+	MIG_QUOTA,		/* 2nd level quota dump data */
+	MIG_QUOTA_END,
+	MIG_RESTORE,		/* undump and resume */
+	MIG_START,		/* int32 CT_ST_* state to bring CT into */
+	MIG_DONE,
+	MIG_ABORT,
+	/* sync channels */
+	MIG_UNIT_REQ,		/* struct mig_unit, path */
+	MIG_BATCH,		/* end of requests, reply is MIG_SUMS each */
+	MIG_SUMS,		/* uint32 unit, 0 or block hashes */
+	MIG_DATA,		/* uint32 unit, uint64 offset, data */
+	MIG_UNIT_END,		/* uint32 unit */
+	MIG_BATCH_END,		/* reply is MIG_REPLY */
+	MIG_BYE,
+};
+
+/* Channel roles */
+enum {
+	MIG_CH_CTL = 1,
+	MIG_CH_SYNC,
+	MIG_CH_DUMP,
+};
+
+struct mig_msg_hdr {
+	uint32_t type;
+	uint32_t len;
+};
+
+struct mig_hello {
+	uint32_t version;
+	uint32_t role;
+	uint32_t veid;
+};
+
+/* MIG_CHECK flags */
+#define MIG_F_ONLINE		0x1
+#define MIG_F_KEEP_DST		0x2
+#define MIG_F_QUOTA		0x4
+#define MIG_F_NEED_VZ		0x8
+
+struct mig_check {
+	uint32_t flags;
+};
+
+/* MIG_TREE_END flags */
+#define MIG_TREE_DELTA		0x1	/* changed entries only, keep the rest */
+
+/* Tree entry types */
+enum {
+	MIG_ENT_DIR = 1,
+	MIG_ENT_FILE,
+	MIG_ENT_LINK,		/* hard link, target is the first path */
+	MIG_ENT_SYMLINK,
+	MIG_ENT_SPECIAL,	/* device, fifo or socket */
+};
+
+/* Tree entry as sent, followed by path and target, not aligned */
+struct mig_ent_hdr {
+	uint8_t type;
+	uint32_t mode;
+	uint32_t uid;
+	uint32_t gid;
+	uint64_t size;
+	int64_t mtime;
+	uint32_t mtime_ns;
+	uint64_t rdev;
+	uint32_t nlink;
+	uint16_t path_len;
+	uint16_t target_len;
+} __attribute__ ((packed));
+
+struct mig_ent {
+	struct mig_ent_hdr h;
+	char *path;		/* relative to private */
+	char *target;		/* symlink or hard link target */
+};
+
+struct mig_tree {
+	struct mig_ent *ent;
+	int n;
+	int size;
+};
+
+/* Files with more than one link by inode, to find hard links */
+struct mig_inode {
+	dev_t dev;
+	ino_t ino;
+	char *path;		/* first path seen */
+};
+
+struct mig_inodes {
+	struct mig_inode *tab;
+	unsigned int size;
+	unsigned int n;
+};
+
+/* Range of a file to sync */
+struct mig_unit_hdr {
+	uint64_t offset;
+	uint64_t len;
+	uint64_t size;		/* file size and mtime, for the manifest */
+	int64_t mtime;
+	uint32_t mtime_ns;
+	uint16_t path_len;
+} __attribute__ ((packed));
+
+struct mig_unit {
+	struct mig_unit_hdr h;
+	char *path;
+};
+
+/* Block hash */
+struct mig_hash {
+	uint64_t h1;
+	uint64_t h2;
+};
+
+/* Channel to the receiver: a byte stream, e.g. pipes to ssh */
+struct mig_chan {
+	int rd;
+	int wr;
+	pid_t pid;		/* transport process, or 0 */
+	void *buf;		/* last received message */
+	size_t buf_size;
+};
+
+/* Lookup of paths inside the private area one part at a time, never
+ * following a symlink, so that a running CT can not redirect it out of
+ * the area by replacing a directory with a symlink. The directory found
+ * last is kept open for the next lookup.
+ */
+struct mig_walk {
+	int root;		/* private area, not owned */
+	int fd;			/* directory found last, or -1 */
+	char dir[PATH_MAX];	/* its path */
+};
+
+/* Where to migrate to */
+struct mig_dest {
+	char *host;
+	char *ssh_opts;		/* extra ssh options, space separated */
+};
+
+/* vzmigrate-proto.c */
+int mig_send(struct mig_chan *ch, int type, void *data, size_t len);
+int mig_send2(struct mig_chan *ch, int type, void *d1, size_t len1,
+	void *d2, size_t len2);
+int mig_recv(struct mig_chan *ch, int *type, void **data, size_t *len);
+int mig_expect(struct mig_chan *ch, int type, void **data, size_t *len);
+int mig_reply(struct mig_chan *ch, int code);
+int mig_wait_reply(struct mig_chan *ch);
+int mig_write(int fd, const void *buf, size_t len);
+int mig_read(int fd, void *buf, size_t len);
+
+/* Transport: starts the receiver (rargv) and connects a channel to it */
+struct mig_transport {
+	const char *name;
+	int (*open)(struct mig_chan *ch, char **rargv, struct mig_dest *dest);
+};
+
+struct mig_transport *mig_find_transport(const char *name);
+int mig_open(struct mig_transport *t, struct mig_chan *ch, char **rargv,
+	struct mig_dest *dest, int role, envid_t veid);
+void mig_close(struct mig_chan *ch);
+
+struct mig_track;
+
+/* Entries changed since the last pass */
+struct mig_delta {
+	struct mig_tree tree;
+	char **del;		/* paths gone */
+	int ndel;
+	unsigned long long bytes;	/* in changed files */
+};
+
+/* vzmigrate-sync.c */
+void mig_hash_block(const void *buf, size_t len, struct mig_hash *h);
+int mig_add_ent(struct mig_tree *tree, struct mig_inodes *inodes, int dfd,
+	const char *name, const char *path, struct stat *st,
+	struct mig_walk *lw);
+void mig_free_inodes(struct mig_inodes *m);
+int mig_scan_tree(const char *dir, struct mig_tree *tree,
+	struct mig_inodes *inodes, struct mig_track *track);
+void mig_free_tree(struct mig_tree *tree);
+int mig_pack_tree(struct mig_chan *ch, struct mig_tree *tree, uint32_t flags);
+int mig_pack_delete(struct mig_chan *ch, char **paths, int n);
+int mig_bad_path(const char *path);
+void mig_walk_init(struct mig_walk *w, int root);
+void mig_walk_done(struct mig_walk *w);
+int mig_walk(struct mig_walk *w, const char *path, const char **name);
+int mig_walk_open(struct mig_walk *w, const char *path, int flags,
+	mode_t mode);
+int mig_unpack_tree(const void *data, size_t len, struct mig_tree *tree);
+int mig_sync_send(struct mig_chan *ch, const char *dir,
+	struct mig_unit *units, int n);
+int mig_sync_recv(struct mig_chan *ch, const char *dir,
+	const char *manifest);
+
+/* vzmigrate-track.c */
+struct mig_track *mig_track_init(const char *dir, const char *root);
+void mig_track_free(struct mig_track *t);
+int mig_track_fd(struct mig_track *t);
+int mig_track_dir(struct mig_track *t, const char *path);
+void mig_track_reset(struct mig_track *t);
+void mig_track_poll(struct mig_track *t);
+void mig_track_clear(struct mig_track *t);
+int mig_track_delta(struct mig_track *t, struct mig_inodes *inodes,
+	struct mig_delta *d);
+void mig_free_delta(struct mig_delta *d);
+void mig_track_open_files(struct mig_track *t, envid_t veid,
+	const char *root);
+
+/* vzmigrate-recv.c */
+int mig_receiver(char *private, char *root, char *confdir);
+
+#endif /* _VZMIGRATE_H_ */
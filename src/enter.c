@@ -30,16 +30,24 @@
 #include <pty.h>
 #include <grp.h>
 #include <pwd.h>
+#include <stdint.h>
+#include <time.h>
+#include <poll.h>
+#include <dirent.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "vzerror.h"
 #include "logger.h"
 #include "env.h"
 #include "util.h"
+#include "relay.h"
+#include "exec.h"
 
 #define DEV_TTY		"/dev/tty"
 
-static volatile sig_atomic_t child_term;
-static volatile sig_atomic_t win_changed;
 static struct termios s_tios;
 extern char *_proc_title;
 extern int _proc_title_len;
@@ -110,16 +118,6 @@ static int winchange(int info, int ptyfd)
 	return 0;
 }
 
-static void child_handler(int sig)
-{
-	child_term = 1;
-}
-
-static void winchange_handler(int sig)
-{
-	win_changed = 1;
-}
-
 static void set_proc_title(char *tty)
 {
 	char *p;
@@ -132,91 +130,170 @@ static void set_proc_title(char *tty)
 		p != NULL ? p : "");
 }
 
-static int stdredir(int rdfd, int wrfd)
+/* Events in the enter loop */
+enum {
+	EV_IN,
+	EV_OUT,
+	EV_INFO,
+	EV_CHILD,
+	EV_WINCH,
+};
+
+static int ev_add(int epfd, int fd, int tag)
 {
-	int lenr, lenw, lentotal, lenremain;
-	char buf[10240];
-	char *p;
+	struct epoll_event ev;
 
-	if ((lenr = read(rdfd, buf, sizeof(buf)-1)) > 0) {
-		lentotal = 0;
-		lenremain = lenr;
-		p = buf;
-		while (lentotal < lenr) {
-			while ((lenw = write(wrfd, p, lenremain)) < 0)
-				if (errno != EINTR && errno != EAGAIN)
-					break;
-			if (lenw < 0) {
-				return -1;
-			} else {
-				lentotal += lenw;
-				lenremain -= lenw;
-				p += lenw;
-			}
-		}
-	} else if (lenr == 0) {
-		return -1;
-	} else {
-		if (errno == EAGAIN)
-			return 1;
-		else if (errno != EINTR)
-			return -1;
-	}
-	return 0;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = tag;
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
 }
 
-static void e_loop(int r_in, int w_in,  int r_out, int w_out, int info)
+/* Relay r_in -> w_in and r_out -> w_out until the child exits.
+ * Window size changes are sent to info_wr on SIGWINCH, and the ones
+ * read from info_rd are set on w_in.
+ */
+static void e_loop(int pid, int r_in, int w_in, int r_out, int w_out,
+	int info_rd, int info_wr)
 {
-	int n, fl = 0;
-	fd_set rd_set;
+	int i, n, fl = 0, done, in_poll = 0;
+	int epfd, winfd = -1;
+	struct relay in, out;
+	struct child_watch cw;
+	struct epoll_event ev[8];
+	struct signalfd_siginfo si;
+	sigset_t mask, oldmask;
 
 	set_not_blk(r_in);
 	set_not_blk(r_out);
-	while (!child_term) {
-		/* Process SIGWINCH
-		 * read winsize from stdin and send announce to the other end.
-		 */
-		if (win_changed) {
-			struct winsize ws;
-
-			if (!ioctl(r_in, TIOCGWINSZ, &ws))
-				write(info, &ws, sizeof(ws));
-			win_changed = 0;
+	relay_init(&in, r_in, w_in);
+	relay_init(&out, r_out, w_out);
+	cw.fd = -1;
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+		child_watch_init(&cw, pid) ||
+		ev_add(epfd, cw.fd, EV_CHILD) ||
+		ev_add(epfd, r_out, EV_OUT))
+	{
+		logger(-1, errno, "Unable to set up enter loop");
+		goto out;
+	}
+	if (ev_add(epfd, r_in, EV_IN)) {
+		/* Regular files and such are always ready */
+		if (errno == EPERM)
+			in_poll = 1;
+		else
+			fl |= 1;
+	}
+	if (info_rd < 0 || ev_add(epfd, info_rd, EV_INFO))
+		fl |= 4;
+	if (info_wr >= 0) {
+		sigemptyset(&mask);
+		sigaddset(&mask, SIGWINCH);
+		sigprocmask(SIG_BLOCK, &mask, &oldmask);
+		winfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+		if (winfd >= 0)
+			ev_add(epfd, winfd, EV_WINCH);
+	}
+	done = child_watch_exited(&cw);
+	while (!done) {
+		n = epoll_wait(epfd, ev, ARRAY_SIZE(ev), in_poll ? 0 : -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			close(r_out);
+			fl |= 2;
+			logger(-1, errno, "Error in epoll_wait()");
+			break;
 		}
-		FD_ZERO(&rd_set);
-		if (!(fl & 1))
-			FD_SET(r_in, &rd_set);
-		if (!(fl & 2))
-			FD_SET(r_out, &rd_set);
-		if (!(fl & 4))
-			FD_SET(info, &rd_set);
-
-		n = select(FD_SETSIZE, &rd_set, NULL, NULL, NULL);
-		if (n > 0) {
-			if (FD_ISSET(r_in, &rd_set))
-				if (stdredir(r_in, w_in) < 0) {
+		for (i = 0; i < n && !(fl & 2); i++) {
+			switch (ev[i].data.u32) {
+			case EV_IN:
+				if (!(fl & 1) && relay_move(&in) < 0) {
 					close(w_in);
+					epoll_ctl(epfd, EPOLL_CTL_DEL, r_in,
+						NULL);
 					fl |= 1;
 				}
-			if (FD_ISSET(r_out, &rd_set))
-				if (stdredir(r_out, w_out) < 0) {
+				break;
+			case EV_OUT:
+				if (relay_move(&out) < 0) {
 					close(r_out);
 					fl |= 2;
-					break;
+					done = 1;
 				}
-			if (FD_ISSET(info, &rd_set)) {
-				if (winchange(info, w_in) < 0)
+				break;
+			case EV_INFO:
+				if (!(fl & 4) && winchange(info_rd, w_in) < 0) {
+					epoll_ctl(epfd, EPOLL_CTL_DEL, info_rd,
+						NULL);
 					fl |= 4;
+				}
+				break;
+			case EV_CHILD:
+				if (child_watch_exited(&cw))
+					done = 1;
+				break;
+			case EV_WINCH:
+			{
+				/* Read winsize from stdin and send announce
+				 * to the other end.
+				 */
+				struct winsize ws;
+
+				while (read(winfd, &si, sizeof(si)) > 0);
+				if (!ioctl(r_in, TIOCGWINSZ, &ws))
+					write(info_wr, &ws, sizeof(ws));
+				break;
 			}
-		} else if (n < 0 && errno != EINTR) {
-			close(r_out);
-			logger(-1, errno, "Error in select()");
-			break;
+			}
+		}
+		if (in_poll && !(fl & 1) && relay_move(&in) < 0) {
+			close(w_in);
+			fl |= 1;
+			in_poll = 0;
 		}
 	}
+out:
+	if (winfd >= 0) {
+		close(winfd);
+		sigprocmask(SIG_SETMASK, &oldmask, NULL);
+	}
+	child_watch_close(&cw);
+	if (epfd >= 0)
+		close(epfd);
 	/* Flush fds */
 	if (!(fl & 2))
-		while (stdredir(r_out, w_out) == 0);
+		while (relay_move(&out) == 0);
+}
+
+/* Run login shell on the pty slave, in a child of the pty owner */
+static void exec_shell(int slave)
+{
+	char buf[64];
+	char *term;
+	char *arg[] = {NULL, NULL};
+	char *env[] = {ENV_PATH,
+		"HISTFILE=/dev/null",
+		"USER=root", "HOME=/root", "LOGNAME=root",
+		NULL, /* for TERM */
+		NULL};
+
+	set_ctty(slave);
+	dup2(slave, 0);
+	dup2(slave, 1);
+	dup2(slave, 2);
+	/* Close the extra descriptor for the pseudo tty. */
+	close(slave);
+	if ((term = getenv("TERM")) != NULL) {
+		snprintf(buf, sizeof(buf), "TERM=%s", term);
+		env[ARRAY_SIZE(env) - 2] = buf;
+	}
+	arg[0] = "-bash";
+	execve("/bin/bash", arg, env);
+	arg[0] = "-sh";
+	execve("/bin/sh", arg, env);
+	logger(-1, errno, "enter failed: unable to exec sh");
+	exit(1);
 }
 
 static void preload_lib()
@@ -251,22 +328,15 @@ int do_enter(vps_handler *h, envid_t veid, const char *root,
 		logger(-1, errno, "Unable to create pipe");
 		return VZ_RESOURCE_ERROR;
 	}
+	relay_grow_pipe(out[0]);
 	if ((ret = vz_setluid(veid)))
 		return ret;
 	preload_lib();
-	child_term = 0;
 	sigemptyset(&act.sa_mask);
-	act.sa_flags = SA_NOCLDSTOP;
-	act.sa_handler = child_handler;
-	sigaction(SIGCHLD, &act, NULL);
-
 	act.sa_handler = SIG_IGN;
 	act.sa_flags = 0;
 	sigaction(SIGPIPE, &act, NULL);
 
-	act.sa_handler = winchange_handler;
-	sigaction(SIGWINCH, &act, NULL);
-
 	if ((pid = fork()) < 0) {
 		logger(-1, errno, "Unable to fork");
 		ret = VZ_RESOURCE_ERROR;
@@ -298,42 +368,14 @@ int do_enter(vps_handler *h, envid_t veid, const char *root,
 		if ((ret = pty_alloc(&master, &slave, &tios, &ws)))
 			goto err;
 		set_proc_title(ttyname(slave));
-		child_term = 0;
-		sigemptyset(&act.sa_mask);
-		act.sa_flags = SA_NOCLDSTOP;
-		act.sa_handler = child_handler;
-		sigaction(SIGCHLD, &act, NULL);
 		if ((pid = fork()) == 0) {
-			char buf[64];
-			char *term;
-			char *arg[] = {NULL, NULL};
-			char *env[] = {ENV_PATH,
-				"HISTFILE=/dev/null",
-				"USER=root", "HOME=/root", "LOGNAME=root",
-				NULL, /* for TERM */
-				NULL};
 			close(master);
-			set_ctty(slave);
-			dup2(slave, 0);
-			dup2(slave, 1);
-			dup2(slave, 2);
-			/* Close the extra descriptor for the pseudo tty. */
-			close(slave);
 			/* Close other ends of our pipes */
 			close(in[0]);
 			close(out[1]);
 			close(st[1]);
 			close(info[0]);
-			if ((term = getenv("TERM")) != NULL) {
-				snprintf(buf, sizeof(buf), "TERM=%s", term);
-				env[ARRAY_SIZE(env) - 2] = buf;
-			}
-			arg[0] = "-bash";
-			execve("/bin/bash", arg, env);
-			arg[0] = "-sh";
-			execve("/bin/sh", arg, env);
-			logger(-1, errno, "enter failed: unable to exec sh");
-			exit(1);
+			exec_shell(slave);
 		} else if (pid < 0) {
 			logger(-1, errno, "Unable to fork");
 			ret = VZ_RESOURCE_ERROR;
@@ -342,7 +384,7 @@ int do_enter(vps_handler *h, envid_t veid, const char *root,
 		}
 		close(slave);
 		close(st[1]);
-		e_loop(in[0], master, master, out[1], info[0]);
+		e_loop(pid, in[0], master, master, out[1], info[0], -1);
 		while ((ret = waitpid(pid, &status, 0)) == -1)
 			if (errno != EINTR)
 				break;
@@ -385,11 +427,15 @@ err:
 					"command arguments sequence "
 					"while passing into CT %d\n", veid);
 		}
-		e_loop(fileno(stdin), in[1], out[0], fileno(stdout), info[1]);
+		e_loop(pid, fileno(stdin), in[1], out[0], fileno(stdout),
+			-1, info[1]);
 	} else {
+		struct relay r;
+
 		fprintf(stdout, "enter into CT %d failed\n", veid);
 		set_not_blk(out[0]);
-		while (stdredir(out[0], fileno(stdout)) == 0)
+		relay_init(&r, out[0], fileno(stdout));
+		while (relay_move(&r) == 0)
 			;
 	}
 	while ((waitpid(pid, &status, 0)) == -1)
@@ -408,3 +454,880 @@ err:
 
 	return ret ? status : 0;
 }
+
+/* Enter sessions
+ *
+ * A session is a shell in CT which outlives the vzctl enter attached
+ * to it, so that a dropped connection to the host does not kill the
+ * work going on inside. The pty is allocated inside CT as usual, and
+ * its master end is passed to a host-side session process. The session
+ * process keeps the recent output in a ring buffer, and serves clients
+ * (vzctl enter --attach) on a UNIX socket, replaying the buffer to
+ * each newly attached one. Several clients can be attached at once.
+ *
+ * Output is read from the pty straight into the ring, as much as there
+ * is, and sent to every client from there in as big chunks as it can
+ * take, so bursts of small pty reads go out in a few writes. Clients
+ * never hold reading from the pty back: one which falls more than the
+ * ring size behind loses the output in between, and gets a marker in
+ * its place.
+ *
+ * Clients send frames (struct sess_hdr followed by data): SESS_ATTACH
+ * or SESS_INFO first, then SESS_DATA (keyboard input) and SESS_WINSZ.
+ * Session sends raw output to attached clients, struct sess_info in
+ * reply to SESS_INFO, and closes connections when the shell is gone.
+ */
+
+#define SESS_SOCK_DIR		"/var/run"
+#define SESS_SOCK_PREFIX	"vzctl-enter.%d."
+#define SESS_SOCK		SESS_SOCK_DIR "/" SESS_SOCK_PREFIX "%d.sock"
+#define SESS_RING_SIZE		(1024 * 1024)
+#define SESS_BUFSIZE		(128 * 1024)
+#define SESS_MAXDATA		4096
+#define SESS_MAXCLIENTS		16
+/* How long clients may stall the last output once the shell is gone */
+#define SESS_LINGER_MS		5000
+/* ^] detaches an attached client */
+#define SESS_DETACH_CHAR	0x1d
+/* Sent to a client in place of the output it was too slow to get */
+#define SESS_LOST_MSG		"\r\n[vzctl: output lost, client too slow]\r\n"
+
+enum {
+	SESS_ATTACH = 1,
+	SESS_INFO,
+	SESS_DATA,
+	SESS_WINSZ,
+};
+
+struct sess_hdr {
+	uint32_t type;
+	uint32_t len;
+};
+
+struct sess_info {
+	uint32_t clients;
+	uint32_t pad;
+	uint64_t started;
+};
+
+/* Events in the session loop, client N is EV_CLIENT + N */
+enum {
+	EV_LISTEN = EV_WINCH + 1,
+	EV_MASTER,
+	EV_SOCK,
+	EV_CLIENT,
+};
+
+struct sess_client {
+	int fd;			/* -1 - free slot */
+	int attached;
+	unsigned int events;	/* polled for */
+	unsigned long long pos;	/* next ring byte to send */
+	int lost;		/* SESS_LOST_MSG bytes left to send */
+	int rxlen;
+	char rx[sizeof(struct sess_hdr) + SESS_MAXDATA];
+};
+
+struct session {
+	int master;
+	int epfd;
+	unsigned int master_ev;		/* polled for, 0 - not in epoll */
+	char *ring;
+	unsigned long long head;	/* bytes read from pty so far */
+	char in[SESS_MAXDATA];		/* input the pty did not take yet */
+	int in_len;
+	struct sess_client cl[SESS_MAXCLIENTS];
+	time_t started;
+};
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	struct pollfd pfd;
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = write(fd, p, len)) < 0) {
+			if (errno == EAGAIN) {
+				pfd.fd = fd;
+				pfd.events = POLLOUT;
+				poll(&pfd, 1, -1);
+				continue;
+			}
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int send_frame(int fd, int type, const void *data, int len)
+{
+	char buf[sizeof(struct sess_hdr) + SESS_MAXDATA];
+	struct sess_hdr *hdr = (struct sess_hdr *) buf;
+
+	hdr->type = type;
+	hdr->len = len;
+	memcpy(buf + sizeof(*hdr), data, len);
+	return write_all(fd, buf, sizeof(*hdr) + len);
+}
+
+static void sess_sock_path(envid_t veid, int id, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	snprintf(addr->sun_path, sizeof(addr->sun_path), SESS_SOCK, veid, id);
+}
+
+static int sess_connect(envid_t veid, int id)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	sess_sock_path(veid, id, &addr);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		/* Session process is gone */
+		if (errno == ECONNREFUSED)
+			unlink(addr.sun_path);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Move clients whose output got overwritten to the oldest kept byte */
+static void sess_skip_lost(struct session *s)
+{
+	struct sess_client *c;
+	int i;
+
+	for (i = 0; i < SESS_MAXCLIENTS; i++) {
+		c = &s->cl[i];
+		if (c->fd < 0 || !c->attached ||
+				s->head - c->pos <= SESS_RING_SIZE)
+			continue;
+		c->pos = s->head - SESS_RING_SIZE;
+		if (c->lost == 0)
+			c->lost = sizeof(SESS_LOST_MSG) - 1;
+	}
+}
+
+static void sess_arm_master(struct session *s)
+{
+	unsigned int ev;
+	struct epoll_event e;
+
+	ev = EPOLLIN | (s->in_len ? EPOLLOUT : 0);
+	if (ev == s->master_ev)
+		return;
+	memset(&e, 0, sizeof(e));
+	e.events = ev;
+	e.data.u32 = EV_MASTER;
+	epoll_ctl(s->epfd, s->master_ev ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+		s->master, &e);
+	s->master_ev = ev;
+}
+
+static void sess_arm_client(struct session *s, int i)
+{
+	struct sess_client *c = &s->cl[i];
+	struct epoll_event e;
+	unsigned int ev;
+
+	ev = (s->in_len ? 0 : EPOLLIN) |
+		(c->attached && (c->pos < s->head || c->lost) ? EPOLLOUT : 0);
+	if (ev == c->events)
+		return;
+	memset(&e, 0, sizeof(e));
+	e.events = ev;
+	e.data.u32 = EV_CLIENT + i;
+	epoll_ctl(s->epfd, EPOLL_CTL_MOD, c->fd, &e);
+	c->events = ev;
+}
+
+static void sess_drop(struct session *s, int i)
+{
+	close(s->cl[i].fd);
+	s->cl[i].fd = -1;
+}
+
+static void sess_accept(struct session *s, int lsock)
+{
+	struct epoll_event e;
+	int i, fd;
+
+	if ((fd = accept4(lsock, NULL, NULL,
+			SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0)
+		return;
+	for (i = 0; i < SESS_MAXCLIENTS && s->cl[i].fd >= 0; i++);
+	if (i == SESS_MAXCLIENTS) {
+		close(fd);
+		return;
+	}
+	memset(&e, 0, sizeof(e));
+	e.events = EPOLLIN;
+	e.data.u32 = EV_CLIENT + i;
+	if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &e)) {
+		close(fd);
+		return;
+	}
+	s->cl[i].fd = fd;
+	s->cl[i].attached = 0;
+	s->cl[i].lost = 0;
+	s->cl[i].events = EPOLLIN;
+	s->cl[i].rxlen = 0;
+}
+
+/* Read what the pty has, up to SESS_BUFSIZE at once, so that clients
+ * get their share in between. -1 when the shell is gone */
+static int sess_read_master(struct session *s)
+{
+	int room, off, n;
+	int total = 0;
+
+	while (total < SESS_BUFSIZE) {
+		off = s->head % SESS_RING_SIZE;
+		room = SESS_RING_SIZE - off;
+		if (room > SESS_BUFSIZE - total)
+			room = SESS_BUFSIZE - total;
+		if ((n = read(s->master, s->ring + off, room)) > 0) {
+			s->head += n;
+			total += n;
+			sess_skip_lost(s);
+			continue;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			return 0;
+		/* EIO: no more slave users */
+		return -1;
+	}
+	return 0;
+}
+
+/* Send client what it has not seen yet */
+static int sess_flush(struct session *s, struct sess_client *c)
+{
+	int off, len, n;
+
+	while (c->lost > 0) {
+		n = write(c->fd, SESS_LOST_MSG + sizeof(SESS_LOST_MSG) - 1 -
+			c->lost, c->lost);
+		if (n > 0) {
+			c->lost -= n;
+			continue;
+		}
+		if (n < 0 && (errno == EAGAIN || errno == EINTR))
+			return 0;
+		return -1;
+	}
+	while (c->pos < s->head) {
+		off = c->pos % SESS_RING_SIZE;
+		len = SESS_RING_SIZE - off;
+		if ((unsigned long long) len > s->head - c->pos)
+			len = s->head - c->pos;
+		if ((n = write(c->fd, s->ring + off, len)) > 0) {
+			c->pos += n;
+			continue;
+		}
+		if (n < 0 && (errno == EAGAIN || errno == EINTR))
+			return 0;
+		return -1;
+	}
+	return 0;
+}
+
+/* Write input to the pty, keeping what it can't take now */
+static int sess_input(struct session *s, const char *data, int len)
+{
+	int n;
+
+	while (len > 0) {
+		if ((n = write(s->master, data, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				return -1;
+			memmove(s->in + s->in_len, data, len);
+			s->in_len += len;
+			return 0;
+		}
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Handle complete frames got from a client. -1 to drop it */
+static int sess_frames(struct session *s, int i)
+{
+	struct sess_client *c = &s->cl[i];
+	struct sess_hdr hdr;
+	struct sess_info info;
+	char *data = c->rx + sizeof(hdr);
+	int k, len;
+
+	while (c->rxlen >= (int) sizeof(hdr) && s->in_len == 0) {
+		memcpy(&hdr, c->rx, sizeof(hdr));
+		if (hdr.len > SESS_MAXDATA)
+			return -1;
+		len = sizeof(hdr) + hdr.len;
+		if (c->rxlen < len)
+			break;
+		switch (hdr.type) {
+		case SESS_ATTACH:
+			c->attached = 1;
+			/* Start from the oldest output kept */
+			c->pos = s->head > SESS_RING_SIZE ?
+				s->head - SESS_RING_SIZE : 0;
+			break;
+		case SESS_INFO:
+			memset(&info, 0, sizeof(info));
+			for (k = 0; k < SESS_MAXCLIENTS; k++)
+				if (s->cl[k].fd >= 0 && s->cl[k].attached)
+					info.clients++;
+			info.started = s->started;
+			write(c->fd, &info, sizeof(info));
+			return -1;
+		case SESS_DATA:
+			if (sess_input(s, data, hdr.len))
+				return -1;
+			break;
+		case SESS_WINSZ:
+			if (hdr.len == sizeof(struct winsize))
+				ioctl(s->master, TIOCSWINSZ, data);
+			break;
+		}
+		c->rxlen -= len;
+		memmove(c->rx, c->rx + len, c->rxlen);
+	}
+	return 0;
+}
+
+static int sess_client_read(struct session *s, int i)
+{
+	struct sess_client *c = &s->cl[i];
+	int n;
+
+	n = read(c->fd, c->rx + c->rxlen, sizeof(c->rx) - c->rxlen);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	if (n <= 0)
+		return -1;
+	c->rxlen += n;
+	return sess_frames(s, i);
+}
+
+static void sess_loop(int lsock, int master)
+{
+	struct session s;
+	struct epoll_event ev[SESS_MAXCLIENTS + 2];
+	struct pollfd pfd[SESS_MAXCLIENTS];
+	int tags[SESS_MAXCLIENTS];
+	int i, j, n, len, tag;
+
+	memset(&s, 0, sizeof(s));
+	s.master = master;
+	s.started = time(NULL);
+	for (i = 0; i < SESS_MAXCLIENTS; i++)
+		s.cl[i].fd = -1;
+	if ((s.ring = malloc(SESS_RING_SIZE)) == NULL ||
+		(s.epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+		ev_add(s.epfd, lsock, EV_LISTEN))
+	{
+		return;
+	}
+	set_not_blk(master);
+	sess_arm_master(&s);
+	for (;;) {
+		n = epoll_wait(s.epfd, ev, ARRAY_SIZE(ev), -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		for (j = 0; j < n; j++) {
+			tag = ev[j].data.u32;
+			if (tag == EV_LISTEN) {
+				sess_accept(&s, lsock);
+			} else if (tag == EV_MASTER) {
+				if ((ev[j].events & EPOLLOUT) && s.in_len) {
+					len = s.in_len;
+					s.in_len = 0;
+					if (sess_input(&s, s.in, len))
+						goto out;
+				}
+				if ((ev[j].events & ~EPOLLOUT) &&
+						sess_read_master(&s))
+					goto out;
+			} else if (s.cl[i = tag - EV_CLIENT].fd >= 0) {
+				if ((ev[j].events & ~EPOLLOUT) &&
+						sess_client_read(&s, i))
+					sess_drop(&s, i);
+			}
+		}
+		/* Input the pty could not take blocked reading frames */
+		for (i = 0; i < SESS_MAXCLIENTS && !s.in_len; i++)
+			if (s.cl[i].fd >= 0 && sess_frames(&s, i))
+				sess_drop(&s, i);
+		for (i = 0; i < SESS_MAXCLIENTS; i++) {
+			if (s.cl[i].fd < 0 || !s.cl[i].attached)
+				continue;
+			if (sess_flush(&s, &s.cl[i]))
+				sess_drop(&s, i);
+		}
+		for (i = 0; i < SESS_MAXCLIENTS; i++)
+			if (s.cl[i].fd >= 0)
+				sess_arm_client(&s, i);
+		sess_arm_master(&s);
+	}
+out:
+	/* Shell is gone, let the clients have the last words, as long as
+	 * they take them. One which stalls does not hold the others */
+	for (;;) {
+		for (i = 0, n = 0; i < SESS_MAXCLIENTS; i++) {
+			if (s.cl[i].fd < 0 || !s.cl[i].attached ||
+				(s.cl[i].pos == s.head && !s.cl[i].lost))
+				continue;
+			pfd[n].fd = s.cl[i].fd;
+			pfd[n].events = POLLOUT;
+			tags[n++] = i;
+		}
+		if (n == 0)
+			break;
+		if ((len = poll(pfd, n, SESS_LINGER_MS)) < 0 && errno == EINTR)
+			continue;
+		if (len <= 0)
+			break;
+		for (j = 0; j < n; j++)
+			if (pfd[j].revents &&
+					sess_flush(&s, &s.cl[tags[j]]))
+				sess_drop(&s, tags[j]);
+	}
+	for (i = 0; i < SESS_MAXCLIENTS; i++)
+		if (s.cl[i].fd >= 0)
+			sess_drop(&s, i);
+}
+
+/* Pass pty master (or just an error, if fd is -1) to the session */
+static int send_fd(int sock, int fd, int ret)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &ret;
+	iov.iov_len = sizeof(ret);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (fd >= 0) {
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+	return sendmsg(sock, &msg, 0) < 0 ? -1 : 0;
+}
+
+static int recv_fd(int sock, int *fd)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	int ret;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &ret;
+	iov.iov_len = sizeof(ret);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	*fd = -1;
+	if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != sizeof(ret))
+		return VZ_SYSTEM_ERROR;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg != NULL && cmsg->cmsg_type == SCM_RIGHTS)
+		memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+	if (ret == 0 && *fd < 0)
+		return VZ_SYSTEM_ERROR;
+	return ret;
+}
+
+/* Command line as typed into the shell */
+static int get_cmdline(int argc, char **argv, char *buf, int size)
+{
+	int i, len = 0;
+
+	for (i = 0; i < argc; i++) {
+		len += snprintf(buf + len, size - len, "%s%s", argv[i],
+			i < argc - 1 ? " " : "\n");
+		if (len >= size) {
+			logger(-1, 0, "Command line is too long");
+			return -1;
+		}
+	}
+	return len;
+}
+
+/* Session process: get the pty from CT, then serve clients */
+static int sess_run(vps_handler *h, envid_t veid, const char *root,
+	struct termios *tios, struct winsize *ws, int argc, char **argv,
+	int st)
+{
+	struct sockaddr_un addr;
+	char cmd[SESS_MAXDATA];
+	int lsock, sp[2], pid, master, slave, len = 0, ret;
+	int res[2];
+	mode_t mask;
+
+	res[1] = getpid();
+	if (argc && (len = get_cmdline(argc, argv, cmd, sizeof(cmd))) < 0) {
+		ret = VZ_INVALID_PARAMETER_VALUE;
+		goto err;
+	}
+	sess_sock_path(veid, res[1], &addr);
+	if ((lsock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+		logger(-1, errno, "Unable to create socket");
+		ret = VZ_RESOURCE_ERROR;
+		goto err;
+	}
+	unlink(addr.sun_path);
+	/* Only root can connect */
+	mask = umask(0077);
+	ret = bind(lsock, (struct sockaddr *) &addr, sizeof(addr));
+	umask(mask);
+	if (ret < 0 || listen(lsock, 16) < 0) {
+		logger(-1, errno, "Unable to bind socket %s", addr.sun_path);
+		ret = VZ_RESOURCE_ERROR;
+		goto err;
+	}
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sp) < 0) {
+		logger(-1, errno, "Unable to create socket");
+		ret = VZ_RESOURCE_ERROR;
+		goto err_sock;
+	}
+	if ((pid = fork()) < 0) {
+		logger(-1, errno, "Unable to fork");
+		ret = VZ_RESOURCE_ERROR;
+		goto err_sock;
+	} else if (pid == 0) {
+		close_fds(0, sp[1], h->vzfd, st, -1);
+		if ((ret = vz_chroot(root)))
+			goto err_ct;
+		ret = vz_env_create_ioctl(h, veid, VE_ENTER);
+		if (ret < 0) {
+			ret = (errno == ESRCH) ? VZ_VE_NOT_RUNNING :
+				VZ_ENVCREATE_ERROR;
+			goto err_ct;
+		}
+		close(h->vzfd);
+		if ((ret = pty_alloc(&master, &slave, tios, ws)))
+			goto err_ct;
+		set_proc_title(ttyname(slave));
+		if ((pid = fork()) == 0) {
+			close(master);
+			exec_shell(slave);
+		} else if (pid < 0) {
+			logger(-1, errno, "Unable to fork");
+			ret = VZ_RESOURCE_ERROR;
+			goto err_ct;
+		}
+		close(slave);
+		send_fd(sp[1], master, 0);
+		close(master);
+		close(sp[1]);
+		close_fds(1, -1);
+		env_wait(pid);
+		exit(0);
+err_ct:
+		send_fd(sp[1], -1, ret);
+		exit(ret);
+	}
+	close(sp[1]);
+	ret = recv_fd(sp[0], &master);
+	close(sp[0]);
+	if (ret)
+		goto err_sock;
+	if (len)
+		write_all(master, cmd, len);
+	res[0] = 0;
+	write(st, res, sizeof(res));
+	close_fds(1, lsock, master, -1);
+	sess_loop(lsock, master);
+	unlink(addr.sun_path);
+	while (waitpid(pid, NULL, 0) < 0 && errno == EINTR);
+	return 0;
+
+err_sock:
+	unlink(addr.sun_path);
+err:
+	res[0] = ret;
+	write(st, res, sizeof(res));
+	return ret;
+}
+
+static int sess_start(vps_handler *h, envid_t veid, const char *root,
+	int argc, char **argv, int *id)
+{
+	struct termios tios;
+	struct winsize ws;
+	int st[2], res[2];
+	int pid, ret, tty;
+
+	/* Shell gets the terminal settings of the one starting it */
+	tty = !tcgetattr(0, &tios) && !ioctl(0, TIOCGWINSZ, &ws);
+	if (pipe(st) < 0) {
+		logger(-1, errno, "Unable to create pipe");
+		return VZ_RESOURCE_ERROR;
+	}
+	if ((ret = vz_setluid(veid)))
+		return ret;
+	preload_lib();
+	fflush(stdout);
+	fflush(stderr);
+	if ((pid = fork()) < 0) {
+		logger(-1, errno, "Unable to fork");
+		return VZ_RESOURCE_ERROR;
+	} else if (pid == 0) {
+		/* Daemonize, so the session outlives us */
+		close(st[0]);
+		setsid();
+		if ((pid = fork()) < 0)
+			_exit(VZ_RESOURCE_ERROR);
+		else if (pid > 0)
+			_exit(0);
+		_exit(sess_run(h, veid, root, tty ? &tios : NULL,
+			tty ? &ws : NULL, argc, argv, st[1]));
+	}
+	close(st[1]);
+	ret = env_wait(pid);
+	if (read(st[0], res, sizeof(res)) != sizeof(res)) {
+		logger(-1, 0, "Unable to start enter session");
+		res[0] = ret ? ret : VZ_SYSTEM_ERROR;
+	}
+	close(st[0]);
+	*id = res[1];
+	return res[0];
+}
+
+static int sess_attach(envid_t veid, int id, int argc, char **argv)
+{
+	static char buf[SESS_BUFSIZE];
+	struct epoll_event ev[4];
+	struct signalfd_siginfo si;
+	struct winsize ws;
+	sigset_t mask, oldmask;
+	char *p;
+	int fd, epfd, winfd = -1, tty, i, n, len;
+	int done = 0, ended = 0;
+
+	if ((fd = sess_connect(veid, id)) < 0) {
+		logger(-1, 0, "Enter session %d is not found in CT %d",
+			id, veid);
+		return VZ_INVALID_PARAMETER_VALUE;
+	}
+	if (send_frame(fd, SESS_ATTACH, NULL, 0))
+		goto lost;
+	if (argc && ((len = get_cmdline(argc, argv, buf,
+			SESS_MAXDATA)) < 0 ||
+			send_frame(fd, SESS_DATA, buf, len)))
+		goto lost;
+	tty = isatty(0) && !ioctl(0, TIOCGWINSZ, &ws);
+	if (tty && send_frame(fd, SESS_WINSZ, &ws, sizeof(ws)))
+		goto lost;
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+		ev_add(epfd, fd, EV_SOCK))
+	{
+		logger(-1, errno, "Unable to set up enter loop");
+		close(fd);
+		return VZ_RESOURCE_ERROR;
+	}
+	/* Input which can't be polled is not passed */
+	ev_add(epfd, STDIN_FILENO, EV_IN);
+	if (tty) {
+		sigemptyset(&mask);
+		sigaddset(&mask, SIGWINCH);
+		sigprocmask(SIG_BLOCK, &mask, &oldmask);
+		winfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+		if (winfd >= 0)
+			ev_add(epfd, winfd, EV_WINCH);
+	}
+	fprintf(stdout, "attached to session %d in CT %d, ^] to detach\n",
+		id, veid);
+	fflush(stdout);
+	if (tty)
+		raw_on();
+	while (!done) {
+		n = epoll_wait(epfd, ev, ARRAY_SIZE(ev), -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		for (i = 0; i < n && !done; i++) {
+			switch (ev[i].data.u32) {
+			case EV_IN:
+				len = read(STDIN_FILENO, buf, SESS_MAXDATA);
+				if (len < 0 && (errno == EINTR ||
+						errno == EAGAIN))
+					break;
+				/* Terminal is gone, session stays */
+				if (len <= 0) {
+					done = 1;
+					break;
+				}
+				p = memchr(buf, SESS_DETACH_CHAR, len);
+				if (p != NULL) {
+					len = p - buf;
+					done = 1;
+				}
+				if (len && send_frame(fd, SESS_DATA, buf, len))
+					done = ended = 1;
+				break;
+			case EV_SOCK:
+				len = read(fd, buf, sizeof(buf));
+				if (len < 0 && (errno == EINTR ||
+						errno == EAGAIN))
+					break;
+				if (len <= 0 ||
+					write_all(STDOUT_FILENO, buf, len))
+				{
+					done = ended = 1;
+				}
+				break;
+			case EV_WINCH:
+				while (read(winfd, &si, sizeof(si)) > 0);
+				if (!ioctl(STDIN_FILENO, TIOCGWINSZ, &ws))
+					send_frame(fd, SESS_WINSZ, &ws,
+						sizeof(ws));
+				break;
+			}
+		}
+	}
+	if (tty)
+		raw_off();
+	if (winfd >= 0) {
+		close(winfd);
+		sigprocmask(SIG_SETMASK, &oldmask, NULL);
+	}
+	close(epfd);
+	close(fd);
+	if (ended)
+		fprintf(stdout, "exited from CT %d\n", veid);
+	else
+		fprintf(stdout, "\ndetached from session %d\n", id);
+	return 0;
+
+lost:
+	close(fd);
+	logger(-1, 0, "Connection to enter session %d lost", id);
+	return VZ_SYSTEM_ERROR;
+}
+
+/* Call fn for every live session of CT */
+static int sess_foreach(envid_t veid, void (*fn)(envid_t, int, int, void *),
+	void *data)
+{
+	char prefix[64];
+	DIR *dir;
+	struct dirent *ent;
+	char *end;
+	int id, fd, len, n = 0;
+
+	len = snprintf(prefix, sizeof(prefix), SESS_SOCK_PREFIX, veid);
+	if ((dir = opendir(SESS_SOCK_DIR)) == NULL)
+		return 0;
+	while ((ent = readdir(dir)) != NULL) {
+		if (strncmp(ent->d_name, prefix, len))
+			continue;
+		id = strtol(ent->d_name + len, &end, 10);
+		if (id <= 0 || strcmp(end, ".sock"))
+			continue;
+		if ((fd = sess_connect(veid, id)) < 0)
+			continue;
+		fn(veid, id, fd, data);
+		close(fd);
+		n++;
+	}
+	closedir(dir);
+	return n;
+}
+
+static void sess_print(envid_t veid, int id, int fd, void *data)
+{
+	struct sess_info info;
+	char buf[32];
+	time_t t;
+
+	if (send_frame(fd, SESS_INFO, NULL, 0) ||
+			read(fd, &info, sizeof(info)) != sizeof(info))
+		return;
+	t = info.started;
+	strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&t));
+	printf("%10d %8u %s\n", id, info.clients, buf);
+}
+
+static void sess_get_id(envid_t veid, int id, int fd, void *data)
+{
+	*(int *) data = id;
+}
+
+/** Enter session actions: --attach [id], --detach, --list.
+ * argv[0] is the action, optionally followed by --exec command.
+ */
+int enter_session(vps_handler *h, envid_t veid, const char *root,
+	int argc, char **argv)
+{
+	const char *act = argv[0];
+	int id = 0, ret;
+
+	argc--; argv++;
+	if (!strcmp(act, "--list")) {
+		printf("%10s %8s %s\n", "SESSION", "CLIENTS", "STARTED");
+		sess_foreach(veid, sess_print, NULL);
+		return 0;
+	}
+	if (!strcmp(act, "--attach") && argc > 0 &&
+			strcmp(argv[0], "--exec"))
+	{
+		if (parse_int(argv[0], &id) || id <= 0) {
+			logger(-1, 0, "Invalid session ID: %s", argv[0]);
+			return VZ_INVALID_PARAMETER_VALUE;
+		}
+		argc--; argv++;
+	}
+	if (argc > 0) {
+		/* omit "--exec" argument */
+		argc--; argv++;
+	}
+	if (!strcmp(act, "--attach")) {
+		if (id == 0 && sess_foreach(veid, sess_get_id, &id) > 1) {
+			logger(-1, 0, "Several enter sessions are running "
+				"in CT %d, specify which one to attach to",
+				veid);
+			return VZ_INVALID_PARAMETER_VALUE;
+		}
+		if (id != 0)
+			return sess_attach(veid, id, argc, argv);
+	}
+	if ((ret = sess_start(h, veid, root, argc, argv, &id)))
+		return ret;
+	if (!strcmp(act, "--detach")) {
+		printf("Started enter session %d in CT %d\n", id, veid);
+		return 0;
+	}
+	return sess_attach(veid, id, 0, NULL);
+}
@@ -0,0 +1,585 @@
+/*
+ *  Copyright (C) 2000-2011, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Exec agent: a process which is entered into CT once, and then runs
+ * commands inside CT on requests coming from a UNIX socket. This saves
+ * fork/chroot/enter/exec for every command run by vzctl exec.
+ *
+ * Control socket lives on the host, so it is not reachable from inside
+ * CT. Every request is served by a separate agent child. The protocol
+ * is a sequence of frames (struct agent_hdr followed by data):
+ *
+ *	client				agent
+ *	AGENT_REQ (mode, argv, envp) ->
+ *				     <- AGENT_STARTED
+ *	AGENT_STDIN ...		     <- AGENT_STDOUT, AGENT_STDERR ...
+ *	AGENT_STDIN (empty, EOF)
+ *				     <- AGENT_EXIT (wait status)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/vzcalluser.h>
+
+#include "types.h"
+#include "vzerror.h"
+#include "logger.h"
+#include "util.h"
+#include "env.h"
+#include "exec.h"
+#include "agent.h"
+
+enum {
+	AGENT_REQ = 1,
+	AGENT_STARTED,
+	AGENT_STDIN,
+	AGENT_STDOUT,
+	AGENT_STDERR,
+	AGENT_EXIT,
+};
+
+struct agent_hdr {
+	uint32_t type;
+	uint32_t len;
+};
+
+#define AGENT_BUFSIZE	16384
+/* Sanity limit for the request size */
+#define AGENT_MAXREQ	(1024 * 1024)
+
+static char *envp_bash[] = {"HOME=/", "TERM=linux", ENV_PATH, NULL};
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Returns 0 on success, 1 on EOF before any data, -1 on error */
+static int read_all(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = read(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (n == 0)
+			return (p == buf) ? 1 : -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int send_frame(int fd, int type, const void *data, int len)
+{
+	struct agent_hdr hdr;
+
+	hdr.type = type;
+	hdr.len = len;
+	if (write_all(fd, &hdr, sizeof(hdr)))
+		return -1;
+	if (len && write_all(fd, data, len))
+		return -1;
+	return 0;
+}
+
+/* Read frame data, or skip it if buf is NULL */
+static int recv_data(int fd, struct agent_hdr *hdr, char *buf, int size)
+{
+	char tmp[256];
+	unsigned int len, n;
+
+	if (buf != NULL) {
+		if (hdr->len > (unsigned int) size)
+			return -1;
+		return read_all(fd, buf, hdr->len) ? -1 : 0;
+	}
+	for (len = hdr->len; len > 0; len -= n) {
+		n = len < sizeof(tmp) ? len : sizeof(tmp);
+		if (read_all(fd, tmp, n))
+			return -1;
+	}
+	return 0;
+}
+
+/* Pack exec mode, argv and envp into a request */
+static char *pack_request(int exec_mode, char *argv[], char *const envp[],
+	int *len)
+{
+	uint32_t hdr[3] = {exec_mode, 0, 0};
+	char *buf, *p;
+	int i, size;
+
+	size = sizeof(hdr);
+	for (i = 0; argv != NULL && argv[i] != NULL; i++, hdr[1]++)
+		size += strlen(argv[i]) + 1;
+	for (i = 0; envp != NULL && envp[i] != NULL; i++, hdr[2]++)
+		size += strlen(envp[i]) + 1;
+	if ((buf = vz_malloc(size)) == NULL)
+		return NULL;
+	memcpy(buf, hdr, sizeof(hdr));
+	p = buf + sizeof(hdr);
+	for (i = 0; argv != NULL && argv[i] != NULL; i++)
+		p = stpcpy(p, argv[i]) + 1;
+	for (i = 0; envp != NULL && envp[i] != NULL; i++)
+		p = stpcpy(p, envp[i]) + 1;
+	*len = size;
+
+	return buf;
+}
+
+/* Build argv and envp out of request, pointing into buf */
+static int unpack_request(char *buf, int len, int *exec_mode,
+	char ***argv, char ***envp)
+{
+	uint32_t hdr[3];
+	char **arr, *p, *end = buf + len;
+	unsigned int i;
+
+	if (len < (int) sizeof(hdr))
+		return -1;
+	memcpy(hdr, buf, sizeof(hdr));
+	if (hdr[1] + hdr[2] > (unsigned int) len)
+		return -1;
+	arr = calloc(hdr[1] + hdr[2] + 2, sizeof(char *));
+	if (arr == NULL)
+		return -1;
+	*exec_mode = hdr[0];
+	*argv = arr;
+	*envp = arr + hdr[1] + 1;
+	p = buf + sizeof(hdr);
+	for (i = 0; i < hdr[1] + hdr[2]; i++) {
+		if (p >= end || memchr(p, '\0', end - p) == NULL) {
+			free(arr);
+			return -1;
+		}
+		if (i < hdr[1])
+			(*argv)[i] = p;
+		else
+			(*envp)[i - hdr[1]] = p;
+		p += strlen(p) + 1;
+	}
+	if (hdr[2] == 0)
+		*envp = envp_bash;
+
+	return 0;
+}
+
+static void agent_do_exec(int exec_mode, char *argv[], char *envp[])
+{
+	char *def_argv[] = { NULL, NULL };
+
+	if (exec_mode == MODE_EXEC && argv[0] != NULL) {
+		execvep(argv[0], argv, envp);
+	} else {
+		if (argv[0] == NULL)
+			argv = def_argv;
+		argv[0] = "/bin/bash";
+		execve(argv[0], argv, envp);
+		argv[0] = "/bin/sh";
+		execve(argv[0], argv, envp);
+	}
+	_exit(VZ_FS_BAD_TMPL);
+}
+
+/* Serve a single request, runs in a child of the agent */
+static int agent_serve(int sock)
+{
+	struct agent_hdr hdr;
+	struct pollfd pfd[4];
+	char buf[AGENT_BUFSIZE], ibuf[AGENT_BUFSIZE];
+	char *req, **argv, **envp;
+	int in[2], out[2], err[2];
+	int i, n, pid, status, mode;
+	int ilen = 0, ioff = 0;
+
+	if (read_all(sock, &hdr, sizeof(hdr)) || hdr.type != AGENT_REQ ||
+			hdr.len > AGENT_MAXREQ)
+		return 1;
+	if ((req = malloc(hdr.len)) == NULL ||
+			read_all(sock, req, hdr.len) ||
+			unpack_request(req, hdr.len, &mode, &argv, &envp))
+		return 1;
+	if (pipe(in) < 0 || pipe(out) < 0 || pipe(err) < 0)
+		return 1;
+	if ((pid = fork()) < 0)
+		return 1;
+	if (pid == 0) {
+		dup2(in[0], STDIN_FILENO);
+		dup2(out[1], STDOUT_FILENO);
+		dup2(err[1], STDERR_FILENO);
+		close_fds(0, -1);
+		signal(SIGPIPE, SIG_DFL);
+		agent_do_exec(mode, argv, envp);
+	}
+	close(in[0]); close(out[1]); close(err[1]);
+	/* Command stdin is written only as far as the pipe takes it,
+	 * so its output is drained while it is not reading input */
+	fcntl(in[1], F_SETFL, O_NONBLOCK);
+	if (send_frame(sock, AGENT_STARTED, NULL, 0)) {
+		kill(pid, SIGKILL);
+		goto out;
+	}
+
+	pfd[0].fd = sock;
+	pfd[1].fd = out[0];
+	pfd[2].fd = err[0];
+	pfd[3].fd = -1;
+	for (i = 0; i < 3; i++)
+		pfd[i].events = POLLIN;
+	pfd[3].events = POLLOUT;
+	/* Relay until both stdout and stderr are closed */
+	while (pfd[1].fd >= 0 || pfd[2].fd >= 0) {
+		if (poll(pfd, 4, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (pfd[0].revents) {
+			if (read_all(sock, &hdr, sizeof(hdr)) ||
+					hdr.type != AGENT_STDIN ||
+					recv_data(sock, &hdr, ibuf, sizeof(ibuf)))
+			{
+				/* Client is gone */
+				kill(pid, SIGTERM);
+				break;
+			}
+			if (hdr.len == 0) {
+				close(in[1]);
+				in[1] = -1;
+			} else {
+				ilen = hdr.len;
+				ioff = 0;
+			}
+		}
+		if (ilen > 0 && in[1] >= 0) {
+			n = write(in[1], ibuf + ioff, ilen - ioff);
+			if (n > 0) {
+				ioff += n;
+				if (ioff == ilen)
+					ilen = 0;
+			} else if (errno != EAGAIN && errno != EINTR) {
+				/* Command does not take input any more */
+				close(in[1]);
+				in[1] = -1;
+				ilen = 0;
+			}
+		}
+		for (i = 1; i < 3; i++) {
+			if (!pfd[i].revents)
+				continue;
+			n = read(pfd[i].fd, buf, sizeof(buf));
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0) {
+				close(pfd[i].fd);
+				pfd[i].fd = -1;
+				continue;
+			}
+			if (send_frame(sock, i == 1 ? AGENT_STDOUT :
+					AGENT_STDERR, buf, n))
+			{
+				kill(pid, SIGTERM);
+				pfd[1].fd = pfd[2].fd = -1;
+			}
+		}
+		/* Take the next stdin frame only when the previous one
+		 * is written, and stop polling the socket once stdin
+		 * is closed */
+		pfd[0].fd = (in[1] >= 0 && ilen == 0) ? sock : -1;
+		pfd[3].fd = (in[1] >= 0 && ilen > 0) ? in[1] : -1;
+	}
+out:
+	while (waitpid(pid, &status, 0) < 0)
+		if (errno != EINTR)
+			return 1;
+	send_frame(sock, AGENT_EXIT, &status, sizeof(status));
+
+	return 0;
+}
+
+static void agent_loop(int lsock)
+{
+	struct pollfd pfd;
+	time_t last;
+	int sock, pid, active = 0;
+
+	signal(SIGPIPE, SIG_IGN);
+	pfd.fd = lsock;
+	pfd.events = POLLIN;
+	last = time(NULL);
+	for (;;) {
+		while (waitpid(-1, NULL, WNOHANG) > 0) {
+			active--;
+			last = time(NULL);
+		}
+		if (active == 0 && time(NULL) - last >= AGENT_IDLE_TIMEOUT)
+			break;
+		if (poll(&pfd, 1, 1000) <= 0)
+			continue;
+		if ((sock = accept(lsock, NULL, NULL)) < 0)
+			continue;
+		if ((pid = fork()) == 0) {
+			close(lsock);
+			_exit(agent_serve(sock));
+		} else if (pid > 0) {
+			active++;
+		}
+		close(sock);
+		last = time(NULL);
+	}
+}
+
+static int agent_connect(envid_t veid)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), AGENT_SOCK, veid);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	return fd;
+}
+
+static int agent_start(vps_handler *h, envid_t veid, const char *root)
+{
+	struct sockaddr_un addr;
+	mode_t mask;
+	int lsock, pid, ret;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), AGENT_SOCK, veid);
+	if ((lsock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		logger(-1, errno, "Unable to create socket");
+		return VZ_RESOURCE_ERROR;
+	}
+	unlink(addr.sun_path);
+	/* Only root can connect */
+	mask = umask(0077);
+	ret = bind(lsock, (struct sockaddr *)&addr, sizeof(addr));
+	umask(mask);
+	if (ret < 0 || listen(lsock, 16) < 0) {
+		logger(-1, errno, "Unable to bind socket %s", addr.sun_path);
+		close(lsock);
+		return VZ_RESOURCE_ERROR;
+	}
+	logger(1, 0, "Starting exec agent");
+	if ((pid = fork()) < 0) {
+		logger(-1, errno, "Unable to fork");
+		close(lsock);
+		return VZ_RESOURCE_ERROR;
+	} else if (pid == 0) {
+		/* Daemonize, so the agent outlives us */
+		if (fork() != 0)
+			_exit(0);
+		/* Enter CT, so the agent and its children are
+		 * accounted to the CT */
+		if (vz_setluid(veid))
+			_exit(VZ_SETLUID_ERROR);
+		if (vz_chroot(root))
+			_exit(VZ_RESOURCE_ERROR);
+		close_fds(1, lsock, h->vzfd, -1);
+		if (vz_env_create_ioctl(h, veid, VE_ENTER) < 0)
+			_exit(VZ_ENVCREATE_ERROR);
+		close(h->vzfd);
+		agent_loop(lsock);
+		_exit(0);
+	}
+	close(lsock);
+	env_wait(pid);
+
+	return 0;
+}
+
+/* Run command by the agent. Sets started if the agent took it */
+static int agent_run(int sock, int exec_mode, char *argv[],
+	char *const envp[], int *started)
+{
+	struct agent_hdr hdr;
+	struct pollfd pfd[2];
+	char buf[AGENT_BUFSIZE];
+	char obuf[sizeof(hdr) + AGENT_BUFSIZE];
+	char *req;
+	int n, len, status;
+	int olen = 0, ooff = 0, in_done = 0;
+
+	*started = 0;
+	if ((req = pack_request(exec_mode, argv, envp, &len)) == NULL)
+		return VZ_RESOURCE_ERROR;
+	n = send_frame(sock, AGENT_REQ, req, len);
+	free(req);
+	if (n || read_all(sock, &hdr, sizeof(hdr)) ||
+			hdr.type != AGENT_STARTED)
+		return VZ_SYSTEM_ERROR;
+	*started = 1;
+
+	/* Stdin frames are sent without blocking, so the output of
+	 * the command is read while the agent is not taking input */
+	pfd[1].fd = sock;
+	pfd[0].events = POLLIN;
+	for (;;) {
+		/* Read the next chunk only when the previous one is sent */
+		pfd[0].fd = (!in_done && olen == 0) ? STDIN_FILENO : -1;
+		pfd[1].events = olen > 0 ? POLLIN | POLLOUT : POLLIN;
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			logger(-1, errno, "Error in poll()");
+			return VZ_SYSTEM_ERROR;
+		}
+		if (pfd[0].revents) {
+			n = read(STDIN_FILENO, obuf + sizeof(hdr),
+				sizeof(obuf) - sizeof(hdr));
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0) {
+				/* Let the command know there is no more input */
+				n = 0;
+				in_done = 1;
+			}
+			hdr.type = AGENT_STDIN;
+			hdr.len = n;
+			memcpy(obuf, &hdr, sizeof(hdr));
+			olen = sizeof(hdr) + n;
+			ooff = 0;
+		}
+		if (olen > 0) {
+			n = send(sock, obuf + ooff, olen - ooff,
+				MSG_DONTWAIT | MSG_NOSIGNAL);
+			if (n > 0) {
+				ooff += n;
+				if (ooff == olen)
+					olen = 0;
+			} else if (errno != EAGAIN && errno != EINTR) {
+				olen = 0;
+				in_done = 1;
+			}
+		}
+		if (!(pfd[1].revents & (POLLIN | POLLHUP | POLLERR)))
+			continue;
+		if (read_all(sock, &hdr, sizeof(hdr)))
+			break;
+		switch (hdr.type) {
+		case AGENT_STDOUT:
+		case AGENT_STDERR:
+			if (recv_data(sock, &hdr, buf, sizeof(buf)))
+				goto lost;
+			write_all(hdr.type == AGENT_STDOUT ?
+				STDOUT_FILENO : STDERR_FILENO, buf, hdr.len);
+			break;
+		case AGENT_EXIT:
+			if (hdr.len != sizeof(status) ||
+				recv_data(sock, &hdr, (char *) &status,
+					sizeof(status)))
+				goto lost;
+			if (WIFEXITED(status))
+				return WEXITSTATUS(status);
+			if (WIFSIGNALED(status))
+				logger(-1, 0, "Got signal %d",
+					WTERMSIG(status));
+			return VZ_SYSTEM_ERROR;
+		default:
+			if (recv_data(sock, &hdr, NULL, 0))
+				goto lost;
+		}
+	}
+lost:
+	logger(-1, 0, "Connection to exec agent lost");
+	return VZ_SYSTEM_ERROR;
+}
+
+int vps_agent_exec(vps_handler *h, envid_t veid, const char *root,
+	int exec_mode, char *argv[], char *const envp[])
+{
+	char buf[STR_SIZE];
+	int i, fd, lfd, ret, started;
+
+	if (check_var(root, "Container root (VE_ROOT) is not set"))
+		return VZ_VE_ROOT_NOTSET;
+	if (!vps_is_run(h, veid)) {
+		logger(-1, 0, "Container is not running");
+		return VZ_VE_NOT_RUNNING;
+	}
+	fflush(stdout);
+	fflush(stderr);
+	/* Second try is for an agent which has just exited on idle */
+	for (i = 0; i < 2; i++) {
+		if ((fd = agent_connect(veid)) < 0) {
+			/* Serialize agent start */
+			snprintf(buf, sizeof(buf), AGENT_LOCK, veid);
+			lfd = open(buf, O_RDWR | O_CREAT, 0600);
+			if (lfd >= 0)
+				flock(lfd, LOCK_EX);
+			if ((fd = agent_connect(veid)) < 0 &&
+					agent_start(h, veid, root) == 0)
+				fd = agent_connect(veid);
+			if (lfd >= 0)
+				close(lfd);
+		}
+		if (fd < 0)
+			break;
+		ret = agent_run(fd, exec_mode, argv, envp, &started);
+		close(fd);
+		if (started)
+			return ret;
+	}
+	logger(1, 0, "Exec agent is not available, running command directly");
+
+	return vps_exec(h, veid, root, exec_mode, argv, envp, NULL, 0);
+}
@@ -56,7 +56,10 @@ static int check_name(char *name);
 static vps_config config[] = {
 /*	Op	*/
 {"LOCKDIR",	NULL, PARAM_LOCKDIR},
+{"LOCK_TIMEOUT",	NULL, PARAM_LOCK_TIMEOUT},
+{"TIMING_LOG",	NULL, PARAM_TIMING_LOG},
 {"DUMPDIR",	NULL, PARAM_DUMPDIR},
+{"DUMP_COMPRESS",	NULL, PARAM_DUMP_COMPRESS},
 /*	Log	*/
 {"LOGGING",	NULL, PARAM_LOGGING},
 {"LOG_LEVEL",	NULL, PARAM_LOGLEVEL},
@@ -125,6 +128,8 @@ static vps_config config[] = {
 {"ONBOOT",	NULL, PARAM_ONBOOT},
 {"CONFIGFILE",	NULL, PARAM_CONFIG},
 {"ORIGIN_SAMPLE",NULL,PARAM_CONFIG_SAMPLE},
+{"BASE_SAMPLE",	NULL, PARAM_BASE_SAMPLE},
+{"INHERIT_SAMPLE",NULL, PARAM_INHERIT_SAMPLE},
 {"DISABLED",	NULL, PARAM_DISABLED},
 /* quota */
 {"DISK_QUOTA",	NULL, PARAM_DISK_QUOTA},
@@ -141,6 +146,7 @@ static vps_config config[] = {
 {"FEATURES",	NULL, PARAM_FEATURES},
 {"IOPRIO",	NULL, PARAM_IOPRIO},
 {"BOOTORDER",	NULL, PARAM_BOOTORDER},
+{"STOP_TIMEOUT",	NULL, PARAM_STOP_TIMEOUT},
 
 /* These ones are either known parameters for global config file,
  * or some obsoleted parameters used in the past. In both cases
@@ -199,7 +205,7 @@ static int opt_get_by_id(struct option *opt, int id)
 	return -1;
 }
 
-static conf_struct *find_conf_line(list_head_t *head, char *name,
+static conf_struct *find_conf_line(list_head_t *head, const char *name,
 	char delim)
 {
 	conf_struct *conf;
@@ -1320,6 +1326,10 @@ static int store_misc(vps_param *old_p, vps_param *vps_p, vps_config *conf,
 		ret = conf_store_ulong(conf_h, conf->name,
 				misc->bootorder);
 		break;
+	case PARAM_STOP_TIMEOUT:
+		ret = conf_store_ulong(conf_h, conf->name,
+				misc->stop_timeout);
+		break;
 	case PARAM_DISABLED:
 		ret = conf_store_yesno(conf_h, conf->name,
 			vps_p->opt.start_disabled);
@@ -1328,6 +1338,10 @@ static int store_misc(vps_param *old_p, vps_param *vps_p, vps_config *conf,
 		ret = conf_store_str(conf_h, conf->name,
 			vps_p->opt.origin_sample);
 		break;
+	case PARAM_BASE_SAMPLE:
+		ret = conf_store_str(conf_h, conf->name,
+			vps_p->opt.base_sample);
+		break;
 	case PARAM_HOSTNAME:
 		ret = conf_store_str(conf_h, conf->name, misc->hostname);
 		break;
@@ -1873,6 +1887,12 @@ static int parse(envid_t veid, vps_param *vps_p, char *val, int id)
 	case PARAM_CONFIG_SAMPLE:
 		ret = conf_parse_str(&vps_p->opt.origin_sample, val);
 		break;
+	case PARAM_BASE_SAMPLE:
+		ret = conf_parse_str(&vps_p->opt.base_sample, val);
+		break;
+	case PARAM_INHERIT_SAMPLE:
+		ret = conf_parse_yesno(&vps_p->opt.inherit_sample, val);
+		break;
 	case PARAM_SAVE:
 		vps_p->opt.save = YES;
 		break;
@@ -1921,9 +1941,20 @@ static int parse(envid_t veid, vps_param *vps_p, char *val, int id)
 	case PARAM_LOCKDIR:
 		ret = conf_parse_str(&vps_p->opt.lockdir, val);
 		break;
+	case PARAM_LOCK_TIMEOUT:
+		ret = conf_parse_ulong(&vps_p->opt.lock_timeout, val);
+		break;
+	case PARAM_TIMING_LOG:
+		ret = conf_parse_str(&vps_p->opt.timing_log, val);
+		break;
 	case PARAM_DUMPDIR:
 		ret = conf_parse_str(&vps_p->res.cpt.dumpdir, val);
 		break;
+	case PARAM_DUMP_COMPRESS:
+		if ((int_id = cpt_compress_id(val)) < 0)
+			return ERR_INVAL;
+		vps_p->res.cpt.compress = int_id;
+		break;
 	case PARAM_LOGGING:
 		ret = conf_parse_yesno(&vps_p->log.enable, val);
 		break;
@@ -2139,6 +2170,9 @@ static int parse(envid_t veid, vps_param *vps_p, char *val, int id)
 	case PARAM_BOOTORDER:
 		ret = conf_parse_ulong(&vps_p->res.misc.bootorder, val);
 		break;
+	case PARAM_STOP_TIMEOUT:
+		ret = conf_parse_ulong(&vps_p->res.misc.stop_timeout, val);
+		break;
 	case PARAM_IGNORED:
 		/* Well known but ignored parameter */
 		break;
@@ -2179,7 +2213,7 @@ static int store(vps_param *old_p, vps_param *vps_p, list_head_t *conf_h)
 /*	CT parse config stuff				*/
 /********************************************************/
 
-int vps_parse_config(envid_t veid, char *path, vps_param *vps_p,
+static int parse_config(envid_t veid, char *path, vps_param *vps_p,
 	struct mod_action *action)
 {
 	char *str;
@@ -2265,6 +2299,162 @@ int vps_parse_config(envid_t veid, char *path, vps_param *vps_p,
 	return err;
 }
 
+/********************************************************/
+/*	Sample config registry				*/
+/********************************************************/
+
+/* Every sample config is parsed once per process and then reused
+ * as long as the file is not changed.
+ *
+ * There is deliberately no host-wide cache of parsed samples: parsing a
+ * stock sample takes 13-22 us, while just starting vzctl takes ~1.4 ms,
+ * and reading a cache file back would cost about as much as reading the
+ * sample itself. The per-process registry pays off for batch and
+ * multi-CT runs; a single create or set is dominated by everything else.
+ */
+struct sample_conf {
+	list_elem_t list;
+	char *name;
+	time_t mtime;
+	off_t size;
+	ino_t ino;
+	vps_param *param;
+};
+
+static list_head_t samples = {&samples, &samples};
+
+static void free_sample(struct sample_conf *sample)
+{
+	list_del(&sample->list);
+	free_vps_param(sample->param);
+	free(sample->name);
+	free(sample);
+}
+
+/** Get parsed sample config from the registry.
+ *
+ * @param name		sample name, as in ve-<name>.conf-sample.
+ * @param action	modules list, or NULL.
+ * @return		parameters (owned by the registry) or NULL.
+ */
+vps_param *get_sample_config(const char *name, struct mod_action *action)
+{
+	struct sample_conf *sample, *tmp;
+	char path[STR_SIZE];
+	struct stat st;
+
+	snprintf(path, sizeof(path), VPS_CONF_DIR "ve-%s.conf-sample", name);
+	if (stat(path, &st)) {
+		logger(-1, errno, "Unable to stat %s", path);
+		return NULL;
+	}
+	list_for_each_safe(sample, tmp, &samples, list) {
+		if (strcmp(sample->name, name))
+			continue;
+		if (sample->mtime == st.st_mtime &&
+				sample->size == st.st_size &&
+				sample->ino == st.st_ino)
+			return sample->param;
+		/* Sample was changed, reread it */
+		free_sample(sample);
+		break;
+	}
+	if ((sample = calloc(1, sizeof(*sample))) == NULL)
+		return NULL;
+	sample->name = strdup(name);
+	sample->param = init_vps_param();
+	if (sample->name == NULL || sample->param == NULL)
+		goto err;
+	if (parse_config(0, path, sample->param, action))
+		goto err;
+	if (sample->param->opt.base_sample != NULL)
+		logger(0, 0, "Warning: BASE_SAMPLE in %s is ignored", path);
+	sample->mtime = st.st_mtime;
+	sample->size = st.st_size;
+	sample->ino = st.st_ino;
+	list_add(&sample->list, &samples);
+	logger(3, 0, "Sample config %s parsed", path);
+	return sample->param;
+
+err:
+	free_vps_param(sample->param);
+	free(sample->name);
+	free(sample);
+	return NULL;
+}
+
+/** Merge sample config parameters into dst.
+ *
+ * @param veid		CT ID, used to expand $VEID.
+ * @param name		sample name.
+ * @param dst		parameters to merge into.
+ * @param action	modules list, or NULL.
+ * @return		0 on success.
+ */
+int merge_sample_config(envid_t veid, const char *name, vps_param *dst,
+	struct mod_action *action)
+{
+	vps_param *sample;
+	fs_param *fs = &dst->res.fs;
+
+	if ((sample = get_sample_config(name, action)) == NULL)
+		return VZ_APPLY_CONFIG_ERROR;
+	/* Generated veth names and MACs depend on CT ID, can't reuse */
+	if (!list_empty(&sample->res.veth.dev)) {
+		char path[STR_SIZE];
+
+		snprintf(path, sizeof(path),
+			VPS_CONF_DIR "ve-%s.conf-sample", name);
+		return parse_config(veid, path, dst, action);
+	}
+	merge_vps_param(dst, sample);
+	/* Sample is parsed for CT 0, redo $VEID substitution */
+	if (sample->res.fs.root_orig != NULL) {
+		free(fs->root);
+		fs->root = subst_VEID(veid, fs->root_orig);
+	}
+	if (sample->res.fs.private_orig != NULL) {
+		free(fs->private);
+		fs->private = subst_VEID(veid, fs->private_orig);
+	}
+	return 0;
+}
+
+void free_sample_configs(void)
+{
+	struct sample_conf *sample, *tmp;
+
+	list_for_each_safe(sample, tmp, &samples, list)
+		free_sample(sample);
+}
+
+/* Put BASE_SAMPLE parameters under the ones set in CT config */
+static int apply_base_sample(envid_t veid, vps_param *vps_p,
+	struct mod_action *action)
+{
+	vps_param *own;
+	int ret;
+
+	if ((own = init_vps_param()) == NULL)
+		return VZ_RESOURCE_ERROR;
+	merge_vps_param(own, vps_p);
+	ret = merge_sample_config(veid, vps_p->opt.base_sample, vps_p, action);
+	merge_vps_param(vps_p, own);
+	free_vps_param(own);
+	return ret;
+}
+
+int vps_parse_config(envid_t veid, char *path, vps_param *vps_p,
+	struct mod_action *action)
+{
+	int ret;
+
+	ret = parse_config(veid, path, vps_p, action);
+	if (ret == 0 && vps_p->opt.base_sample != NULL)
+		ret = apply_base_sample(veid, vps_p, action);
+	return ret;
+}
+
 /********************************************************/
 /*	CT save config stuff				*/
 /********************************************************/
@@ -2294,6 +2484,18 @@ static int write_conf(char *fname, list_head_t *head)
 	const char *suffix = ".tmp";
 	char *fmt;
 
+	if (fname == NULL) {
+		/* No file given -- dump config to stdout */
+		list_for_each(conf, head, list) {
+			if (conf->val == NULL)
+				continue;
+			if (strchr(conf->val, '\n') == NULL)
+				printf("%s\n", conf->val);
+			else
+				printf("%s", conf->val);
+		}
+		return fflush(stdout) ? ret : 0;
+	}
 	file = canonicalize_file_name(fname);
 	if (file == NULL) {
 		if (errno != ENOENT) {
@@ -2370,8 +2572,23 @@ static int vps_merge_conf(list_head_t *dst, list_head_t *src)
 	return cnt;
 }
 
-int vps_save_config(envid_t veid, char *path, vps_param *new_p,
-	vps_param *old_p, struct mod_action *action)
+static void drop_conf_lines(list_head_t *head, const char **names)
+{
+	conf_struct *line;
+
+	if (names == NULL)
+		return;
+	for (; *names != NULL; names++) {
+		while ((line = find_conf_line(head, *names, '='))) {
+			list_del(&line->list);
+			free(line->val);
+			free(line);
+		}
+	}
+}
+
+static int save_config(envid_t veid, char *src, char *dst, vps_param *new_p,
+	vps_param *old_p, const char **drop, struct mod_action *action)
 {
 	vps_param *tmp_old_p = NULL;
 	list_head_t conf, new_conf;
@@ -2379,27 +2596,26 @@ int vps_save_config(envid_t veid, char *path, vps_param *new_p,
 
 	list_head_init(&conf);
 	list_head_init(&new_conf);
-	if (old_p == NULL && stat_file(path)) {
+	if (old_p == NULL && stat_file(src)) {
 		tmp_old_p = init_vps_param();
-		vps_parse_config(veid, path, tmp_old_p, action);
+		vps_parse_config(veid, src, tmp_old_p, action);
 		old_p = tmp_old_p;
 	}
-	if (read_conf(path, &conf) != 0)
+	if (read_conf(src, &conf) != 0)
 		goto err_read;
+	drop_conf_lines(&conf, drop);
 	store(old_p, new_p, &new_conf);
 	if (action != NULL)
 		mod_save_config(action, &new_conf);
-	if (vps_merge_conf(&conf, &new_conf) == 0)
+	if (vps_merge_conf(&conf, &new_conf) == 0 && dst == src)
 	{
 		/* Nothing to save */
 		logger(0, 0, "No changes in CT configuration, not saving");
-		ret = 0;
+		ret = 1;
 		goto out;
 	}
 
-	ret = write_conf(path, &conf);
-	if (ret == 0)
-		logger(0, 0, "CT configuration saved to %s", path);
+	ret = write_conf(dst, &conf);
 out:
 	free_str_param(&conf);
 	free_str_param(&new_conf);
@@ -2409,6 +2625,43 @@ err_read:
 	return ret;
 }
 
+int vps_save_config(envid_t veid, char *path, vps_param *new_p,
+	vps_param *old_p, struct mod_action *action)
+{
+	int ret;
+
+	ret = save_config(veid, path, path, new_p, old_p, NULL, action);
+	if (ret == 0)
+		logger(0, 0, "CT configuration saved to %s", path);
+	else if (ret == 1)
+		ret = 0;
+
+	return ret;
+}
+
+/** Write a copy of config src with new_p stored on top of it.
+ *
+ * The result is written to a temporary file next to dst and renamed
+ * over it, same as vps_save_config() does.
+ *
+ * @param veid		CT ID.
+ * @param src		config file to start from.
+ * @param dst		file to write, NULL means stdout.
+ * @param new_p		parameters to store.
+ * @param old_p		parameters parsed from src, or NULL.
+ * @param drop		NULL-terminated list of parameters to remove, or NULL.
+ * @param action	modules list, or NULL.
+ * @return		0 on success.
+ */
+int vps_write_config(envid_t veid, char *src, char *dst, vps_param *new_p,
+	vps_param *old_p, const char **drop, struct mod_action *action)
+{
+	int ret;
+
+	ret = save_config(veid, src, dst, new_p, old_p, drop, action);
+	return ret == 1 ? 0 : ret;
+}
+
 /********************************************************************/
 int vps_parse_opt(envid_t veid, struct option *opts, vps_param *param,
 	int opt, char *rval, struct mod_action *action)
@@ -2455,6 +2708,7 @@ vps_param *init_vps_param()
 	list_head_init(&param->del_res.veth.dev);
 	param->res.meminfo.mode = -1;
 	param->res.io.ioprio = -1;
+	param->res.cpt.stream_fd = -1;
 
 	return param;
 }
@@ -2547,8 +2801,11 @@ static void free_opt(vps_opt *opt)
 {
 	FREE_P(opt->config)
 	FREE_P(opt->origin_sample)
+	FREE_P(opt->base_sample)
 	FREE_P(opt->apply_cfg)
 	FREE_P(opt->lockdir)
+	FREE_P(opt->lock_timeout)
+	FREE_P(opt->timing_log)
 }
 
 static void free_log_s(struct log_s *log)
@@ -2586,6 +2843,7 @@ static void free_misc(misc_param *misc)
 	FREE_P(misc->hostname)
 	FREE_P(misc->description)
 	FREE_P(misc->bootorder)
+	FREE_P(misc->stop_timeout)
 }
 
 static void free_net(net_param *net)
@@ -2625,6 +2883,7 @@ static void free_cpt(cpt_param *cpt)
 {
 	FREE_P(cpt->dumpdir)
 	FREE_P(cpt->dumpfile)
+	FREE_P(cpt->dumpsock)
 }
 
 static void free_name(name_param *name)
@@ -2697,9 +2956,11 @@ static void merge_opt(vps_opt *dst, vps_opt *src)
 	MERGE_INT(start_force)
 	MERGE_INT(setmode)
 	MERGE_INT(apply_cfg_map)
+	MERGE_INT(inherit_sample)
 
 	MERGE_STR(config)
 	MERGE_STR(origin_sample)
+	MERGE_STR(base_sample)
 	MERGE_STR(apply_cfg)
 }
 
@@ -2752,6 +3013,7 @@ static void merge_misc(misc_param *dst, misc_param *src)
 	MERGE_STR(description)
 	MERGE_INT(onboot)
 	MERGE_P(bootorder)
+	MERGE_P(stop_timeout)
 	MERGE_INT(wait)
 }
 
@@ -2803,6 +3065,9 @@ static void merge_cpt(cpt_param *dst, cpt_param *src)
 	MERGE_INT(ctx)
 	MERGE_INT(cpu_flags)
 	MERGE_INT(cmd)
+	MERGE_INT(compress)
+	MERGE_INT2(stream_fd)
+	MERGE_STR(dumpsock)
 }
 
 static void merge_meminfo(meminfo_param *dst, meminfo_param *src)
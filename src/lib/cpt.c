@@ -25,6 +25,8 @@
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <linux/cpt_ioctl.h>
@@ -34,6 +36,8 @@
 #include <sys/param.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <stdint.h>
+#include <time.h>
 
 
 #include "cpt.h"
@@ -44,9 +48,307 @@
 #include "vzerror.h"
 #include "logger.h"
 #include "util.h"
+#include "spawnprog.h"
 
 static int setup_hardlink_dir(const char *mntdir, int cpt_fd);
 
+/* Dump compression and streaming
+ *
+ * The kernel goes back to fill in section headers while dumping, and
+ * reads the dump at random offsets on restore, so it is always given
+ * a plain file. A compressed dump is made by running a compressor
+ * over the finished dump file, and unpacked into a temporary unlinked
+ * file before restore. A dump sent to a stream (socket or pipe) is
+ * read from the page cache right after dumping, and received the same
+ * way. Compressed files and all streams start with a header telling
+ * the codec, dump files without one are taken as is.
+ */
+#define CPT_ZMAGIC	"VZCPTZ1"
+
+struct cpt_zhdr {
+	char magic[8];
+	char codec[8];
+	uint64_t size;		/* uncompressed dump size */
+};
+
+struct cpt_codec {
+	const char *name;
+	char *comp[6];
+	char *decomp[6];
+};
+
+/* Indexed by CPT_COMPRESS_*, programs work as stdin to stdout filters */
+static struct cpt_codec cpt_codecs[] = {
+	[CPT_COMPRESS_NONE] = {"none"},
+	[CPT_COMPRESS_LZ4] = {"lz4",
+		{"lz4", "-q", "-c", NULL},
+		{"lz4", "-q", "-d", "-c", NULL}},
+	[CPT_COMPRESS_ZSTD] = {"zstd",
+		{"zstd", "-q", "-c", "-T0", NULL},
+		{"zstd", "-q", "-d", "-c", NULL}},
+	[CPT_COMPRESS_GZIP] = {"gzip",
+		{"gzip", "-c", NULL},
+		{"gzip", "-d", "-c", NULL}},
+};
+
+static char *envp_codec[] = {ENV_PATH, NULL};
+
+#define CPT_COPY_BUF		(1024 * 1024)
+#define CPT_SENDFILE_LEN	(64 * 1024 * 1024)
+
+int cpt_compress_id(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(cpt_codecs); i++)
+		if (cpt_codecs[i].name != NULL &&
+				!strcmp(cpt_codecs[i].name, name))
+			return i;
+	return -1;
+}
+
+static double sec_since(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) +
+		(now.tv_nsec - start->tv_nsec) / 1000000000.0;
+}
+
+/* Create a temporary file next to the dump */
+static int dump_tmp(const char *file, char *buf, int len)
+{
+	int fd, n;
+
+	/* mkstemp() needs the whole XXXXXX suffix */
+	n = snprintf(buf, len, "%s.XXXXXX", file);
+	if (n < 0 || n >= len) {
+		logger(-1, ENAMETOOLONG, "Can not create temporary file "
+			"for %s", file);
+		return -1;
+	}
+	if ((fd = mkstemp(buf)) < 0)
+		logger(-1, errno, "Can not create temporary file %s", buf);
+	return fd;
+}
+
+/* Run a codec program from in to out */
+static int run_codec(char **argv, int in, int out)
+{
+	char path[PATH_LEN];
+	pid_t pid;
+
+	if (spawn_find(argv[0], path, sizeof(path))) {
+		logger(-1, 0, "%s not found", argv[0]);
+		return -1;
+	}
+	if ((pid = spawn_prog(path, argv, envp_codec, in, out,
+			SPAWN_KEEP)) < 0)
+		return -1;
+	if (spawn_wait(pid, path)) {
+		logger(-1, 0, "%s failed", argv[0]);
+		return -1;
+	}
+	return 0;
+}
+
+/* Copy from in to out, up to len bytes if len is not -1 */
+static int copy_fd(int in, int out, int64_t len)
+{
+	char *buf;
+	ssize_t n, w;
+	size_t chunk;
+	int ret = -1;
+
+	if ((buf = malloc(CPT_COPY_BUF)) == NULL) {
+		logger(-1, ENOMEM, "Can not copy dump");
+		return -1;
+	}
+	while (len != 0) {
+		chunk = CPT_COPY_BUF;
+		if (len > 0 && (uint64_t) len < chunk)
+			chunk = len;
+		if ((n = read(in, buf, chunk)) < 0) {
+			if (errno == EINTR)
+				continue;
+			logger(-1, errno, "Can not read dump");
+			goto out;
+		}
+		if (n == 0) {
+			if (len < 0)
+				break;
+			logger(-1, 0, "Unexpected end of dump");
+			goto out;
+		}
+		if (len > 0)
+			len -= n;
+		for (w = 0; w < n; ) {
+			ssize_t r = write(out, buf + w, n - w);
+
+			if (r < 0) {
+				if (errno == EINTR)
+					continue;
+				logger(-1, errno, "Can not write dump");
+				goto out;
+			}
+			w += r;
+		}
+	}
+	ret = 0;
+out:
+	free(buf);
+	return ret;
+}
+
+/* Send raw dump file to out, sendfile() to sockets, copy otherwise */
+static int send_raw(int raw_fd, int out)
+{
+	ssize_t n;
+
+	for (;;) {
+		n = sendfile(out, raw_fd, NULL, CPT_SENDFILE_LEN);
+		if (n == 0)
+			return 0;
+		if (n > 0)
+			continue;
+		if (errno == EINTR)
+			continue;
+		if (errno == EINVAL || errno == ENOSYS)
+			break;
+		logger(-1, errno, "Can not send dump");
+		return -1;
+	}
+	return copy_fd(raw_fd, out, -1);
+}
+
+/* Write the dump from raw_fd to out_fd (a file or a stream),
+ * with a header and compressed by c
+ */
+static int dump_write(int raw_fd, int out_fd, struct cpt_codec *c)
+{
+	struct cpt_zhdr hdr;
+	struct timespec start;
+	struct stat st;
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (c->comp[0] != NULL)
+		logger(0, 0, "\tcompress (%s)...", c->name);
+	if (fstat(raw_fd, &st) || lseek(raw_fd, 0, SEEK_SET) < 0) {
+		logger(-1, errno, "Can not read dump file");
+		return -1;
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	strcpy(hdr.magic, CPT_ZMAGIC);
+	strncpy(hdr.codec, c->name, sizeof(hdr.codec) - 1);
+	hdr.size = st.st_size;
+	if (write(out_fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+		logger(-1, errno, "Can not write dump");
+		return -1;
+	}
+	if (c->comp[0] != NULL)
+		ret = run_codec(c->comp, raw_fd, out_fd);
+	else
+		ret = send_raw(raw_fd, out_fd);
+	if (ret)
+		return -1;
+	if (!fstat(out_fd, &st) && S_ISREG(st.st_mode))
+		logger(0, 0, "\tdump compressed from %llu to %llu MB "
+			"in %.3f s", (unsigned long long) hdr.size >> 20,
+			(unsigned long long) st.st_size >> 20,
+			sec_since(&start));
+	else
+		logger(0, 0, "\tdump of %llu MB sent in %.3f s",
+			(unsigned long long) hdr.size >> 20,
+			sec_since(&start));
+	return 0;
+}
+
+/* Read full header from a file or stream */
+static int read_hdr(int fd, struct cpt_zhdr *hdr)
+{
+	size_t len = 0;
+	ssize_t n;
+
+	while (len < sizeof(*hdr)) {
+		n = read(fd, (char *) hdr + len, sizeof(*hdr) - len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		len += n;
+	}
+	return memcmp(hdr->magic, CPT_ZMAGIC, sizeof(CPT_ZMAGIC)) ? -1 : 0;
+}
+
+/* Open dump for restore from a file or, if fd is not -1, a stream
+ * which is unpacked next to file. Returns a descriptor of the raw dump,
+ * -1 on error.
+ */
+static int dump_open(const char *file, int fd)
+{
+	struct cpt_zhdr hdr;
+	struct timespec start;
+	struct stat st;
+	char tmp[PATH_LEN];
+	int raw_fd, id, stream = fd != -1;
+
+	if (!stream && (fd = open(file, O_RDONLY)) < 0) {
+		logger(-1, errno, "Unable to open %s", file);
+		return -1;
+	}
+	if (read_hdr(fd, &hdr)) {
+		if (stream) {
+			logger(-1, 0, "Invalid dump stream");
+			return -1;
+		}
+		/* Plain dump file */
+		lseek(fd, 0, SEEK_SET);
+		return fd;
+	}
+	hdr.codec[sizeof(hdr.codec) - 1] = '\0';
+	if ((id = cpt_compress_id(hdr.codec)) < 0) {
+		logger(-1, 0, "Dump is compressed by unknown method %s",
+			hdr.codec);
+		goto err;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (id != CPT_COMPRESS_NONE)
+		logger(0, 0, "\tdecompress (%s)...", hdr.codec);
+	else
+		logger(0, 0, "\treceive...");
+	if ((raw_fd = dump_tmp(file, tmp, sizeof(tmp))) < 0)
+		goto err;
+	unlink(tmp);
+	/* A raw stream has known length, so the sender
+	 * doesn't have to close it
+	 */
+	if (id != CPT_COMPRESS_NONE) {
+		if (run_codec(cpt_codecs[id].decomp, fd, raw_fd))
+			goto err_raw;
+	} else if (copy_fd(fd, raw_fd, hdr.size)) {
+		goto err_raw;
+	}
+	if (fstat(raw_fd, &st) || (uint64_t) st.st_size != hdr.size) {
+		logger(-1, 0, "Dump is truncated");
+		goto err_raw;
+	}
+	lseek(raw_fd, 0, SEEK_SET);
+	logger(0, 0, "\tdump of %llu MB unpacked in %.3f s",
+		(unsigned long long) hdr.size >> 20, sec_since(&start));
+	if (!stream)
+		close(fd);
+	return raw_fd;
+
+err_raw:
+	close(raw_fd);
+err:
+	if (!stream)
+		close(fd);
+	return -1;
+}
+
 int cpt_cmd(vps_handler *h, envid_t veid, int action, cpt_param *param,
 	vps_param *vps_p)
 {
@@ -194,12 +496,20 @@ err_out:
 int vps_chkpnt(vps_handler *h, envid_t veid, vps_param *vps_p, int cmd,
 	cpt_param *param)
 {
-	int dump_fd = -1;
-	char dumpfile[PATH_LEN];
-	int cpt_fd, pid, ret;
+	int dump_fd = -1, out_fd = -1;
+	char dumpfile[PATH_LEN], tmp[PATH_LEN], path[PATH_LEN];
+	const char *file = NULL, *base = NULL;
+	int cpt_fd, pid, ret, compress;
+	int stream = param->stream_fd != -1;
 	const char *root = vps_p->res.fs.root;
+	struct cpt_codec *codec = NULL;
+	struct timespec start;
 
 	ret = VZ_CHKPNT_ERROR;
+	tmp[0] = '\0';
+	compress = param->compress ? : vps_p->res.cpt.compress;
+	if (compress > CPT_COMPRESS_NONE)
+		codec = &cpt_codecs[compress];
 	if (root == NULL) {
 		logger(-1, 0, "Container root (VE_ROOT) is not set");
 		return VZ_VE_ROOT_NOTSET;
@@ -220,7 +530,7 @@ int vps_chkpnt(vps_handler *h, envid_t veid, vps_param *vps_p, int cmd,
 	}
 	if ((cmd == CMD_CHKPNT || cmd == CMD_DUMP)) {
 		if (param->dumpfile == NULL) {
-			if (cmd == CMD_DUMP) {
+			if (cmd == CMD_DUMP && !stream) {
 				logger(-1,  0, "Error: dumpfile is not"
 					" specified.");
 				goto err;
@@ -228,12 +538,37 @@ int vps_chkpnt(vps_handler *h, envid_t veid, vps_param *vps_p, int cmd,
 			get_dump_file(veid, vps_p->res.cpt.dumpdir,
 					dumpfile, sizeof(dumpfile));
 		}
-		dump_fd = open(param->dumpfile ? : dumpfile,
-			O_CREAT|O_TRUNC|O_RDWR, 0600);
-		if (dump_fd < 0) {
-			logger(-1, errno, "Can not create dump file %s",
-				param->dumpfile ? : dumpfile);
-			goto err;
+		base = param->dumpfile ? : dumpfile;
+		if (stream) {
+			out_fd = param->stream_fd;
+			if (codec == NULL)
+				codec = &cpt_codecs[CPT_COMPRESS_NONE];
+		} else {
+			dump_fd = open(base, O_CREAT|O_TRUNC|O_RDWR, 0600);
+			if (dump_fd < 0) {
+				logger(-1, errno, "Can not create dump file %s",
+					base);
+				goto err;
+			}
+			file = base;
+			if (codec != NULL) {
+				out_fd = dump_fd;
+				dump_fd = -1;
+			}
+		}
+		if (out_fd != -1) {
+			/* Kernel dumps to a temporary file, which is then
+			 * compressed to the dump file or sent
+			 */
+			if (codec->comp[0] != NULL &&
+				spawn_find(codec->comp[0], path, sizeof(path)))
+			{
+				logger(-1, 0, "Can not compress dump: "
+					"%s not found", codec->comp[0]);
+				goto err;
+			}
+			if ((dump_fd = dump_tmp(base, tmp, sizeof(tmp))) < 0)
+				goto err;
 		}
 	}
 	if (param->ctx || cmd > CMD_SUSPEND) {
@@ -261,6 +596,7 @@ int vps_chkpnt(vps_handler *h, envid_t veid, vps_param *vps_p, int cmd,
 			goto err;
 		}
 	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	if ((pid = fork()) < 0) {
 		logger(-1, errno, "Can't fork");
 		ret = VZ_RESOURCE_ERROR;
@@ -283,6 +619,7 @@ int vps_chkpnt(vps_handler *h, envid_t veid, vps_param *vps_p, int cmd,
 	ret = env_wait(pid);
 	if (ret)
 		goto err;
+	logger(0, 0, "\tcheckpoint took %.3f s", sec_since(&start));
 	if (cmd == CMD_CHKPNT || cmd == CMD_DUMP) {
 		/* Clear CT network configuration */
 		run_net_script(veid, DEL, &vps_p->res.net.ip, STATE_RUNNING,
@@ -290,17 +627,39 @@ int vps_chkpnt(vps_handler *h, envid_t veid, vps_param *vps_p, int cmd,
 		if (cmd == CMD_CHKPNT)
 			vps_umount(h, veid, root, 0);
 	}
+	if (out_fd != -1 && dump_write(dump_fd, out_fd, codec)) {
+		ret = VZ_CHKPNT_ERROR;
+		/* Suspended CT can be resumed */
+		if (cmd == CMD_DUMP && stream)
+			goto err;
+		/* Otherwise its state may be in the dump only, keep it */
+		if (rename(tmp, base))
+			logger(-1, errno, "Unable to rename %s to %s,"
+				" dump is left there", tmp, base);
+		else
+			logger(-1, 0, "Warning: dump is left uncompressed"
+				" in %s", base);
+		tmp[0] = '\0';
+		if (stream)
+			goto err;
+	}
+	if (tmp[0] != '\0')
+		unlink(tmp);
 	ret = 0;
 	logger(0, 0, "Checkpointing completed succesfully");
 err:
 	if (ret) {
 		ret = VZ_CHKPNT_ERROR;
 		logger(-1, 0, "Checkpointing failed");
-		if (cmd == CMD_CHKPNT || cmd == CMD_DUMP)
-			unlink(param->dumpfile ? : dumpfile);
+		if (file != NULL)
+			unlink(file);
+		if (tmp[0] != '\0')
+			unlink(tmp);
 	}
 	if (dump_fd != -1)
 		close(dump_fd);
+	if (out_fd != -1 && !stream)
+		close(out_fd);
 	if (cpt_fd != -1)
 		close(cpt_fd);
 
@@ -402,6 +761,7 @@ int vps_restore(vps_handler *h, envid_t veid, vps_param *vps_p, int cmd,
 	int ret, rst_fd;
 	int dump_fd = -1;
 	char dumpfile[PATH_LEN];
+	struct timespec start;
 
 	if (vps_is_run(h, veid)) {
 		logger(-1, 0, "Unable to perform restore: "
@@ -425,7 +785,7 @@ int vps_restore(vps_handler *h, envid_t veid, vps_param *vps_p, int cmd,
 		}
 	}
 	if (param->dumpfile == NULL) {
-		if (cmd == CMD_UNDUMP) {
+		if (cmd == CMD_UNDUMP && param->stream_fd == -1) {
 			logger(-1, 0, "Error: dumpfile is not specified");
 			goto err;
 		}
@@ -434,12 +794,10 @@ int vps_restore(vps_handler *h, envid_t veid, vps_param *vps_p, int cmd,
 					dumpfile, sizeof(dumpfile));
 	}
 	if (cmd == CMD_RESTORE || cmd == CMD_UNDUMP) {
-		dump_fd = open(param->dumpfile ? : dumpfile, O_RDONLY);
-		if (dump_fd < 0) {
-			logger(-1, errno, "Unable to open %s",
-				param->dumpfile ? : dumpfile);
+		dump_fd = dump_open(param->dumpfile ? : dumpfile,
+			param->stream_fd);
+		if (dump_fd < 0)
 			goto err;
-		}
 	}
 	if (dump_fd != -1) {
 		if (ioctl(rst_fd, CPT_SET_DUMPFD, dump_fd)) {
@@ -449,10 +807,12 @@ int vps_restore(vps_handler *h, envid_t veid, vps_param *vps_p, int cmd,
 	}
 	param->rst_fd = rst_fd;
 	param->cmd = cmd;
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	ret = vps_start_custom(h, veid, vps_p, SKIP_CONFIGURE,
 		NULL, restore_fn, param);
 	if (ret)
 		goto err;
+	logger(0, 0, "\trestore took %.3f s", sec_since(&start));
 	/* Restore second-level quota links & quota device */
 	if ((cmd == CMD_RESTORE || cmd == CMD_UNDUMP) &&
 		vps_p->res.dq.ugidlimit != NULL &&
@@ -169,6 +169,19 @@ err:
 	return ret;
 }
 
+static int create_empty_config(const char *path)
+{
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		logger(-1, errno, "Unable to create %s", path);
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
+
 int vps_create(vps_handler *h, envid_t veid, vps_param *vps_p, vps_param *cmd_p,
 	struct mod_action *action)
 {
@@ -226,7 +239,21 @@ int vps_create(vps_handler *h, envid_t veid, vps_param *vps_p, vps_param *cmd_p,
 				"to fix.");
 		}
 	}
-	if (sample_config != NULL) {
+	if (sample_config != NULL && vps_p->opt.inherit_sample == YES) {
+		/* CT config only refers to the sample, see BASE_SAMPLE */
+		if (create_empty_config(dst))
+		{
+			ret = VZ_CP_CONFIG;
+			goto err;
+		}
+		if (merge_sample_config(veid, sample_config, vps_p, action))
+		{
+			ret = VZ_CP_CONFIG;
+			goto err_cfg;
+		}
+		cmd_p->opt.base_sample = strdup(sample_config);
+		cmd_p->opt.origin_sample = strdup(sample_config);
+	} else if (sample_config != NULL) {
 		if (cp_file(dst, src))
 		{
 			ret = VZ_CP_CONFIG;
@@ -237,7 +264,7 @@ int vps_create(vps_handler *h, envid_t veid, vps_param *vps_p, vps_param *cmd_p,
 			ret = VZ_RESOURCE_ERROR;
 			goto err_cfg;
 		}
-		vps_parse_config(veid, src, conf_p, action);
+		merge_sample_config(veid, sample_config, conf_p, action);
 		merge_vps_param(vps_p, conf_p);
 		if (conf_p->opt.origin_sample == NULL)
 			cmd_p->opt.origin_sample = strdup(sample_config);
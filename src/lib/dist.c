@@ -20,11 +20,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/stat.h>
 
 #include "util.h"
 #include "dist.h"
 #include "logger.h"
 #include "vzerror.h"
+#include "list.h"
 
 static struct distr_conf {
 	char *name;
@@ -158,25 +160,14 @@ static int get_dist_conf_name(char *dist_name, char *dir, char *file, int len)
 	return 0;
 }
 
-/* Read distribution specific actions configuration file.
- *
- * @param dist_name	distribution name.
- * @param dir		directory distribution config file will be searched.
- * @param dist		filled dist_actions
- * @return		0 on success
- */
-int read_dist_actions(char *dist_name, char *dir, dist_actions *actions)
+static int parse_dist_conf(const char *file, char *dir, dist_actions *actions)
 {
 	char buf[256];
 	char ltoken[256];
-	char file[256];
 	char *rtoken;
 	FILE *fp;
 	int ret = 0;
 
-	memset(actions, 0, sizeof(*actions));
-	if ((ret = get_dist_conf_name(dist_name, dir, file, sizeof(file))))
-		return ret;
 	if ((fp = fopen(file, "r")) == NULL) {
 		logger(-1, errno, "unable to open %s", file);
 		return VZ_NO_DISTR_CONF;
@@ -196,6 +187,129 @@ int read_dist_actions(char *dist_name, char *dir, dist_actions *actions)
 	return ret;
 }
 
+/* Distribution configs are parsed once per process and then reused
+ * as long as the file is not changed, so a long running vzctl
+ * (like in batch mode) does not reread them for every command.
+ */
+struct dist_conf {
+	list_elem_t list;
+	char *name;		/* distribution name, NULL for default */
+	char *dir;
+	char *file;		/* config file the name was resolved to */
+	time_t mtime;
+	off_t size;
+	ino_t ino;
+	dist_actions actions;
+};
+
+static list_head_t dist_confs = {&dist_confs, &dist_confs};
+
+static void free_dist_conf(struct dist_conf *conf)
+{
+	list_del(&conf->list);
+	free_dist_actions(&conf->actions);
+	free(conf->name);
+	free(conf->dir);
+	free(conf->file);
+	free(conf);
+}
+
+#define COPY_ACTION(x)						\
+	if (src->x != NULL && (dst->x = strdup(src->x)) == NULL)	\
+		goto err;
+
+static int copy_dist_actions(dist_actions *dst, dist_actions *src)
+{
+	memset(dst, 0, sizeof(*dst));
+	COPY_ACTION(add_ip)
+	COPY_ACTION(del_ip)
+	COPY_ACTION(set_hostname)
+	COPY_ACTION(set_dns)
+	COPY_ACTION(set_userpass)
+	COPY_ACTION(set_ugid_quota)
+	COPY_ACTION(post_create)
+	return 0;
+
+err:
+	free_dist_actions(dst);
+	memset(dst, 0, sizeof(*dst));
+	return VZ_RESOURCE_ERROR;
+}
+#undef COPY_ACTION
+
+static int same_name(const char *n1, const char *n2)
+{
+	if (n1 == NULL || n2 == NULL)
+		return n1 == n2;
+	return !strcmp(n1, n2);
+}
+
+/* Read distribution specific actions configuration file.
+ *
+ * @param dist_name	distribution name.
+ * @param dir		directory distribution config file will be searched.
+ * @param dist		filled dist_actions
+ * @return		0 on success
+ */
+int read_dist_actions(char *dist_name, char *dir, dist_actions *actions)
+{
+	struct dist_conf *conf, *tmp;
+	struct stat st;
+	char file[256];
+	int ret;
+
+	memset(actions, 0, sizeof(*actions));
+	list_for_each_safe(conf, tmp, &dist_confs, list) {
+		if (!same_name(conf->name, dist_name) || strcmp(conf->dir, dir))
+			continue;
+		if (stat(conf->file, &st) == 0 &&
+				conf->mtime == st.st_mtime &&
+				conf->size == st.st_size &&
+				conf->ino == st.st_ino)
+			return copy_dist_actions(actions, &conf->actions);
+		/* Config was changed, reread it */
+		free_dist_conf(conf);
+		break;
+	}
+	if ((ret = get_dist_conf_name(dist_name, dir, file, sizeof(file))))
+		return ret;
+	if (stat(file, &st)) {
+		logger(-1, errno, "Unable to stat %s", file);
+		return VZ_NO_DISTR_CONF;
+	}
+	if ((ret = parse_dist_conf(file, dir, actions)))
+		return ret;
+	/* Failing to cache is not an error */
+	if ((conf = calloc(1, sizeof(*conf))) == NULL)
+		return 0;
+	conf->name = dist_name != NULL ? strdup(dist_name) : NULL;
+	conf->dir = strdup(dir);
+	conf->file = strdup(file);
+	if ((dist_name != NULL && conf->name == NULL) ||
+		conf->dir == NULL || conf->file == NULL ||
+		copy_dist_actions(&conf->actions, actions))
+	{
+		free(conf->name);
+		free(conf->dir);
+		free(conf->file);
+		free(conf);
+		return 0;
+	}
+	conf->mtime = st.st_mtime;
+	conf->size = st.st_size;
+	conf->ino = st.st_ino;
+	list_add(&conf->list, &dist_confs);
+	return 0;
+}
+
+void free_dist_confs(void)
+{
+	struct dist_conf *conf, *tmp;
+
+	list_for_each_safe(conf, tmp, &dist_confs, list)
+		free_dist_conf(conf);
+}
+
 /** Get distribution name form tmpl_param structure.
  *
  * @param tmpl		distribution data.
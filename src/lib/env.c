@@ -32,6 +32,10 @@
 #include <sys/personality.h>
 #include <linux/reboot.h>
 #include <sys/mount.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <linux/netlink.h>
+#include <poll.h>
 
 #include "vzerror.h"
 #include "res.h"
@@ -45,11 +49,22 @@
 #include "readelf.h"
 #include "vzsyscalls.h"
 #include "cpt.h"
+#include "span.h"
+#include "net.h"
 
 #define ENVRETRY	3
 
+#define NETLINK_UEVENT	31	/* from kernel/ve/vzevent.c */
+/* How often to check CT state while waiting for it to stop, in ms.
+ * STOP_POLL_MS is used without the event socket and after the ve-stop
+ * event has arrived; STOP_RECHECK_MS is merely a safety net for a lost
+ * event.
+ */
+#define STOP_POLL_MS	100
+#define STOP_RECHECK_MS	1000
+
 static int env_stop(vps_handler *h, envid_t veid, const char *root,
-		int stop_mode);
+		int stop_mode, int timeout);
 
 static inline int setluid(uid_t uid)
 {
@@ -225,6 +240,99 @@ int vps_is_run(vps_handler *h, envid_t veid)
 	return 1;
 }
 
+static int envid_sort_fn(const void *val1, const void *val2)
+{
+	return *(const envid_t *) val1 - *(const envid_t *) val2;
+}
+
+#if HAVE_VZLIST_IOCTL
+static int get_run_list_ioctl(vps_handler *h, envid_t **ids)
+{
+	struct vzlist_veidctl veid;
+	envid_t *buf = NULL, *tmp;
+	int ret;
+
+	veid.num = 256;
+	for (;;) {
+		if ((tmp = realloc(buf, veid.num * sizeof(*buf))) == NULL) {
+			free(buf);
+			return -1;
+		}
+		buf = tmp;
+		veid.id = buf;
+		ret = ioctl(h->vzfd, VZCTL_GET_VEIDS, &veid);
+		if (ret < 0) {
+			free(buf);
+			return -1;
+		}
+		if (ret <= veid.num)
+			break;
+		veid.num = ret + 20;
+	}
+	*ids = buf;
+	return ret;
+}
+#endif
+
+static int get_run_list_proc(envid_t **ids)
+{
+	FILE *fp;
+	char str[STR_SIZE];
+	envid_t *buf = NULL, *tmp;
+	int veid, n = 0, size = 0;
+
+	if ((fp = fopen(PROCVEINFO, "r")) == NULL)
+		return -1;
+	while (fgets(str, sizeof(str), fp)) {
+		if (sscanf(str, "%d", &veid) != 1)
+			continue;
+		if (n == size) {
+			size = size ? size * 2 : 256;
+			tmp = realloc(buf, size * sizeof(*buf));
+			if (tmp == NULL) {
+				free(buf);
+				fclose(fp);
+				return -1;
+			}
+			buf = tmp;
+		}
+		buf[n++] = veid;
+	}
+	fclose(fp);
+	*ids = buf;
+	return n;
+}
+
+/** Get IDs of all running CTs at once.
+ *
+ * @param h		CT handler.
+ * @param ids		returned array of CT IDs, sorted, to be freed
+ *			by the caller. CT 0 is not included.
+ * @return		number of CTs, or -1 on error.
+ */
+int vps_get_run_list(vps_handler *h, envid_t **ids)
+{
+	int i, j, n = -1;
+
+	*ids = NULL;
+#if HAVE_VZLIST_IOCTL
+	if (h != NULL)
+		n = get_run_list_ioctl(h, ids);
+#endif
+	if (n < 0)
+		n = get_run_list_proc(ids);
+	if (n < 0) {
+		logger(-1, errno, "Unable to get list of running containers");
+		return -1;
+	}
+	for (i = 0, j = 0; i < n; i++)
+		if ((*ids)[i] != 0)
+			(*ids)[j++] = (*ids)[i];
+	if (j)
+		qsort(*ids, j, sizeof(**ids), envid_sort_fn);
+	return j;
+}
+
 /** Change root to specified directory
  *
  * @param		CT root
@@ -672,7 +780,7 @@ static int fix_ve_devconsole(const char *root)
 	return 0;
 }
 
-int vps_start_custom(vps_handler *h, envid_t veid, vps_param *param,
+static int do_vps_start(vps_handler *h, envid_t veid, vps_param *param,
 	skipFlags skip, struct mod_action *mod,
 	env_create_FN fn, void *data)
 {
@@ -693,6 +801,7 @@ int vps_start_custom(vps_handler *h, envid_t veid, vps_param *param,
 		logger(-1, 0, "Container is already running");
 		return VZ_VE_RUNNING;
 	}
+	span_begin("dist");
 	if ((ret = check_ub(&res->ub)))
 		return ret;
 	dist_name = get_dist_name(&res->tmpl);
@@ -700,10 +809,17 @@ int vps_start_custom(vps_handler *h, envid_t veid, vps_param *param,
 	free(dist_name);
 	if (ret)
 		return ret;
+	span_end();
 	logger(0, 0, "Starting container ...");
+	span_begin("mount");
 	if (vps_is_mounted(res->fs.root)) {
-		/* if CT is mounted -- umount first, to cleanup mount state */
-		vps_umount(h, veid, res->fs.root, skip);
+		if (skip & SKIP_UMOUNT)
+			/* restart: reuse mount and quota state */
+			logger(1, 0, "Container is already mounted");
+		else
+			/* if CT is mounted -- umount first,
+			 * to cleanup mount state */
+			vps_umount(h, veid, res->fs.root, skip);
 	}
 	if (!vps_is_mounted(res->fs.root)) {
 		/* increase quota to perform setup */
@@ -712,11 +828,14 @@ int vps_start_custom(vps_handler *h, envid_t veid, vps_param *param,
 			return ret;
 		quota_inc(&res->dq, -100);
 	}
+	span_end();
 	/* Fedora 14/15 hacks */
+	span_begin("fixup");
 	if (fix_ve_devconsole(res->fs.root) != 0)
 		return VZ_FS_BAD_TMPL;
 	if (fix_ve_systemd(res->fs.root) != 0)
 		return VZ_FS_BAD_TMPL;
+	span_end();
 
 	if (pipe(wait_p) < 0) {
 		logger(-1, errno, "Can not create pipe");
@@ -748,26 +867,32 @@ int vps_start_custom(vps_handler *h, envid_t veid, vps_param *param,
 	fix_numiptent(&res->ub);
 	fix_cpu(&res->cpu);
 
+	span_begin("create");
 	ret = vz_env_create(h, veid, res, wait_p,
 				old_wait_p, err_p, fn, data);
 	if (ret)
 		goto err;
+	span_end();
 
+	span_begin("setup");
 	if ((ret = vps_setup_res(h, veid, &actions, &res->fs, param,
 		STATE_STARTING, skip, mod)))
 	{
 		goto err;
 	}
+	span_end();
 	if (!(skip & SKIP_ACTION_SCRIPT)) {
 		snprintf(buf, sizeof(buf), VPS_CONF_DIR "%d.%s", veid,
 			START_PREFIX);
 		if (stat_file(buf)) {
+			span_begin("action script");
 			if (vps_exec_script(h, veid, res->fs.root, NULL, NULL,
 				buf, NULL, 0))
 			{
 				ret = VZ_ACTIONSCRIPT_ERROR;
 				goto err;
 			}
+			span_end();
 		}
 	}
 	/* Tell the child that it's time to start /sbin/init */
@@ -794,8 +919,10 @@ err:
 			if (res->misc.wait == YES) {
 				logger(0, 0, "Container start in progress"
 					", waiting ...");
+				span_begin("wait");
 				err = vps_execFn(h, veid, res->fs.root,
 					wait_on_fifo, NULL, 0);
+				span_end();
 				if (err) {
 					logger(0, 0, "Container wait failed%s",
 						err == VZ_EXEC_TIMEOUT ? \
@@ -817,7 +944,7 @@ err:
 	}
 	if (ret) {
 		if (vps_is_run(h, veid))
-			env_stop(h, veid, res->fs.root, M_KILL);
+			env_stop(h, veid, res->fs.root, M_KILL, 0);
 		/* restore original quota values */
 		vps_set_quota(veid, &res->dq);
 		if (vps_is_mounted(res->fs.root))
@@ -831,6 +958,19 @@ err:
 	return ret;
 }
 
+int vps_start_custom(vps_handler *h, envid_t veid, vps_param *param,
+	skipFlags skip, struct mod_action *mod,
+	env_create_FN fn, void *data)
+{
+	int ret;
+
+	span_start(veid, "start", param->opt.timing_log);
+	ret = do_vps_start(h, veid, param, skip, mod, fn, data);
+	span_finish(ret);
+
+	return ret;
+}
+
 /** Start and configure CT.
  *
  * @param h		CT handler.
@@ -887,11 +1027,97 @@ static int real_env_stop(vps_handler *h, envid_t veid, const char *vps_root,
 	return 0;
 }
 
+/* Subscribe to vzevent notifications. Should be done before
+ * initiating a stop, so the event can not be missed.
+ */
+static int ve_event_open(void)
+{
+	int fd;
+	struct sockaddr_nl nl;
+
+	fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_UEVENT);
+	if (fd < 0)
+		return -1;
+	memset(&nl, 0, sizeof(nl));
+	nl.nl_family = AF_NETLINK;
+	nl.nl_groups = 0x01; /* multicast */
+	if (bind(fd, (struct sockaddr *)&nl, sizeof(nl)) < 0) {
+		close(fd);
+		return -1;
+	}
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	return fd;
+}
+
+/* Returns 1 if a ve-stop event for a given CT was received */
+static int ve_event_stopped(int fd, envid_t veid)
+{
+	char buf[32], event[16];
+	unsigned int id;
+	ssize_t len;
+	int found = 0;
+
+	while ((len = recv(fd, buf, sizeof(buf) - 1, 0)) > 0) {
+		buf[len] = '\0';
+		if (sscanf(buf, "%15[^@]@%u", event, &id) != 2)
+			continue;
+		if (id == veid && !strcmp(event, "ve-stop"))
+			found = 1;
+	}
+
+	return found;
+}
+
+/* Monotonic, so that a wall clock step does not cut the wait short */
+static long ms_since(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 +
+		(now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/* Wait for CT to stop for up to timeout seconds.
+ * Returns 0 if CT is stopped, 1 on timeout.
+ */
+static int wait_env_stop(vps_handler *h, envid_t veid, int fd, int timeout)
+{
+	struct timespec start;
+	struct pollfd pfd;
+	int got_event = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	for (;;) {
+		if (fd >= 0 && !got_event) {
+			if (poll(&pfd, 1, STOP_RECHECK_MS) > 0 &&
+					ve_event_stopped(fd, veid))
+			{
+				/* The event is sent while CT is still
+				 * being torn down, so recheck often */
+				logger(2, 0, "Got ve-stop event");
+				got_event = 1;
+			}
+		} else {
+			usleep(STOP_POLL_MS * 1000);
+		}
+		if (!vps_is_run(h, veid))
+			return 0;
+		if (ms_since(&start) >= timeout * 1000L)
+			return 1;
+	}
+}
+
 static int env_stop(vps_handler *h, envid_t veid, const char *root,
-		int stop_mode)
+		int stop_mode, int timeout)
 {
 	struct sigaction act, actold;
-	int i, pid, ret = 0;
+	struct timespec start;
+	int pid, fd, ret = 0;
 
 	sigaction(SIGCHLD, NULL, &actold);
 	sigemptyset(&act.sa_mask);
@@ -899,6 +1125,12 @@ static int env_stop(vps_handler *h, envid_t veid, const char *root,
 	act.sa_flags = SA_NOCLDSTOP;
 	sigaction(SIGCHLD, &act, NULL);
 
+	if (timeout <= 0)
+		timeout = MAX_SHTD_TM;
+	fd = ve_event_open();
+	if (fd < 0)
+		logger(2, errno, "vzevent is not available, polling");
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	logger(0, 0, "Stopping container ...");
 	if (stop_mode == M_KILL)
 		goto kill_vps;
@@ -910,13 +1142,12 @@ static int env_stop(vps_handler *h, envid_t veid, const char *root,
 		ret = real_env_stop(h, veid, root, stop_mode);
 		exit(ret);
 	}
-	for (i = 0; i < MAX_SHTD_TM; i++) {
-		sleep(1);
-		if (!vps_is_run(h, veid)) {
-			ret = 0;
-			goto out;
-		}
+	if (!wait_env_stop(h, veid, fd, timeout)) {
+		ret = 0;
+		goto out;
 	}
+	logger(0, 0, "Graceful shutdown timed out after %d s, "
+			"killing container", timeout);
 
 kill_vps:
 	if ((pid = fork()) < 0) {
@@ -929,19 +1160,18 @@ kill_vps:
 		exit(ret);
 	}
 	ret = VZ_STOP_ERROR;
-	for (i = 0; i < MAX_SHTD_TM; i++) {
-		usleep(500000);
-		if (!vps_is_run(h, veid)) {
-			ret = 0;
-			break;
-		}
-	}
+	if (!wait_env_stop(h, veid, fd, MAX_SHTD_TM / 2))
+		ret = 0;
 out:
 	if (ret)
 		logger(-1, 0, "Unable to stop container: operation timed out");
-	else
+	else {
 		logger(0, 0, "Container was stopped");
+		logger(1, 0, "Stop took %.3f s", ms_since(&start) / 1000.0);
+	}
 err:
+	if (fd >= 0)
+		close(fd);
 	sigaction(SIGCHLD, &actold, NULL);
 	return ret;
 }
@@ -982,15 +1212,44 @@ int vps_stop(vps_handler *h, envid_t veid, vps_param *param, int stop_mode,
 	}
 	/* get CT IP addresses for cleanup */
 	get_vps_ip(h, veid, &param->del_res.net.ip);
-	if ((ret = env_stop(h, veid, res->fs.root, stop_mode)))
+	if ((ret = env_stop(h, veid, res->fs.root, stop_mode,
+			res->misc.stop_timeout != NULL ?
+			*res->misc.stop_timeout : 0)))
 		goto end;
 	mod_cleanup(h, veid, action, param);
 	/* Cleanup CT IPs */
 	run_net_script(veid, DEL, &param->del_res.net.ip,
 			STATE_STOPPING, param->res.net.skip_arpdetect);
-	ret = vps_umount(h, veid, res->fs.root, skip);
+	if (!(skip & SKIP_UMOUNT))
+		ret = vps_umount(h, veid, res->fs.root, skip);
 
 end:
 	free_str_param(&param->del_res.net.ip);
 	return ret;
 }
+
+/** Restart CT, keeping its file system mounted and quota on.
+ * Stopping needs no distribution actions, and starting takes them
+ * from the read_dist_actions() cache when they were read before.
+ *
+ * @param h		CT handler.
+ * @param veid		CT ID.
+ * @param param		CT parameters.
+ * @param stop_mode	stop mode, one of (M_REBOOT M_HALT M_KILL).
+ * @param skip		flags to skip CT setup and action scripts
+ * @param action	modules list.
+ * @return		0 on success.
+ */
+int vps_restart(vps_handler *h, envid_t veid, vps_param *param,
+	int stop_mode, skipFlags skip, struct mod_action *action)
+{
+	int ret;
+
+	if (vps_is_run(h, veid)) {
+		ret = vps_stop(h, veid, param, stop_mode,
+			(skip & SKIP_ACTION_SCRIPT) | SKIP_UMOUNT, action);
+		if (ret)
+			return ret;
+	}
+	return vps_start(h, veid, param, skip | SKIP_UMOUNT, action);
+}
@@ -27,6 +27,10 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
 #include <string.h>
 
 #include "vzerror.h"
@@ -35,8 +39,8 @@
 #include "util.h"
 #include "logger.h"
 #include "script.h"
+#include "relay.h"
 
-static volatile sig_atomic_t alarm_flag, child_exited;
 static char *envp_bash[] = {"HOME=/", "TERM=linux", ENV_PATH, NULL};
 
 int vz_env_create_ioctl(vps_handler *h, envid_t veid, int flags);
@@ -79,49 +83,6 @@ int execvep(const char *path, char *const argv[], char *const envp[])
 	return -1;
 }
 
-static int stdredir(int rdfd, int wrfd)
-{
-	int lenr, lenw, lentotal, lenremain;
-	char buf[10240];
-	char *p;
-
-	if ((lenr = read(rdfd, buf, sizeof(buf)-1)) > 0) {
-		lentotal = 0;
-		lenremain = lenr;
-		p = buf;
-		while (lentotal < lenr) {
-			if ((lenw = write(wrfd, p, lenremain)) < 0) {
-				if (errno != EINTR)
-					return -1;
-			} else {
-				lentotal += lenw;
-				lenremain -= lenw;
-				p += lenw;
-			}
-		}
-	} else if (lenr == 0){
-		return -1;
-	} else {
-		if (errno == EAGAIN)
-			return 1;
-		else if (errno != EINTR)
-			return -1;
-	}
-	return 0;
-}
-
-static void exec_handler(int sig)
-{
-	child_exited = 1;
-	return;
-}
-
-static void alarm_handler(int sig)
-{
-	alarm_flag = 1;
-	return;
-}
-
 int env_wait(int pid)
 {
 	int ret, status;
@@ -143,16 +104,230 @@ int env_wait(int pid)
 	return ret;
 }
 
+int child_watch_init(struct child_watch *w, int pid)
+{
+	sigset_t mask;
+
+	w->pid = pid;
+	w->sigfd = 0;
+#ifdef __NR_pidfd_open
+	if ((w->fd = syscall(__NR_pidfd_open, pid, 0)) >= 0) {
+		fcntl(w->fd, F_SETFD, FD_CLOEXEC);
+		return 0;
+	}
+#endif
+	/* Old kernel, get SIGCHLD as data instead */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	if (sigprocmask(SIG_BLOCK, &mask, &w->oldmask))
+		return -1;
+	if ((w->fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+		sigprocmask(SIG_SETMASK, &w->oldmask, NULL);
+		return -1;
+	}
+	w->sigfd = 1;
+	return 0;
+}
+
+int child_watch_exited(struct child_watch *w)
+{
+	struct signalfd_siginfo si;
+	siginfo_t info;
+
+	if (w->sigfd)
+		while (read(w->fd, &si, sizeof(si)) > 0);
+	info.si_pid = 0;
+	if (waitid(P_PID, w->pid, &info, WEXITED | WNOHANG | WNOWAIT)) {
+		/* Reaped already, or auto-reaped with SIGCHLD ignored */
+		return errno != EINTR;
+	}
+	return info.si_pid != 0;
+}
+
+void child_watch_close(struct child_watch *w)
+{
+	if (w->fd < 0)
+		return;
+	close(w->fd);
+	w->fd = -1;
+	if (w->sigfd)
+		sigprocmask(SIG_SETMASK, &w->oldmask, NULL);
+}
+
+/* Events in the exec loop */
+enum {
+	EV_OUT,
+	EV_ERR,
+	EV_IN,
+	EV_CHILD,
+	EV_TIMER,
+	EV_SRC,
+	EV_FEED,
+};
+
+static int ev_ctl(int epfd, int op, int fd, int tag, unsigned int events)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.u32 = tag;
+	return epoll_ctl(epfd, op, fd, &ev);
+}
+
+static int ev_add(int epfd, int fd, int tag)
+{
+	return ev_ctl(epfd, EPOLL_CTL_ADD, fd, tag, EPOLLIN);
+}
+
+/* Command stdin streamed from exec_stdin source. Data is taken from
+ * the source only after the previous chunk went to the command, so
+ * a slow reader holds the source back instead of filling memory.
+ */
+#define FEED_BUF_SIZE	(64 * 1024)
+
+/* What the feed waits for */
+enum {
+	FEED_SRC,	/* source data */
+	FEED_OUT,	/* room in the command stdin pipe */
+	FEED_DONE,
+};
+
+struct feed {
+	struct exec_stdin *src;
+	int fd;			/* command stdin pipe, non-blocking */
+	int poll;		/* source can't be waited for, call it */
+	int state;
+	char *buf;
+	int pos;
+	int len;
+};
+
+/* Get next chunk: 0 - got it, 1 - nothing yet, -1 - end of data */
+static int feed_fill(struct feed *f)
+{
+	int n;
+
+	if (f->src->fd >= 0)
+		n = read(f->src->fd, f->buf, FEED_BUF_SIZE);
+	else
+		n = f->src->fn(f->src->data, f->buf, FEED_BUF_SIZE);
+	if (n > 0) {
+		f->pos = 0;
+		f->len = n;
+		return 0;
+	} else if (n < 0) {
+		if (errno == EINTR || errno == EAGAIN)
+			return 1;
+		logger(-1, errno, "Unable to read command input");
+	}
+	return -1;
+}
+
+static int feed_step(struct feed *f)
+{
+	int n;
+
+	if (f->pos == f->len) {
+		if ((n = feed_fill(f)) != 0)
+			return n < 0 ? FEED_DONE : FEED_SRC;
+	}
+	if ((n = write(f->fd, f->buf + f->pos, f->len - f->pos)) < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return FEED_OUT;
+		/* Command closed its stdin */
+		return FEED_DONE;
+	}
+	f->pos += n;
+	return f->pos == f->len ? FEED_SRC : FEED_OUT;
+}
+
+/* Wait for whatever is needed next */
+static void feed_set(int epfd, struct feed *f, int state)
+{
+	if (state == f->state)
+		return;
+	f->state = state;
+	if (state == FEED_DONE) {
+		if (f->src->fd >= 0 && !f->poll)
+			epoll_ctl(epfd, EPOLL_CTL_DEL, f->src->fd, NULL);
+		close(f->fd);
+		return;
+	}
+	ev_ctl(epfd, EPOLL_CTL_MOD, f->fd, EV_FEED,
+		state == FEED_OUT ? EPOLLOUT : 0);
+	if (f->src->fd >= 0 && !f->poll)
+		ev_ctl(epfd, EPOLL_CTL_MOD, f->src->fd, EV_SRC,
+			state == FEED_SRC ? EPOLLIN : 0);
+}
+
+/* Move a chunk */
+static void feed_run(int epfd, struct feed *f)
+{
+	feed_set(epfd, f, feed_step(f));
+}
+
+static int feed_init(int epfd, struct feed *f, struct exec_stdin *src,
+	int fd)
+{
+	f->src = src;
+	f->fd = fd;
+	f->poll = 0;
+	f->state = FEED_SRC;
+	f->pos = f->len = 0;
+	if ((f->buf = malloc(FEED_BUF_SIZE)) == NULL)
+		return -1;
+	set_not_blk(fd);
+	if (ev_ctl(epfd, EPOLL_CTL_ADD, fd, EV_FEED, 0))
+		return -1;
+	if (src->fd < 0) {
+		f->poll = 1;
+	} else if (ev_add(epfd, src->fd, EV_SRC)) {
+		/* Regular files and such are always ready */
+		if (errno != EPERM)
+			return -1;
+		f->poll = 1;
+	}
+	return 0;
+}
+
+/* std_in string, as a source */
+struct str_src {
+	const char *p;
+	int len;
+};
+
+static int str_read(void *data, char *buf, int len)
+{
+	struct str_src *s = data;
+
+	if (len > s->len)
+		len = s->len;
+	memcpy(buf, s->p, len);
+	s->p += len;
+	s->len -= len;
+	return len;
+}
+
 static int vps_real_exec(vps_handler *h, envid_t veid, const char *root,
-	int exec_mode, char *argv[], char *const envp[], char *std_in,
-	int timeout)
+	int exec_mode, char *argv[], char *const envp[],
+	struct exec_stdin *src, int timeout, int keep_fd)
 {
 	int ret, pid;
 	int in[2], out[2], err[2], st[2];
 	int fl = 0;
 	struct sigaction act;
 	char *def_argv[] = { NULL, NULL };
-
+	struct relay r_out, r_err, r_in;
+	struct child_watch cw;
+	struct feed f;
+	struct epoll_event ev[8];
+	struct itimerspec its;
+	int epfd = -1, tfd = -1;
+	int i, n, done = 0, timed_out = 0, stdin_poll = 0;
+
+	cw.fd = -1;
+	f.buf = NULL;
 	if (pipe(in) < 0 ||
 		pipe(out) < 0 ||
 		pipe(err) < 0 ||
@@ -167,27 +342,37 @@ static int vps_real_exec(vps_handler *h, envid_t veid, const char *root,
 	/* Set non block mode */
 	set_not_blk(out[0]);
 	set_not_blk(err[0]);
-	/* Setup alarm handler */
+	/* Bigger pipes mean fewer wakeups for bulk output */
+	relay_grow_pipe(out[0]);
+	relay_grow_pipe(in[0]);
+	relay_init(&r_out, out[0], STDOUT_FILENO);
+	relay_init(&r_err, err[0], STDERR_FILENO);
+	relay_init(&r_in, STDIN_FILENO, in[1]);
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		logger(-1, errno, "Unable to create epoll descriptor");
+		ret = VZ_RESOURCE_ERROR;
+		goto err;
+	}
+	/* Execution timeout runs from now on */
 	if (timeout) {
-		alarm_flag = 0;
-		act.sa_flags = 0;
-		sigemptyset(&act.sa_mask);
-		act.sa_handler = alarm_handler;
-		sigaction(SIGALRM, &act, NULL);
-		alarm(timeout);
-	}
-	child_exited = 0;
-	sigemptyset(&act.sa_mask);
-	act.sa_flags = SA_NOCLDSTOP;
-	act.sa_handler = exec_handler;
-	sigaction(SIGCHLD, &act, NULL);
-
+		memset(&its, 0, sizeof(its));
+		its.it_value.tv_sec = timeout;
+		if ((tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) < 0 ||
+			timerfd_settime(tfd, 0, &its, NULL) ||
+			ev_add(epfd, tfd, EV_TIMER))
+		{
+			logger(-1, errno, "Unable to set up execution timeout");
+			ret = VZ_RESOURCE_ERROR;
+			goto err;
+		}
+	}
 	act.sa_handler = SIG_IGN;
 	act.sa_flags = 0;
+	sigemptyset(&act.sa_mask);
 	sigaction(SIGPIPE, &act, NULL);
 
 	if ((ret = vz_setluid(veid)))
-		return ret;
+		goto err;
 	if ((pid = fork()) < 0) {
 		logger(-1, errno, "Unable to fork");
 		ret = VZ_RESOURCE_ERROR;
@@ -202,9 +387,11 @@ static int vps_real_exec(vps_handler *h, envid_t veid, const char *root,
 		close(in[1]); close(out[0]); close(err[0]);
 		close(st[0]);
 		fcntl(st[1], F_SETFD, FD_CLOEXEC);
+		if (keep_fd >= 0)
+			fcntl(keep_fd, F_SETFD, 0);
 		if ((ret = vz_chroot(root)))
 			goto  env_err;
-		close_fds(0, st[1], h->vzfd, -1);
+		close_fds(0, st[1], h->vzfd, keep_fd, -1);
 		ret = vz_env_create_ioctl(h, veid, VE_ENTER);
 		if (ret < 0) {
 			if (errno == ESRCH)
@@ -236,76 +423,112 @@ env_err:
 			break;
 	if (ret)
 		goto err;
-	if (std_in != NULL) {
-		if (write(in[1], std_in, strlen(std_in)) < 0) {
-			ret = VZ_COMMAND_EXECUTION_ERROR;
-			/* Flush fd */
-			while (stdredir(out[0], STDOUT_FILENO) == 0);
-			while (stdredir(err[0], STDERR_FILENO) == 0);
-			goto err;
-		}
-		close(in[1]);
-		/* do not set STDIN_FILENO in select() */
-		fl = 4;
-	}
-	while(!child_exited) {
-		int n;
-		fd_set rd_set;
-
-		if (timeout && alarm_flag) {
-			logger(-1, 0, "Execution timeout expired");
-			kill(pid, SIGTERM);
-			alarm(0);
-			break;
-		}
+	if (child_watch_init(&cw, pid) || ev_add(epfd, cw.fd, EV_CHILD) ||
+		ev_add(epfd, out[0], EV_OUT) || ev_add(epfd, err[0], EV_ERR) ||
+		(src != NULL && feed_init(epfd, &f, src, in[1])))
+	{
+		logger(-1, errno, "Unable to set up exec loop");
+		kill(pid, SIGTERM);
+		env_wait(pid);
+		ret = VZ_RESOURCE_ERROR;
+		goto err;
+	}
+	/* do not wait for STDIN_FILENO */
+	if (src != NULL)
+		fl |= 4;
+	else if (ev_add(epfd, STDIN_FILENO, EV_IN)) {
+		/* Regular files and such are always ready */
+		if (errno == EPERM)
+			stdin_poll = 1;
+		else
+			fl |= 4;
+	}
+	done = child_watch_exited(&cw);
+	while (!done) {
 		if ((fl & 3) == 3) {
 			/* all fd are closed */
 			close(in[1]);
 			break;
 		}
-		FD_ZERO(&rd_set);
-		if (!(fl & 4))
-			FD_SET(STDIN_FILENO, &rd_set);
-		if (!(fl & 1))
-			FD_SET(out[0], &rd_set);
-		if (!(fl & 2))
-			FD_SET(err[0], &rd_set);
-		n = select(FD_SETSIZE, &rd_set, NULL, NULL, NULL);
-		if (n > 0) {
-			if (FD_ISSET(out[0], &rd_set))
-				if (stdredir(out[0], STDOUT_FILENO) < 0) {
+		n = epoll_wait(epfd, ev, ARRAY_SIZE(ev), stdin_poll ||
+			(src != NULL && f.poll && f.state == FEED_SRC) ? 0 : -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			logger(-1, errno, "Error in epoll_wait()");
+			close(out[0]);
+			close(err[0]);
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			switch (ev[i].data.u32) {
+			case EV_OUT:
+				if (!(fl & 1) && relay_move(&r_out) < 0) {
 					fl |= 1;
 					close(out[0]);
 				}
-			if (FD_ISSET(err[0], &rd_set))
-				if (stdredir(err[0], STDERR_FILENO) < 0) {
+				break;
+			case EV_ERR:
+				if (!(fl & 2) && relay_move(&r_err) < 0) {
 					fl |= 2;
 					close(err[0]);
 				}
-			if (FD_ISSET(STDIN_FILENO, &rd_set))
-				if (stdredir(STDIN_FILENO, in[1]) < 0) {
+				break;
+			case EV_IN:
+				if (!(fl & 4) && relay_move(&r_in) < 0) {
 					fl |= 4;
 					close(in[1]);
+					epoll_ctl(epfd, EPOLL_CTL_DEL,
+						STDIN_FILENO, NULL);
 				}
-		} else if (n < 0 && errno != EINTR) {
-			logger(-1, errno, "Error in select()");
-			close(out[0]);
-			close(err[0]);
-			break;
+				break;
+			case EV_SRC:
+				if (f.state == FEED_SRC)
+					feed_run(epfd, &f);
+				break;
+			case EV_FEED:
+				if (ev[i].events & EPOLLERR)
+					feed_set(epfd, &f, FEED_DONE);
+				else if (f.state == FEED_OUT)
+					feed_run(epfd, &f);
+				break;
+			case EV_CHILD:
+				if (child_watch_exited(&cw))
+					done = 1;
+				break;
+			case EV_TIMER:
+				logger(-1, 0, "Execution timeout expired");
+				kill(pid, SIGTERM);
+				timed_out = done = 1;
+				break;
+			}
+		}
+		if (stdin_poll && !(fl & 4) && relay_move(&r_in) < 0) {
+			fl |= 4;
+			stdin_poll = 0;
+			close(in[1]);
 		}
+		if (src != NULL && f.poll && f.state == FEED_SRC)
+			feed_run(epfd, &f);
 	}
 	/* Flush fds */
 	if (!(fl & 1)) {
-		while (stdredir(out[0], STDOUT_FILENO) == 0);
+		while (relay_move(&r_out) == 0);
 	}
 	if (!(fl & 2)) {
-		while (stdredir(err[0], STDERR_FILENO) == 0);
+		while (relay_move(&r_err) == 0);
 	}
 	ret = env_wait(pid);
-	if (ret && timeout && alarm_flag)
+	if (ret && timed_out)
 		ret = VZ_EXEC_TIMEOUT;
 
 err:
+	free(f.buf);
+	child_watch_close(&cw);
+	if (tfd >= 0)
+		close(tfd);
+	if (epfd >= 0)
+		close(epfd);
 	close(st[0]); close(st[1]);
 	close(out[0]); close(out[1]);
 	close(err[0]); close(err[1]);
@@ -314,7 +537,7 @@ err:
 	return ret;
 }
 
-/** Execute command inside CT.
+/** Execute command inside CT, streaming its stdin from a source.
  *
  * @param h		CT handler.
  * @param veid		CT ID.
@@ -322,12 +545,14 @@ err:
  * @param exec_mode	execution mode (MODE_EXEC, MODE_BASH).
  * @param arg		argv array.
  * @param envp		command environment array.
- * @param std_in	read command from buffer stdin point to.
+ * @param src		stdin source, NULL to relay STDIN_FILENO.
  * @param timeout	execution timeout, 0 - unlimited.
+ * @param keep_fd	descriptor to pass to the command, -1 for none.
  * @return		0 on success.
  */
-int vps_exec(vps_handler *h, envid_t veid, const char *root, int exec_mode,
-	char *argv[], char *const envp[], char *std_in, int timeout)
+int vps_exec_src(vps_handler *h, envid_t veid, const char *root,
+	int exec_mode, char *argv[], char *const envp[],
+	struct exec_stdin *src, int timeout, int keep_fd)
 {
 	int pid, ret;
 
@@ -345,7 +570,7 @@ int vps_exec(vps_handler *h, envid_t veid, const char *root, int exec_mode,
 		return VZ_RESOURCE_ERROR;
 	} else if (pid == 0) {
 		ret = vps_real_exec(h, veid, root, exec_mode, argv, envp,
-			std_in, timeout);
+			src, timeout, keep_fd);
 		exit(ret);
 	}
 	ret = env_wait(pid);
@@ -353,6 +578,57 @@ int vps_exec(vps_handler *h, envid_t veid, const char *root, int exec_mode,
 	return ret;
 }
 
+/** Execute command inside CT, leaving a descriptor open for it.
+ *
+ * @param h		CT handler.
+ * @param veid		CT ID.
+ * @param root		CT root.
+ * @param exec_mode	execution mode (MODE_EXEC, MODE_BASH).
+ * @param arg		argv array.
+ * @param envp		command environment array.
+ * @param std_in	read command from buffer stdin point to.
+ * @param timeout	execution timeout, 0 - unlimited.
+ * @param keep_fd	descriptor to pass to the command, -1 for none.
+ * @return		0 on success.
+ */
+int vps_exec_fd(vps_handler *h, envid_t veid, const char *root,
+	int exec_mode, char *argv[], char *const envp[], char *std_in,
+	int timeout, int keep_fd)
+{
+	struct exec_stdin src;
+	struct str_src str;
+
+	if (std_in == NULL)
+		return vps_exec_src(h, veid, root, exec_mode, argv, envp,
+			NULL, timeout, keep_fd);
+	str.p = std_in;
+	str.len = strlen(std_in);
+	src.fd = -1;
+	src.fn = str_read;
+	src.data = &str;
+	return vps_exec_src(h, veid, root, exec_mode, argv, envp, &src,
+		timeout, keep_fd);
+}
+
+/** Execute command inside CT.
+ *
+ * @param h		CT handler.
+ * @param veid		CT ID.
+ * @param root		CT root.
+ * @param exec_mode	execution mode (MODE_EXEC, MODE_BASH).
+ * @param arg		argv array.
+ * @param envp		command environment array.
+ * @param std_in	read command from buffer stdin point to.
+ * @param timeout	execution timeout, 0 - unlimited.
+ * @return		0 on success.
+ */
+int vps_exec(vps_handler *h, envid_t veid, const char *root, int exec_mode,
+	char *argv[], char *const envp[], char *std_in, int timeout)
+{
+	return vps_exec_fd(h, veid, root, exec_mode, argv, envp, std_in,
+		timeout, -1);
+}
+
 static int _real_execFn(vps_handler *h, envid_t veid, const char *root,
 		execFn fn, void *data, int flags)
 {
@@ -409,7 +685,33 @@ int vps_execFn(vps_handler *h, envid_t veid, const char *root,
 	return ret;
 }
 
-/** Read script and execute it in CT.
+/* Function file and script, read one after another as a source.
+ * Every file is followed by a newline, as done by read_script().
+ */
+struct script_src {
+	int fd[2];
+	int cur;
+};
+
+static int script_read(void *data, char *buf, int len)
+{
+	struct script_src *s = data;
+	int n;
+
+	while (s->cur < 2) {
+		if (s->fd[s->cur] >= 0 &&
+				(n = read(s->fd[s->cur], buf, len)) != 0)
+			return n;
+		if (s->fd[s->cur++] >= 0) {
+			buf[0] = '\n';
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/** Execute script in CT, streaming it with the function file
+ * (if any, from the script directory) to bash stdin.
  *
  * @param h		CT handler.
  * @param veid		CT ID.
@@ -425,14 +727,49 @@ int vps_exec_script(vps_handler *h, envid_t veid, const char *root,
 	char *argv[], char *const envp[], const char *fname, char *func,
 	int timeout)
 {
-	int len, ret;
-	char *script = NULL;
-
-	if ((len = read_script(fname, func, &script)) < 0)
+	char inc[STR_SIZE];
+	struct script_src s;
+	struct exec_stdin src;
+	const char *p;
+	int ret;
+
+	if (!fname) {
+		logger(-1, 0, "vps_exec_script: file name not specified");
 		return -1;
+	}
+	s.fd[0] = s.fd[1] = -1;
+	s.cur = 0;
+	if (func != NULL) {
+		if ((p = strrchr(fname, '/')) != NULL)
+			snprintf(inc, sizeof(inc), "%.*s%s",
+				(int) (p - fname + 1), fname, func);
+		else
+			snprintf(inc, sizeof(inc), "%s", func);
+		if (stat_file(inc) &&
+				(s.fd[0] = open(inc, O_RDONLY | O_CLOEXEC)) < 0)
+		{
+			logger(-1, errno, "Unable to open %s", inc);
+			return -1;
+		}
+	}
+	if ((s.fd[1] = open(fname, O_RDONLY | O_CLOEXEC)) < 0) {
+		if (errno == ENOENT)
+			logger(-1, 0, "file %s not found", fname);
+		else
+			logger(-1, errno, "Unable to open %s", fname);
+		if (s.fd[0] >= 0)
+			close(s.fd[0]);
+		return -1;
+	}
+	src.fd = -1;
+	src.fn = script_read;
+	src.data = &s;
 	logger(1, 0, "Running container script: %s", fname);
-	ret = vps_exec(h, veid, root, MODE_BASH, argv, envp, script, timeout);
-	free(script);
+	ret = vps_exec_src(h, veid, root, MODE_BASH, argv, envp, &src,
+		timeout, -1);
+	if (s.fd[0] >= 0)
+		close(s.fd[0]);
+	close(s.fd[1]);
 	return ret;
 }
 
@@ -26,6 +26,8 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/file.h>
+#include <sys/inotify.h>
+#include <poll.h>
 
 #include "vzerror.h"
 #include "types.h"
@@ -59,6 +61,189 @@ static int getlockpid(char *file)
 	return pid;
 }
 
+/* How often to recheck the lock while waiting for it, in ms.
+ * Needed to notice a holder which died without removing the lock.
+ */
+#define LOCK_RECHECK_MS		1000
+
+static int is_alive(int pid)
+{
+	char buf[64];
+	struct stat st;
+
+	snprintf(buf, sizeof(buf), "/proc/%d", pid);
+	return !stat(buf, &st);
+}
+
+/* Try to take the lock by linking the prepared tmp_file to lockfile.
+ * return: 0 - locked
+ *	   1 - lock is held by another process
+ *	  -1 - error
+ */
+static int try_lock(char *tmp_file, char *lockfile)
+{
+	int pid;
+	int retry = 0;
+	int ret = -1;
+
+	while (retry < 3) {
+		/* vps locked */
+		if (!link(tmp_file, lockfile)) {
+			ret = 0;
+			break;
+		}
+		pid = getlockpid(lockfile);
+		if (pid < 0) {
+			/*  Error read pid id */
+			usleep(500000);
+			retry++;
+			continue;
+		} else if (pid == 0) {
+			/* incorrect pid, remove lock file */
+			unlink(lockfile);
+		} else if (is_alive(pid)) {
+			ret = 1;
+			break;
+		} else if (getlockpid(lockfile) == pid) {
+			/* Check it was not just released and taken again */
+			logger(0, 0, "Removing stale lock file %s", lockfile);
+			unlink(lockfile);
+		}
+		retry++;
+	}
+	return ret;
+}
+
+/* Lock waiters queue, $dir/$veid.lck.queue.
+ * Holds pids of processes waiting for the lock, one per line, in
+ * order of arrival. Only the first one may take the lock, so it is
+ * granted in FIFO order. The file is changed under flock(), and
+ * waiters which are gone are dropped by whoever updates it next.
+ * The file is removed once there are no waiters left.
+ *
+ * Adds pid add (if > 0), removes pid del (if > 0), and returns
+ * the pid of the first waiter in *head (0 if there are none).
+ */
+static int queue_update(char *qfile, int add, int del, int *head)
+{
+	char *buf = NULL, *out = NULL, *tmp, *p;
+	int fd, pid, len = 0, size = 0, n, olen = 0;
+	struct stat st;
+	int ret = -1;
+
+	for (;;) {
+		fd = open(qfile, O_RDWR | O_CLOEXEC | (add > 0 ? O_CREAT : 0),
+			0600);
+		if (fd < 0 && errno == ENOENT) {
+			/* No queue, no waiters */
+			if (head != NULL)
+				*head = 0;
+			return 0;
+		}
+		if (fd < 0) {
+			logger(-1, errno, "Unable to open %s", qfile);
+			return -1;
+		}
+		if (flock(fd, LOCK_EX)) {
+			logger(-1, errno, "Error in flock()");
+			goto err;
+		}
+		/* Retry if it was removed as empty while we waited */
+		if (fstat(fd, &st) == 0 && st.st_nlink > 0)
+			break;
+		close(fd);
+	}
+	do {
+		if (size - len < 64) {
+			size += 1024;
+			if ((tmp = realloc(buf, size + 1)) == NULL)
+				goto err;
+			buf = tmp;
+		}
+		if ((n = read(fd, buf + len, size - len)) < 0) {
+			logger(-1, errno, "Unable to read %s", qfile);
+			goto err;
+		}
+		len += n;
+	} while (n > 0);
+	buf[len] = '\0';
+	if ((out = malloc(len + 16)) == NULL)
+		goto err;
+	if (head != NULL)
+		*head = 0;
+	for (p = buf; sscanf(p, "%d", &pid) == 1; p++) {
+		if (pid > 0 && pid != del && pid != add && is_alive(pid)) {
+			if (head != NULL && *head == 0)
+				*head = pid;
+			olen += sprintf(out + olen, "%d\n", pid);
+		}
+		if ((p = strchr(p, '\n')) == NULL)
+			break;
+	}
+	if (add > 0) {
+		if (head != NULL && *head == 0)
+			*head = add;
+		olen += sprintf(out + olen, "%d\n", add);
+	}
+	if (olen == 0) {
+		if (unlink(qfile) && errno != ENOENT) {
+			logger(-1, errno, "Unable to remove %s", qfile);
+			goto err;
+		}
+	} else if (olen != len || memcmp(buf, out, len)) {
+		if (ftruncate(fd, 0) || pwrite(fd, out, olen, 0) != olen) {
+			logger(-1, errno, "Unable to write %s", qfile);
+			goto err;
+		}
+	}
+	ret = 0;
+err:
+	free(buf);
+	free(out);
+	close(fd);
+	return ret;
+}
+
+/* Wait for a change of the lock or its queue, or ms milliseconds */
+static void wait_lock_change(int ifd, envid_t veid, int ms)
+{
+	char buf[4096]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	char name[32];
+	struct inotify_event *ev;
+	struct pollfd pfd;
+	int n, off;
+
+	if (ifd < 0) {
+		usleep(ms < 100 ? ms * 1000 : 100000);
+		return;
+	}
+	pfd.fd = ifd;
+	pfd.events = POLLIN;
+	snprintf(name, sizeof(name), "%d.lck", veid);
+	while (poll(&pfd, 1, ms) > 0) {
+		if ((n = read(ifd, buf, sizeof(buf))) <= 0)
+			return;
+		for (off = 0; off < n; off += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *) (buf + off);
+			/* $veid.lck or $veid.lck.queue */
+			if (ev->len && !strncmp(ev->name, name, strlen(name)))
+				return;
+		}
+		/* Events of other CTs, keep waiting */
+		ms = 10;
+	}
+}
+
+static int ms_left(struct timespec *deadline)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (deadline->tv_sec - now.tv_sec) * 1000 +
+		(deadline->tv_nsec - now.tv_nsec) / 1000000;
+}
+
 /** Lock container.
  * Create lock file $dir/$veid.lck.
  * @param veid		CT ID.
@@ -70,12 +255,29 @@ static int getlockpid(char *file)
  */
 int vps_lock(envid_t veid, char *dir, char *status)
 {
-	int fd, pid;
+	return vps_lock_wait(veid, dir, status, 0);
+}
+
+/** Lock container, waiting for the lock if it is taken.
+ * Waiters get the lock in order of arrival.
+ * @param veid		CT ID.
+ * @param dir		lock directory.
+ * @param status	transition status.
+ * @param timeout	seconds to wait for the lock, 0 - do not wait.
+ * @return		 0 - success
+ *			 1 - locked
+ *			-1 - error.
+ */
+int vps_lock_wait(envid_t veid, char *dir, char *status,
+		unsigned long timeout)
+{
+	int fd, ifd = -1, head, ms;
+	int pid = getpid(), waiting = 0;
 	char buf[STR_SIZE];
 	char lockfile[STR_SIZE];
 	char tmp_file[STR_SIZE];
-	struct stat st;
-	int retry = 0;
+	char qfile[STR_SIZE + sizeof(".queue")];
+	struct timespec deadline;
 	int ret = -1;
 
 	if (check_var(dir, "lockdir is not set"))
@@ -96,38 +298,53 @@ int vps_lock(envid_t veid, char *dir, char *status)
 				" temporary lock file: %s", tmp_file);
 		return -1;
 	}
-	snprintf(buf, sizeof(buf), "%d\n%s\n", getpid(),
+	snprintf(buf, sizeof(buf), "%d\n%s\n", pid,
 		status == NULL ? "" : status);
 	write(fd, buf, strlen(buf));
 	close(fd);
-	while (retry < 3) {
-		/* vps locked */
-		if (!link(tmp_file, lockfile)) {
-			ret = 0;
+	snprintf(qfile, sizeof(qfile), "%s.queue", lockfile);
+	if (timeout == 0) {
+		/* Do not jump the queue: the lock goes to its head */
+		if (queue_update(qfile, 0, 0, &head) == 0)
+			ret = head ? 1 : try_lock(tmp_file, lockfile);
+		goto out;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += timeout;
+	/* Watch before queueing, not to miss a wakeup */
+	if ((ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) >= 0 &&
+		inotify_add_watch(ifd, dir, IN_DELETE | IN_MOVED_FROM |
+			IN_CLOSE_WRITE) < 0)
+	{
+		close(ifd);
+		ifd = -1;
+	}
+	if (queue_update(qfile, pid, 0, &head))
+		goto out;
+	for (;;) {
+		if (head == pid) {
+			if ((ret = try_lock(tmp_file, lockfile)) != 1)
+				break;
+		}
+		if ((ms = ms_left(&deadline)) <= 0) {
+			ret = 1;
 			break;
 		}
-		pid = getlockpid(lockfile);
-		if (pid < 0) {
-			/*  Error read pid id */
-			usleep(500000);
-			retry++;
-			continue;
-		} else if (pid == 0) {
-			/* incorrect pid, remove lock file */
-			unlink(lockfile);
-		} else {
-			snprintf(buf, sizeof(buf), "/proc/%d", pid);
-			if (!stat(buf, &st)) {
-				ret = 1;
-				break;
-			} else {
-				logger(0, 0, "Removing stale lock"
-						" file %s", lockfile);
-				unlink(lockfile);
-			}
+		if (!waiting++)
+			logger(0, 0, "Container is locked, waiting"
+				" up to %lu s", timeout);
+		wait_lock_change(ifd, veid,
+			ms < LOCK_RECHECK_MS ? ms : LOCK_RECHECK_MS);
+		if (queue_update(qfile, 0, 0, &head)) {
+			ret = -1;
+			break;
 		}
-		retry++;
 	}
+	queue_update(qfile, 0, pid, NULL);
+	if (ifd >= 0)
+		close(ifd);
+out:
 	unlink(tmp_file);
 	return ret;
 }
@@ -0,0 +1,175 @@
+/*
+ *  Copyright (C) 2000-2011, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Stream relay for exec and enter
+ *
+ * When one end is a pipe, data is moved by splice() inside the kernel,
+ * without copying it to user space. Other streams (terminals mostly)
+ * are copied through a big buffer on the stack, so streams can be
+ * moved by several threads at once. If the kernel refuses to splice
+ * a stream (e.g. file opened with O_APPEND), it is copied from then on.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+
+#include "relay.h"
+
+/* Max data moved by one splice() */
+#define RELAY_SPLICE_LEN	(1024 * 1024)
+/* Buffer for streams which can't be spliced */
+#define RELAY_BUF_SIZE		(128 * 1024)
+
+static int relay_splice = 1;
+
+void relay_use_splice(int on)
+{
+	relay_splice = on;
+}
+
+static int can_splice(mode_t m)
+{
+	return S_ISFIFO(m) || S_ISREG(m) || S_ISSOCK(m);
+}
+
+void relay_init(struct relay *r, int rdfd, int wrfd)
+{
+	struct stat rd, wr;
+	int fl;
+
+	r->rdfd = rdfd;
+	r->wrfd = wrfd;
+	r->splice = 0;
+	fl = fcntl(rdfd, F_GETFL);
+	r->nonblock = fl != -1 && (fl & O_NONBLOCK);
+	if (!relay_splice || fstat(rdfd, &rd) || fstat(wrfd, &wr))
+		return;
+	/* splice() needs a pipe on either end */
+	if ((S_ISFIFO(rd.st_mode) && can_splice(wr.st_mode)) ||
+			(S_ISFIFO(wr.st_mode) && can_splice(rd.st_mode)))
+		r->splice = 1;
+}
+
+void relay_grow_pipe(int fd)
+{
+#ifdef F_SETPIPE_SZ
+	fcntl(fd, F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+#endif
+}
+
+/* Wait until wrfd can take more data */
+static int wait_writable(int fd)
+{
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = POLLOUT;
+	while (poll(&pfd, 1, -1) < 0)
+		if (errno != EINTR)
+			return -1;
+	return (pfd.revents & POLLERR) ? -1 : 0;
+}
+
+/* splice() returned EAGAIN: it is either no input or no room for output */
+static int splice_again(struct relay *r)
+{
+	struct pollfd pfd;
+
+	pfd.fd = r->rdfd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 0) <= 0 || !(pfd.revents & (POLLIN | POLLHUP)))
+		return 1;
+	return wait_writable(r->wrfd);
+}
+
+static int splice_move(struct relay *r)
+{
+	ssize_t n;
+
+	n = splice(r->rdfd, NULL, r->wrfd, NULL, RELAY_SPLICE_LEN,
+		SPLICE_F_MOVE | (r->nonblock ? SPLICE_F_NONBLOCK : 0));
+	if (n > 0)
+		return 0;
+	if (n == 0)
+		return -1;
+	switch (errno) {
+	case EINTR:
+		return 0;
+	case EAGAIN:
+		return splice_again(r);
+	case EINVAL:
+		/* Not supported for these fds, nothing was moved */
+		r->splice = 0;
+		return 0;
+	}
+	return -1;
+}
+
+static int copy_move(struct relay *r)
+{
+	char buf[RELAY_BUF_SIZE];
+	ssize_t lenr, lenw;
+	size_t len = 0;
+	char *p;
+
+	/* Gather all there is (a pty gives it out in small pieces),
+	 * to write it at once
+	 */
+	do {
+		lenr = read(r->rdfd, buf + len, sizeof(buf) - len);
+		if (lenr > 0)
+			len += lenr;
+	} while (r->nonblock && lenr > 0 && len < sizeof(buf));
+	if (len > 0) {
+		/* End of file or error will show up next time */
+		lenr = len;
+		p = buf;
+		while (lenr > 0) {
+			if ((lenw = write(r->wrfd, p, lenr)) < 0) {
+				if (errno == EAGAIN) {
+					if (wait_writable(r->wrfd))
+						return -1;
+				} else if (errno != EINTR) {
+					return -1;
+				}
+			} else {
+				lenr -= lenw;
+				p += lenw;
+			}
+		}
+	} else if (lenr == 0) {
+		return -1;
+	} else {
+		if (errno == EAGAIN)
+			return 1;
+		else if (errno != EINTR)
+			return -1;
+	}
+	return 0;
+}
+
+int relay_move(struct relay *r)
+{
+	if (r->splice)
+		return splice_move(r);
+	return copy_move(r);
+}
@@ -35,7 +35,14 @@
 #include "util.h"
 #include "quota.h"
 #include "vps_configure.h"
+#include "config.h"
 #include "io.h"
+#include "net.h"
+#include "fs.h"
+#include "cpu.h"
+#include "meminfo.h"
+#include "veth.h"
+#include "span.h"
 
 /** Function called on CT start to setup resource management
  *
@@ -76,60 +83,173 @@ static int vps_2quota_perm(vps_handler *h, int veid,
 }
 
 
-int vps_setup_res(vps_handler *h, envid_t veid, dist_actions *actions,
-	fs_param *fs, vps_param *param, int vps_state, skipFlags skip,
-	struct mod_action *action)
+static int ub_set(ub_param *ub)
 {
-	int ret;
-	vps_res *res = &param->res;
+#define UB_SET(name)						\
+	if (ub->name != NULL) return 1;
 
-	if (skip & SKIP_SETUP)
-		return 0;
-	if (vps_state != STATE_STARTING) {
-		if ((ret = vps_set_ublimit(h, veid, &res->ub)))
-			return ret;
+	UB_SET(kmemsize)
+	UB_SET(lockedpages)
+	UB_SET(privvmpages)
+	UB_SET(shmpages)
+	UB_SET(numproc)
+	UB_SET(physpages)
+	UB_SET(vmguarpages)
+	UB_SET(oomguarpages)
+	UB_SET(numtcpsock)
+	UB_SET(numflock)
+	UB_SET(numpty)
+	UB_SET(numsiginfo)
+	UB_SET(tcpsndbuf)
+	UB_SET(tcprcvbuf)
+	UB_SET(othersockbuf)
+	UB_SET(dgramrcvbuf)
+	UB_SET(numothersock)
+	UB_SET(numfile)
+	UB_SET(dcachesize)
+	UB_SET(numiptent)
+	UB_SET(avnumproc)
+	UB_SET(swappages)
+#undef UB_SET
+	return 0;
+}
+
+/** Compute which CT subsystems are touched by the requested parameters.
+ *
+ * Values are not compared with the current ones: the running CT can
+ * differ from its config, so every requested value is to be applied.
+ *
+ * @param new		requested parameters.
+ * @return		mask of VPS_RES_* bits.
+ */
+int vps_res_changes(vps_param *new)
+{
+	int changes = 0;
+	vps_res *n = &new->res;
+
+	if (ub_set(&n->ub))
+		changes |= VPS_RES_UB | VPS_RES_MEMINFO;
+	if (n->net.delall || !list_empty(&n->net.ip) ||
+			!list_empty(&new->del_res.net.ip))
+		changes |= VPS_RES_NET | VPS_RES_CONFIGURE;
+	if (!list_empty(&n->net.dev) || !list_empty(&new->del_res.net.dev))
+		changes |= VPS_RES_NETDEV;
+	if (n->cpu.units != NULL || n->cpu.weight != NULL ||
+		n->cpu.limit != NULL || n->cpu.vcpus != NULL ||
+		n->cpu.mask != NULL)
+	{
+		changes |= VPS_RES_CPU;
 	}
-	if ((ret = vps_net_ctl(h, veid, DEL, &param->del_res.net, actions,
-		fs->root, vps_state, skip)))
+	if (!list_empty(&n->dev.dev))
+		changes |= VPS_RES_DEV;
+	if (!list_empty(&n->pci.list) || !list_empty(&new->del_res.pci.list))
+		changes |= VPS_RES_PCI;
+	if (n->fs.noatime == YES)
+		changes |= VPS_RES_FS;
+	if (n->meminfo.mode >= 0)
+		changes |= VPS_RES_MEMINFO;
+	if (n->io.ioprio >= 0)
+		changes |= VPS_RES_IO;
+	if (n->dq.enable || n->dq.diskspace != NULL ||
+		n->dq.diskinodes != NULL || n->dq.exptime != NULL)
 	{
-		return ret;
+		changes |= VPS_RES_QUOTA;
 	}
-	if ((ret = vps_net_ctl(h, veid, ADD, &res->net, actions, fs->root,
-		vps_state, skip)))
+	if (n->dq.ugidlimit != NULL)
+		changes |= VPS_RES_QUOTA | VPS_RES_CONFIGURE;
+	if (n->misc.hostname != NULL || !list_empty(&n->misc.nameserver) ||
+		!list_empty(&n->misc.searchdomain))
 	{
-		return ret;
+		changes |= VPS_RES_CONFIGURE;
 	}
-	if ((ret = vps_set_netdev(h, veid, &res->ub,
-					&res->net, &param->del_res.net)))
-		return ret;
-	if ((ret = vps_set_cpu(h, veid, &res->cpu)))
-		return ret;
-	if ((ret = vps_set_devperm(h, veid, fs->root, &res->dev)))
-		return ret;
-	if ((ret = vps_set_pci(h, veid, ADD, fs->root, &res->pci)))
-		return ret;
-	if ((ret = vps_set_pci(h, veid, DEL, fs->root, &param->del_res.pci)))
-		return ret;
-	if ((ret = vps_set_fs(fs, &res->fs)))
-		return ret;
-	if((ret = vps_meminfo_set(h, veid, &res->meminfo, param, vps_state)))
-		return ret;
-	if ((ret = ve_ioprio_set(h, veid, &res->io)))
-		return ret;
-	if ((ret = vps_2quota_perm(h, veid, fs->root, &res->dq)))
-		return ret;
+	if (!list_empty(&n->veth.dev) || !list_empty(&new->del_res.veth.dev))
+		changes |= VPS_RES_VETH;
 
+	return changes;
+}
+
+/* Run applier if its subsystem is in the change set,
+ * and record its run time.
+ */
+#define SETUP_STEP(mask, name, call)					\
+	if (changes & (mask)) {						\
+		span_begin(name);					\
+		ret = (call);						\
+		span_end();						\
+		if (ret)						\
+			goto err;					\
+	}
+
+int vps_setup_res_changed(vps_handler *h, envid_t veid,
+	dist_actions *actions, fs_param *fs, vps_param *param, int changes,
+	int vps_state, skipFlags skip, struct mod_action *action)
+{
+	int ret;
+	vps_res *res = &param->res;
+
+	if (skip & SKIP_SETUP)
+		return 0;
+	/* Run all in-CT configuration scripts in one go */
 	if (!(skip & SKIP_CONFIGURE))
-		vps_configure(h, veid, actions, fs->root, param, vps_state);
-	/* Setup quota limits after configure steps */
-	if ((ret = vps_set_quota(veid, &res->dq)))
-		return ret;
-	if ((ret = vps_setup_veth(h, veid, actions,  fs->root, &res->veth,
-			&param->del_res.veth, vps_state, skip)))
-	{
-		return ret;
+		vps_configure_begin();
+	if (vps_state != STATE_STARTING) {
+		SETUP_STEP(VPS_RES_UB, "ublimit",
+			vps_set_ublimit(h, veid, &res->ub))
+	}
+	SETUP_STEP(VPS_RES_NET, "net del",
+		vps_net_ctl(h, veid, DEL, &param->del_res.net, actions,
+			fs->root, vps_state, skip))
+	SETUP_STEP(VPS_RES_NET, "net add",
+		vps_net_ctl(h, veid, ADD, &res->net, actions, fs->root,
+			vps_state, skip))
+	SETUP_STEP(VPS_RES_NETDEV, "netdev",
+		vps_set_netdev(h, veid, &res->ub, &res->net,
+			&param->del_res.net))
+	SETUP_STEP(VPS_RES_CPU, "cpu", vps_set_cpu(h, veid, &res->cpu))
+	SETUP_STEP(VPS_RES_DEV, "devperm",
+		vps_set_devperm(h, veid, fs->root, &res->dev))
+	SETUP_STEP(VPS_RES_PCI, "pci add",
+		vps_set_pci(h, veid, ADD, fs->root, &res->pci))
+	SETUP_STEP(VPS_RES_PCI, "pci del",
+		vps_set_pci(h, veid, DEL, fs->root, &param->del_res.pci))
+	SETUP_STEP(VPS_RES_FS, "fs", vps_set_fs(fs, &res->fs))
+	SETUP_STEP(VPS_RES_MEMINFO, "meminfo",
+		vps_meminfo_set(h, veid, &res->meminfo, param, vps_state))
+	SETUP_STEP(VPS_RES_IO, "ioprio", ve_ioprio_set(h, veid, &res->io))
+	SETUP_STEP(VPS_RES_QUOTA, "quota perm",
+		vps_2quota_perm(h, veid, fs->root, &res->dq))
+
+	if (!(skip & SKIP_CONFIGURE)) {
+		/* configure errors are not fatal */
+		SETUP_STEP(VPS_RES_CONFIGURE, "configure",
+			(vps_configure(h, veid, actions, fs->root, param,
+				vps_state), 0))
+		span_begin("configure session");
+		ret = vps_configure_end(h, veid, fs->root);
+		span_end();
+		if (ret)
+			goto err;
 	}
+	/* Setup quota limits after configure steps */
+	SETUP_STEP(VPS_RES_QUOTA, "quota", vps_set_quota(veid, &res->dq))
+	SETUP_STEP(VPS_RES_VETH, "veth",
+		vps_setup_veth(h, veid, actions,  fs->root, &res->veth,
+			&param->del_res.veth, vps_state, skip))
 	ret = mod_setup(h, veid, vps_state, skip, action, param);
 
 	return ret;
+
+err:
+	/* Do not leave configure session behind. Script failures are
+	 * logged by it, ret keeps the error of the step which failed */
+	vps_configure_end(h, veid, fs->root);
+	return ret;
+}
+
+int vps_setup_res(vps_handler *h, envid_t veid, dist_actions *actions,
+	fs_param *fs, vps_param *param, int vps_state, skipFlags skip,
+	struct mod_action *action)
+{
+	return vps_setup_res_changed(h, veid, actions, fs, param, VPS_RES_ALL,
+		vps_state, skip, action);
 }
@@ -35,6 +35,7 @@
 #include "vzerror.h"
 #include "util.h"
 #include "script.h"
+#include "spawnprog.h"
 #include "fs.h"
 
 volatile sig_atomic_t alarm_flag;
@@ -109,12 +110,10 @@ err:
 #define ENV_SIZE	256
 int run_script(const char *f, char *argv[], char *env[], int quiet)
 {
-	int child, pid, fd;
-	int status;
+	int child;
 	int ret, i, j;
 	char *cmd;
 	struct sigaction act, actold;
-	int out[2];
 	char *envp[ENV_SIZE];
 
 	if (!stat_file(f)) {
@@ -132,11 +131,6 @@ int run_script(const char *f, char *argv[], char *env[], int quiet)
 		logger(2, 0, "Running: %s", cmd);
 		free(cmd);
 	}
-	if (quiet && pipe(out) < 0) {
-		logger(-1, errno, "run_script: unable to create pipe");
-		ret = VZ_RESOURCE_ERROR;
-		goto err;
-	}
 	i = 0;
 	if (env != NULL) {
 		for (i = 0; i < ENV_SIZE - 1 && env[i] != NULL; i++)
@@ -145,45 +139,14 @@ int run_script(const char *f, char *argv[], char *env[], int quiet)
 	for (j = 0; i < ENV_SIZE - 1 && envp_bash[j] != NULL; i++, j++)
 		envp[i] = envp_bash[j];
 	envp[i] = NULL;
-	if ((child = fork()) == 0) {
-		fd = open("/dev/null", O_WRONLY);
-		if (fd < 0)
-			close(0);
-		else
-			dup2(fd, 0);
-
-		if (quiet) {
-			dup2(fd, 1);
-			dup2(fd, 2);
-		} else {
-/*
-			dup2(out[1], STDOUT_FILENO);
-			dup2(out[1], STDERR_FILENO);
-			close(out[0]);
-			close(out[1]);
-*/
-		}
-		execve(f, argv, envp);
-		logger(-1, errno, "Error exec %s", f);
-		exit(1);
-	} else if(child == -1) {
-		logger(-1, errno, "Unable to fork");
-		ret = VZ_RESOURCE_ERROR;
+	child = spawn_prog(f, argv, envp, SPAWN_NULL,
+		quiet ? SPAWN_NULL : SPAWN_KEEP,
+		quiet ? SPAWN_NULL : SPAWN_KEEP);
+	if (child < 0) {
+		ret = VZ_SYSTEM_ERROR;
 		goto err;
 	}
-	while ((pid = waitpid(child, &status, 0)) == -1)
-		if (errno != EINTR)
-			break;
-	ret = VZ_SYSTEM_ERROR;
-	if (pid == child) {
-		if (WIFEXITED(status))
-			ret = WEXITSTATUS(status);
-		else if (WIFSIGNALED(status))
-			logger(-1, 0, "Received signal:"
-					"  %d in %s", WTERMSIG(status), f);
-	} else {
-		logger(-1, errno, "Error in waitpid");
-	}
+	ret = spawn_wait(child, f);
 err:
 	sigaction(SIGCHLD, &actold, NULL);
 
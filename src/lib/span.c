@@ -0,0 +1,194 @@
+/*
+ *  Copyright (C) 2000-2011, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* A simple recorder of per-phase latencies for long operations
+ * (like CT start), used to find out where the time is spent.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+#include "span.h"
+#include "logger.h"
+
+#define MAX_SPAN_DEPTH	8
+
+struct span_rec {
+	const char *name;
+	int depth;
+	int parent;
+	struct timespec start;
+	unsigned long long usec;
+};
+
+static struct {
+	int active;
+	envid_t veid;
+	const char *op;
+	char *file;
+	time_t time;
+	int n;
+	int depth;
+	int stack[MAX_SPAN_DEPTH];
+	struct span_rec rec[MAX_SPANS];
+} span;
+
+static unsigned long long usec_since(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000ULL +
+		(now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+void span_start(envid_t veid, const char *op, const char *file)
+{
+	free(span.file);
+	memset(&span, 0, sizeof(span));
+	span.active = 1;
+	span.veid = veid;
+	span.op = op;
+	span.time = time(NULL);
+	if (file != NULL && *file != '\0')
+		span.file = strdup(file);
+	span_begin(op);
+}
+
+void span_begin(const char *name)
+{
+	struct span_rec *r;
+	int id = -1;
+
+	if (span.depth >= MAX_SPAN_DEPTH)
+		return;
+	if (span.n < MAX_SPANS) {
+		id = span.n++;
+		r = &span.rec[id];
+		r->name = name;
+		r->depth = span.depth;
+		r->parent = span.depth ? span.stack[span.depth - 1] : -1;
+		r->usec = 0;
+		clock_gettime(CLOCK_MONOTONIC, &r->start);
+	}
+	/* id is -1 if there's no room left, still keep nesting right */
+	span.stack[span.depth++] = id;
+}
+
+void span_end(void)
+{
+	struct span_rec *r;
+	int id;
+
+	if (span.depth == 0)
+		return;
+	id = span.stack[--span.depth];
+	if (id < 0)
+		return;
+	r = &span.rec[id];
+	r->usec = usec_since(&r->start);
+	if (!span.active) {
+		/* Not recording, just report it */
+		logger(1, 0, "%s: %.3f s", r->name, r->usec / 1000000.0);
+		if (span.depth == 0)
+			span.n = 0;
+	}
+}
+
+/* Build slash-separated phase path with no spaces, e.g. start/setup/net_add.
+ * Returns path length, or -1 if it does not fit.
+ */
+static int span_path(int id, char *buf, int len)
+{
+	char *p;
+	int n = 0, r;
+
+	if (span.rec[id].parent >= 0 &&
+			(n = span_path(span.rec[id].parent, buf, len)) < 0)
+		return -1;
+	r = snprintf(buf + n, len - n, "%s%s", n ? "/" : "",
+			span.rec[id].name);
+	if (r < 0 || r >= len - n)
+		return -1;
+	for (p = buf + n; *p != '\0'; p++)
+		if (*p == ' ' || *p == '\t')
+			*p = '_';
+	return n + r;
+}
+
+static void span_write(int ret)
+{
+	char path[256];
+	char *buf, *p;
+	int i, fd, len;
+
+	len = span.n * (sizeof(path) + 64);
+	if ((buf = malloc(len)) == NULL)
+		return;
+	for (i = 0, p = buf; i < span.n; i++) {
+		if (span_path(i, path, sizeof(path)) < 0) {
+			logger(1, 0, "Span name is too long, skipped");
+			continue;
+		}
+		p += snprintf(p, len - (p - buf), "%lu %d %s %llu %d\n",
+				(unsigned long) span.time, span.veid, path,
+				span.rec[i].usec, ret);
+	}
+	/* A single append, so records of parallel operations
+	 * do not get interleaved
+	 */
+	fd = open(span.file, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		logger(-1, errno, "Unable to open %s", span.file);
+	} else {
+		if (write(fd, buf, p - buf) != p - buf)
+			logger(-1, errno, "Unable to write to %s", span.file);
+		close(fd);
+	}
+	free(buf);
+}
+
+void span_finish(int ret)
+{
+	struct span_rec *r;
+	int i;
+
+	if (!span.active)
+		return;
+	/* Close the phases left open on error paths */
+	while (span.depth > 0)
+		span_end();
+	span.active = 0;
+
+	logger(1, 0, "Timing of %s for CT %d:", span.op, span.veid);
+	for (i = 0; i < span.n; i++) {
+		r = &span.rec[i];
+		logger(1, 0, "  %*s%-*s %10.3f ms", r->depth * 2, "",
+				24 - r->depth * 2, r->name, r->usec / 1000.0);
+	}
+	if (span.file != NULL)
+		span_write(ret);
+	free(span.file);
+	span.file = NULL;
+	span.n = 0;
+}
@@ -0,0 +1,403 @@
+/*
+ *  Copyright (C) 2000-2011, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Container status table
+ *
+ * A small file in LOCKDIR, mapped shared by all vzctl processes,
+ * with one entry per CT: state flags, current transition and the pid
+ * doing it. vzctl updates an entry at each transition, readers get
+ * it without locking. Every entry is protected by a sequence counter
+ * which is odd while the entry is being written; readers retry if it
+ * changed under them.
+ *
+ * The table is reset on reboot (boot_id changes). Entries are only
+ * trusted while vzeventd, which tracks CT start and stop done without
+ * vzctl, is running, and only if written since it started (entry gen
+ * matches the table gen). Anything else is reported as stale, and the
+ * caller has to probe the CT state the slow way. Mounts and dump files
+ * are not tracked by vzeventd, so ct_status_check() rechecks them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#include "status.h"
+#include "env.h"
+#include "fs.h"
+#include "util.h"
+#include "logger.h"
+
+#define CT_STATUS_MAGIC		0x56535431	/* VST1 */
+#define CT_STATUS_VERSION	1
+#define CT_STATUS_SLOTS		4096
+#define BOOT_ID			"/proc/sys/kernel/random/boot_id"
+
+/* Reader retries before giving up on an entry being written */
+#define READ_TRIES		100
+/* Writer waits that long for another writer, then takes over */
+#define WRITE_WAIT_MS		1000
+
+struct ct_status_hdr {
+	unsigned int magic;
+	unsigned int version;
+	unsigned int nslots;
+	unsigned int gen;		/* vzeventd session */
+	int eventd_pid;
+	unsigned int pad[3];
+	char boot_id[48];
+};
+
+struct ct_status_ent {
+	unsigned int seq;		/* odd while being written */
+	unsigned int veid;		/* 0 - free slot */
+	unsigned int state;
+	unsigned int transition;
+	int lock_pid;
+	unsigned int gen;
+	unsigned int mtime;
+	unsigned int pad;
+};
+
+struct ct_status_tbl {
+	struct ct_status_hdr hdr;
+	struct ct_status_ent ent[CT_STATUS_SLOTS];
+};
+
+static struct ct_status_tbl *tbl;
+static int tbl_rw;
+
+static void get_boot_id(char *buf, int len)
+{
+	int fd, n = 0;
+
+	memset(buf, 0, len);
+	if ((fd = open(BOOT_ID, O_RDONLY | O_CLOEXEC)) < 0)
+		return;
+	if ((n = read(fd, buf, len - 1)) < 0)
+		n = 0;
+	buf[n] = '\0';
+	close(fd);
+}
+
+static int is_alive(int pid)
+{
+	return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+int ct_status_init(const char *lockdir)
+{
+	char path[STR_SIZE];
+	char boot_id[sizeof(tbl->hdr.boot_id)];
+	struct ct_status_tbl *t;
+	struct stat st;
+	int fd, rw = 1;
+
+	if (tbl != NULL)
+		return 0;
+	if (lockdir == NULL)
+		return -1;
+	snprintf(path, sizeof(path), "%s/" CT_STATUS_FILE, lockdir);
+	if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+		/* Not root, still can read */
+		if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+			return -1;
+		rw = 0;
+	}
+	if (fstat(fd, &st))
+		goto err;
+	if (st.st_size < (off_t) sizeof(*tbl) &&
+			(!rw || ftruncate(fd, sizeof(*tbl))))
+		goto err;
+	t = mmap(NULL, sizeof(*tbl), PROT_READ | (rw ? PROT_WRITE : 0),
+		MAP_SHARED, fd, 0);
+	if (t == MAP_FAILED)
+		goto err;
+	get_boot_id(boot_id, sizeof(boot_id));
+	if (rw && (t->hdr.magic != CT_STATUS_MAGIC ||
+			t->hdr.version != CT_STATUS_VERSION ||
+			strcmp(t->hdr.boot_id, boot_id)))
+	{
+		/* New table, or the host was rebooted */
+		flock(fd, LOCK_EX);
+		if (t->hdr.magic != CT_STATUS_MAGIC ||
+				t->hdr.version != CT_STATUS_VERSION ||
+				strcmp(t->hdr.boot_id, boot_id))
+		{
+			memset(t, 0, sizeof(*t));
+			t->hdr.version = CT_STATUS_VERSION;
+			t->hdr.nslots = CT_STATUS_SLOTS;
+			strcpy(t->hdr.boot_id, boot_id);
+			__sync_synchronize();
+			t->hdr.magic = CT_STATUS_MAGIC;
+		}
+		flock(fd, LOCK_UN);
+	}
+	close(fd);
+	tbl = t;
+	tbl_rw = rw;
+	return 0;
+
+err:
+	close(fd);
+	return -1;
+}
+
+void ct_status_close(void)
+{
+	if (tbl == NULL)
+		return;
+	munmap(tbl, sizeof(*tbl));
+	tbl = NULL;
+}
+
+/* Table is of no use if it is from before reboot */
+static int tbl_valid(void)
+{
+	char boot_id[sizeof(tbl->hdr.boot_id)];
+
+	if (tbl == NULL || tbl->hdr.magic != CT_STATUS_MAGIC ||
+			tbl->hdr.version != CT_STATUS_VERSION)
+		return 0;
+	get_boot_id(boot_id, sizeof(boot_id));
+	return !strcmp(tbl->hdr.boot_id, boot_id);
+}
+
+/* Find CT entry, allocating a free slot if alloc is set */
+static struct ct_status_ent *find_ent(envid_t veid, int alloc)
+{
+	struct ct_status_ent *e;
+	unsigned int i, n;
+
+	if (veid <= 0)
+		return NULL;
+	for (n = 0, i = veid % CT_STATUS_SLOTS; n < CT_STATUS_SLOTS;
+			n++, i = (i + 1) % CT_STATUS_SLOTS)
+	{
+		e = &tbl->ent[i];
+		if (e->veid == (unsigned int) veid)
+			return e;
+		if (e->veid != 0)
+			continue;
+		if (!alloc)
+			return NULL;
+		if (__sync_bool_compare_and_swap(&e->veid, 0, veid))
+			return e;
+		/* Somebody took it, maybe for the same CT */
+		if (e->veid == (unsigned int) veid)
+			return e;
+	}
+	return NULL;
+}
+
+/* Start writing an entry. If seq is not NULL, only if the entry was
+ * not changed since *seq was read.
+ */
+static int ent_lock(struct ct_status_ent *e, unsigned int *seq)
+{
+	unsigned int s;
+	int ms = 0;
+
+	for (;;) {
+		s = *(volatile unsigned int *) &e->seq;
+		if (seq != NULL && s != *seq)
+			return -1;
+		if (!(s & 1)) {
+			if (__sync_bool_compare_and_swap(&e->seq, s, s + 1))
+				return 0;
+			continue;
+		}
+		if (ms >= WRITE_WAIT_MS) {
+			/* Writer is gone in the middle, take over */
+			if (__sync_bool_compare_and_swap(&e->seq, s, s + 2))
+				return 0;
+			continue;
+		}
+		usleep(1000);
+		ms++;
+	}
+}
+
+static void ent_unlock(struct ct_status_ent *e)
+{
+	e->mtime = time(NULL);
+	__sync_fetch_and_add(&e->seq, 1);
+}
+
+void ct_status_attach(void)
+{
+	if (tbl == NULL || !tbl_rw)
+		return;
+	/* Entries written before are stale from now on */
+	__sync_fetch_and_add(&tbl->hdr.gen, 1);
+	tbl->hdr.eventd_pid = getpid();
+}
+
+void ct_status_begin(envid_t veid, int transition)
+{
+	struct ct_status_ent *e;
+
+	if (tbl == NULL || !tbl_rw || (e = find_ent(veid, 1)) == NULL)
+		return;
+	ent_lock(e, NULL);
+	e->transition = transition;
+	e->lock_pid = getpid();
+	ent_unlock(e);
+}
+
+void ct_status_end(envid_t veid, int state)
+{
+	struct ct_status_ent *e;
+
+	if (tbl == NULL || !tbl_rw || (e = find_ent(veid, 1)) == NULL)
+		return;
+	ent_lock(e, NULL);
+	e->state = state;
+	e->transition = CT_TR_NONE;
+	e->lock_pid = 0;
+	e->gen = tbl->hdr.gen;
+	ent_unlock(e);
+}
+
+void ct_status_event(envid_t veid, int set, int clear)
+{
+	struct ct_status_ent *e;
+
+	if (tbl == NULL || !tbl_rw || (e = find_ent(veid, 0)) == NULL)
+		return;
+	ent_lock(e, NULL);
+	if (e->gen == tbl->hdr.gen) {
+		e->state |= set;
+		e->state &= ~clear;
+	}
+	ent_unlock(e);
+}
+
+int ct_status_get(envid_t veid, struct ct_status *st)
+{
+	struct ct_status_ent *e, copy;
+	unsigned int s;
+	int i;
+
+	memset(st, 0, sizeof(*st));
+	st->veid = veid;
+	if (!tbl_valid() || (e = find_ent(veid, 0)) == NULL)
+		return 1;
+	for (i = 0; i < READ_TRIES; i++) {
+		s = *(volatile unsigned int *) &e->seq;
+		if (s & 1) {
+			sched_yield();
+			continue;
+		}
+		__sync_synchronize();
+		copy = *e;
+		__sync_synchronize();
+		if (*(volatile unsigned int *) &e->seq == s)
+			break;
+	}
+	if (i == READ_TRIES)
+		return 1;
+	st->seq = s;
+	st->state = copy.state;
+	st->transition = copy.transition;
+	st->lock_pid = copy.lock_pid;
+	st->mtime = copy.mtime;
+	if (!is_alive(tbl->hdr.eventd_pid) || copy.gen != tbl->hdr.gen)
+		return 1;
+	/* Transition was interrupted */
+	if (copy.lock_pid != 0 && !is_alive(copy.lock_pid))
+		return 1;
+	return 0;
+}
+
+void ct_status_refresh(struct ct_status *st, int state)
+{
+	struct ct_status_ent *e;
+
+	if (!tbl_valid() || !tbl_rw || !is_alive(tbl->hdr.eventd_pid))
+		return;
+	if ((e = find_ent(st->veid, 1)) == NULL)
+		return;
+	/* New entries have seq 0, same as st->seq for no entry */
+	if (ent_lock(e, &st->seq))
+		return;
+	/* Leave a transition in progress alone */
+	if (e->lock_pid == 0 || !is_alive(e->lock_pid)) {
+		e->state = state;
+		e->transition = CT_TR_NONE;
+		e->lock_pid = 0;
+		e->gen = tbl->hdr.gen;
+	}
+	ent_unlock(e);
+}
+
+/* Something is mounted on path: it is on another device than its
+ * parent, or it is the file system root
+ */
+static int is_mountpoint(const char *path)
+{
+	char buf[STR_SIZE];
+	struct stat st, pst;
+
+	snprintf(buf, sizeof(buf), "%s/..", path);
+	if (stat(path, &st) || stat(buf, &pst))
+		return 0;
+	return st.st_dev != pst.st_dev || st.st_ino == pst.st_ino;
+}
+
+int ct_status_check(struct ct_status *st, const char *root,
+	const char *dumpdir)
+{
+	char buf[STR_SIZE];
+	int state;
+
+	state = st->state & ~(CT_ST_MOUNTED | CT_ST_SUSPENDED);
+	if (root != NULL && is_mountpoint(root))
+		state |= CT_ST_MOUNTED;
+	get_dump_file(st->veid, dumpdir, buf, sizeof(buf));
+	if (stat_file(buf))
+		state |= CT_ST_SUSPENDED;
+	if (state != st->state)
+		ct_status_refresh(st, state);
+	return state;
+}
+
+int ct_status_probe(vps_handler *h, envid_t veid, const char *root,
+	const char *dumpdir)
+{
+	char buf[STR_SIZE];
+	int state = 0;
+
+	if (h != NULL && vps_is_run(h, veid))
+		state |= CT_ST_RUNNING;
+	if (root != NULL && vps_is_mounted(root))
+		state |= CT_ST_MOUNTED;
+	get_dump_file(veid, dumpdir, buf, sizeof(buf));
+	if (stat_file(buf))
+		state |= CT_ST_SUSPENDED;
+	return state;
+}
@@ -17,6 +17,7 @@
  */
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -164,21 +165,51 @@ const char *get_ub_name(unsigned int res_id)
 	return NULL;
 }
 
-int set_ublimit(vps_handler *h, envid_t veid, ub_param *ub)
+static int ub_equal(const unsigned long *cur, const unsigned long *res)
+{
+	return cur != NULL && cur[0] == res[0] && cur[1] == res[1];
+}
+
+/** Apply UBC resources, skipping the ones already set.
+ *
+ * Current barriers and limits are read in one pass, and setublimit()
+ * is only called for resources whose values differ.
+ *
+ * @param h		CT handler.
+ * @param veid		CT ID.
+ * @param ub		UBC parameters.
+ * @param changed	number of changed resources (can be NULL).
+ * @return		0 on success.
+ */
+int set_ublimit_changed(vps_handler *h, envid_t veid, ub_param *ub,
+	int *changed)
 {
 	int vswap = is_vswap_config(ub);
 	const unsigned long unlim_ub[2] = {LONG_MAX, LONG_MAX};
 	const unsigned long *res;
+	ub_param cur;
+	int cnt = 0, total = 0;
+	int ret = 0;
+
+	memset(&cur, 0, sizeof(cur));
+	/* Can't read, so set everything */
+	if (vps_read_ub_limits(veid, &cur))
+		free_ub_param(&cur);
 
 #define SET_UB_LIMIT(name, id)						\
 res = ub->name;								\
 if (vswap && !res)							\
 	res = unlim_ub;							\
 if (res != NULL) {							\
-	if (setublimit(veid, id, res)) {				\
-		logger(-1, errno, "setublimit %s %lu:%lu failed",	\
-			get_ub_name(id), res[0], res[1]);		\
-		return VZ_SETUBC_ERROR;					\
+	total++;							\
+	if (!ub_equal(cur.name, res)) {					\
+		if (setublimit(veid, id, res)) {			\
+			logger(-1, errno, "setublimit %s %lu:%lu failed",\
+				get_ub_name(id), res[0], res[1]);	\
+			ret = VZ_SETUBC_ERROR;				\
+			goto out;					\
+		}							\
+		cnt++;							\
 	}								\
 }
 
@@ -202,19 +233,31 @@ if (res != NULL) {							\
 	SET_UB_LIMIT(numfile, UB_NUMFILE)
 	SET_UB_LIMIT(dcachesize, UB_DCACHESIZE)
 	SET_UB_LIMIT(numiptent, UB_IPTENTRIES)
-	if (ub->swappages &&
-	    setublimit(veid, UB_SWAPPAGES, ub->swappages) == -1)
-	{
-		if (errno == EINVAL) {
+	if (ub->swappages)
+		total++;
+	if (ub->swappages && !ub_equal(cur.swappages, ub->swappages)) {
+		if (setublimit(veid, UB_SWAPPAGES, ub->swappages) == 0) {
+			cnt++;
+		} else if (errno == EINVAL) {
 			logger(-1, ENOSYS, "failed to set swappages");
 		} else {
 			logger(-1, errno, "failed to set swappages");
-			return VZ_SETUBC_ERROR;
+			ret = VZ_SETUBC_ERROR;
+			goto out;
 		}
 	}
 #undef SET_UB_LIMIT
+	logger(1, 0, "UB limits changed: %d of %d", cnt, total);
+out:
+	free_ub_param(&cur);
+	if (changed != NULL)
+		*changed = cnt;
+	return ret;
+}
 
-	return 0;
+int set_ublimit(vps_handler *h, envid_t veid, ub_param *ub)
+{
+	return set_ublimit_changed(h, veid, ub, NULL);
 }
 
 /** Apply UBC resources.
@@ -226,7 +269,7 @@ if (res != NULL) {							\
  */
 int vps_set_ublimit(vps_handler *h, envid_t veid, ub_param *ub)
 {
-	int ret;
+	int ret, changed;
 
 	if (is_ub_empty(ub))
 		return 0;
@@ -235,9 +278,12 @@ int vps_set_ublimit(vps_handler *h, envid_t veid, ub_param *ub)
 			"container is not running");
 		return VZ_VE_NOT_RUNNING;
 	}
-	if ((ret = set_ublimit(h, veid, ub)))
+	if ((ret = set_ublimit_changed(h, veid, ub, &changed)))
 		return ret;
-	logger(0, 0, "UB limits were set successfully");
+	if (changed)
+		logger(0, 0, "UB limits were set successfully");
+	else
+		logger(0, 0, "UB limits are already set");
 	return 0;
 }
 
@@ -360,23 +406,46 @@ if ((src->x) != NULL) {						\
 #undef MERGE_P2
 }
 
-/** Read UBC resources current usage from /proc/user_beancounters
- *
- * @param veid		CT ID.
- * @param ub		UBC parameters.
- * @return		0 on success.
+/* Parse one resource line, in either /proc/user_beancounters
+ * or /proc/bc/<id>/resources format. If limits is set,
+ * barrier:limit pair is stored, otherwise held value.
  */
-int vps_read_ubc(envid_t veid, ub_param *ub)
+static void parse_ubc_line(const char *str, const char *fmt, ub_param *ub,
+	int limits)
+{
+	char name[64];
+	unsigned long held, maxheld, barrier, limit;
+	ub_res res;
+
+	if (sscanf(str, fmt, name, &held, &maxheld, &barrier, &limit) != 5)
+		return;
+	if ((res.res_id = get_ub_resid(name)) < 0)
+		return;
+	if (limits) {
+		res.limit[0] = barrier;
+		res.limit[1] = limit;
+	} else {
+		res.limit[0] = held;
+		res.limit[1] = held;
+	}
+	add_ub_param(ub, &res);
+}
+
+static int read_ubc(envid_t veid, ub_param *ub, int limits)
 {
 	FILE *fd;
 	char str[STR_SIZE];
-	char name[64];
 	const char *fmt = NULL; /* make gcc happy */
-	int ret, found;
+	int found;
 	envid_t id;
-	unsigned long held, maxheld, barrier, limit;
-	ub_res res;
 
+	snprintf(str, sizeof(str), PROC_BC_DIR "/%d/resources", veid);
+	if ((fd = fopen(str, "r")) != NULL) {
+		while (fgets(str, sizeof(str), fd))
+			parse_ubc_line(str, "%s%lu%lu%lu%lu", ub, limits);
+		fclose(fd);
+		return 0;
+	}
 	fd = fopen(PROCUBC, "r");
 	if (fd == NULL) {
 		logger(-1, errno, "Unable to open " PROCUBC);
@@ -384,7 +453,7 @@ int vps_read_ubc(envid_t veid, ub_param *ub)
 	}
 	found = 0;
 	while (fgets(str, sizeof(str), fd)) {
-		if ((ret = sscanf(str, "%d:", &id)) == 1) {
+		if (sscanf(str, "%d:", &id) == 1) {
 			if (id == veid) {
 				fmt =  "%*lu:%s%lu%lu%lu%lu";
 				found = 1;
@@ -397,21 +466,34 @@ int vps_read_ubc(envid_t veid, ub_param *ub)
 		}
 		if (!found)
 			continue;
-		if ((ret = sscanf(str, fmt,
-			name, &held, &maxheld, &barrier, &limit)) != 5)
-		{
-			continue;
-		}
-		if ((res.res_id = get_ub_resid(name)) >= 0) {
-			res.limit[0] = held;
-			res.limit[1] = held;
-			add_ub_param(ub, &res);
-		}
+		parse_ubc_line(str, fmt, ub, limits);
 	}
 	fclose(fd);
 	return !found;
 }
 
+/** Read UBC resources current usage.
+ *
+ * @param veid		CT ID.
+ * @param ub		UBC parameters.
+ * @return		0 on success.
+ */
+int vps_read_ubc(envid_t veid, ub_param *ub)
+{
+	return read_ubc(veid, ub, 0);
+}
+
+/** Read current UBC barriers and limits.
+ *
+ * @param veid		CT ID.
+ * @param ub		UBC parameters.
+ * @return		0 on success.
+ */
+int vps_read_ub_limits(envid_t veid, ub_param *ub)
+{
+	return read_ubc(veid, ub, 1);
+}
+
 int is_vswap_config(const ub_param *param)
 {
 	/* Dirty hack: treat INT_MAX (i.e. 32 bit LONG_MAX) as unlimited.
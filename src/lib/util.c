@@ -33,6 +33,7 @@
 #include <limits.h>
 #include <dirent.h>
 #include <sys/utsname.h>
+#include <sys/syscall.h>
 
 #include "util.h"
 #include "logger.h"
@@ -511,20 +512,77 @@ int set_not_blk(int fd)
 	return ret;
 }
 
+static int is_skipped(int fd, const int *skip)
+{
+	for (; *skip != -1; skip++)
+		if (*skip == fd)
+			return 1;
+	return 0;
+}
+
+/* Close fds from 3 up, except the ones in skip (sorted, -1 terminated).
+ * Rather than a close() for every possible fd, which is a lot with
+ * RLIMIT_NOFILE raised, close the gaps between skipped fds with
+ * close_range(), or only the fds which are open, as listed in /proc.
+ */
+static void close_fds_from(const int *skip)
+{
+	int fd, max;
+	DIR *dir;
+	struct dirent *ent;
+	char *end;
+#ifdef __NR_close_range
+	const int *s;
+	unsigned int from = 3;
+
+	for (s = skip; ; s++) {
+		if (*s != -1 && (unsigned int) *s < from)
+			continue;
+		if ((*s == -1 || (unsigned int) *s > from) &&
+				syscall(__NR_close_range, from,
+					*s == -1 ? ~0U : *s - 1U, 0))
+			break;
+		if (*s == -1)
+			return;
+		from = *s + 1;
+	}
+#endif
+	/* /proc is not there in a CT being entered, as a rule */
+	if ((dir = opendir("/proc/self/fd")) != NULL) {
+		while ((ent = readdir(dir)) != NULL) {
+			fd = strtol(ent->d_name, &end, 10);
+			if (*end != '\0' || end == ent->d_name || fd < 3 ||
+					fd == dirfd(dir) || is_skipped(fd, skip))
+				continue;
+			close(fd);
+		}
+		closedir(dir);
+		return;
+	}
+	max = sysconf(_SC_OPEN_MAX);
+	if (max < NR_OPEN)
+		max = NR_OPEN;
+	for (fd = 3; fd < max; fd++)
+		if (!is_skipped(fd, skip))
+			close(fd);
+}
+
+static int int_cmp(const void *a, const void *b)
+{
+	return *(const int *) a - *(const int *) b;
+}
+
 /** Close all fd.
  * @param close_std	flag for closing the [0-2] fds
  * @param ...		list of fds are skiped, (-1 is the end mark)
 */
 void close_fds(int close_std, ...)
 {
-	int fd, max;
-	unsigned int i;
+	int fd;
+	unsigned int n;
 	va_list ap;
 	int skip_fds[255];
 
-	max = sysconf(_SC_OPEN_MAX);
-	if (max < NR_OPEN)
-		max = NR_OPEN;
 	if (close_std) {
 		fd = open("/dev/null", O_RDWR);
 		if (fd != -1) {
@@ -533,22 +591,18 @@ void close_fds(int close_std, ...)
 			close(0); close(1); close(2);
 		}
 	}
-	/* build aray of skiped fds */
+	/* build sorted aray of skiped fds */
 	va_start(ap, close_std);
-	skip_fds[0] = -1;
-	for (i = 0; i < ARRAY_SIZE(skip_fds); i++) {
+	for (n = 0; n < ARRAY_SIZE(skip_fds) - 1; n++) {
 		fd = va_arg(ap, int);
-		skip_fds[i] = fd;
 		if (fd == -1)
 			break;
+		skip_fds[n] = fd;
 	}
 	va_end(ap);
-	for (fd = 3; fd < max; fd++) {
-		for (i = 0; skip_fds[i] != fd && skip_fds[i] != -1; i++);
-		if (skip_fds[i] == fd)
-			continue;
-		close(fd);
-	}
+	qsort(skip_fds, n, sizeof(int), int_cmp);
+	skip_fds[n] = -1;
+	close_fds_from(skip_fds);
 }
 
 static void __move_config(int veid, int action, const char *prefix)
@@ -22,6 +22,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <linux/vzcalluser.h>
 
@@ -34,7 +35,27 @@
 #include "env.h"
 #include "vps_configure.h"
 #include "list.h"
+#include "script.h"
 
+/* Maximum number of action scripts in a configure session */
+#define MAX_BATCH	16
+
+/* Configure session. While it is active, action scripts are not run
+ * one by one, but collected into a single script which is then run
+ * by one shell inside CT. Every script runs in its own subshell, and
+ * reports its exit code to a descriptor given in VZ_STATUS_FD.
+ */
+static struct {
+	int active;
+	char *func;		/* DIST_FUNC file sourced by the session */
+	char *head;		/* DIST_FUNC contents */
+	char *buf;
+	int len;
+	int n;
+	char *names[MAX_BATCH];
+	int optional;		/* scripts added now may fail */
+	char is_optional[MAX_BATCH];
+} batch;
 
 static struct vps_state{
 	char *name;
@@ -58,6 +79,221 @@ const char *state2str(int state)
 	return NULL;
 }
 
+static void batch_free(void)
+{
+	int i;
+
+	for (i = 0; i < batch.n; i++)
+		free(batch.names[i]);
+	free(batch.func);
+	free(batch.head);
+	free(batch.buf);
+	memset(&batch, 0, sizeof(batch));
+}
+
+static int batch_add(const char *str, int len)
+{
+	char *tmp;
+
+	if ((tmp = realloc(batch.buf, batch.len + len + 1)) == NULL) {
+		logger(-1, ENOMEM, "Unable to allocate memory");
+		return -1;
+	}
+	batch.buf = tmp;
+	memcpy(batch.buf + batch.len, str, len);
+	batch.len += len;
+	batch.buf[batch.len] = '\0';
+
+	return 0;
+}
+
+#define batch_adds(str)	batch_add(str, strlen(str))
+
+/* Add export NAME='value' line */
+static int batch_add_env(const char *env)
+{
+	const char *p, *val;
+	int ret;
+
+	if ((val = strchr(env, '=')) == NULL)
+		return 0;
+	ret = batch_adds("export ");
+	ret |= batch_add(env, val - env + 1);
+	ret |= batch_adds("'");
+	for (p = ++val; *p != '\0'; p++) {
+		if (*p != '\'')
+			continue;
+		ret |= batch_add(val, p - val);
+		ret |= batch_adds("'\\''");
+		val = p + 1;
+	}
+	ret |= batch_adds(val);
+	ret |= batch_adds("'\n");
+
+	return ret;
+}
+
+static char *get_func_path(const char *script)
+{
+	const char *p;
+	char *path;
+	int len;
+
+	p = strrchr(script, '/');
+	len = (p != NULL) ? p - script + 1 : 0;
+	if ((path = vz_malloc(len + sizeof(DIST_FUNC))) == NULL)
+		return NULL;
+	memcpy(path, script, len);
+	strcpy(path + len, DIST_FUNC);
+
+	return path;
+}
+
+/* Add action script to the configure session */
+static int batch_script(char *const envp[], const char *script)
+{
+	char *func, *text = NULL;
+	const char *name;
+	char buf[64];
+	int i, ret;
+
+	if ((func = get_func_path(script)) == NULL)
+		return -1;
+	if (batch.func == NULL) {
+		batch.func = func;
+		func = NULL;
+		if (stat_file(batch.func) &&
+				read_script(batch.func, NULL, &batch.head) < 0)
+		{
+			/* freed by read_script() */
+			batch.head = NULL;
+			return -1;
+		}
+	} else if (!strcmp(func, batch.func)) {
+		free(func);
+		func = NULL;
+	}
+	/* Scripts from another directory get their own functions */
+	if (read_script(script, func != NULL && stat_file(func) ?
+			DIST_FUNC : NULL, &text) < 0)
+	{
+		free(func);
+		return -1;
+	}
+	free(func);
+	name = strrchr(script, '/');
+	name = (name != NULL) ? name + 1 : script;
+	logger(1, 0, "Adding container script to session: %s", name);
+
+	/* Status descriptor is closed for the script, so that daemons
+	 * it starts do not keep it open */
+	ret = batch_adds("(\neval \"exec $VZ_STATUS_FD>&-\"\n");
+	for (i = 0; envp[i] != NULL; i++)
+		ret |= batch_add_env(envp[i]);
+	ret |= batch_adds(text);
+	snprintf(buf, sizeof(buf), "\n)\necho \"%d $?\" >&$VZ_STATUS_FD\n",
+		batch.n);
+	ret |= batch_adds(buf);
+	free(text);
+	if (ret)
+		return -1;
+	batch.is_optional[batch.n] = batch.optional;
+	batch.names[batch.n++] = strdup(name);
+
+	return 0;
+}
+
+/* Run action script, or add it to the session if one is active */
+static int configure_exec(vps_handler *h, envid_t veid, const char *root,
+	char *const envp[], const char *script)
+{
+	if (batch.active && batch.n < MAX_BATCH)
+		return batch_script(envp, script);
+
+	return vps_exec_script(h, veid, root, NULL, envp, script, DIST_FUNC,
+		SCRIPT_EXEC_TIMEOUT);
+}
+
+void vps_configure_begin(void)
+{
+	batch_free();
+	batch.active = 1;
+}
+
+int vps_configure_end(vps_handler *h, envid_t veid, const char *root)
+{
+	int st[2];
+	int rc[MAX_BATCH];
+	char *script, *p;
+	char buf[512];
+	int i, n, len, ret, idx, code;
+
+	if (!batch.active)
+		return 0;
+	batch.active = 0;
+	if (batch.n == 0) {
+		batch_free();
+		return 0;
+	}
+	if (pipe(st) < 0) {
+		logger(-1, errno, "Unable to create pipe");
+		batch_free();
+		return VZ_RESOURCE_ERROR;
+	}
+	fcntl(st[0], F_SETFD, FD_CLOEXEC);
+	fcntl(st[0], F_SETFL, O_NONBLOCK);
+	snprintf(buf, sizeof(buf), "VZ_STATUS_FD=%d\n", st[1]);
+	len = strlen(buf) + (batch.head ? strlen(batch.head) : 0) + batch.len;
+	if ((script = vz_malloc(len + 1)) == NULL) {
+		close(st[0]);
+		close(st[1]);
+		batch_free();
+		return VZ_RESOURCE_ERROR;
+	}
+	sprintf(script, "%s%s%s", buf, batch.head ? batch.head : "",
+		batch.buf);
+	logger(1, 0, "Running %d container scripts in one session", batch.n);
+	ret = vps_exec_fd(h, veid, root, MODE_BASH, NULL, NULL, script,
+		batch.n * SCRIPT_EXEC_TIMEOUT, st[1]);
+	close(st[1]);
+	free(script);
+
+	for (i = 0; i < batch.n; i++)
+		rc[i] = -1;
+	/* All statuses are written by the time the shell exits, so
+	 * only take what is there, not waiting for end of file */
+	len = 0;
+	while ((n = read(st[0], buf + len, sizeof(buf) - len - 1)) > 0 ||
+			(n < 0 && errno == EINTR))
+		if (n > 0)
+			len += n;
+	close(st[0]);
+	buf[len] = '\0';
+	for (p = strtok(buf, "\n"); p != NULL; p = strtok(NULL, "\n"))
+		if (sscanf(p, "%d %d", &idx, &code) == 2 &&
+				idx >= 0 && idx < batch.n)
+			rc[idx] = code;
+
+	for (i = 0; i < batch.n; i++) {
+		if (rc[i] == 0) {
+			logger(1, 0, "Container script %s succeeded",
+				batch.names[i]);
+			continue;
+		}
+		if (rc[i] < 0)
+			logger(-1, 0, "Container script %s was not run",
+				batch.names[i]);
+		else
+			logger(-1, 0, "Container script %s exited with "
+				"code %d", batch.names[i], rc[i]);
+		if (!ret && !batch.is_optional[i])
+			ret = rc[i] < 0 ? VZ_COMMAND_EXECUTION_ERROR : rc[i];
+	}
+	batch_free();
+
+	return ret;
+}
+
 static const char *get_local_ip(vps_param *param)
 {
 	list_head_t *h = &param->res.net.ip;
@@ -111,8 +347,7 @@ static int vps_hostnm_configure(vps_handler *h, envid_t veid,
 		envp[3] = ipnm;
 	}
 	envp[4] = NULL;
-	ret = vps_exec_script(h, veid, root, NULL, envp, script, DIST_FUNC,
-		SCRIPT_EXEC_TIMEOUT);
+	ret = configure_exec(h, veid, root, envp, script);
 
 	return ret;
 }
@@ -148,8 +383,7 @@ static int vps_dns_configure(vps_handler *h, envid_t veid,
 	}
 	envp[i++] = strdup(ENV_PATH);
 	envp[i] = NULL;
-	ret = vps_exec_script(h, veid, root, NULL, envp, script, DIST_FUNC,
-		SCRIPT_EXEC_TIMEOUT);
+	ret = configure_exec(h, veid, root, envp, script);
 	free_arg(envp);
 
 	return ret;
@@ -175,8 +409,7 @@ int vps_pw_configure(vps_handler *h, envid_t veid, dist_actions *actions,
 	envp[0] = str;
 	envp[1] = ENV_PATH;
 	envp[2] = NULL;
-	if ((ret = vps_exec_script(h, veid, root, NULL, envp, script, DIST_FUNC,
-		SCRIPT_EXEC_TIMEOUT)))
+	if ((ret = configure_exec(h, veid, root, envp, script)))
 	{
 		ret = VZ_CHANGEPASS;
 		logger(0, 0, "Password change failed");
@@ -225,8 +458,7 @@ static int vps_quota_configure(vps_handler *h, envid_t veid,
 	}
 	envp[i++] = strdup(ENV_PATH);
 	envp[i] = NULL;
-	ret = vps_exec_script(h, veid, root, NULL, envp, script, DIST_FUNC,
-		SCRIPT_EXEC_TIMEOUT);
+	ret = configure_exec(h, veid, root, envp, script);
 	free_arg(envp);
 
 	return ret;
@@ -296,8 +528,7 @@ int vps_ip_configure(vps_handler *h, envid_t veid, dist_actions *actions,
 		envp[i++] = ipv6_net;
 	envp[i++] = ENV_PATH;
 	envp[i] = NULL;
-	ret = vps_exec_script(h, veid, root, NULL, envp, script, DIST_FUNC,
-		SCRIPT_EXEC_TIMEOUT);
+	ret = configure_exec(h, veid, root, envp, script);
 	free(str);
 
 	return ret;
@@ -305,8 +536,8 @@ int vps_ip_configure(vps_handler *h, envid_t veid, dist_actions *actions,
 
 
 
-int vps_configure(vps_handler *h, envid_t veid, dist_actions *actions,
-	const char *root, vps_param *param, int state)
+static int configure_scripts(vps_handler *h, envid_t veid,
+	dist_actions *actions, const char *root, vps_param *param, int state)
 {
 	int ret;
 	vps_res *res = &param->res;
@@ -338,3 +569,16 @@ int vps_configure(vps_handler *h, envid_t veid, dist_actions *actions,
 	}
 	return 0;
 }
+
+int vps_configure(vps_handler *h, envid_t veid, dist_actions *actions,
+	const char *root, vps_param *param, int state)
+{
+	int ret;
+
+	/* Failed configure scripts are reported, but not fatal */
+	batch.optional = 1;
+	ret = configure_scripts(h, veid, actions, root, param, state);
+	batch.optional = 0;
+
+	return ret;
+}
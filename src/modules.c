@@ -75,6 +75,24 @@ void free_modules(struct mod_action *action)
 	action->mod_list = NULL;
 }
 
+/* Drop per-command module data, keeping modules loaded */
+void reset_modules(struct mod_action *action)
+{
+	int i;
+	struct mod *mod;
+
+	for (i = 0, mod = action->mod_list; i < action->mod_count; i++, mod++) {
+		if (mod->mod_info->free_data != NULL)
+			mod->mod_info->free_data(mod->data);
+		if (mod->mod_info->alloc_data != NULL)
+			mod->data = mod->mod_info->alloc_data();
+		else
+			mod->data = NULL;
+		if (mod->mod_info->init != NULL)
+			mod->mod_info->init(mod->data);
+	}
+}
+
 static void *open_dlib(char *fname)
 {
 	return dlopen(fname, RTLD_NOW);
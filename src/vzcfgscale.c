@@ -1,372 +1,554 @@
-#include <stdio.h>
+/*
+ *  Copyright (C) 2000-2011, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
 #include <stdlib.h>
-#include <getopt.h>
-#include <limits.h>
+#include <stdio.h>
 #include <string.h>
-#include <sys/stat.h>
+#include <unistd.h>
+#include <limits.h>
 #include <errno.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
-#include "vzcfgscale.h"
-#include "vzctl.h"
-#include "list.h"
 #include "config.h"
 #include "validate.h"
-#include "vzfs.h"
-#include "vz.h"
-#include "distrconf.h"
+#include "logger.h"
+#include "util.h"
+#include "cpu.h"
 
-struct CParam *gparam, *lparam;
-struct CList *redirect_conf = NULL;
+#define MAX_FACTORS	64
 
-static struct option options[] =
-{
-	{"output-file",	required_argument, NULL, PARAM_OUTPUT_FILE},
-	{"all",		required_argument, NULL, PARAM_ALL},
-	{"cpu-only",	required_argument, NULL, PARAM_CPU},
-	{"disk-only",	required_argument, NULL, PARAM_DISK},
-	{"ubc-only",	required_argument, NULL, PARAM_UBC},
-	{"network-only",required_argument, NULL, PARAM_NET},
-	{"remove",	no_argument, NULL, PARAM_REMOVE},
-	{"validate",	no_argument, NULL, PARAM_VALIDATE},
-	{"help",	no_argument, NULL, PARAM_HELP},
-	{ NULL, 0, NULL, 0 }
+const char progname[] = "vzcfgscale";
+extern int page_size;
+
+/* One set of scale coefficients, 0 means "do not scale" */
+struct factor {
+	float ubc;
+	float cpu;
+	float disk;
+};
+
+struct job {
+	char *in;
+	char *out;
+	struct factor *k;
+};
+
+static int remove_spec;
+static int validate_mode;
+
+/* Container-specific parameters dropped by --remove */
+static const char *ve_spec_params[] = {
+	"HOSTNAME", "NAMESERVER", "SEARCHDOMAIN", "IP_ADDRESS",
+	"VE_ROOT", "VE_PRIVATE", "OSTEMPLATE", "ORIGIN_SAMPLE",
+	"NAME", "VEID", "DESCRIPTION", "NETIF", NULL
 };
 
-void usage(int rc)
+static void usage(int rc)
 {
-	fprintf(rc ? stderr : stdout, "Usage: vzcfgscale [options] <configfile>
-Options are:
-\t-o, --output-file <file>   Write output to file. Default is stdout
-\t-a, --all <coeff>          Scale all parameters to the value <coeff>
-\t-c, --cpu-only <coeff>     Scale only CPU parameters
-\t-d, --disk-only <coeff>    Scale only disk quota parameters
-\t-u, --ubc-only <coeff>     Scale only UBC parameters
-\t-n, --network-only <coeff> Scale only network bandwidth parameters
-\t-v, --validate             Validate UBC parameters
-\t-r, --remove               Removes container-specific parameters\n");
+	fprintf(rc ? stderr : stdout,
+"Usage: %s [options] <configfile>\n"
+"       %s [options] -O <dir> [-j <N>] <configfile|dir> ...\n"
+"Options are:\n"
+"	-o, --output-file <file>   write output to file, default is stdout\n"
+"	-O, --output-dir <dir>     batch mode: write outputs to directory\n"
+"	-j, --jobs <N>             batch mode: number of parallel workers\n"
+"	-a, --all <coeff>          scale all parameters by <coeff>\n"
+"	-c, --cpu-only <coeff>     scale CPU parameters\n"
+"	-d, --disk-only <coeff>    scale disk quota parameters\n"
+"	-u, --ubc-only <coeff>     scale UBC parameters\n"
+"	-v, --validate             validate UBC parameters\n"
+"	-r, --remove               remove container-specific parameters\n"
+"In batch mode <coeff> can be a comma-separated list, every element\n"
+"of which produces its own output in <dir>/<coeff>/. If several lists\n"
+"are given, the subdirectory is named after all coefficients which\n"
+"differ between the sets, e.g. <dir>/ubc2-cpu0.5/\n",
+		progname, progname);
 	exit(rc);
 }
 
-void remove_ve_spec(struct CParam *param)
+static int parse_coeff(char *str, float *val, int *num)
 {
-#define FREE_PARAM(name)	\
-do { \
-	if (param->name != NULL) \
-	{ \
-		free(param->name); \
-		param->name = NULL; \
-	} \
-} while (0); \
-
-	FREE_PARAM(hostname)
-	FREE_PARAM(nameserver)
-	FREE_PARAM(searchdomain)
-	FREE_PARAM(tmpl_set)
-	FREE_PARAM(ve_root_orig)
-	FREE_PARAM(ve_private_orig)
-	FREE_PARAM(shared_base_id)
-	FREE_PARAM(templates)
-	ListFree(param->ipadd);
-	param->ipadd =  NULL;
+	char *token, *end;
+	int n = 0;
+
+	for_each_strtok(token, str, ",") {
+		if (n >= MAX_FACTORS)
+			return -1;
+		val[n] = strtof(token, &end);
+		if (*end != '\0' || val[n] < 0)
+			return -1;
+		n++;
+	}
+	if (n == 0)
+		return -1;
+	*num = n;
+	return 0;
 }
 
-void scale(float ubc_k, float cpu_k, float disk_k, float net_k,
-		struct CParam *param)
+static unsigned long scale_ul(unsigned long val, float k)
 {
-	unsigned long val0, val1;
-
-#define SCALE_UBC(name, k) \
-do { \
-	if (param->name == NULL) \
-		break; \
-	val0 = param->name[0]; \
-	val1 = param->name[1]; \
-	if (val0 != LONG_MAX) \
-		val0 *= k; \
-	if (val0 > LONG_MAX) \
-		val0 = LONG_MAX; \
-	if (val1 != LONG_MAX) \
-		val1 *= k; \
-	if (val1 > LONG_MAX) \
-		val1 = LONG_MAX; \
-	param->name[0] = val0; \
-	param->name[1] = val1; \
-} while(0);
-
-#define SCALE_PARAM(name, k) \
-do { \
-	if (param->name == NULL) \
-		break; \
-	param->name[0] *= k; \
-	param->name[1] *= k; \
-	if (param->name[0] > LONG_MAX) \
-		param->name[0] = LONG_MAX; \
-	if (param->name[1] > LONG_MAX) \
-		param->name[1] = LONG_MAX; \
-} while(0);
-
-	if (ubc_k)
-	{
-		SCALE_UBC(kmemsize, ubc_k)
-		SCALE_UBC(avnumproc, ubc_k)
-		SCALE_UBC(numproc, ubc_k)
-		SCALE_UBC(vmguarpages, ubc_k)
-		SCALE_UBC(oomguarpages, ubc_k)
-		SCALE_UBC(lockedpages, ubc_k)
-		SCALE_UBC(shmpages, ubc_k)
-		SCALE_UBC(privvmpages, ubc_k)
-		SCALE_UBC(numfile, ubc_k)
-		SCALE_UBC(numflock, ubc_k)
-		SCALE_UBC(numpty, ubc_k)
-		SCALE_UBC(numsiginfo, ubc_k)
-		SCALE_UBC(dcachesize, ubc_k)
-		SCALE_UBC(physpages, ubc_k)
-		SCALE_UBC(numtcpsock, ubc_k)
-		SCALE_UBC(numothersock, ubc_k)
-		SCALE_UBC(tcpsndbuf, ubc_k)
-		SCALE_UBC(tcprcvbuf, ubc_k)
-		SCALE_UBC(othersockbuf, ubc_k)
-		SCALE_UBC(dgramrcvbuf, ubc_k)
-		SCALE_UBC(numiptent, ubc_k)
+	double res;
+
+	if (val == LONG_MAX)
+		return val;
+	res = (double)val * k;
+	if (res > LONG_MAX)
+		return LONG_MAX;
+	return (unsigned long)res;
+}
+
+static void scale(vps_res *res, struct factor *k)
+{
+	ub_param *ub = &res->ub;
+
+#define SCALE_2(name, coeff)					\
+if ((name) != NULL) {						\
+	(name)[0] = scale_ul((name)[0], coeff);			\
+	(name)[1] = scale_ul((name)[1], coeff);			\
+}
+	if (k->ubc) {
+		SCALE_2(ub->kmemsize, k->ubc)
+		SCALE_2(ub->lockedpages, k->ubc)
+		SCALE_2(ub->privvmpages, k->ubc)
+		SCALE_2(ub->shmpages, k->ubc)
+		SCALE_2(ub->numproc, k->ubc)
+		SCALE_2(ub->physpages, k->ubc)
+		SCALE_2(ub->vmguarpages, k->ubc)
+		SCALE_2(ub->oomguarpages, k->ubc)
+		SCALE_2(ub->numtcpsock, k->ubc)
+		SCALE_2(ub->numflock, k->ubc)
+		SCALE_2(ub->numpty, k->ubc)
+		SCALE_2(ub->numsiginfo, k->ubc)
+		SCALE_2(ub->tcpsndbuf, k->ubc)
+		SCALE_2(ub->tcprcvbuf, k->ubc)
+		SCALE_2(ub->othersockbuf, k->ubc)
+		SCALE_2(ub->dgramrcvbuf, k->ubc)
+		SCALE_2(ub->numothersock, k->ubc)
+		SCALE_2(ub->numfile, k->ubc)
+		SCALE_2(ub->dcachesize, k->ubc)
+		SCALE_2(ub->numiptent, k->ubc)
+		SCALE_2(ub->avnumproc, k->ubc)
+		SCALE_2(ub->swappages, k->ubc)
 	}
-	if (cpu_k && param->cpu_units != NULL)
-	{
-		*param->cpu_units *= cpu_k;
-		if (*param->cpu_units > MAXCPUUNITS)
-			 *param->cpu_units = MAXCPUUNITS;
+	if (k->disk) {
+		SCALE_2(res->dq.diskspace, k->disk)
+		SCALE_2(res->dq.diskinodes, k->disk)
 	}
-	if (disk_k)
-	{
-		SCALE_PARAM(quota_block, disk_k)
-		SCALE_PARAM(quota_inode, disk_k)
+#undef SCALE_2
+	if (k->cpu && res->cpu.units != NULL) {
+		*res->cpu.units = scale_ul(*res->cpu.units, k->cpu);
+		if (*res->cpu.units > MAXCPUUNITS)
+			*res->cpu.units = MAXCPUUNITS;
+		if (*res->cpu.units < MINCPUUNITS)
+			*res->cpu.units = MINCPUUNITS;
+	}
+}
+
+static int scale_file(char *in, char *out, struct factor *k)
+{
+	vps_param *old_p, *new_p;
+	int ret = 1;
+
+	old_p = init_vps_param();
+	new_p = init_vps_param();
+	if (old_p == NULL || new_p == NULL) {
+		logger(-1, ENOMEM, "Unable to scale %s", in);
+		goto out;
 	}
-	if (net_k && param->rate != NULL)
+	if (vps_parse_config(0, in, old_p, NULL) ||
+			vps_parse_config(0, in, new_p, NULL))
+		goto out;
+	scale(&new_p->res, k);
+	if (validate_mode &&
+		validate(&new_p->res, 0, 0, is_vswap_config(&new_p->res.ub)))
 	{
-		struct CList *p;
+		logger(-1, 0, "Validation of %s failed", in);
+		ret = 2;
+		goto out;
+	}
+	if (vps_write_config(0, in, out, new_p, old_p,
+			remove_spec ? ve_spec_params : NULL, NULL))
+		goto out;
+	ret = 0;
+out:
+	free_vps_param(old_p);
+	free_vps_param(new_p);
+	return ret;
+}
+
+static int is_conf_name(const char *name)
+{
+	static const char *suffix[] = {".conf", ".conf-sample", NULL};
+	const char **p;
+	size_t len, slen;
+
+	len = strlen(name);
+	for (p = suffix; *p != NULL; p++) {
+		slen = strlen(*p);
+		if (len > slen && !strcmp(name + len - slen, *p))
+			return 1;
+	}
+	return 0;
+}
+
+static int add_input(char ***list, int *num, const char *path)
+{
+	char **tmp;
+
+	tmp = realloc(*list, sizeof(char *) * (*num + 1));
+	if (tmp == NULL)
+		return -1;
+	*list = tmp;
+	if ((tmp[*num] = strdup(path)) == NULL)
+		return -1;
+	(*num)++;
+	return 0;
+}
+
+/* Collect input configs, directories are expanded to the config
+ * files they contain.
+ */
+static int get_inputs(char **argv, int argc, char ***list, int *num)
+{
+	struct stat st;
+	struct dirent *ent;
+	DIR *dp;
+	char buf[PATH_MAX];
+	int i;
 
-		for (p = param->rate; p != NULL; p = p->next)
-		{
-			if (p->val2 == NULL)
+	for (i = 0; i < argc; i++) {
+		if (stat(argv[i], &st)) {
+			logger(-1, errno, "Unable to stat %s", argv[i]);
+			return -1;
+		}
+		if (!S_ISDIR(st.st_mode)) {
+			if (add_input(list, num, argv[i]))
+				return -1;
+			continue;
+		}
+		if ((dp = opendir(argv[i])) == NULL) {
+			logger(-1, errno, "Unable to open %s", argv[i]);
+			return -1;
+		}
+		while ((ent = readdir(dp)) != NULL) {
+			if (!is_conf_name(ent->d_name))
 				continue;
-			*p->val2 *= net_k;
-			if (*p->val2 > LONG_MAX)
-				*p->val2 = LONG_MAX;
+			snprintf(buf, sizeof(buf), "%s/%s",
+					argv[i], ent->d_name);
+			if (stat(buf, &st) || !S_ISREG(st.st_mode))
+				continue;
+			if (add_input(list, num, buf)) {
+				closedir(dp);
+				return -1;
+			}
 		}
+		closedir(dp);
 	}
+	return 0;
 }
 
-int check_file(char *file1, char *file2)
+/* Run jobs in forked workers, at most nworkers at a time. A new job is
+ * started as soon as any of the running ones finishes.
+ */
+static int run_jobs(struct job *jobs, int njobs, int nworkers)
 {
-	struct stat st1, st2;
-
-	if (file1 == NULL || file2 == NULL)
-		return 0;
-	if (stat(file1, &st1))
-		return 0;
-	if (stat(file2, &st2))
-		return 0;
-	if (st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino)
-		return 1;
-	return 0;
+	int i, pid, status, running = 0, failed = 0;
+
+	for (i = 0; i < njobs || running > 0; ) {
+		if (i < njobs && running < nworkers) {
+			if ((pid = fork()) < 0) {
+				logger(-1, errno, "Unable to fork");
+				failed++;
+				i++;
+				continue;
+			} else if (pid == 0) {
+				exit(scale_file(jobs[i].in, jobs[i].out,
+							jobs[i].k));
+			}
+			running++;
+			i++;
+			continue;
+		}
+		if ((pid = wait(&status)) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		running--;
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			failed++;
+	}
+	return failed;
 }
 
-int get_id(char *in_file)
+static int job_cmp(const void *a, const void *b)
 {
-	char buf[STR_SIZE];
-	char *p;
-	int id;
-
-	if (in_file == NULL)
-		return 0;
-	if ((p = strrchr(in_file, '/')) != NULL)
-		p++;
-	else
-		p = in_file;
-	if (sscanf(p, "%d.conf", &id) != 1)
-		return 0;
-	snprintf(buf, sizeof(buf), SCRIPT_DIR "%d.conf", id);
-	if (check_file(in_file, buf))
-		return id;
+	return strcmp(((const struct job *)a)->out,
+			((const struct job *)b)->out);
+}
+
+/* Subdirectory of a coefficient set: the coefficient if only one kind
+ * differs between the sets (or they all differ the same way), otherwise
+ * all the ones which differ.
+ */
+static int set_dir(char *buf, size_t size, const char *outdir,
+		struct factor *k, int nk, int j)
+{
+	int ubc = 0, cpu = 0, disk = 0, same = 1, i, len;
+
+	for (i = 1; i < nk; i++) {
+		ubc |= k[i].ubc != k[0].ubc;
+		cpu |= k[i].cpu != k[0].cpu;
+		disk |= k[i].disk != k[0].disk;
+	}
+	/* As given by --all */
+	for (i = 0; i < nk; i++)
+		if ((ubc && cpu && k[i].ubc != k[i].cpu) ||
+				(ubc && disk && k[i].ubc != k[i].disk) ||
+				(cpu && disk && k[i].cpu != k[i].disk))
+			same = 0;
+	if (ubc + cpu + disk == 1 || (ubc + cpu + disk > 1 && same)) {
+		len = snprintf(buf, size, "%s/%g", outdir,
+			ubc ? k[j].ubc : cpu ? k[j].cpu : k[j].disk);
+	} else {
+		len = snprintf(buf, size, "%s/", outdir);
+		if (ubc && len >= 0 && (size_t)len < size)
+			len += snprintf(buf + len, size - len, "ubc%g-",
+				k[j].ubc);
+		if (cpu && len >= 0 && (size_t)len < size)
+			len += snprintf(buf + len, size - len, "cpu%g-",
+				k[j].cpu);
+		if (disk && len >= 0 && (size_t)len < size)
+			len += snprintf(buf + len, size - len, "disk%g-",
+				k[j].disk);
+		/* Drop the trailing dash */
+		if (len >= 0 && (size_t)len < size)
+			buf[--len] = '\0';
+	}
+	if (len < 0 || (size_t)len >= size) {
+		logger(-1, ENAMETOOLONG, "Unable to make output directory"
+				" name in %s", outdir);
+		return -1;
+	}
 	return 0;
 }
 
-int cpfile(char *in, char *out)
+static int batch(char *outdir, int nworkers, struct factor *k, int nk,
+		char **inputs, int ninputs)
 {
-	char buf[STR_SIZE];
-
-	if (in == NULL || out == NULL)
-		return 0;
-	if (check_file(in, out))
-		return 0;
-	snprintf(buf, sizeof(buf), "/bin/cp -f %s %s", in, out);
-	if (system(buf))
+	struct job *jobs;
+	char buf[PATH_MAX], dir[PATH_MAX];
+	const char *base;
+	int i, j, n = 0, failed = ninputs * nk;
+
+	if ((jobs = calloc(ninputs * nk, sizeof(*jobs))) == NULL) {
+		logger(-1, ENOMEM, "Unable to allocate jobs");
 		return 1;
-	return 0;
+	}
+	for (j = 0; j < nk; j++) {
+		if (nk > 1) {
+			if (set_dir(dir, sizeof(dir), outdir, k, nk, j))
+				goto out;
+		} else {
+			snprintf(dir, sizeof(dir), "%s", outdir);
+		}
+		for (i = 0; i < ninputs; i++) {
+			if ((base = strrchr(inputs[i], '/')) != NULL)
+				base++;
+			else
+				base = inputs[i];
+			if (snprintf(buf, sizeof(buf), "%s/%s", dir, base) >=
+					(int)sizeof(buf)) {
+				logger(-1, ENAMETOOLONG, "Unable to make output"
+						" file name for %s", inputs[i]);
+				goto out;
+			}
+			jobs[n].in = inputs[i];
+			jobs[n].k = &k[j];
+			if ((jobs[n].out = strdup(buf)) == NULL) {
+				logger(-1, ENOMEM, "Unable to allocate jobs");
+				goto out;
+			}
+			n++;
+		}
+	}
+	/* One output must not overwrite another */
+	qsort(jobs, n, sizeof(*jobs), job_cmp);
+	for (i = 1; i < n; i++) {
+		if (strcmp(jobs[i - 1].out, jobs[i].out))
+			continue;
+		logger(-1, 0, "Both %s and %s would be written to %s",
+				jobs[i - 1].in, jobs[i].in, jobs[i].out);
+		goto out;
+	}
+	for (j = 0; nk > 1 && j < nk; j++) {
+		set_dir(dir, sizeof(dir), outdir, k, nk, j);
+		if (make_dir(dir, 1))
+			goto out;
+	}
+	failed = run_jobs(jobs, n, nworkers);
+	logger(0, 0, "Scaled %d of %d configs", n - failed, n);
+out:
+	for (i = 0; i < n; i++)
+		free(jobs[i].out);
+	free(jobs);
+	return failed ? 1 : 0;
 }
 
+static struct option options[] =
+{
+	{"output-file",	required_argument, NULL, 'o'},
+	{"output-dir",	required_argument, NULL, 'O'},
+	{"jobs",	required_argument, NULL, 'j'},
+	{"all",		required_argument, NULL, 'a'},
+	{"cpu-only",	required_argument, NULL, 'c'},
+	{"disk-only",	required_argument, NULL, 'd'},
+	{"ubc-only",	required_argument, NULL, 'u'},
+	{"remove",	no_argument, NULL, 'r'},
+	{"validate",	no_argument, NULL, 'v'},
+	{"help",	no_argument, NULL, 'h'},
+	{ NULL, 0, NULL, 0 }
+};
+
 int main(int argc, char **argv)
 {
-	struct CParam param;
-	struct stat st;
-	char buf[STR_SIZE];
-	char *in_file = NULL;
-	char *out_file = NULL;
-	float ubc_k, cpu_k, disk_k, net_k, all_k;
-	int remove, validate;
-	int veid, c;
-
-	gparam = &param;
-	memset(&param, 0, sizeof(param));
-	ubc_k = cpu_k = disk_k = net_k = all_k = 0;
-	remove = validate = 0;
-	if (argc < 2)
-		usage(1);
-	while(1)
+	char *out_file = NULL, *out_dir = NULL;
+	float all_k[MAX_FACTORS], ubc_k[MAX_FACTORS];
+	float cpu_k[MAX_FACTORS], disk_k[MAX_FACTORS];
+	int n_all = 0, n_ubc = 0, n_cpu = 0, n_disk = 0;
+	struct factor k[MAX_FACTORS];
+	char **inputs = NULL;
+	int ninputs = 0, nk = 1;
+	int nworkers = 0;
+	int c, i, ret;
+
+	init_log(NULL, 0, 1, 0, 0, progname);
+
+	while ((c = getopt_long(argc, argv, "o:O:j:a:c:d:u:rvh",
+			options, NULL)) != -1)
 	{
-		int option_index = -1;
-		c = getopt_long(argc, argv, "o:a:c:d:u:n:hrv", options,
-				&option_index);
-		if (c == -1)
+		switch (c) {
+		case 'o':
+			out_file = optarg;
+			break;
+		case 'O':
+			out_dir = optarg;
+			break;
+		case 'j':
+			if (parse_int(optarg, &nworkers) || nworkers <= 0) {
+				logger(-1, 0, "Invalid number of jobs: %s",
+						optarg);
+				usage(1);
+			}
 			break;
-		switch(c)
-		{
-			case PARAM_OUTPUT_FILE	:
-				out_file = strdup(optarg);
-				break;
-			case PARAM_ALL		:
-				if (sscanf(optarg, "%f", &all_k) != 1)
-				{
-					fprintf(stderr, "Bad parameter %s\n",
-							optarg);
-					return 1;
-				}
-				break;
-			case PARAM_CPU		:
-				if (sscanf(optarg, "%f", &cpu_k) != 1)
-				{
-					fprintf(stderr, "Bad parameter %s\n",
-							optarg);
-					return 1;
-				}
-				break;
-			case PARAM_DISK		:
-				if (sscanf(optarg, "%f", &disk_k) != 1)
-				{
-					fprintf(stderr, "Bad parameter %s\n",
-							optarg);
-					return 1;
-				}
-				break;
-			case PARAM_UBC		:
-				if (sscanf(optarg, "%f", &ubc_k) != 1)
-				{
-					fprintf(stderr, "Bad parameter %s\n",
-							optarg);
-					return 1;
-				}
-				break;
-			case PARAM_NET		:
-				if (sscanf(optarg, "%f", &net_k) != 1)
-				{
-					fprintf(stderr, "Bad parameter %s\n",
-							optarg);
-					return 1;
-				}
-				break;
-			case PARAM_REMOVE	:
-				remove = 1;
-				break;
-			case PARAM_VALIDATE	:
-				validate = 1;
-				break;
-			case PARAM_HELP		:
-				usage(0);
-			case '?'		:
-				exit(1);
-			default			:
-				fprintf(stderr, "Unknown option %s\n", optarg);
-				exit(1);
+		case 'a':
+		case 'c':
+		case 'd':
+		case 'u':
+			if (parse_coeff(optarg,
+				c == 'a' ? all_k : c == 'c' ? cpu_k :
+				c == 'd' ? disk_k : ubc_k,
+				c == 'a' ? &n_all : c == 'c' ? &n_cpu :
+				c == 'd' ? &n_disk : &n_ubc))
+			{
+				logger(-1, 0, "Bad coefficient %s", optarg);
+				return 1;
+			}
+			break;
+		case 'r':
+			remove_spec = 1;
+			break;
+		case 'v':
+			validate_mode = 1;
+			break;
+		case 'h':
+			usage(0);
+			break;
+		default:
+			usage(1);
 		}
-
-	}
-	if (optind == argc - 1)
-	{
-			in_file = strdup(argv[optind]);
 	}
-	else if (optind < argc)
-	{
-		fprintf(stderr, "non-option ARGV-elements: ");
-		while (optind < argc - 1)
-			fprintf(stderr, "%s ", argv[optind++]);
-		fprintf(stderr, "\n");
-		exit(1);
+	if (optind >= argc)
+		usage(1);
+	if (out_dir == NULL && (optind != argc - 1 || nworkers)) {
+		logger(-1, 0, "Multiple inputs and --jobs require --output-dir");
+		usage(1);
 	}
-	if (in_file == NULL)
-	{
+	if (out_dir != NULL && out_file != NULL) {
+		logger(-1, 0, "--output-file and --output-dir are exclusive");
 		usage(1);
 	}
-	if (!stat(out_file, &st) && S_ISDIR(st.st_mode))
-	{
-		printf("Error: output file %s is directory\n", out_file);
-		free(in_file);
+
+	/* Every coefficient list is either of length 1 and applies to all
+	 * sets, or defines one coefficient per set.
+	 */
+#define SET_NK(n)							\
+	if ((n) > 1) {							\
+		if (nk > 1 && (n) != nk) {				\
+			logger(-1, 0, "Coefficient lists differ in length"); \
+			return 1;					\
+		}							\
+		nk = (n);						\
+	}
+	SET_NK(n_all)
+	SET_NK(n_ubc)
+	SET_NK(n_cpu)
+	SET_NK(n_disk)
+#undef SET_NK
+	if (nk > 1 && out_dir == NULL) {
+		logger(-1, 0, "Coefficient lists require --output-dir");
 		return 1;
 	}
-	if (all_k)
-		ubc_k = cpu_k = disk_k = net_k =  all_k;
-	if (stat(in_file, &st))
-	{
-		fprintf(stderr, "No such file %s\n", in_file);
-		exit(1);
+	for (i = 0; i < nk; i++) {
+		float all = n_all ? all_k[n_all > 1 ? i : 0] : 0;
+
+		k[i].ubc = n_ubc ? ubc_k[n_ubc > 1 ? i : 0] : all;
+		k[i].cpu = n_cpu ? cpu_k[n_cpu > 1 ? i : 0] : all;
+		k[i].disk = n_disk ? disk_k[n_disk > 1 ? i : 0] : all;
 	}
-	if (ParseConfig(0, in_file, &param, 0))
-	{
-		fprintf(stderr, "Unable open %s\n", in_file);
-		free(in_file);
+
+	if ((page_size = get_pagesize()) < 0)
 		return 1;
+
+	if (out_dir == NULL) {
+		ret = scale_file(argv[optind], out_file, &k[0]);
+		if (ret == 0 && out_file != NULL)
+			logger(0, 0, "Scale completed: success");
+		return ret;
 	}
-	scale(ubc_k, cpu_k, disk_k, net_k, &param);
-	if (remove)
-		remove_ve_spec(&param);
-	if (validate)
-	{
-		param.validatemode = strdup(STR_ACT_ERROR);
-		if (validate_ve(0, &param)) {
-			free(in_file);
-			return 1;
-		}
-	}
-	if ((veid = get_id(in_file)))
-	{
-		if (!vz_init(veid) && env_is_running(veid))
-		{
-			fprintf(stderr, "Container %d is running, applying "
-					"new parameters\n", veid);
-			if (disk_k)
-				VZFSQuotaSet(veid, NULL, &param, QUOTA_SET, 0);
-			if (ubc_k)
-				VZSetUbLimit(veid, &param);
-			if (cpu_k)
-				SetFairShed(veid, param.cpu_weight,
-					param.cpu_units, param.cpu_limit, 0);
-		}
+
+	if (get_inputs(argv + optind, argc - optind, &inputs, &ninputs)) {
+		ret = 1;
+		goto out;
 	}
-	/* if out_file already exist make backup */
-	if (out_file != NULL && !stat(out_file, &st))
-	{
-		snprintf(buf, sizeof(buf), "%s.bak", out_file);
-		if (remove)
-			rename(out_file, buf);
-		else
-			cpfile(out_file, buf);
+	if (make_dir(out_dir, 1)) {
+		ret = 1;
+		goto out;
 	}
-	if (out_file != NULL && !remove)
-		cpfile(in_file, out_file);
-	free(in_file);
-	if (SaveConfig(0, out_file, &param) == -1)
-		return 1;
-	if (!validate && param.class_id != NULL && *param.class_id == 1)
-		fprintf(stderr, "Warning: Some parameters were reduced, You need"
-			" to validate the configuration by vzcfgvalidate.\n");
-	fprintf(stderr, "Scale completed: success\n");
-	return 0;
+	if (nworkers == 0)
+		nworkers = get_num_cpu();
+	ret = batch(out_dir, nworkers, k, nk, inputs, ninputs);
+out:
+	for (i = 0; i < ninputs; i++)
+		free(inputs[i]);
+	free(inputs);
+	return ret;
 }
@@ -25,6 +25,9 @@
 #include <linux/vzcalluser.h>
 #include <errno.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "vzctl.h"
 #include "vzctl_param.h"
@@ -37,13 +40,19 @@
 #include "destroy.h"
 #include "util.h"
 #include "lock.h"
+#include "status.h"
 #include "vps_configure.h"
+#include "agent.h"
 #include "modules.h"
 #include "io.h"
 
 extern struct mod_action g_action;
+/* Handler shared by all commands in batch mode */
+extern vps_handler *g_handler;
 extern int do_enter(vps_handler *h, envid_t veid, const char *root,
 			int argc, char **argv);
+extern int enter_session(vps_handler *h, envid_t veid, const char *root,
+			int argc, char **argv);
 
 static struct option set_opt[] = {
 	{"save",	no_argument, NULL, PARAM_SAVE},
@@ -136,6 +145,7 @@ static struct option set_opt[] = {
 	{"ioprio",	required_argument, NULL, PARAM_IOPRIO},
 	{"description",	required_argument, NULL, PARAM_DESCRIPTION},
 	{"bootorder",	required_argument, NULL, PARAM_BOOTORDER},
+	{"stop_timeout", required_argument, NULL, PARAM_STOP_TIMEOUT},
 
 	/* New "easy" VSwap parameters */
 	{"ram",		required_argument, NULL, PARAM_RAM},
@@ -213,6 +223,7 @@ static int parse_startstop_opt(int argc, char **argv, vps_param *param,
 		{"skip_ve_setup", no_argument, NULL, PARAM_SKIP_VE_SETUP},
 		{"wait", no_argument, NULL, PARAM_WAIT},
 		{"fast", no_argument, NULL, PARAM_FAST},
+		{"keep_mounted", no_argument, NULL, PARAM_KEEP_MOUNTED},
 		{ NULL, 0, NULL, 0 }
 	};
 
@@ -245,6 +256,12 @@ static int parse_startstop_opt(int argc, char **argv, vps_param *param,
 			else
 				ret = VZ_INVALID_PARAMETER_SYNTAX;
 			break;
+		case PARAM_KEEP_MOUNTED:
+			if (start && stop)
+				param->opt.keep_mounted = YES;
+			else
+				ret = VZ_INVALID_PARAMETER_SYNTAX;
+			break;
 		default:
 			ret = VZ_INVALID_PARAMETER_SYNTAX;
 			break;
@@ -295,6 +312,19 @@ static int restart(vps_handler *h, envid_t veid, vps_param *g_p,
 
 	logger(0, 0, "Restarting container");
 
+	if (cmd_p->opt.keep_mounted == YES) {
+		if (g_p->opt.start_disabled == YES &&
+			cmd_p->opt.start_force != YES)
+		{
+			logger(-1, 0, "Container start disabled");
+			return VZ_VE_START_DISABLED;
+		}
+		g_p->res.misc.wait = cmd_p->res.misc.wait;
+		return vps_restart(h, veid, g_p,
+			cmd_p->opt.fast_kill == YES ? M_KILL : M_HALT,
+			cmd_p->opt.skip_setup == YES ? SKIP_SETUP : 0,
+			&g_action);
+	}
 	if (vps_is_run(h, veid)) {
 		ret = stop(h, veid, g_p, cmd_p);
 		if (ret != 0)
@@ -351,6 +381,16 @@ static int destroy(vps_handler *h, envid_t veid, vps_param *g_p,
 	return ret;
 }
 
+/* Descriptor given to --dump-to-fd or --from-fd */
+static int parse_stream_fd(const char *str, int *fd)
+{
+	if (parse_int(str, fd) || *fd < 0 || fcntl(*fd, F_GETFD) < 0) {
+		logger(-1, 0, "Invalid file descriptor: %s", str);
+		return VZ_INVALID_PARAMETER_VALUE;
+	}
+	return 0;
+}
+
 static int parse_chkpnt_opt(int argc, char **argv, vps_param *vps_p)
 {
 	int c, ret;
@@ -367,6 +407,9 @@ static int parse_chkpnt_opt(int argc, char **argv, vps_param *vps_p)
 	{"flags",	required_argument, NULL, PARAM_CPU_FLAGS},
 	{"context",	required_argument, NULL, PARAM_CPTCONTEXT},
 	{"dumpfile",	required_argument, NULL, PARAM_DUMPFILE},
+	{"compress",	required_argument, NULL, PARAM_DUMP_COMPRESS},
+	{"dump-to-fd",	required_argument, NULL, PARAM_DUMP_TO_FD},
+	{"dump-to-socket", required_argument, NULL, PARAM_DUMP_TO_SOCKET},
 	{ NULL, 0, NULL, 0 }
 	};
 
@@ -386,6 +429,21 @@ static int parse_chkpnt_opt(int argc, char **argv, vps_param *vps_p)
 		case PARAM_CPU_FLAGS:
 			cpt->cpu_flags = strtoul(optarg, NULL, 0);
 			break;
+		case PARAM_DUMP_COMPRESS:
+			if ((ret = cpt_compress_id(optarg)) < 0) {
+				logger(-1, 0, "Invalid compression method: %s",
+					optarg);
+				return VZ_INVALID_PARAMETER_VALUE;
+			}
+			cpt->compress = ret;
+			break;
+		case PARAM_DUMP_TO_FD:
+			if ((ret = parse_stream_fd(optarg, &cpt->stream_fd)))
+				return ret;
+			break;
+		case PARAM_DUMP_TO_SOCKET:
+			cpt->dumpsock = strdup(optarg);
+			break;
 		case PARAM_DUMP:
 			if (cpt->cmd)
 				goto err_syntax;
@@ -421,6 +479,20 @@ static int parse_chkpnt_opt(int argc, char **argv, vps_param *vps_p)
 	/* Do full checkpointing */
 	if (!cpt->cmd)
 		cpt->cmd = CMD_CHKPNT;
+	if (cpt->stream_fd != -1 || cpt->dumpsock != NULL) {
+		if ((cpt->stream_fd != -1 && cpt->dumpsock != NULL) ||
+			cpt->dumpfile != NULL)
+		{
+			logger(-1, 0, "Only one of --dumpfile, --dump-to-fd"
+				" and --dump-to-socket may be used");
+			return VZ_INVALID_PARAMETER_SYNTAX;
+		}
+		if (cpt->cmd != CMD_CHKPNT && cpt->cmd != CMD_DUMP) {
+			logger(-1, 0, "--dump-to-fd and --dump-to-socket are"
+				" only valid for checkpointing or --dump");
+			return VZ_INVALID_PARAMETER_SYNTAX;
+		}
+	}
 	return 0;
 
 err_syntax:
@@ -430,7 +502,7 @@ err_syntax:
 
 static int parse_restore_opt(int argc, char **argv, vps_param *vps_p)
 {
-	int c;
+	int c, ret;
 	int option_index;
 	cpt_param *cpt = &vps_p->res.cpt;
 	static struct option restore_options[] = {
@@ -443,6 +515,7 @@ static int parse_restore_opt(int argc, char **argv, vps_param *vps_p)
 	{"flags",	required_argument, NULL, PARAM_CPU_FLAGS},
 	{"context",	required_argument, NULL, PARAM_CPTCONTEXT},
 	{"skip_arpdetect", no_argument, NULL, PARAM_SKIPARPDETECT},
+	{"from-fd",	required_argument, NULL, PARAM_FROM_FD},
 	{ NULL, 0, NULL, 0 }
 	};
 
@@ -461,6 +534,10 @@ static int parse_restore_opt(int argc, char **argv, vps_param *vps_p)
 		case PARAM_CPU_FLAGS:
 			cpt->cpu_flags = strtoul(optarg, NULL, 0);
 			break;
+		case PARAM_FROM_FD:
+			if ((ret = parse_stream_fd(optarg, &cpt->stream_fd)))
+				return ret;
+			break;
 		case PARAM_UNDUMP:
 			if (cpt->cmd)
 				goto err_syntax;
@@ -491,6 +568,18 @@ static int parse_restore_opt(int argc, char **argv, vps_param *vps_p)
 	/* Do full restore */
 	if (!cpt->cmd)
 		cpt->cmd = CMD_RESTORE;
+	if (cpt->stream_fd != -1) {
+		if (cpt->dumpfile != NULL) {
+			logger(-1, 0, "Only one of --dumpfile and --from-fd"
+				" may be used");
+			return VZ_INVALID_PARAMETER_SYNTAX;
+		}
+		if (cpt->cmd != CMD_RESTORE && cpt->cmd != CMD_UNDUMP) {
+			logger(-1, 0, "--from-fd is only valid for restoring"
+				" or --undump");
+			return VZ_INVALID_PARAMETER_SYNTAX;
+		}
+	}
 	return 0;
 err_syntax:
 	logger(-1, 0, "Invalid syntax: only one sub command may be used");
@@ -623,7 +712,10 @@ static int apply_param_from_cfg(int veid, vps_param *param, char *cfg)
 		return VZ_APPLY_CONFIG_ERROR;
 	}
 	new = init_vps_param();
-	vps_parse_config(veid, conf, new, &g_action);
+	if (merge_sample_config(veid, cfg, new, &g_action)) {
+		free_vps_param(new);
+		return VZ_APPLY_CONFIG_ERROR;
+	}
 	merge_apply_param(param, new, cfg);
 	free_vps_param(new);
 	return 0;
@@ -700,7 +792,7 @@ static int fix_ip_param(vps_param *conf, vps_param *cmd)
 static int set(vps_handler *h, envid_t veid, vps_param *g_p, vps_param *vps_p,
 	vps_param *cmd_p)
 {
-	int ret = 0, is_run;
+	int ret = 0, is_run, changes;
 	dist_actions *actions = NULL;
 	char *dist_name;
 
@@ -819,8 +911,11 @@ static int set(vps_handler *h, envid_t veid, vps_param *g_p, vps_param *vps_p,
 			}
 		}
 	}
-	ret = vps_setup_res(h, veid, actions, &g_p->res.fs, cmd_p,
-		STATE_RUNNING, SKIP_NONE, &g_action);
+	/* Only the subsystems not touched by the request are skipped */
+	changes = vps_res_changes(cmd_p);
+	logger(2, 0, "Changed resources mask: %#x", changes);
+	ret = vps_setup_res_changed(h, veid, actions, &g_p->res.fs, cmd_p,
+		changes, STATE_RUNNING, SKIP_NONE, &g_action);
 err:
 	free_dist_actions(actions);
 	free(actions);
@@ -849,6 +944,8 @@ static int enter(vps_handler *h, envid_t veid, const char *root,
 		logger(-1, 0, "Container is not running");
 		return VZ_VE_NOT_RUNNING;
 	}
+	if (argc > 0 && strcmp(argv[0], "--exec"))
+		return enter_session(h, veid, root, argc, argv);
 	if (argc > 0) {
 		/* omit "--exec" argument */
 		argc -= 1; argv += 1;
@@ -858,7 +955,7 @@ static int enter(vps_handler *h, envid_t veid, const char *root,
 }
 
 static int exec(vps_handler *h, act_t action, envid_t veid, const char *root,
-		int argc, char **argv)
+		int argc, char **argv, int agent, int timeout)
 {
 	int mode;
 	char **arg = NULL;
@@ -891,20 +988,72 @@ static int exec(vps_handler *h, act_t action, envid_t veid, const char *root,
 		arg = argv_bash;
 	}
 	logger(1, 0, "Executing command: %s", buf);
-	ret = vps_exec(h, veid, root, mode, arg, NULL, NULL, 0);
+	if (agent)
+		ret = vps_agent_exec(h, veid, root, mode, arg, NULL);
+	else
+		ret = vps_exec(h, veid, root, mode, arg, NULL, NULL, timeout);
+	free(buf);
+
+	return ret;
+}
 
+/** Run exec, exec2 or exec3 command in CT, as for "vzctl exec".
+ *
+ * @param timeout	execution timeout, 0 - unlimited.
+ */
+int exec_ct(vps_handler *h, act_t action, envid_t veid, const char *root,
+	int argc, char **argv, int timeout)
+{
+	int ret;
+
+	ret = exec(h, action, veid, root, argc, argv, 0, timeout);
+	if (ret && ret != VZ_EXEC_TIMEOUT && action == ACTION_EXEC)
+		ret = VZ_COMMAND_EXECUTION_ERROR;
 	return ret;
 }
 
+static int connect_dumpsock(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		logger(-1, 0, "Socket path is too long: %s", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+		logger(-1, errno, "Unable to create socket");
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		logger(-1, errno, "Unable to connect to %s", path);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
 static int chkpnt(vps_handler *h, envid_t veid, vps_param *g_p, vps_param *cmd_p)
 {
-	int cmd;
+	int cmd, ret, fd = -1;
 
 	cmd = cmd_p->res.cpt.cmd;
 	merge_vps_param(g_p, cmd_p);
 	if (cmd == CMD_KILL || cmd == CMD_RESUME)
 		return cpt_cmd(h, veid, CMD_CHKPNT, &cmd_p->res.cpt, g_p);
-	return vps_chkpnt(h, veid, g_p, cmd, &cmd_p->res.cpt);
+	if (cmd_p->res.cpt.dumpsock != NULL) {
+		if ((fd = connect_dumpsock(cmd_p->res.cpt.dumpsock)) < 0)
+			return VZ_CHKPNT_ERROR;
+		cmd_p->res.cpt.stream_fd = fd;
+	}
+	ret = vps_chkpnt(h, veid, g_p, cmd, &cmd_p->res.cpt);
+	/* Receiver sees the end of dump */
+	if (fd != -1)
+		close(fd);
+	return ret;
 }
 
 static int restore(vps_handler *h, envid_t veid, vps_param *g_p,
@@ -921,20 +1070,28 @@ static int restore(vps_handler *h, envid_t veid, vps_param *g_p,
 
 static int show_status(vps_handler *h, envid_t veid, vps_param *param)
 {
-	int exist = 0, mounted = 0, run = 0, suspended = 0;
+	int exist = 0, mounted, run, suspended;
 	char buf[STR_SIZE];
 	fs_param *fs = &param->res.fs;
+	struct ct_status st;
+	int state;
 
 	get_vps_conf_path(veid, buf, sizeof(buf));
 	if (fs->private != NULL && stat_file(fs->private) && stat_file(buf))
 		exist = 1;
-	mounted = vps_is_mounted(fs->root);
-	run = vps_is_run(h, veid);
-	if (exist == 1) {
-		get_dump_file(veid, param->res.cpt.dumpdir, buf, sizeof(buf));
-		if (stat_file(buf))
-			suspended = 1;
+	/* Use the status table if it is up to date, probe otherwise */
+	ct_status_init(param->opt.lockdir);
+	if (ct_status_get(veid, &st)) {
+		state = ct_status_probe(h, veid, fs->root,
+			param->res.cpt.dumpdir);
+		ct_status_refresh(&st, state);
+	} else {
+		state = ct_status_check(&st, fs->root,
+			param->res.cpt.dumpdir);
 	}
+	mounted = (state & CT_ST_MOUNTED) != 0;
+	run = (state & CT_ST_RUNNING) != 0;
+	suspended = exist && (state & CT_ST_SUSPENDED);
 	printf("CTID %d %s %s %s%s\n", veid,
 		exist ? "exist" : "deleted",
 		mounted ? "mounted" : "unmounted",
@@ -961,7 +1118,7 @@ static int parse_custom_opt(envid_t veid, int argc, char **argv,
 int parse_action_opt(envid_t veid, act_t action, int argc, char *argv[],
 	vps_param *param, const char *name)
 {
-	int ret = 0;
+	int ret = 0, i;
 
 	switch (action)	{
 	case ACTION_SET:
@@ -981,8 +1138,26 @@ int parse_action_opt(envid_t veid, act_t action, int argc, char *argv[],
 		break;
 	case ACTION_ENTER:
 		if (argc >= 2) {
-			if (!strcmp(argv[1], "--exec")) {
-				if ((argc == 2) || (*argv[2] == '\0')) {
+			i = 1;
+			if (!strcmp(argv[i], "--attach")) {
+				/* Optional session ID */
+				if (argc > 2 && strcmp(argv[2], "--exec"))
+					i++;
+				i++;
+			} else if (!strcmp(argv[i], "--detach")) {
+				i++;
+			} else if (!strcmp(argv[i], "--list")) {
+				if (argc > 2) {
+					fprintf(stderr, "Invalid option "
+						"'%s'\n", argv[2]);
+					ret = VZ_INVALID_PARAMETER_SYNTAX;
+				}
+				break;
+			}
+			if (i == argc) {
+				break;
+			} else if (!strcmp(argv[i], "--exec")) {
+				if ((argc == i + 1) || (*argv[i + 1] == '\0')) {
 					fprintf(stderr,
 						"No command line "
 						"given for --exec\n");
@@ -990,7 +1165,7 @@ int parse_action_opt(envid_t veid, act_t action, int argc, char *argv[],
 				}
 			} else {
 				fprintf(stderr,
-					"Invalid option '%s'\n", argv[1]);
+					"Invalid option '%s'\n", argv[i]);
 				ret = VZ_INVALID_PARAMETER_SYNTAX;
 			}
 		}
@@ -1034,16 +1209,44 @@ int parse_action_opt(envid_t veid, act_t action, int argc, char *argv[],
 	return ret;
 }
 
+/* Transition recorded in the status table for an action */
+static int action2transition(act_t action)
+{
+	switch (action) {
+	case ACTION_START:
+	case ACTION_RESTART:
+		return CT_TR_STARTING;
+	case ACTION_STOP:
+		return CT_TR_STOPPING;
+	case ACTION_MOUNT:
+		return CT_TR_MOUNTING;
+	case ACTION_UMOUNT:
+		return CT_TR_UMOUNTING;
+	case ACTION_CHKPNT:
+		return CT_TR_SUSPENDING;
+	case ACTION_RESTORE:
+		return CT_TR_RESTORING;
+	case ACTION_CREATE:
+		return CT_TR_CREATING;
+	case ACTION_DESTROY:
+		return CT_TR_DESTROYING;
+	default:
+		return CT_TR_CHANGING;
+	}
+}
+
 int run_action(envid_t veid, act_t action, vps_param *g_p, vps_param *vps_p,
 	vps_param *cmd_p, int argc, char **argv, int skiplock)
 {
 	vps_handler *h = NULL;
-	int ret, lock_id = -1;
+	int ret, lock_id = -1, tr = CT_TR_NONE;
 	struct sigaction act;
 	char fname[STR_SIZE];
 
 	ret = 0;
-	if ((h = vz_open(veid)) == NULL) {
+	if (g_handler != NULL)
+		h = g_handler;
+	else if ((h = vz_open(veid)) == NULL) {
 		/* Accept to run "set --save --force" on non-openvz
 		 * kernel */
 		if (action != ACTION_SET ||
@@ -1060,7 +1263,9 @@ int run_action(envid_t veid, act_t action, vps_param *g_p, vps_param *vps_p,
 		action != ACTION_STATUS)
 	{
 		if (skiplock != YES) {
-			lock_id = vps_lock(veid, g_p->opt.lockdir, "");
+			lock_id = vps_lock_wait(veid, g_p->opt.lockdir, "",
+				g_p->opt.lock_timeout != NULL ?
+					*g_p->opt.lock_timeout : 0);
 			if (lock_id > 0) {
 				logger(-1, 0, "Container already locked");
 				ret = VZ_LOCKED;
@@ -1071,6 +1276,10 @@ int run_action(envid_t veid, act_t action, vps_param *g_p, vps_param *vps_p,
 				goto err;
 			}
 		}
+		if (veid != 0 && !ct_status_init(g_p->opt.lockdir)) {
+			tr = action2transition(action);
+			ct_status_begin(veid, tr);
+		}
 		sigemptyset(&act.sa_mask);
 		act.sa_handler = SIG_IGN;
 		act.sa_flags = 0;
@@ -1130,7 +1339,8 @@ int run_action(envid_t veid, act_t action, vps_param *g_p, vps_param *vps_p,
 	case ACTION_EXEC:
 	case ACTION_EXEC2:
 	case ACTION_EXEC3:
-		ret = exec(h, action, veid, g_p->res.fs.root, argc, argv);
+		ret = exec(h, action, veid, g_p->res.fs.root, argc, argv,
+			cmd_p->opt.exec_agent == YES, 0);
 		if (ret && action == ACTION_EXEC)
 			ret = VZ_COMMAND_EXECUTION_ERROR;
 		break;
@@ -1166,11 +1376,21 @@ int run_action(envid_t veid, act_t action, vps_param *g_p, vps_param *vps_p,
 	case ACTION_CUSTOM:
 		ret = mod_setup(h, veid, 0, 0, &g_action, g_p);
 		break;
+	case ACTION_START_ALL:
+	case ACTION_STOP_ALL:
+		/* Run by vzctl-all.c as ACTION_START/STOP for every CT */
+		logger(-1, 0, "Internal error: unexpected action %d", action);
+		ret = VZ_SYSTEM_ERROR;
+		break;
 	}
 err:
+	if (tr != CT_TR_NONE)
+		ct_status_end(veid, ct_status_probe(h, veid,
+			g_p->res.fs.root, g_p->res.cpt.dumpdir));
 	/* Unlock CT in case lock taken */
 	if (skiplock != YES && !lock_id)
 		vps_unlock(veid, g_p->opt.lockdir);
-	vz_close(h);
+	if (h != g_handler)
+		vz_close(h);
 	return ret;
 }
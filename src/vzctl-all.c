@@ -0,0 +1,1322 @@
+/*
+ *  Copyright (C) 2000-2011, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Actions on all containers of the host (start-all, stop-all,
+ * status and exec for many containers)
+ *
+ * Global config and modules are read once by the parent; every
+ * container is handled by a forked worker, with stdin from /dev/null.
+ * Start and stop go through the usual run_action() path, so locking,
+ * action scripts and so on work the same way as for a single
+ * container; exec calls exec_ct() directly, as it takes no lock.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/mount.h>
+#include <mntent.h>
+
+#include "vzctl.h"
+#include "env.h"
+#include "logger.h"
+#include "config.h"
+#include "status.h"
+#include "vzerror.h"
+#include "types.h"
+#include "util.h"
+#include "modules.h"
+#include "cpu.h"
+#include "quota.h"
+
+extern struct mod_action g_action;
+
+int run_action(envid_t veid, act_t action, vps_param *g_p, vps_param *vps_p,
+	vps_param *cmd_p, int argc, char **argv, int skiplock);
+int exec_ct(vps_handler *h, act_t action, envid_t veid, const char *root,
+	int argc, char **argv, int timeout);
+
+/* Seconds to wait for load/memory to become acceptable
+ * before starting a container anyway
+ */
+#define ADMIT_TIMEOUT		300
+/* Passes over still running containers in stop-all */
+#define STOP_PASSES		3
+/* Attempts to unmount a busy CT root */
+#define UMOUNT_TRIES		5
+/* CPU weight given to a container being stopped */
+#define STOP_CPUUNITS		2000
+
+#define PROCMOUNTS		"/proc/mounts"
+#define PROC_VZQUOTA		"/proc/vz/vzquota"
+
+struct ct_entry {
+	envid_t veid;
+	vps_param *param;	/* CT config */
+	int skip;		/* CT_SKIP_* reason to skip the CT */
+	int status;		/* worker exit code */
+	double time;		/* worker run time, seconds */
+	FILE *out;		/* worker output */
+	char *path;		/* mount point, for unmount jobs */
+	int done;		/* no more work for this CT */
+};
+
+enum {
+	CT_SKIP_NONE = 0,
+	CT_SKIP_RUNNING,
+	CT_SKIP_DISABLED,
+	CT_SKIP_BADCONF,
+	CT_SKIP_STOPPED,
+};
+
+struct all_opt {
+	int jobs;
+	double max_load;
+	unsigned long min_mem;	/* in MB */
+	int skiplock;
+	int fast;
+	/* exec */
+	act_t action;
+	int timeout;
+	char *outdir;		/* per-CT output files */
+	vps_handler *h;
+	int argc;
+	char **argv;
+};
+
+static double tv_diff(struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) +
+		(now.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+static int ct_id_sort_fn(const void *val1, const void *val2)
+{
+	const struct ct_entry *c1 = val1, *c2 = val2;
+
+	return c1->veid - c2->veid;
+}
+
+/* Higher BOOTORDER goes first, CTs without BOOTORDER go last */
+static int ct_bootorder_sort_fn(const void *val1, const void *val2)
+{
+	const struct ct_entry *c1 = val1, *c2 = val2;
+	unsigned long *b1 = c1->param->res.misc.bootorder;
+	unsigned long *b2 = c2->param->res.misc.bootorder;
+
+	if (b1 != NULL && b2 != NULL && *b1 != *b2)
+		return *b1 > *b2 ? -1 : 1;
+	if (b1 != NULL && b2 == NULL)
+		return -1;
+	if (b1 == NULL && b2 != NULL)
+		return 1;
+	return ct_id_sort_fn(val1, val2);
+}
+
+static int same_bootorder(struct ct_entry *c1, struct ct_entry *c2)
+{
+	unsigned long *b1 = c1->param->res.misc.bootorder;
+	unsigned long *b2 = c2->param->res.misc.bootorder;
+
+	if (b1 == NULL || b2 == NULL)
+		return b1 == b2;
+	return *b1 == *b2;
+}
+
+static void free_ct_list(struct ct_entry *list, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		free_vps_param(list[i].param);
+		free(list[i].path);
+		if (list[i].out != NULL)
+			fclose(list[i].out);
+	}
+	free(list);
+}
+
+/* Add an entry to the list, reading CT config if it exists */
+static struct ct_entry *add_ct_entry(struct ct_entry **list, int *n,
+	envid_t veid)
+{
+	struct ct_entry *ct, *tmp;
+	char path[STR_SIZE];
+
+	/* Start with 64 entries, then double */
+	if (*n == 0 || (*n >= 64 && (*n & (*n - 1)) == 0)) {
+		tmp = realloc(*list, (*n ? *n * 2 : 64) * sizeof(**list));
+		if (tmp == NULL)
+			return NULL;
+		*list = tmp;
+	}
+	ct = *list + *n;
+	memset(ct, 0, sizeof(*ct));
+	ct->veid = veid;
+	if ((ct->param = init_vps_param()) == NULL)
+		return NULL;
+	(*n)++;
+	get_vps_conf_path(veid, path, sizeof(path));
+	if (veid && stat_file(path) &&
+		vps_parse_config(veid, path, ct->param, &g_action))
+	{
+		logger(-1, 0, "Error in config file %s", path);
+		ct->skip = CT_SKIP_BADCONF;
+	}
+	return ct;
+}
+
+/* Read configs of all containers on the host, sorted by CT ID */
+static int get_ct_list(struct ct_entry **list, int *n)
+{
+	DIR *dp;
+	struct dirent *ep;
+	int veid;
+	char str[6];
+
+	*list = NULL;
+	*n = 0;
+	if ((dp = opendir(VPS_CONF_DIR)) == NULL) {
+		logger(-1, errno, "Unable to open " VPS_CONF_DIR);
+		return VZ_SYSTEM_ERROR;
+	}
+	while ((ep = readdir(dp))) {
+		if (sscanf(ep->d_name, "%d.%5s", &veid, str) != 2 ||
+				strcmp(str, "conf") || veid <= 0)
+			continue;
+		if (add_ct_entry(list, n, veid) == NULL) {
+			closedir(dp);
+			return VZ_RESOURCE_ERROR;
+		}
+	}
+	closedir(dp);
+	if (*list != NULL)
+		qsort(*list, *n, sizeof(**list), ct_id_sort_fn);
+	return 0;
+}
+
+/* Get running containers from /proc/vz/veinfo, sorted by CT ID */
+static int get_running_ct_list(struct ct_entry **list, int *n)
+{
+	FILE *fp;
+	char str[STR_SIZE];
+	int veid;
+
+	*list = NULL;
+	*n = 0;
+	if ((fp = fopen(PROCVEINFO, "r")) == NULL) {
+		logger(-1, errno, "Unable to open " PROCVEINFO);
+		return VZ_SYSTEM_ERROR;
+	}
+	while (fgets(str, sizeof(str), fp)) {
+		if (sscanf(str, "%d", &veid) != 1 || veid <= 0)
+			continue;
+		if (add_ct_entry(list, n, veid) == NULL) {
+			fclose(fp);
+			return VZ_RESOURCE_ERROR;
+		}
+	}
+	fclose(fp);
+	if (*list != NULL)
+		qsort(*list, *n, sizeof(**list), ct_id_sort_fn);
+	return 0;
+}
+
+/* Free memory in MB: MemAvailable if the kernel has it,
+ * otherwise MemFree + Buffers + Cached
+ */
+static int get_free_mem(unsigned long *mb)
+{
+	FILE *fp;
+	char str[128];
+	unsigned long val, avail = 0, sum = 0;
+	int has_avail = 0;
+
+	if ((fp = fopen(PROCMEM, "r")) == NULL)
+		return -1;
+	while (fgets(str, sizeof(str), fp)) {
+		if (sscanf(str, "MemAvailable: %lu", &val) == 1) {
+			avail = val;
+			has_avail = 1;
+		} else if (sscanf(str, "MemFree: %lu", &val) == 1 ||
+				sscanf(str, "Buffers: %lu", &val) == 1 ||
+				sscanf(str, "Cached: %lu", &val) == 1)
+		{
+			sum += val;
+		}
+	}
+	fclose(fp);
+	*mb = (has_avail ? avail : sum) / 1024;
+	return 0;
+}
+
+/* Check host load average and free memory */
+static int admit(struct all_opt *opt, int verbose)
+{
+	double load;
+	unsigned long mem;
+
+	if (opt->max_load > 0 && getloadavg(&load, 1) == 1 &&
+			load > opt->max_load)
+	{
+		if (verbose)
+			logger(1, 0, "Load average %.2f is above %.2f, "
+				"waiting", load, opt->max_load);
+		return 0;
+	}
+	if (opt->min_mem > 0 && get_free_mem(&mem) == 0 &&
+			mem < opt->min_mem)
+	{
+		if (verbose)
+			logger(1, 0, "Free memory %lu MB is below %lu MB, "
+				"waiting", mem, opt->min_mem);
+		return 0;
+	}
+	return 1;
+}
+
+struct worker {
+	pid_t pid;
+	struct ct_entry *ct;
+	struct timeval start;
+};
+
+typedef int (*ct_action_FN)(struct ct_entry *ct, vps_param *g_p,
+	struct all_opt *opt);
+
+/* Print worker output, prefixed with CT ID */
+static void print_ct_output(struct ct_entry *ct)
+{
+	char buf[STR_SIZE];
+	int bol = 1;
+
+	if (ct->out == NULL)
+		return;
+	rewind(ct->out);
+	while (fgets(buf, sizeof(buf), ct->out)) {
+		/* Only prefix line starts, long lines come in parts */
+		if (!bol)
+			printf("%s", buf);
+		else if (ct->path != NULL)
+			printf("%s: %s", ct->path, buf);
+		else
+			printf("CT %d: %s", ct->veid, buf);
+		bol = buf[strlen(buf) - 1] == '\n';
+	}
+	if (!bol)
+		printf("\n");
+	fflush(stdout);
+	fclose(ct->out);
+	ct->out = NULL;
+}
+
+/* Wait for any worker to exit, return number of workers left */
+static int reap_worker(struct worker *w, int running)
+{
+	int i, status;
+	pid_t pid;
+
+	while ((pid = waitpid(-1, &status, 0)) < 0) {
+		if (errno != EINTR)
+			return 0;
+	}
+	for (i = 0; i < running; i++) {
+		if (w[i].pid != pid)
+			continue;
+		w[i].ct->time = tv_diff(&w[i].start);
+		if (WIFEXITED(status))
+			w[i].ct->status = WEXITSTATUS(status);
+		else
+			w[i].ct->status = VZ_SYSTEM_ERROR;
+		print_ct_output(w[i].ct);
+		w[i] = w[--running];
+		break;
+	}
+	return running;
+}
+
+static int run_worker(struct worker *w, struct ct_entry *ct,
+	vps_param *g_p, struct all_opt *opt, ct_action_FN fn)
+{
+	pid_t pid;
+	int fd;
+
+	ct->out = tmpfile();
+	fflush(stdout);
+	fflush(stderr);
+	if ((pid = fork()) < 0) {
+		logger(-1, errno, "Unable to fork");
+		return VZ_RESOURCE_ERROR;
+	} else if (pid == 0) {
+		/* Workers run at the same time, none can own stdin */
+		if ((fd = open("/dev/null", O_RDONLY)) >= 0) {
+			dup2(fd, STDIN_FILENO);
+			close(fd);
+		}
+		if (ct->out != NULL) {
+			dup2(fileno(ct->out), STDOUT_FILENO);
+			dup2(fileno(ct->out), STDERR_FILENO);
+		}
+		set_log_ctid(ct->veid);
+		exit(fn(ct, g_p, opt));
+	}
+	w->pid = pid;
+	w->ct = ct;
+	gettimeofday(&w->start, NULL);
+	return 0;
+}
+
+/* Run fn for every CT in list[0..n) not marked to skip,
+ * with at most opt->jobs workers at a time.
+ */
+static int run_group(struct ct_entry *list, int n, vps_param *g_p,
+	struct all_opt *opt, ct_action_FN fn)
+{
+	struct worker *w;
+	int i, running = 0, waited;
+	int ret = 0;
+
+	if ((w = calloc(opt->jobs, sizeof(*w))) == NULL)
+		return VZ_RESOURCE_ERROR;
+	for (i = 0; i < n; i++) {
+		if (list[i].skip || list[i].done)
+			continue;
+		while (running == opt->jobs)
+			running = reap_worker(w, running);
+		for (waited = 0; !admit(opt, waited == 0); waited++) {
+			if (running) {
+				running = reap_worker(w, running);
+				continue;
+			}
+			if (waited >= ADMIT_TIMEOUT) {
+				logger(0, 0, "Host is still busy, "
+					"starting CT %d anyway", list[i].veid);
+				break;
+			}
+			sleep(1);
+		}
+		if ((ret = run_worker(&w[running], &list[i], g_p, opt, fn)))
+			break;
+		running++;
+	}
+	while (running)
+		running = reap_worker(w, running);
+	free(w);
+	return ret;
+}
+
+/* Make the worker's copy of global parameters those of CT,
+ * as main() does for a single CT, and return command line parameters.
+ */
+static vps_param *setup_ct_param(struct ct_entry *ct, vps_param *g_p)
+{
+	vps_param *cmd_p;
+	fs_param *fs = &g_p->res.fs;
+
+	merge_vps_param(g_p, ct->param);
+	/* Global config was parsed for CT 0, redo $VEID substitution */
+	if (fs->root_orig != NULL) {
+		free(fs->root);
+		fs->root = subst_VEID(ct->veid, fs->root_orig);
+	}
+	if (fs->private_orig != NULL) {
+		free(fs->private);
+		fs->private = subst_VEID(ct->veid, fs->private_orig);
+	}
+	if ((cmd_p = init_vps_param()) == NULL)
+		return NULL;
+	merge_global_param(cmd_p, g_p);
+	return cmd_p;
+}
+
+static int start_ct(struct ct_entry *ct, vps_param *g_p, struct all_opt *opt)
+{
+	vps_param *cmd_p;
+
+	if ((cmd_p = setup_ct_param(ct, g_p)) == NULL)
+		return VZ_RESOURCE_ERROR;
+	return run_action(ct->veid, ACTION_START, g_p, ct->param, cmd_p,
+		0, NULL, opt->skiplock);
+}
+
+static int stop_ct(struct ct_entry *ct, vps_param *g_p, struct all_opt *opt)
+{
+	vps_param *cmd_p;
+	vps_handler *h;
+	cpu_param cpu;
+	unsigned long units = STOP_CPUUNITS, limit = 0;
+
+	if ((cmd_p = setup_ct_param(ct, g_p)) == NULL)
+		return VZ_RESOURCE_ERROR;
+	/* Give CT more CPU so it stops faster, not saved to config */
+	if ((h = vz_open(ct->veid)) != NULL) {
+		memset(&cpu, 0, sizeof(cpu));
+		cpu.units = &units;
+		cpu.limit = &limit;
+		vps_set_cpu(h, ct->veid, &cpu);
+		vz_close(h);
+	}
+	if (opt->fast)
+		cmd_p->opt.fast_kill = YES;
+	return run_action(ct->veid, ACTION_STOP, g_p, ct->param, cmd_p,
+		0, NULL, opt->skiplock);
+}
+
+/* CT ID of a leftover CT root, if it matches the global VE_ROOT */
+static int root_veid(const char *path, vps_param *g_p)
+{
+	const char *p;
+	char *root;
+	int veid;
+
+	if ((p = strrchr(path, '/')) == NULL ||
+			g_p->res.fs.root_orig == NULL ||
+			parse_int(p + 1, &veid) || veid <= 0)
+		return 0;
+	root = subst_VEID(veid, g_p->res.fs.root_orig);
+	if (root == NULL || strcmp(root, path))
+		veid = 0;
+	free(root);
+	return veid;
+}
+
+/* Unmount a leftover CT root, and turn its quota off */
+static int umount_ct(struct ct_entry *ct, vps_param *g_p,
+	struct all_opt *opt)
+{
+	int i, veid, ret = 0;
+
+	if (ct->path != NULL) {
+		for (i = 0; umount(ct->path); i++) {
+			if (errno != EBUSY || i == UMOUNT_TRIES - 1) {
+				logger(-1, errno, "Can't umount %s", ct->path);
+				return VZ_FS_CANTUMOUNT;
+			}
+			sleep(1);
+		}
+		logger(0, 0, "Unmounted %s", ct->path);
+		/* Readers recheck the flag anyway, but keep it right */
+		if ((veid = root_veid(ct->path, g_p)) > 0 &&
+				!ct_status_init(g_p->opt.lockdir))
+			ct_status_event(veid, 0, CT_ST_MOUNTED);
+	}
+	if (ct->veid && !quota_ctl(ct->veid, QUOTA_STAT))
+		ret = quota_off(ct->veid, 0);
+	return ret;
+}
+
+static void print_summary(const char *name, const char *done,
+	struct ct_entry *list, int n, double total)
+{
+	int i, started = 0, failed = 0, skipped = 0;
+	const char *res;
+
+	printf("%10s %-10s %8s\n", "CTID", "RESULT", "TIME");
+	for (i = 0; i < n; i++) {
+		switch (list[i].skip) {
+		case CT_SKIP_RUNNING:
+			res = "running";
+			break;
+		case CT_SKIP_DISABLED:
+			res = "disabled";
+			break;
+		case CT_SKIP_BADCONF:
+			res = "badconf";
+			break;
+		case CT_SKIP_STOPPED:
+			res = "down";
+			break;
+		default:
+			res = list[i].status ? "failed" : done;
+		}
+		if (list[i].skip)
+			skipped++;
+		else if (list[i].status)
+			failed++;
+		else
+			started++;
+		if (list[i].skip)
+			printf("%10d %-10s %8s\n", list[i].veid, res, "-");
+		else if (list[i].status)
+			printf("%10d %-10s %8.2f (error %d)\n", list[i].veid,
+				res, list[i].time, list[i].status);
+		else
+			printf("%10d %-10s %8.2f\n", list[i].veid, res,
+				list[i].time);
+	}
+	fflush(stdout);
+	logger(0, 0, "%s: %s %d, failed %d, skipped %d containers in %.2f s",
+		name, done, started, failed, skipped, total);
+}
+
+static int parse_all_opt(act_t action, int argc, char **argv,
+	struct all_opt *opt)
+{
+	int c;
+	char *tail;
+	struct option start_options[] = {
+		{"jobs",	required_argument, NULL, 'j'},
+		{"max-load",	required_argument, NULL, 'L'},
+		{"min-mem",	required_argument, NULL, 'M'},
+		{ NULL, 0, NULL, 0 }
+	};
+	struct option stop_options[] = {
+		{"jobs",	required_argument, NULL, 'j'},
+		{"fast",	no_argument, NULL, 'f'},
+		{ NULL, 0, NULL, 0 }
+	};
+	struct option *options;
+
+	opt->jobs = get_num_cpu();
+	if (action == ACTION_START_ALL) {
+		options = start_options;
+		opt->max_load = 4 * opt->jobs;
+	} else {
+		/* Stopping is mostly waiting, run more at a time */
+		options = stop_options;
+		opt->jobs *= 4;
+	}
+	while ((c = getopt_long(argc, argv, "j:", options, NULL)) != -1) {
+		switch (c) {
+		case 'j':
+			if (parse_int(optarg, &opt->jobs) || opt->jobs <= 0) {
+				fprintf(stderr, "Invalid value for "
+					"--jobs: %s\n", optarg);
+				return VZ_INVALID_PARAMETER_VALUE;
+			}
+			break;
+		case 'L':
+			opt->max_load = strtod(optarg, &tail);
+			if (*tail != '\0' || opt->max_load < 0) {
+				fprintf(stderr, "Invalid value for "
+					"--max-load: %s\n", optarg);
+				return VZ_INVALID_PARAMETER_VALUE;
+			}
+			break;
+		case 'M':
+			if (parse_ul(optarg, &opt->min_mem)) {
+				fprintf(stderr, "Invalid value for "
+					"--min-mem: %s\n", optarg);
+				return VZ_INVALID_PARAMETER_VALUE;
+			}
+			break;
+		case 'f':
+			opt->fast = 1;
+			break;
+		default:
+			return VZ_INVALID_PARAMETER_SYNTAX;
+		}
+	}
+	if (optind < argc) {
+		fprintf(stderr, "Invalid option: %s\n", argv[optind]);
+		return VZ_INVALID_PARAMETER_SYNTAX;
+	}
+	return 0;
+}
+
+/** Start all containers marked to start on boot.
+ *
+ * Containers are started in groups of equal BOOTORDER, from the highest
+ * one; a group is started in parallel and waited for before the next.
+ *
+ * @param g_p		global parameters.
+ * @param argc		number of arguments.
+ * @param argv		arguments (options).
+ * @param skiplock	skip CT locking.
+ * @return		0 on success, or error of the first failed CT.
+ */
+int start_all(vps_param *g_p, int argc, char **argv, int skiplock)
+{
+	struct ct_entry *list = NULL;
+	struct all_opt opt;
+	vps_handler *h;
+	struct timeval start;
+	int i, j, n, ret;
+
+	memset(&opt, 0, sizeof(opt));
+	opt.skiplock = skiplock;
+	if ((ret = parse_all_opt(ACTION_START_ALL, argc, argv, &opt)))
+		return ret;
+	if ((h = vz_open(0)) == NULL)
+		return VZ_BAD_KERNEL;
+	gettimeofday(&start, NULL);
+	if ((ret = get_ct_list(&list, &n)))
+		goto out;
+	/* Leave only ONBOOT containers */
+	for (i = 0, j = 0; i < n; i++) {
+		if (list[i].skip != CT_SKIP_BADCONF &&
+			list[i].param->res.misc.onboot != YES)
+		{
+			free_vps_param(list[i].param);
+			continue;
+		}
+		list[j++] = list[i];
+	}
+	n = j;
+	for (i = 0; i < n; i++) {
+		if (list[i].skip)
+			continue;
+		if (list[i].param->opt.start_disabled == YES)
+			list[i].skip = CT_SKIP_DISABLED;
+		else if (vps_is_run(h, list[i].veid))
+			list[i].skip = CT_SKIP_RUNNING;
+	}
+	qsort(list, n, sizeof(*list), ct_bootorder_sort_fn);
+	for (i = 0, j = 0; i < n; i++)
+		if (!list[i].skip)
+			j++;
+	logger(0, 0, "Starting %d containers, %d at a time", j, opt.jobs);
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && same_bootorder(&list[i], &list[j]);)
+			j++;
+		if (list[i].param->res.misc.bootorder != NULL)
+			logger(1, 0, "Starting containers with bootorder %lu",
+				*list[i].param->res.misc.bootorder);
+		if ((ret = run_group(list + i, j - i, g_p, &opt, start_ct)))
+			goto out;
+	}
+	qsort(list, n, sizeof(*list), ct_id_sort_fn);
+	print_summary("start-all", "started", list, n, tv_diff(&start));
+	for (i = 0; i < n; i++) {
+		if (!list[i].skip && list[i].status) {
+			ret = list[i].status;
+			break;
+		}
+	}
+out:
+	free_ct_list(list, n);
+	vz_close(h);
+	return ret;
+}
+
+/* Get leftover CT root mounts and CTs with disk quota on */
+static int get_leftovers(struct ct_entry **mounts, int *n_mounts,
+	struct ct_entry **quotas, int *n_quotas)
+{
+	FILE *fp;
+	struct mntent *mnt;
+	struct ct_entry *ct;
+	char str[STR_SIZE];
+	int veid;
+
+	*mounts = *quotas = NULL;
+	*n_mounts = *n_quotas = 0;
+	if ((fp = setmntent(PROCMOUNTS, "r")) == NULL) {
+		logger(-1, errno, "Unable to open " PROCMOUNTS);
+		return VZ_SYSTEM_ERROR;
+	}
+	while ((mnt = getmntent(fp)) != NULL) {
+		if (strcmp(mnt->mnt_type, "simfs"))
+			continue;
+		if ((ct = add_ct_entry(mounts, n_mounts, 0)) == NULL ||
+			(ct->path = strdup(mnt->mnt_dir)) == NULL)
+		{
+			endmntent(fp);
+			return VZ_RESOURCE_ERROR;
+		}
+	}
+	endmntent(fp);
+	/* No quota file means no quota */
+	if ((fp = fopen(PROC_VZQUOTA, "r")) == NULL)
+		return 0;
+	while (fgets(str, sizeof(str), fp)) {
+		if (sscanf(str, "%d:", &veid) != 1 || veid <= 0)
+			continue;
+		if (add_ct_entry(quotas, n_quotas, veid) == NULL) {
+			fclose(fp);
+			return VZ_RESOURCE_ERROR;
+		}
+	}
+	fclose(fp);
+	return 0;
+}
+
+/* Unmount leftover CT roots and turn quota off, in parallel */
+static int cleanup_leftovers(vps_param *g_p, struct all_opt *opt)
+{
+	struct ct_entry *mounts, *quotas;
+	int i, n_mounts, n_quotas, ret;
+
+	ret = get_leftovers(&mounts, &n_mounts, &quotas, &n_quotas);
+	if (ret == 0 && n_mounts) {
+		logger(0, 0, "Unmounting %d container areas", n_mounts);
+		ret = run_group(mounts, n_mounts, g_p, opt, umount_ct);
+	}
+	if (ret == 0 && n_quotas) {
+		logger(0, 0, "Turning quota off for %d containers", n_quotas);
+		ret = run_group(quotas, n_quotas, g_p, opt, umount_ct);
+	}
+	for (i = 0; ret == 0 && i < n_mounts; i++)
+		ret = mounts[i].status;
+	for (i = 0; ret == 0 && i < n_quotas; i++)
+		ret = quotas[i].status;
+	free_ct_list(mounts, n_mounts);
+	free_ct_list(quotas, n_quotas);
+	return ret;
+}
+
+/** Stop all running containers.
+ *
+ * Containers are stopped in parallel, a new stop is started as soon
+ * as any other one finishes. Containers still running afterwards are
+ * retried, then leftover CT roots are unmounted and disk quota is
+ * turned off, also in parallel.
+ *
+ * @param g_p		global parameters.
+ * @param argc		number of arguments.
+ * @param argv		arguments (options).
+ * @param skiplock	skip CT locking.
+ * @return		0 on success, or error of the first failed CT.
+ */
+int stop_all(vps_param *g_p, int argc, char **argv, int skiplock)
+{
+	struct ct_entry *list = NULL;
+	struct all_opt opt;
+	vps_handler *h;
+	struct timeval start;
+	int i, n = 0, pass, left, ret;
+
+	memset(&opt, 0, sizeof(opt));
+	opt.skiplock = skiplock;
+	if ((ret = parse_all_opt(ACTION_STOP_ALL, argc, argv, &opt)))
+		return ret;
+	if ((h = vz_open(0)) == NULL)
+		return VZ_BAD_KERNEL;
+	gettimeofday(&start, NULL);
+	if ((ret = get_running_ct_list(&list, &n)))
+		goto out;
+	logger(0, 0, "Stopping %d containers, %d at a time", n, opt.jobs);
+	for (pass = 0, left = n; pass < STOP_PASSES && left; pass++) {
+		if (pass)
+			logger(0, 0, "Retrying to stop %d containers", left);
+		if ((ret = run_group(list, n, g_p, &opt, stop_ct)))
+			goto out;
+		for (i = 0, left = 0; i < n; i++) {
+			if (list[i].done)
+				continue;
+			if (vps_is_run(h, list[i].veid)) {
+				if (!list[i].status)
+					list[i].status = VZ_STOP_ERROR;
+				left++;
+			} else
+				list[i].done = 1;
+		}
+	}
+	print_summary("stop-all", "stopped", list, n, tv_diff(&start));
+	for (i = 0; i < n; i++) {
+		if (list[i].status) {
+			ret = list[i].status;
+			break;
+		}
+	}
+	i = cleanup_leftovers(g_p, &opt);
+	if (ret == 0)
+		ret = i;
+out:
+	free_ct_list(list, n);
+	vz_close(h);
+	return ret;
+}
+
+/* Snapshot of the host state shared by all CTs in status_all() */
+struct status_snap {
+	envid_t *run;		/* running CTs, sorted */
+	int n_run;
+	char **mnt;		/* mount points, sorted */
+	int n_mnt;
+	const char *dumpdir;	/* listed dump directory */
+	envid_t *dump;		/* CTs with a dump file there, sorted */
+	int n_dump;
+};
+
+static int envid_cmp(const void *val1, const void *val2)
+{
+	return *(const envid_t *) val1 - *(const envid_t *) val2;
+}
+
+static int str_cmp(const void *val1, const void *val2)
+{
+	return strcmp(*(char * const *) val1, *(char * const *) val2);
+}
+
+static void free_status_snap(struct status_snap *snap)
+{
+	int i;
+
+	free(snap->run);
+	for (i = 0; i < snap->n_mnt; i++)
+		free(snap->mnt[i]);
+	free(snap->mnt);
+	free(snap->dump);
+}
+
+/* Add an element to an array growing by doubling */
+static int add_elem(void **arr, int *n, size_t size, const void *elem)
+{
+	void *tmp;
+
+	if (*n == 0 || (*n >= 64 && (*n & (*n - 1)) == 0)) {
+		tmp = realloc(*arr, (*n ? *n * 2 : 64) * size);
+		if (tmp == NULL)
+			return -1;
+		*arr = tmp;
+	}
+	memcpy((char *) *arr + *n * size, elem, size);
+	(*n)++;
+	return 0;
+}
+
+/* Running CTs, mount points and dump files, one read of each */
+static int get_status_snap(vps_handler *h, const char *dumpdir,
+	struct status_snap *snap)
+{
+	FILE *fp;
+	struct mntent *mnt;
+	DIR *dp;
+	struct dirent *ep;
+	char *dir;
+	envid_t veid;
+	char str[6];
+
+	memset(snap, 0, sizeof(*snap));
+	if ((snap->n_run = vps_get_run_list(h, &snap->run)) < 0)
+		return VZ_SYSTEM_ERROR;
+	if ((fp = setmntent(PROCMOUNTS, "r")) == NULL) {
+		logger(-1, errno, "Unable to open " PROCMOUNTS);
+		return VZ_SYSTEM_ERROR;
+	}
+	while ((mnt = getmntent(fp)) != NULL) {
+		if ((dir = strdup(mnt->mnt_dir)) == NULL ||
+			add_elem((void **) &snap->mnt, &snap->n_mnt,
+				sizeof(dir), &dir))
+		{
+			free(dir);
+			endmntent(fp);
+			return VZ_RESOURCE_ERROR;
+		}
+	}
+	endmntent(fp);
+	if (snap->mnt != NULL)
+		qsort(snap->mnt, snap->n_mnt, sizeof(*snap->mnt), str_cmp);
+	snap->dumpdir = dumpdir != NULL ? dumpdir : DEF_DUMPDIR;
+	/* No dump directory means no dumps */
+	if ((dp = opendir(snap->dumpdir)) == NULL)
+		return 0;
+	while ((ep = readdir(dp))) {
+		if (sscanf(ep->d_name, DEF_DUMPFILE "%1s", &veid, str) != 1)
+			continue;
+		if (add_elem((void **) &snap->dump, &snap->n_dump,
+				sizeof(veid), &veid))
+		{
+			closedir(dp);
+			return VZ_RESOURCE_ERROR;
+		}
+	}
+	closedir(dp);
+	if (snap->dump != NULL)
+		qsort(snap->dump, snap->n_dump, sizeof(*snap->dump), envid_cmp);
+	return 0;
+}
+
+static int snap_is_mounted(struct status_snap *snap, const char *root)
+{
+	char *path;
+	int ret;
+
+	if (root == NULL || snap->mnt == NULL)
+		return 0;
+	if ((path = realpath(root, NULL)) == NULL)
+		path = strdup(root);
+	if (path == NULL)
+		return 0;
+	ret = bsearch(&path, snap->mnt, snap->n_mnt, sizeof(*snap->mnt),
+		str_cmp) != NULL;
+	free(path);
+	return ret;
+}
+
+/* Get CT state from the snapshot, the same way show_status() does */
+static int snap_ct_state(struct ct_entry *ct, vps_param *g_p,
+	struct status_snap *snap, int *exist)
+{
+	fs_param *fs = &ct->param->res.fs;
+	const char *dumpdir = ct->param->res.cpt.dumpdir;
+	char *root = NULL, *private = NULL;
+	char buf[STR_SIZE];
+	int state = 0;
+
+	if (fs->root == NULL && g_p->res.fs.root_orig != NULL)
+		root = subst_VEID(ct->veid, g_p->res.fs.root_orig);
+	if (fs->private == NULL && g_p->res.fs.private_orig != NULL)
+		private = subst_VEID(ct->veid, g_p->res.fs.private_orig);
+	get_vps_conf_path(ct->veid, buf, sizeof(buf));
+	*exist = (fs->private != NULL || private != NULL) &&
+		stat_file(fs->private ? : private) && stat_file(buf);
+	if (bsearch(&ct->veid, snap->run, snap->n_run, sizeof(*snap->run),
+			envid_cmp) != NULL)
+		state |= CT_ST_RUNNING;
+	if (snap_is_mounted(snap, fs->root ? : root))
+		state |= CT_ST_MOUNTED;
+	if (dumpdir == NULL)
+		dumpdir = g_p->res.cpt.dumpdir;
+	if (dumpdir == NULL || !strcmp(dumpdir, snap->dumpdir)) {
+		if (bsearch(&ct->veid, snap->dump, snap->n_dump,
+				sizeof(*snap->dump), envid_cmp) != NULL)
+			state |= CT_ST_SUSPENDED;
+	} else {
+		/* CT has its own dump directory */
+		get_dump_file(ct->veid, dumpdir, buf, sizeof(buf));
+		if (stat_file(buf))
+			state |= CT_ST_SUSPENDED;
+	}
+	free(root);
+	free(private);
+	return state;
+}
+
+static int parse_status_opt(int argc, char **argv, int *all, int *json)
+{
+	int c;
+	struct option options[] = {
+		{"all",		no_argument, NULL, 'a'},
+		{"json",	no_argument, NULL, 'j'},
+		{ NULL, 0, NULL, 0 }
+	};
+
+	while ((c = getopt_long(argc, argv, "", options, NULL)) != -1) {
+		switch (c) {
+		case 'a':
+			*all = 1;
+			break;
+		case 'j':
+			*json = 1;
+			break;
+		default:
+			return VZ_INVALID_PARAMETER_SYNTAX;
+		}
+	}
+	if (*all && optind < argc) {
+		fprintf(stderr, "CT IDs can't be used with --all\n");
+		return VZ_INVALID_PARAMETER_SYNTAX;
+	}
+	if (!*all && optind == argc) {
+		fprintf(stderr, "CT ID missing\n");
+		return VZ_INVALID_PARAMETER_VALUE;
+	}
+	return 0;
+}
+
+/** Show status of many containers.
+ *
+ * Running containers, mounts and dump files are read once for all
+ * containers instead of probing each one, so the cost hardly depends
+ * on the number of containers.
+ *
+ * @param g_p		global parameters.
+ * @param argc		number of arguments.
+ * @param argv		arguments: options, then CT IDs or names.
+ * @return		0 on success.
+ */
+int status_all(vps_param *g_p, int argc, char **argv)
+{
+	struct ct_entry *list = NULL;
+	struct status_snap snap;
+	vps_handler *h;
+	int i, n = 0, veid, exist, state, all = 0, json = 0;
+	int ret;
+
+	if ((ret = parse_status_opt(argc, argv, &all, &json)))
+		return ret;
+	if ((h = vz_open(0)) == NULL)
+		return VZ_BAD_KERNEL;
+	if (all) {
+		if ((ret = get_ct_list(&list, &n)))
+			goto out;
+	} else {
+		for (i = optind; i < argc; i++) {
+			if (parse_int(argv[i], &veid)) {
+				veid = get_veid_by_name(argv[i]);
+				if (veid < 0 || veid > VEID_MAX) {
+					fprintf(stderr, "Bad CT ID %s\n",
+						argv[i]);
+					ret = VZ_INVALID_PARAMETER_VALUE;
+					goto out;
+				}
+			} else if (veid <= 0) {
+				fprintf(stderr, "Bad CT ID %s\n", argv[i]);
+				ret = VZ_INVALID_PARAMETER_VALUE;
+				goto out;
+			}
+			if (add_ct_entry(&list, &n, veid) == NULL) {
+				ret = VZ_RESOURCE_ERROR;
+				goto out;
+			}
+		}
+	}
+	if ((ret = get_status_snap(h, g_p->res.cpt.dumpdir, &snap)))
+		goto out_snap;
+	if (json)
+		printf("[");
+	for (i = 0; i < n; i++) {
+		state = snap_ct_state(&list[i], g_p, &snap, &exist);
+		if (json) {
+			printf("%s\n  {\"ctid\": %d, \"exist\": %s, "
+				"\"mounted\": %s, \"running\": %s, "
+				"\"suspended\": %s}",
+				i ? "," : "", list[i].veid,
+				exist ? "true" : "false",
+				state & CT_ST_MOUNTED ? "true" : "false",
+				state & CT_ST_RUNNING ? "true" : "false",
+				exist && (state & CT_ST_SUSPENDED) ?
+					"true" : "false");
+			continue;
+		}
+		printf("CTID %d %s %s %s%s\n", list[i].veid,
+			exist ? "exist" : "deleted",
+			state & CT_ST_MOUNTED ? "mounted" : "unmounted",
+			state & CT_ST_RUNNING ? "running" : "down",
+			exist && (state & CT_ST_SUSPENDED) ?
+				" suspended" : "");
+	}
+	if (json)
+		printf("%s]\n", n ? "\n" : "");
+	fflush(stdout);
+out_snap:
+	free_status_snap(&snap);
+out:
+	free_ct_list(list, n);
+	vz_close(h);
+	return ret;
+}
+
+static int exec_one(struct ct_entry *ct, vps_param *g_p, struct all_opt *opt)
+{
+	vps_param *cmd_p;
+	char path[STR_SIZE];
+	int fd;
+
+	if ((cmd_p = setup_ct_param(ct, g_p)) == NULL)
+		return VZ_RESOURCE_ERROR;
+	free_vps_param(cmd_p);
+	if (opt->outdir != NULL) {
+		snprintf(path, sizeof(path), "%s/%d.out", opt->outdir,
+			ct->veid);
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd < 0) {
+			logger(-1, errno, "Unable to create %s", path);
+			return VZ_SYSTEM_ERROR;
+		}
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+		close(fd);
+	}
+	return exec_ct(opt->h, opt->action, ct->veid, g_p->res.fs.root,
+		opt->argc, opt->argv, opt->timeout);
+}
+
+/* Parse CT list like "101,102,200-210,name" */
+static int parse_ctids(char *str, struct ct_entry **list, int *n)
+{
+	char *tok, *p, *end;
+	int veid, last;
+
+	for (tok = strtok(str, ", "); tok != NULL; tok = strtok(NULL, ", ")) {
+		veid = strtol(tok, &end, 10);
+		last = veid;
+		if (*end == '-' && end != tok) {
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if (end == p)
+				end = p - 1;
+		}
+		if (end == tok || *end != '\0') {
+			/* Not a number, try CT name */
+			veid = last = get_veid_by_name(tok);
+			if (veid < 0) {
+				fprintf(stderr, "Bad CT ID %s\n", tok);
+				return VZ_INVALID_PARAMETER_VALUE;
+			}
+		}
+		if (veid <= 0 || last < veid || last > VEID_MAX) {
+			fprintf(stderr, "Bad CT ID %s\n", tok);
+			return VZ_INVALID_PARAMETER_VALUE;
+		}
+		for (; veid <= last; veid++)
+			if (add_ct_entry(list, n, veid) == NULL)
+				return VZ_RESOURCE_ERROR;
+	}
+	if (*n == 0) {
+		fprintf(stderr, "CT ID missing\n");
+		return VZ_INVALID_PARAMETER_VALUE;
+	}
+	qsort(*list, *n, sizeof(**list), ct_id_sort_fn);
+	return 0;
+}
+
+static int parse_exec_opt(int argc, char **argv, struct all_opt *opt,
+	char **ctids, int *all)
+{
+	int c;
+	struct option options[] = {
+		{"ctids",	required_argument, NULL, 'c'},
+		{"all",		no_argument, NULL, 'a'},
+		{"jobs",	required_argument, NULL, 'j'},
+		{"timeout",	required_argument, NULL, 't'},
+		{"outdir",	required_argument, NULL, 'o'},
+		{ NULL, 0, NULL, 0 }
+	};
+
+	/* Commands mostly wait for I/O, run more at a time */
+	opt->jobs = get_num_cpu() * 4;
+	/* Stop at the command */
+	while ((c = getopt_long(argc, argv, "+", options, NULL)) != -1) {
+		switch (c) {
+		case 'c':
+			*ctids = optarg;
+			break;
+		case 'a':
+			*all = 1;
+			break;
+		case 'j':
+			if (parse_int(optarg, &opt->jobs) || opt->jobs <= 0) {
+				fprintf(stderr, "Invalid value for "
+					"--jobs: %s\n", optarg);
+				return VZ_INVALID_PARAMETER_VALUE;
+			}
+			break;
+		case 't':
+			if (parse_int(optarg, &opt->timeout) ||
+					opt->timeout < 0)
+			{
+				fprintf(stderr, "Invalid value for "
+					"--timeout: %s\n", optarg);
+				return VZ_INVALID_PARAMETER_VALUE;
+			}
+			break;
+		case 'o':
+			opt->outdir = optarg;
+			break;
+		default:
+			return VZ_INVALID_PARAMETER_SYNTAX;
+		}
+	}
+	if (!*all == !*ctids) {
+		fprintf(stderr, "Either --ctids or --all is required\n");
+		return VZ_INVALID_PARAMETER_SYNTAX;
+	}
+	if (optind == argc) {
+		fprintf(stderr, "No command line given for exec\n");
+		return VZ_INVALID_PARAMETER_SYNTAX;
+	}
+	if (!strcmp(argv[optind], "-")) {
+		fprintf(stderr, "Commands can't be read from stdin "
+			"for many containers\n");
+		return VZ_INVALID_PARAMETER_SYNTAX;
+	}
+	opt->argc = argc - optind;
+	opt->argv = argv + optind;
+	return 0;
+}
+
+/** Execute a command in many containers at once.
+ *
+ * The command is run in up to --jobs containers in parallel, by
+ * forked workers sharing the handler and global config. Output of
+ * every container is printed when it finishes, each line prefixed
+ * with its CT ID, or saved to <outdir>/<CTID>.out.
+ *
+ * @param g_p		global parameters.
+ * @param action	ACTION_EXEC, ACTION_EXEC2 or ACTION_EXEC3.
+ * @param argc		number of arguments.
+ * @param argv		arguments: options, then the command.
+ * @return		0 on success, or error of the first failed CT.
+ */
+int exec_all(vps_param *g_p, act_t action, int argc, char **argv)
+{
+	struct ct_entry *list = NULL;
+	struct all_opt opt;
+	struct timeval start;
+	envid_t *run = NULL;
+	char *ctids = NULL;
+	int i, n = 0, n_run, all = 0, ret;
+
+	memset(&opt, 0, sizeof(opt));
+	opt.action = action;
+	if ((ret = parse_exec_opt(argc, argv, &opt, &ctids, &all)))
+		return ret;
+	if (opt.outdir != NULL && make_dir(opt.outdir, 1)) {
+		logger(-1, errno, "Unable to create %s", opt.outdir);
+		return VZ_SYSTEM_ERROR;
+	}
+	if ((opt.h = vz_open(0)) == NULL)
+		return VZ_BAD_KERNEL;
+	gettimeofday(&start, NULL);
+	if ((n_run = vps_get_run_list(opt.h, &run)) < 0) {
+		ret = VZ_SYSTEM_ERROR;
+		goto out;
+	}
+	if (all) {
+		for (i = 0; i < n_run; i++) {
+			if (add_ct_entry(&list, &n, run[i]) == NULL) {
+				ret = VZ_RESOURCE_ERROR;
+				goto out;
+			}
+		}
+	} else if ((ret = parse_ctids(ctids, &list, &n))) {
+		goto out;
+	}
+	for (i = 0; i < n; i++) {
+		if (!list[i].skip && bsearch(&list[i].veid, run, n_run,
+				sizeof(*run), envid_cmp) == NULL)
+			list[i].skip = CT_SKIP_STOPPED;
+	}
+	logger(1, 0, "Executing command in %d containers, %d at a time",
+		n, opt.jobs);
+	if ((ret = run_group(list, n, g_p, &opt, exec_one)))
+		goto out;
+	print_summary("exec", "done", list, n, tv_diff(&start));
+	for (i = 0; i < n; i++) {
+		if (list[i].skip == CT_SKIP_STOPPED) {
+			if (!ret)
+				ret = VZ_VE_NOT_RUNNING;
+		} else if (list[i].skip) {
+			if (!ret)
+				ret = VZ_NOCONFIG;
+		} else if (list[i].status) {
+			ret = list[i].status;
+			break;
+		}
+	}
+out:
+	free(run);
+	free_ct_list(list, n);
+	vz_close(opt.h);
+	return ret;
+}
@@ -0,0 +1,502 @@
+/*
+ *  Copyright (C) 2000-2011, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Batch mode: run many vzctl commands in a single process
+ *
+ * Commands are read one per line, in the usual vzctl syntax, with
+ * an optional leading "vzctl". Modules, the CT handler, sample and
+ * distribution configs are loaded once and shared by all commands.
+ * With more than one job, commands run in forked workers; commands
+ * for the same CT are still run one after another, in order.
+ *
+ * For every command a status line is printed:
+ *	STATUS line=<N> rc=<exit code> time=<seconds> action=<cmd> ctid=<id>
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+
+#include "vzctl.h"
+#include "logger.h"
+#include "config.h"
+#include "vzerror.h"
+#include "types.h"
+#include "util.h"
+
+extern char *_proc_title;
+
+int run_command(int argc, char *argv[], int verbose, int verbose_custom,
+	int quiet, int skiplock, int lock_timeout);
+void keep_state(int on);
+
+/* Max number of arguments in a command line */
+#define MAX_ARGS	256
+
+struct batch_cmd {
+	int line;		/* line number in the input */
+	char *buf;		/* line, split into arguments */
+	int argc;
+	char **argv;		/* argv[1] is the command name */
+	const char *action;	/* command name */
+	const char *ctid;	/* CT ID argument as given, or NULL */
+	int veid;		/* CT ID, or -1 if unknown */
+	int barrier;		/* acts on all CTs (start-all, stop-all) */
+	int verbose;
+	int verbose_custom;
+	int quiet;
+	int skiplock;
+	int lock_timeout;
+	int error;		/* line can not be run, exit code */
+	pid_t pid;		/* worker, if running */
+	int done;
+	int status;
+	double time;
+	FILE *out;		/* worker output */
+};
+
+struct batch_opt {
+	int verbose;
+	int verbose_custom;
+	int quiet;
+	int skiplock;
+	int lock_timeout;
+};
+
+static double tv_diff(struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) +
+		(now.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+/* Split line into arguments in place, handling '' and "" quotes
+ * and backslash escapes the way the shell does.
+ * Returns number of arguments, or -1 on syntax error.
+ */
+static int split_line(char *line, char **argv, int max)
+{
+	char *src = line, *dst = line;
+	char quote;
+	int argc = 0;
+
+	for (;;) {
+		while (*src == ' ' || *src == '\t' || *src == '\n' ||
+				*src == '\r')
+			src++;
+		if (*src == '\0' || *src == '#')
+			break;
+		if (argc == max)
+			return -1;
+		argv[argc++] = dst;
+		quote = 0;
+		for (; *src != '\0'; src++) {
+			if (quote == 0 && (*src == ' ' || *src == '\t' ||
+					*src == '\n' || *src == '\r'))
+				break;
+			if (quote == 0 && (*src == '\'' || *src == '"')) {
+				quote = *src;
+			} else if (quote != 0 && *src == quote) {
+				quote = 0;
+			} else if (*src == '\\' && quote != '\'' &&
+					src[1] != '\0' && src[1] != '\n')
+			{
+				*dst++ = *++src;
+			} else {
+				*dst++ = *src;
+			}
+		}
+		if (quote != 0)
+			return -1;
+		if (*src != '\0')
+			src++;
+		*dst++ = '\0';
+	}
+	return argc;
+}
+
+/* Parse a line into cmd. Returns 1 if the line is empty,
+ * 0 otherwise (cmd->error is set if it can't be run).
+ */
+static int parse_cmd(struct batch_cmd *cmd, char *line, int lineno,
+	struct batch_opt *opt)
+{
+	char *args[MAX_ARGS];
+	char *id;
+	int argc, i;
+
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->line = lineno;
+	cmd->veid = -1;
+	cmd->verbose = opt->verbose;
+	cmd->verbose_custom = opt->verbose_custom;
+	cmd->quiet = opt->quiet;
+	cmd->skiplock = opt->skiplock;
+	cmd->lock_timeout = opt->lock_timeout;
+	if ((cmd->buf = strdup(line)) == NULL) {
+		cmd->error = VZ_RESOURCE_ERROR;
+		return 0;
+	}
+	if ((argc = split_line(cmd->buf, args, MAX_ARGS)) < 0) {
+		fprintf(stderr, "Line %d: syntax error\n", lineno);
+		cmd->error = VZ_INVALID_PARAMETER_SYNTAX;
+		return 0;
+	}
+	if (argc == 0)
+		return 1;
+	i = 0;
+	if (!strcmp(args[i], "vzctl"))
+		i++;
+	for (; i < argc; i++) {
+		if (!strcmp(args[i], "--verbose")) {
+			cmd->verbose++;
+			cmd->verbose_custom = 1;
+		} else if (!strcmp(args[i], "--quiet")) {
+			cmd->quiet = 1;
+		} else if (!strcmp(args[i], "--skiplock")) {
+			cmd->skiplock = YES;
+		} else if (!strcmp(args[i], "--lock-timeout") &&
+				i + 1 < argc)
+		{
+			if (parse_int(args[++i], &cmd->lock_timeout) ||
+					cmd->lock_timeout < 0)
+			{
+				fprintf(stderr, "Line %d: invalid lock "
+					"timeout: %s\n", lineno, args[i]);
+				cmd->error = VZ_INVALID_PARAMETER_VALUE;
+				return 0;
+			}
+		} else {
+			break;
+		}
+	}
+	if (i == argc) {
+		fprintf(stderr, "Line %d: command missing\n", lineno);
+		cmd->error = VZ_INVALID_PARAMETER_SYNTAX;
+		return 0;
+	}
+	if (!strcmp(args[i], "enter") || args[i][0] == '-') {
+		fprintf(stderr, "Line %d: %s can not be used in batch mode\n",
+			lineno, args[i]);
+		cmd->error = VZ_INVALID_PARAMETER_SYNTAX;
+		return 0;
+	}
+	/* argv[0] is program name, argv[argc] is NULL, as for main() */
+	cmd->argc = argc - i + 1;
+	if ((cmd->argv = calloc(cmd->argc + 1, sizeof(char *))) == NULL) {
+		cmd->error = VZ_RESOURCE_ERROR;
+		return 0;
+	}
+	cmd->argv[0] = _proc_title;
+	memcpy(cmd->argv + 1, args + i, (argc - i) * sizeof(char *));
+	/* argv can be changed by the command */
+	cmd->action = args[i];
+
+	if (!strcmp(cmd->argv[1], "start-all") ||
+			!strcmp(cmd->argv[1], "stop-all"))
+	{
+		cmd->barrier = 1;
+		return 0;
+	}
+	i = 2;
+	if (i < cmd->argc && !strcmp(cmd->argv[i], "--agent"))
+		i++;
+	if (i < cmd->argc) {
+		id = cmd->argv[i];
+		cmd->ctid = id;
+		/* Options (status -a, exec --all) are not a CT ID */
+		if (id[0] != '-' && parse_int(id, &cmd->veid) &&
+				(cmd->veid = get_veid_by_name(id)) < 0)
+		{
+			/* Can't be ordered with other commands for the CT */
+			fprintf(stderr, "Line %d: bad CT ID %s\n",
+				lineno, id);
+			cmd->error = VZ_INVALID_PARAMETER_VALUE;
+		}
+	}
+	return 0;
+}
+
+static void free_cmd(struct batch_cmd *cmd)
+{
+	free(cmd->argv);
+	free(cmd->buf);
+	if (cmd->out != NULL)
+		fclose(cmd->out);
+}
+
+static void print_status(struct batch_cmd *cmd)
+{
+	printf("STATUS line=%d rc=%d time=%.3f action=%s ctid=%s\n",
+		cmd->line, cmd->status, cmd->time,
+		cmd->action != NULL ? cmd->action : "-",
+		cmd->ctid != NULL ? cmd->ctid : "-");
+	fflush(stdout);
+}
+
+static int exec_cmd(struct batch_cmd *cmd)
+{
+	return run_command(cmd->argc, cmd->argv, cmd->verbose,
+		cmd->verbose_custom, cmd->quiet, cmd->skiplock,
+		cmd->lock_timeout);
+}
+
+/* Read next line of any length, without the trailing newline */
+static char *read_line(FILE *fp, char **buf, size_t *len)
+{
+	ssize_t n;
+
+	if ((n = getline(buf, len, fp)) < 0)
+		return NULL;
+	if (n > 0 && (*buf)[n - 1] == '\n')
+		(*buf)[n - 1] = '\0';
+	return *buf;
+}
+
+/* One job: run commands in order, as they are read */
+static int run_serial(FILE *fp, struct batch_opt *opt)
+{
+	struct batch_cmd cmd;
+	struct timeval start;
+	char *line = NULL;
+	size_t len = 0;
+	int lineno = 0, ret = 0;
+
+	while (read_line(fp, &line, &len) != NULL) {
+		lineno++;
+		if (parse_cmd(&cmd, line, lineno, opt)) {
+			free_cmd(&cmd);
+			continue;
+		}
+		gettimeofday(&start, NULL);
+		if (cmd.error)
+			cmd.status = cmd.error;
+		else
+			cmd.status = exec_cmd(&cmd);
+		cmd.time = tv_diff(&start);
+		fflush(stderr);
+		print_status(&cmd);
+		if (cmd.status && !ret)
+			ret = cmd.status;
+		free_cmd(&cmd);
+	}
+	free(line);
+	return ret;
+}
+
+/* Commands which must not run at the same time */
+static int conflicts(struct batch_cmd *c1, struct batch_cmd *c2)
+{
+	if (c1->barrier || c2->barrier)
+		return 1;
+	return c1->veid >= 0 && c1->veid == c2->veid;
+}
+
+/* Check that no earlier unfinished command conflicts with list[i] */
+static int can_start(struct batch_cmd *list, int i)
+{
+	int j;
+
+	for (j = 0; j < i; j++)
+		if (!list[j].done && conflicts(&list[i], &list[j]))
+			return 0;
+	return 1;
+}
+
+static int start_worker(struct batch_cmd *cmd)
+{
+	pid_t pid;
+
+	cmd->out = tmpfile();
+	fflush(stdout);
+	fflush(stderr);
+	if ((pid = fork()) < 0) {
+		logger(-1, errno, "Unable to fork");
+		return VZ_RESOURCE_ERROR;
+	} else if (pid == 0) {
+		if (cmd->out != NULL) {
+			dup2(fileno(cmd->out), STDOUT_FILENO);
+			dup2(fileno(cmd->out), STDERR_FILENO);
+		}
+		exit(exec_cmd(cmd));
+	}
+	cmd->pid = pid;
+	return 0;
+}
+
+static void print_output(struct batch_cmd *cmd)
+{
+	char buf[STR_SIZE];
+	size_t n;
+
+	if (cmd->out == NULL)
+		return;
+	rewind(cmd->out);
+	while ((n = fread(buf, 1, sizeof(buf), cmd->out)) > 0)
+		fwrite(buf, 1, n, stdout);
+	fclose(cmd->out);
+	cmd->out = NULL;
+}
+
+/* Wait for a worker to exit, return the command it ran */
+static struct batch_cmd *reap_worker(struct batch_cmd *list, int n,
+	struct timeval *start)
+{
+	int i, status;
+	pid_t pid;
+
+	while ((pid = waitpid(-1, &status, 0)) < 0) {
+		if (errno != EINTR)
+			return NULL;
+	}
+	for (i = 0; i < n; i++) {
+		if (list[i].pid != pid || list[i].done)
+			continue;
+		list[i].time = tv_diff(&start[i]);
+		if (WIFEXITED(status))
+			list[i].status = WEXITSTATUS(status);
+		else
+			list[i].status = VZ_SYSTEM_ERROR;
+		list[i].done = 1;
+		print_output(&list[i]);
+		print_status(&list[i]);
+		return &list[i];
+	}
+	return NULL;
+}
+
+/* Many jobs: read all commands, then run them in workers,
+ * at most jobs at a time, keeping order of commands per CT.
+ */
+static int run_parallel(FILE *fp, struct batch_opt *opt, int jobs)
+{
+	struct batch_cmd *list = NULL, *tmp;
+	struct timeval *start = NULL;
+	char *line = NULL;
+	size_t len = 0;
+	int n = 0, lineno = 0, running = 0, left, i;
+	int ret = 0;
+
+	while (read_line(fp, &line, &len) != NULL) {
+		lineno++;
+		if ((n & (n + 1)) == 0) {
+			tmp = realloc(list, (n + 1) * 2 * sizeof(*list));
+			if (tmp == NULL) {
+				ret = VZ_RESOURCE_ERROR;
+				goto out;
+			}
+			list = tmp;
+		}
+		if (parse_cmd(&list[n], line, lineno, opt)) {
+			free_cmd(&list[n]);
+			continue;
+		}
+		n++;
+	}
+	if (n == 0)
+		goto out;
+	if ((start = calloc(n, sizeof(*start))) == NULL) {
+		ret = VZ_RESOURCE_ERROR;
+		goto out;
+	}
+	/* Lines with errors are reported right away */
+	for (i = 0, left = n; i < n; i++) {
+		if (!list[i].error)
+			continue;
+		list[i].status = list[i].error;
+		list[i].done = 1;
+		print_status(&list[i]);
+		left--;
+	}
+	while (left > 0) {
+		for (i = 0; i < n && running < jobs; i++) {
+			if (list[i].done || list[i].pid || !can_start(list, i))
+				continue;
+			gettimeofday(&start[i], NULL);
+			if (start_worker(&list[i])) {
+				list[i].status = VZ_RESOURCE_ERROR;
+				list[i].done = 1;
+				print_status(&list[i]);
+				left--;
+				continue;
+			}
+			running++;
+		}
+		if (running == 0)
+			break;
+		if (reap_worker(list, n, start) == NULL)
+			break;
+		running--;
+		left--;
+	}
+	for (i = 0; i < n; i++) {
+		if (list[i].status && !ret)
+			ret = list[i].status;
+	}
+
+out:
+	for (i = 0; i < n; i++)
+		free_cmd(&list[i]);
+	free(list);
+	free(start);
+	free(line);
+	return ret;
+}
+
+/** Run vzctl commands from a file.
+ *
+ * @param file		file name, "-" for stdin.
+ * @param jobs		max number of commands run at the same time.
+ * @return		0 if all commands succeeded, otherwise exit code
+ *			of the first failed one.
+ */
+int run_batch(const char *file, int jobs, int verbose, int verbose_custom,
+	int quiet, int skiplock, int lock_timeout)
+{
+	struct batch_opt opt;
+	FILE *fp;
+	int ret;
+
+	if (!strcmp(file, "-")) {
+		fp = stdin;
+	} else if ((fp = fopen(file, "r")) == NULL) {
+		logger(-1, errno, "Unable to open %s", file);
+		return VZ_INVALID_PARAMETER_VALUE;
+	}
+	opt.verbose = verbose;
+	opt.verbose_custom = verbose_custom;
+	opt.quiet = quiet;
+	opt.skiplock = skiplock;
+	opt.lock_timeout = lock_timeout;
+	keep_state(1);
+	if (jobs > 1)
+		ret = run_parallel(fp, &opt, jobs);
+	else
+		ret = run_serial(fp, &opt);
+	keep_state(0);
+	if (fp != stdin)
+		fclose(fp);
+	return ret;
+}
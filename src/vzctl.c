@@ -33,17 +33,26 @@
 #include "types.h"
 #include "util.h"
 #include "modules.h"
+#include "dist.h"
 
 struct mod_action g_action;
+vps_handler *g_handler;
 char *_proc_title;
 int _proc_title_len;
 
 void init_modules(struct mod_action *action, const char *name);
 void free_modules(struct mod_action *action);
+void reset_modules(struct mod_action *action);
 int parse_action_opt(envid_t veid, act_t action, int argc, char *argv[],
 	vps_param *param, const char *name);
 int run_action(envid_t veid, act_t action, vps_param *g_p, vps_param *vps_p,
 	vps_param *cmd_p, int argc, char **argv, int skiplock);
+int start_all(vps_param *g_p, int argc, char **argv, int skiplock);
+int stop_all(vps_param *g_p, int argc, char **argv, int skiplock);
+int status_all(vps_param *g_p, int argc, char **argv);
+int exec_all(vps_param *g_p, act_t action, int argc, char **argv);
+int run_batch(const char *file, int jobs, int verbose, int verbose_custom,
+	int quiet, int skiplock, int lock_timeout);
 
 static void version(FILE *fp)
 {
@@ -61,21 +70,31 @@ static void usage(int rc)
 "This program may be distributed under the terms of the GNU GPL License.\n"
 "\n"
 "Usage: vzctl [options] <command> <ctid> [parameters]\n"
+"       vzctl [options] --batch <file>|- [--jobs <N>]\n"
+"Options: --quiet --verbose --skiplock --lock-timeout <sec>\n"
 "\n"
 "vzctl create <ctid> [--ostemplate <name>] [--config <name>]\n"
 "   [--private <path>] [--root <path>] [--ipadd <addr>] | [--hostname <name>]\n"
 "vzctl start <ctid> [--force] [--wait]\n"
-"vzctl destroy | mount | umount | stop | restart | status <ctid>\n"
+"vzctl start-all [--jobs <N>] [--max-load <L>] [--min-mem <MB>]\n"
+"vzctl stop-all [--jobs <N>] [--fast]\n"
+"vzctl restart <ctid> [--force] [--wait] [--fast] [--keep_mounted]\n"
+"vzctl destroy | mount | umount | stop | status <ctid>\n"
+"vzctl status [--json] --all | <ctid> ...\n"
 "vzctl quotaon | quotaoff | quotainit <ctid>\n"
-"vzctl enter <ctid> [--exec <command> [arg ...]]\n"
-"vzctl exec | exec2 <ctid> <command> [arg ...]\n"
+"vzctl enter <ctid> [--attach [<id>] | --detach] [--exec <command> [arg ...]]\n"
+"vzctl enter <ctid> --list\n"
+"vzctl exec | exec2 [--agent] <ctid> <command> [arg ...]\n"
+"vzctl exec | exec2 | exec3 --ctids <list> | --all [--jobs <N>]\n"
+"   [--timeout <sec>] [--outdir <dir>] -- <command> [arg ...]\n"
 "vzctl runscript <ctid> <script>\n"
-"vzctl chkpnt <ctid> [--dumpfile <name>]\n"
-"vzctl restore <ctid> [--dumpfile <name>]\n"
+"vzctl chkpnt <ctid> [--dumpfile <name> | --dump-to-fd <N> |\n"
+"   --dump-to-socket <path>] [--compress none|lz4|zstd|gzip]\n"
+"vzctl restore <ctid> [--dumpfile <name> | --from-fd <N>]\n"
 "vzctl set <ctid> [--save] [--force] [--setmode restart|ignore]\n"
 "   [--ipadd <addr>] [--ipdel <addr>|all] [--hostname <name>]\n"
 "   [--nameserver <addr>] [--searchdomain <name>]\n"
-"   [--onboot yes|no] [--bootorder <N>]\n"
+"   [--onboot yes|no] [--bootorder <N>] [--stop_timeout <sec>]\n"
 "   [--userpasswd <user>:<passwd>]\n"
 "   [--cpuunits <N>] [--cpulimit <N>] [--cpus <N>] [--cpumask <cpus>]\n"
 "   [--diskspace <soft>[:<hard>]] [--diskinodes <soft>[:<hard>]]\n"
@@ -111,63 +130,155 @@ static void usage(int rc)
 	exit(rc);
 }
 
-int main(int argc, char *argv[], char *envp[])
+static int read_global_config(envid_t veid, vps_param *gparam, int quiet,
+	int verbose, int verbose_custom, int lock_timeout)
+{
+	if (vps_parse_config(veid, GLOBAL_CFG, gparam, &g_action)) {
+		fprintf(stderr, "Global configuration file %s not found\n",
+			GLOBAL_CFG);
+		return VZ_NOCONFIG;
+	}
+	init_log(gparam->log.log_file, veid, gparam->log.enable != NO,
+		gparam->log.level, quiet, "vzctl");
+	/* Set verbose level from global config if not overwriten
+	   by --verbose
+	*/
+	if (!verbose_custom && gparam->log.verbose != NULL) {
+		verbose = *gparam->log.verbose;
+		verbose_custom = 1;
+	}
+	if (verbose < -1)
+		verbose = -1;
+	if (verbose_custom)
+		set_log_verbose(verbose);
+	/* --lock-timeout overrides LOCK_TIMEOUT */
+	if (lock_timeout >= 0) {
+		if (gparam->opt.lock_timeout == NULL)
+			gparam->opt.lock_timeout =
+				malloc(sizeof(*gparam->opt.lock_timeout));
+		if (gparam->opt.lock_timeout != NULL)
+			*gparam->opt.lock_timeout = lock_timeout;
+	}
+	return 0;
+}
+
+/* In batch mode every set of modules is loaded once and then
+ * reused by all the commands needing it, with module data reset
+ * in between. g_action is a copy of the set in use.
+ */
+#define MAX_MOD_SETS	8
+
+static struct mod_set {
+	char *name;
+	struct mod_action action;
+} mod_sets[MAX_MOD_SETS];
+static int mod_nsets;
+static int mod_cur = -1;
+static int keep_modules;
+
+static void load_modules(const char *name)
+{
+	int i;
+
+	if (!keep_modules) {
+		init_modules(&g_action, name);
+		return;
+	}
+	for (i = 0; i < mod_nsets; i++) {
+		if (strcmp(mod_sets[i].name, name))
+			continue;
+		g_action = mod_sets[i].action;
+		reset_modules(&g_action);
+		mod_cur = i;
+		return;
+	}
+	init_modules(&g_action, name);
+	if (mod_nsets < MAX_MOD_SETS &&
+		(mod_sets[mod_nsets].name = strdup(name)) != NULL)
+	{
+		mod_sets[mod_nsets].action = g_action;
+		mod_cur = mod_nsets++;
+	}
+}
+
+static void release_modules(void)
+{
+	if (mod_cur >= 0) {
+		mod_sets[mod_cur].action = g_action;
+		mod_cur = -1;
+		memset(&g_action, 0, sizeof(g_action));
+		return;
+	}
+	free_modules(&g_action);
+}
+
+/** Keep modules and CT handler between commands (batch mode).
+ *
+ * @param on		1 to start, 0 to stop and free everything.
+ */
+void keep_state(int on)
+{
+	int i;
+
+	keep_modules = on;
+	if (on) {
+		/* Failure is not fatal, commands will try on their own */
+		if (g_handler == NULL)
+			g_handler = vz_open(0);
+		return;
+	}
+	for (i = 0; i < mod_nsets; i++) {
+		free_modules(&mod_sets[i].action);
+		free(mod_sets[i].name);
+	}
+	mod_nsets = 0;
+	vz_close(g_handler);
+	g_handler = NULL;
+	free_sample_configs();
+	free_dist_confs();
+}
+
+/** Run a single vzctl command.
+ *
+ * @param argc		number of arguments.
+ * @param argv		arguments, argv[1] is the command name.
+ * @return		command exit code.
+ */
+int run_command(int argc, char *argv[], int verbose, int verbose_custom,
+	int quiet, int skiplock, int lock_timeout)
 {
 	act_t action = -1;
-	int verbose = 0;
-	int verbose_custom = 0;
-	int quiet = 0;
-	int veid, ret, skiplock = 0;
+	int veid, ret;
 	char buf[256];
-	vps_param *gparam = NULL, *vps_p = NULL, *cmd_p = NULL;
+	vps_param *gparam, *vps_p, *cmd_p;
 	const char *action_nm;
-	struct sigaction act;
-	char *name = NULL, *opt;
-
-	_proc_title = argv[0];
-	_proc_title_len = envp[0] - argv[0];
+	char *name = NULL;
 
 	gparam = init_vps_param();
 	vps_p = init_vps_param();
 	cmd_p = init_vps_param();
+	/* Commands in batch mode parse their options in turn */
+	optind = 0;
 
-	sigemptyset(&act.sa_mask);
-	act.sa_handler = SIG_IGN;
-	act.sa_flags = 0;
-	sigaction(SIGPIPE, &act, NULL);
-
-	while (argc > 1) {
-		opt = argv[1];
-
-		if (!strcmp(opt, "--verbose")) {
-			verbose++;
-			verbose_custom = 1;
-		} else if (!strcmp(opt, "--quiet"))
-			quiet = 1;
-		else if (!strcmp(opt, "--version")) {
-			version(stdout);
-			exit(0);
-		} else if (!strcmp(opt, "--skiplock"))
-			skiplock = YES;
-		else
-			break;
-		argc--; argv++;
-	}
-	if (argc <= 1)
-		usage(VZ_INVALID_PARAMETER_SYNTAX);
 	action_nm = argv[1];
 	init_log(NULL, 0, 1, verbose, quiet, NULL);
 	if (!strcmp(argv[1], "set")) {
-		init_modules(&g_action, "set");
+		load_modules("set");
 		action = ACTION_SET;
 	} else if (!strcmp(argv[1], "create")) {
-		init_modules(&g_action, "create");
+		load_modules("create");
 		action = ACTION_CREATE;
 	} else if (!strcmp(argv[1], "start")) {
-		init_modules(&g_action, "set");
+		load_modules("set");
 		action = ACTION_START;
+	} else if (!strcmp(argv[1], "start-all")) {
+		load_modules("set");
+		action = ACTION_START_ALL;
+	} else if (!strcmp(argv[1], "stop-all")) {
+		load_modules("set");
+		action = ACTION_STOP_ALL;
 	} else if (!strcmp(argv[1], "stop")) {
-		init_modules(&g_action, "set");
+		load_modules("set");
 		action = ACTION_STOP;
 	} else if (!strcmp(argv[1], "restart")) {
 		action = ACTION_RESTART;
@@ -200,10 +311,10 @@ int main(int argc, char *argv[], char *envp[])
 		action = ACTION_QUOTAOFF;
 	} else if (!strcmp(argv[1], "quotainit")) {
 		action = ACTION_QUOTAINIT;
-	} else if (!strcmp(argv[1], "--help")) {
+	} else if (!strcmp(argv[1], "--help") && !keep_modules) {
 		usage(0);
 	} else {
-		init_modules(&g_action, action_nm);
+		load_modules(action_nm);
 		action = ACTION_CUSTOM;
 		if (!g_action.mod_count) {
 			fprintf(stderr, "Bad command: %s\n", argv[1]);
@@ -211,6 +322,51 @@ int main(int argc, char *argv[], char *envp[])
 			goto error;
 		}
 	}
+	if (action == ACTION_START_ALL || action == ACTION_STOP_ALL) {
+		argc--; argv++;
+		argv[0] = _proc_title;
+		if ((ret = read_global_config(0, gparam, quiet, verbose,
+				verbose_custom, lock_timeout)))
+			goto error;
+		if (action == ACTION_START_ALL)
+			ret = start_all(gparam, argc, argv, skiplock);
+		else
+			ret = stop_all(gparam, argc, argv, skiplock);
+		goto error;
+	}
+	/* Many CTs, or options: all of them are probed at once */
+	if (action == ACTION_STATUS && (argc > 3 ||
+			(argc == 3 && argv[2][0] == '-')))
+	{
+		argc--; argv++;
+		argv[0] = _proc_title;
+		if ((ret = read_global_config(0, gparam, quiet, verbose,
+				verbose_custom, lock_timeout)))
+			goto error;
+		ret = status_all(gparam, argc, argv);
+		goto error;
+	}
+	/* Exec in many CTs: --ctids, --all and so on */
+	if ((action == ACTION_EXEC || action == ACTION_EXEC2 ||
+			action == ACTION_EXEC3) &&
+			argc > 2 && !strncmp(argv[2], "--", 2) &&
+			strcmp(argv[2], "--agent"))
+	{
+		argc--; argv++;
+		argv[0] = _proc_title;
+		if ((ret = read_global_config(0, gparam, quiet, verbose,
+				verbose_custom, lock_timeout)))
+			goto error;
+		ret = exec_all(gparam, action, argc, argv);
+		goto error;
+	}
+	if ((action == ACTION_EXEC || action == ACTION_EXEC2 ||
+			action == ACTION_EXEC3) &&
+			argc > 2 && !strcmp(argv[2], "--agent"))
+	{
+		cmd_p->opt.exec_agent = YES;
+		argc--; argv++;
+	}
 	if (argc < 3) {
 		fprintf(stderr, "CT ID missing\n");
 		ret = VZ_INVALID_PARAMETER_VALUE;
@@ -229,26 +385,9 @@ int main(int argc, char *argv[], char *envp[])
 	/* getopt_long() prints argv[0] when reporting errors */
 	argv[0] = _proc_title;
 
-	/* Read global config file */
-	if (vps_parse_config(veid, GLOBAL_CFG, gparam, &g_action)) {
-		fprintf(stderr, "Global configuration file %s not found\n",
-			GLOBAL_CFG);
-		ret = VZ_NOCONFIG;
+	if ((ret = read_global_config(veid, gparam, quiet, verbose,
+			verbose_custom, lock_timeout)))
 		goto error;
-	}
-	init_log(gparam->log.log_file, veid, gparam->log.enable != NO,
-		gparam->log.level, quiet, "vzctl");
-	/* Set verbose level from global config if not overwriten
-	   by --verbose
-	*/
-	if (!verbose_custom && gparam->log.verbose != NULL) {
-		verbose = *gparam->log.verbose;
-		verbose_custom = 1;
-	}
-	if (verbose < -1)
-		verbose = -1;
-	if (verbose_custom)
-		set_log_verbose(verbose);
 	if ((ret = parse_action_opt(veid, action, argc, argv, cmd_p,
 		action_nm)))
 	{
@@ -294,7 +433,7 @@ int main(int argc, char *argv[], char *envp[])
 		skiplock);
 
 error:
-	free_modules(&g_action);
+	release_modules();
 	free_vps_param(gparam);
 	free_vps_param(vps_p);
 	free_vps_param(cmd_p);
@@ -303,3 +442,71 @@ error:
 
 	return ret;
 }
+
+int main(int argc, char *argv[], char *envp[])
+{
+	int verbose = 0;
+	int verbose_custom = 0;
+	int quiet = 0;
+	int skiplock = 0;
+	int lock_timeout = -1;
+	int jobs = 1;
+	struct sigaction act;
+	char *opt, *batch = NULL;
+
+	_proc_title = argv[0];
+	_proc_title_len = envp[0] - argv[0];
+
+	sigemptyset(&act.sa_mask);
+	act.sa_handler = SIG_IGN;
+	act.sa_flags = 0;
+	sigaction(SIGPIPE, &act, NULL);
+
+	while (argc > 1) {
+		opt = argv[1];
+
+		if (!strcmp(opt, "--verbose")) {
+			verbose++;
+			verbose_custom = 1;
+		} else if (!strcmp(opt, "--quiet"))
+			quiet = 1;
+		else if (!strcmp(opt, "--version")) {
+			version(stdout);
+			exit(0);
+		} else if (!strcmp(opt, "--skiplock"))
+			skiplock = YES;
+		else if (!strcmp(opt, "--lock-timeout") && argc > 2) {
+			if (parse_int(argv[2], &lock_timeout) ||
+					lock_timeout < 0)
+			{
+				fprintf(stderr, "Invalid lock timeout: %s\n",
+					argv[2]);
+				exit(VZ_INVALID_PARAMETER_VALUE);
+			}
+			argc--; argv++;
+		} else if (!strcmp(opt, "--batch") && argc > 2) {
+			batch = argv[2];
+			argc--; argv++;
+		} else if (!strcmp(opt, "--jobs") && argc > 2) {
+			if (parse_int(argv[2], &jobs) || jobs < 1) {
+				fprintf(stderr, "Invalid number of jobs: %s\n",
+					argv[2]);
+				exit(VZ_INVALID_PARAMETER_VALUE);
+			}
+			argc--; argv++;
+		} else
+			break;
+		argc--; argv++;
+	}
+	if (batch != NULL) {
+		if (argc > 1)
+			usage(VZ_INVALID_PARAMETER_SYNTAX);
+		init_log(NULL, 0, 1, verbose, quiet, NULL);
+		return run_batch(batch, jobs, verbose, verbose_custom, quiet,
+			skiplock, lock_timeout);
+	}
+	if (argc <= 1)
+		usage(VZ_INVALID_PARAMETER_SYNTAX);
+	return run_command(argc, argv, verbose, verbose_custom, quiet,
+		skiplock, lock_timeout);
+}
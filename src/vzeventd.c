@@ -37,6 +37,7 @@
 #include "config.h"
 #include "vzerror.h"
 #include "script.h"
+#include "status.h"
 
 #define NETLINK_UEVENT	31	/* from kernel/ve/vzevent.c */
 
@@ -149,13 +150,18 @@ ev_unknown:
 
 ev_mount:
 ev_umount:
-ev_start:
 	logger(2, 0, "Got %s event (ignored)", name);
 	/* Do nothing */
 	return 0;
+ev_start:
+	logger(2, 0, "Got %s event", name);
+	ct_status_event(ctid, CT_ST_RUNNING, 0);
+	return 0;
 ev_reboot:
+	ct_status_event(ctid, 0, CT_ST_RUNNING);
 	return run_event_script(ctid, "reboot");
 ev_stop:
+	ct_status_event(ctid, 0, CT_ST_RUNNING);
 	return run_event_script(ctid, "stop");
 }
 
@@ -168,6 +174,8 @@ static int read_events(int fd, struct sockaddr_nl *sa)
 	int ret;
 
 	logger(0, 0, "Started");
+	/* From now on CT start and stop are tracked in the status table */
+	ct_status_attach();
 
 	while (1) {
 		memset(&msg, 0, sizeof(msg));
@@ -292,6 +300,8 @@ int main(int argc, char **argv)
 	init_log(param->log.log_file, 0, param->log.enable != NO,
 			param->log.level + verbose,
 			0, "vzeventd");
+	if (ct_status_init(param->opt.lockdir))
+		logger(0, 0, "Warning: can't open CT status table");
 
 	return prepare_read_events(daemonize);
 }
@@ -0,0 +1,301 @@
+/*
+ *  Copyright (C) 2000-2011, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Throughput benchmark for vps_exec() output
+ *
+ * Runs "head -c SIZE /dev/zero" inside a running container and measures
+ * how fast its output gets through vps_exec() to a pipe (read by a child
+ * process, like "vzctl exec CTID cmd | consumer") or to a file, once with
+ * splice() and once with copying through a buffer.
+ *
+ * With -a, the stream is fed as stdin to "cat" run by the exec agent
+ * instead, so it goes both ways through the agent connection.
+ *
+ * Not installed, build with "make vzexecbench".
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+
+#include "types.h"
+#include "config.h"
+#include "env.h"
+#include "exec.h"
+#include "relay.h"
+#include "agent.h"
+#include "logger.h"
+#include "util.h"
+#include "vzerror.h"
+
+#define DEF_SIZE_MB	4096
+#define DEF_RUNS	3
+#define DRAIN_BUF	(1024 * 1024)
+
+static FILE *out;
+
+static void usage(int rc)
+{
+	fprintf(rc ? stderr : stdout,
+"Usage: vzexecbench [-s <MB>] [-n <runs>] [-o <file>] [-a] <ctid>\n"
+"  -s	stream size in megabytes (default %d)\n"
+"  -n	runs of each mode (default %d)\n"
+"  -o	write the stream to a file instead of a pipe\n"
+"  -a	pass the stream through cat run by the exec agent\n",
+		DEF_SIZE_MB, DEF_RUNS);
+	exit(rc);
+}
+
+static double tv_diff(struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) +
+		(now.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+/* Reader at the other end of the pipe, exits with 0 if all data came */
+static pid_t start_drain(int fd, unsigned long long size)
+{
+	pid_t pid;
+	char *buf;
+	ssize_t n;
+	unsigned long long total = 0;
+
+	if ((pid = fork()) != 0)
+		return pid;
+	if ((buf = malloc(DRAIN_BUF)) == NULL)
+		exit(1);
+	while ((n = read(fd, buf, DRAIN_BUF)) != 0) {
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			exit(1);
+		}
+		total += n;
+	}
+	exit(total != size);
+}
+
+/* Writer to the other end of the pipe, feeds size zero bytes */
+static pid_t start_feed(int fd, unsigned long long size)
+{
+	pid_t pid;
+	char *buf;
+	size_t n;
+
+	if ((pid = fork()) != 0)
+		return pid;
+	if ((buf = calloc(1, DRAIN_BUF)) == NULL)
+		exit(1);
+	for (; size > 0; size -= n) {
+		n = size < DRAIN_BUF ? size : DRAIN_BUF;
+		if (write(fd, buf, n) != (ssize_t) n)
+			exit(1);
+	}
+	exit(0);
+}
+
+/* Run the stream once, stdout of vps_exec() going to a pipe or file */
+static int run_once(vps_handler *h, envid_t veid, const char *root,
+	unsigned long long size, const char *file, int agent, double *time)
+{
+	char size_str[32];
+	char *argv[] = {"head", "-c", size_str, "/dev/zero", NULL};
+	char *cat_argv[] = {"cat", NULL};
+	struct timeval start;
+	int fd[2], in[2], saved, saved_in = -1, ret, status;
+	pid_t pid = -1, feed = -1;
+
+	snprintf(size_str, sizeof(size_str), "%llu", size);
+	if (file != NULL) {
+		fd[0] = -1;
+		fd[1] = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		if (fd[1] < 0) {
+			logger(-1, errno, "Unable to open %s", file);
+			return 1;
+		}
+	} else {
+		if (pipe(fd) < 0) {
+			logger(-1, errno, "Unable to create pipe");
+			return 1;
+		}
+		relay_grow_pipe(fd[1]);
+		if ((pid = start_drain(fd[0], size)) < 0) {
+			logger(-1, errno, "Unable to fork");
+			return 1;
+		}
+		close(fd[0]);
+	}
+	if (agent) {
+		if (pipe(in) < 0) {
+			logger(-1, errno, "Unable to create pipe");
+			return 1;
+		}
+		if ((feed = start_feed(in[1], size)) < 0) {
+			logger(-1, errno, "Unable to fork");
+			return 1;
+		}
+		close(in[1]);
+		saved_in = dup(STDIN_FILENO);
+		dup2(in[0], STDIN_FILENO);
+		close(in[0]);
+	}
+	saved = dup(STDOUT_FILENO);
+	dup2(fd[1], STDOUT_FILENO);
+	close(fd[1]);
+	gettimeofday(&start, NULL);
+	if (agent)
+		ret = vps_agent_exec(h, veid, root, MODE_EXEC, cat_argv, NULL);
+	else
+		ret = vps_exec(h, veid, root, MODE_EXEC, argv, NULL, NULL, 0);
+	/* Let the reader see end of file */
+	dup2(saved, STDOUT_FILENO);
+	close(saved);
+	if (feed > 0) {
+		/* and the writer see the reader gone */
+		dup2(saved_in, STDIN_FILENO);
+		close(saved_in);
+		while (waitpid(feed, &status, 0) < 0)
+			if (errno != EINTR)
+				break;
+		if (!ret && (!WIFEXITED(status) || WEXITSTATUS(status))) {
+			logger(-1, 0, "Stream was not sent in full");
+			ret = 1;
+		}
+	}
+	if (pid > 0) {
+		while (waitpid(pid, &status, 0) < 0)
+			if (errno != EINTR)
+				break;
+		if (!ret && (!WIFEXITED(status) || WEXITSTATUS(status))) {
+			logger(-1, 0, "Stream was not received in full");
+			ret = 1;
+		}
+	}
+	*time = tv_diff(&start);
+	return ret;
+}
+
+static int run_mode(vps_handler *h, envid_t veid, const char *root,
+	unsigned long long size, const char *file, int runs, int splice,
+	int agent)
+{
+	double t, best = 0, sum = 0;
+	double mb = size / (1024.0 * 1024.0);
+	int i;
+
+	relay_use_splice(splice);
+	for (i = 0; i < runs; i++) {
+		if (run_once(h, veid, root, size, file, agent, &t))
+			return 1;
+		sum += t;
+		if (i == 0 || t < best)
+			best = t;
+	}
+	fprintf(out, "%-7s %10.0f MB %8d %10.1f %10.1f\n",
+		agent ? "agent" : splice ? "splice" : "copy", mb, runs,
+		mb / best, mb * runs / sum);
+	fflush(out);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	vps_handler *h;
+	vps_param *param, *vps_p;
+	char path[STR_SIZE];
+	unsigned long size = DEF_SIZE_MB;
+	int runs = DEF_RUNS;
+	char *file = NULL;
+	int c, veid, ret, agent = 0;
+
+	while ((c = getopt(argc, argv, "s:n:o:ah")) > 0) {
+		switch (c) {
+		case 's':
+			if (parse_ul(optarg, &size) || size == 0) {
+				fprintf(stderr, "Invalid size: %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'n':
+			if (parse_int(optarg, &runs) || runs <= 0) {
+				fprintf(stderr, "Invalid runs: %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'o':
+			file = optarg;
+			break;
+		case 'a':
+			agent = 1;
+			break;
+		case 'h':
+			usage(0);
+			break;
+		default:
+			usage(1);
+		}
+	}
+	if (optind == argc)
+		usage(1);
+	if (parse_int(argv[optind], &veid) || veid <= 0) {
+		fprintf(stderr, "Invalid CT ID: %s\n", argv[optind]);
+		exit(1);
+	}
+	init_log(NULL, veid, 1, 0, 0, "vzexecbench");
+	/* Results go to stdout, which is taken by the stream */
+	if ((out = fdopen(dup(STDOUT_FILENO), "w")) == NULL)
+		exit(1);
+	param = init_vps_param();
+	vps_p = init_vps_param();
+	if (vps_parse_config(veid, GLOBAL_CFG, param, NULL))
+		exit(1);
+	get_vps_conf_path(veid, path, sizeof(path));
+	if (stat_file(path) && vps_parse_config(veid, path, vps_p, NULL))
+		exit(1);
+	merge_vps_param(param, vps_p);
+	if ((h = vz_open(veid)) == NULL)
+		exit(VZ_BAD_KERNEL);
+	if (!vps_is_run(h, veid)) {
+		fprintf(stderr, "Container %d is not running\n", veid);
+		exit(VZ_VE_NOT_RUNNING);
+	}
+	signal(SIGPIPE, SIG_IGN);
+	fprintf(out, "%-7s %13s %8s %10s %10s\n",
+		"MODE", "SIZE", "RUNS", "BEST MB/s", "AVG MB/s");
+	ret = run_mode(h, veid, param->res.fs.root, size * 1024 * 1024ULL,
+		file, runs, 1, agent);
+	if (!ret && !agent)
+		ret = run_mode(h, veid, param->res.fs.root,
+			size * 1024 * 1024ULL, file, runs, 0, 0);
+	vz_close(h);
+	free_vps_param(vps_p);
+	free_vps_param(param);
+	if (file != NULL)
+		unlink(file);
+	exit(ret);
+}
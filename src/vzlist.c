@@ -38,6 +38,7 @@
 #include "vzlist.h"
 #include "config.h"
 #include "fs.h"
+#include "status.h"
 #include "res.h"
 #include "logger.h"
 #include "util.h"
@@ -844,6 +845,7 @@ static int read_ves_param()
 		ve_private = strdup(param->res.fs.private_orig);
 	if (param->res.cpt.dumpdir != NULL)
 		dumpdir = strdup(param->res.cpt.dumpdir);
+	ct_status_init(param->opt.lockdir);
 	free_vps_param(param);
 	for (i = 0; i < n_veinfo; i++) {
 		veid = veinfo[i].veid;
@@ -1240,8 +1242,8 @@ static int get_ves_cpustat()
 
 static int get_mounted_status()
 {
-	int i;
-	char buf[512];
+	int i, state;
+	struct ct_status st;
 
 	for (i = 0; i < n_veinfo; i++) {
 		if (veinfo[i].status == VE_RUNNING)
@@ -1252,12 +1254,18 @@ static int get_mounted_status()
 			veinfo[i].hide = 1;
 			continue;
 		}
-		get_dump_file(veinfo[i].veid, dumpdir, buf, sizeof(buf));
-		if (stat_file(buf))
+		/* Avoid /proc/mounts scan per CT if the table is valid */
+		if (ct_status_get(veinfo[i].veid, &st)) {
+			/* Not running, as /proc/vz/veinfo says */
+			state = ct_status_probe(NULL, veinfo[i].veid,
+				veinfo[i].ve_root, dumpdir);
+			ct_status_refresh(&st, state);
+		} else
+			state = ct_status_check(&st, veinfo[i].ve_root,
+				dumpdir);
+		if (state & CT_ST_SUSPENDED)
 			veinfo[i].status = VE_SUSPENDED;
-		if (veinfo[i].ve_root == NULL)
-			continue;
-		if (vps_is_mounted(veinfo[i].ve_root))
+		if (state & CT_ST_MOUNTED)
 			veinfo[i].status = VE_MOUNTED;
 	}
 	return 0;
@@ -0,0 +1,338 @@
+/*
+ *  Copyright (C) 2000-2011, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* vzmigrate channels and transports
+ *
+ * A channel is a byte stream to a "vzmigrate --receiver" process,
+ * carrying messages of a header (type, length) and payload. The
+ * transport starts the receiver and gives its stdin/stdout: over ssh,
+ * or directly on this node (to migrate between two roots, mostly for
+ * testing). Each channel is a receiver process of its own.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+
+#include "vzmigrate.h"
+#include "spawnprog.h"
+#include "logger.h"
+#include "util.h"
+
+extern char **environ;
+
+int mig_write(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = write(fd, p, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			logger(-1, errno, "Migration channel write error");
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int mig_read(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = read(fd, p, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			logger(-1, errno, "Migration channel read error");
+			return -1;
+		}
+		if (n == 0) {
+			logger(-1, 0, "Migration channel closed unexpectedly");
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int mig_send2(struct mig_chan *ch, int type, void *d1, size_t len1,
+	void *d2, size_t len2)
+{
+	struct mig_msg_hdr hdr;
+	struct iovec iov[3];
+	ssize_t n;
+	int i = 0, cnt = 3;
+
+	hdr.type = type;
+	hdr.len = len1 + len2;
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = d1;
+	iov[1].iov_len = len1;
+	iov[2].iov_base = d2;
+	iov[2].iov_len = len2;
+	while (i < cnt) {
+		if ((n = writev(ch->wr, iov + i, cnt - i)) < 0) {
+			if (errno == EINTR)
+				continue;
+			logger(-1, errno, "Migration channel write error");
+			return -1;
+		}
+		/* Skip what was written */
+		while (i < cnt && (size_t) n >= iov[i].iov_len) {
+			n -= iov[i].iov_len;
+			i++;
+		}
+		if (i < cnt) {
+			iov[i].iov_base = (char *) iov[i].iov_base + n;
+			iov[i].iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+int mig_send(struct mig_chan *ch, int type, void *data, size_t len)
+{
+	return mig_send2(ch, type, data, len, NULL, 0);
+}
+
+/* Payload is in ch->buf, valid until the next call */
+int mig_recv(struct mig_chan *ch, int *type, void **data, size_t *len)
+{
+	struct mig_msg_hdr hdr;
+
+	if (mig_read(ch->rd, &hdr, sizeof(hdr)))
+		return -1;
+	if (hdr.len > MIG_MSG_MAX + MIG_BLOCK) {
+		logger(-1, 0, "Migration protocol error: message of %u bytes",
+			hdr.len);
+		return -1;
+	}
+	if (hdr.len + 1 > ch->buf_size) {
+		free(ch->buf);
+		ch->buf_size = hdr.len + 1;
+		if ((ch->buf = malloc(ch->buf_size)) == NULL) {
+			ch->buf_size = 0;
+			logger(-1, ENOMEM, "Can not receive message");
+			return -1;
+		}
+	}
+	if (mig_read(ch->rd, ch->buf, hdr.len))
+		return -1;
+	/* Strings can be used as is */
+	((char *) ch->buf)[hdr.len] = '\0';
+	*type = hdr.type;
+	if (data != NULL)
+		*data = ch->buf;
+	if (len != NULL)
+		*len = hdr.len;
+	return 0;
+}
+
+int mig_expect(struct mig_chan *ch, int type, void **data, size_t *len)
+{
+	int t;
+
+	if (mig_recv(ch, &t, data, len))
+		return -1;
+	if (t != type) {
+		logger(-1, 0, "Migration protocol error: got message %d"
+			" instead of %d", t, type);
+		return -1;
+	}
+	return 0;
+}
+
+int mig_reply(struct mig_chan *ch, int code)
+{
+	int32_t c = code;
+
+	return mig_send(ch, MIG_REPLY, &c, sizeof(c));
+}
+
+/* Returns the code sent by the receiver, MIG_ERR_PROTO on errors */
+int mig_wait_reply(struct mig_chan *ch)
+{
+	void *data;
+	size_t len;
+	int32_t c;
+
+	if (mig_expect(ch, MIG_REPLY, &data, &len))
+		return MIG_ERR_PROTO;
+	if (len != sizeof(c)) {
+		logger(-1, 0, "Migration protocol error: bad reply");
+		return MIG_ERR_PROTO;
+	}
+	memcpy(&c, data, sizeof(c));
+	return c;
+}
+
+/* Start argv with stdin and stdout connected to the channel */
+static int spawn_chan(struct mig_chan *ch, const char *path, char **argv)
+{
+	int in[2], out[2];
+
+	if (pipe2(in, O_CLOEXEC) < 0) {
+		logger(-1, errno, "Unable to create pipe");
+		return -1;
+	}
+	if (pipe2(out, O_CLOEXEC) < 0) {
+		logger(-1, errno, "Unable to create pipe");
+		close(in[0]);
+		close(in[1]);
+		return -1;
+	}
+	ch->pid = spawn_prog(path, argv, environ, in[0], out[1], SPAWN_KEEP);
+	close(in[0]);
+	close(out[1]);
+	if (ch->pid < 0) {
+		close(in[1]);
+		close(out[0]);
+		return -1;
+	}
+	ch->wr = in[1];
+	ch->rd = out[0];
+	return 0;
+}
+
+/* Quote for the remote shell */
+static char *shell_quote(char **argv)
+{
+	char *buf, *p;
+	const char *s;
+	size_t len = 1;
+	int i;
+
+	for (i = 0; argv[i] != NULL; i++)
+		len += strlen(argv[i]) * 4 + 3;
+	if ((buf = malloc(len)) == NULL)
+		return NULL;
+	for (i = 0, p = buf; argv[i] != NULL; i++) {
+		if (i)
+			*p++ = ' ';
+		*p++ = '\'';
+		for (s = argv[i]; *s != '\0'; s++) {
+			if (*s == '\'') {
+				memcpy(p, "'\\''", 4);
+				p += 4;
+			} else {
+				*p++ = *s;
+			}
+		}
+		*p++ = '\'';
+	}
+	*p = '\0';
+	return buf;
+}
+
+static int ssh_open(struct mig_chan *ch, char **rargv, struct mig_dest *dest)
+{
+	char *argv[64];
+	char target[STR_SIZE], path[PATH_LEN];
+	char *opts = NULL, *cmd, *p;
+	int i = 0, ret;
+
+	if (spawn_find("ssh", path, sizeof(path))) {
+		logger(-1, 0, "ssh not found");
+		return -1;
+	}
+	argv[i++] = "ssh";
+	argv[i++] = "-o";
+	argv[i++] = "BatchMode=yes";
+	if (dest->ssh_opts != NULL) {
+		if ((opts = strdup(dest->ssh_opts)) == NULL)
+			return -1;
+		for_each_strtok(p, opts, " \t")
+			if (i < (int) ARRAY_SIZE(argv) - 3)
+				argv[i++] = p;
+	}
+	snprintf(target, sizeof(target), "root@%s", dest->host);
+	argv[i++] = target;
+	if ((cmd = shell_quote(rargv)) == NULL) {
+		free(opts);
+		return -1;
+	}
+	argv[i++] = cmd;
+	argv[i] = NULL;
+	ret = spawn_chan(ch, path, argv);
+	free(cmd);
+	free(opts);
+	return ret;
+}
+
+static int local_open(struct mig_chan *ch, char **rargv, struct mig_dest *dest)
+{
+	return spawn_chan(ch, rargv[0], rargv);
+}
+
+static struct mig_transport transports[] = {
+	{"ssh", ssh_open},
+	{"local", local_open},
+};
+
+struct mig_transport *mig_find_transport(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(transports); i++)
+		if (!strcmp(transports[i].name, name))
+			return &transports[i];
+	return NULL;
+}
+
+int mig_open(struct mig_transport *t, struct mig_chan *ch, char **rargv,
+	struct mig_dest *dest, int role, envid_t veid)
+{
+	struct mig_hello hello;
+
+	memset(ch, 0, sizeof(*ch));
+	ch->rd = ch->wr = -1;
+	if (t->open(ch, rargv, dest))
+		return MIG_ERR_CANT_CONNECT;
+	hello.version = MIG_VERSION;
+	hello.role = role;
+	hello.veid = veid;
+	if (mig_send(ch, MIG_HELLO, &hello, sizeof(hello)))
+		return MIG_ERR_CANT_CONNECT;
+	return mig_wait_reply(ch);
+}
+
+void mig_close(struct mig_chan *ch)
+{
+	if (ch->wr != -1)
+		close(ch->wr);
+	if (ch->rd != -1)
+		close(ch->rd);
+	ch->rd = ch->wr = -1;
+	if (ch->pid > 0)
+		spawn_wait(ch->pid, "migration transport");
+	ch->pid = 0;
+	free(ch->buf);
+	ch->buf = NULL;
+	ch->buf_size = 0;
+}
@@ -0,0 +1,991 @@
+/*
+ *  Copyright (C) 2000-2011, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Receiving side of vzmigrate (vzmigrate --receiver)
+ *
+ * Started by the transport on the destination node, talks to the source
+ * over stdin/stdout. The control channel receiver applies the config and
+ * the tree and brings the CT up, undoing all that if the source aborts
+ * or goes away. Sync channel receivers write file contents, dump
+ * channel receiver saves the checkpoint dump.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "vzmigrate.h"
+#include "config.h"
+#include "spawnprog.h"
+#include "destroy.h"
+#include "status.h"
+#include "logger.h"
+#include "vzerror.h"
+#include "util.h"
+
+extern char **environ;
+
+/* What was done on this node, to undo */
+#define DONE_CONF		0x01
+#define DONE_NAME		0x02
+#define DONE_SCRIPTS		0x04
+#define DONE_DIRS		0x08
+#define DONE_QUOTA_INIT		0x10
+#define DONE_QUOTA_ON		0x20
+#define DONE_UNDUMP		0x40
+
+#define MAX_SCRIPTS		16
+
+struct recv {
+	envid_t veid;
+	struct mig_chan ch;
+	char *opt_private;
+	char *opt_root;
+	char *confdir;
+	vps_param *param;
+	char *private;
+	char *root;
+	char conf[PATH_LEN];
+	char manifest[PATH_LEN];
+	char dumpfile[PATH_LEN];
+	char *scripts[MAX_SCRIPTS];
+	int nscripts;
+	int flags;		/* MIG_F_* */
+	int done;		/* DONE_* */
+	struct mig_tree tree;
+	int *order;		/* tree entries sorted by path */
+	int err;		/* of a streamed message, replied at the end */
+	pid_t quota_pid;
+	int quota_fd;
+};
+
+static int run(char *name, char **argv, int in)
+{
+	char path[PATH_LEN];
+	pid_t pid;
+
+	if (spawn_find(name, path, sizeof(path))) {
+		logger(-1, 0, "%s not found", name);
+		return VZ_SYSTEM_ERROR;
+	}
+	if ((pid = spawn_prog(path, argv, environ, in, SPAWN_KEEP,
+			SPAWN_KEEP)) < 0)
+		return VZ_SYSTEM_ERROR;
+	return spawn_wait(pid, path);
+}
+
+static int run_vzctl(struct recv *r, char *cmd, char *arg1, char *arg2,
+	char *arg3, int in)
+{
+	char veid[16];
+	char *argv[] = {"vzctl", cmd, veid, arg1, arg2, arg3, NULL};
+
+	snprintf(veid, sizeof(veid), "%d", r->veid);
+	return run(SBINDIR "/vzctl", argv, in);
+}
+
+static int run_vzquota(struct recv *r, char *cmd)
+{
+	char veid[16];
+	char *argv[] = {"vzquota", cmd, veid, NULL};
+
+	snprintf(veid, sizeof(veid), "%d", r->veid);
+	return run("vzquota", argv, SPAWN_NULL);
+}
+
+/* Read config the source has sent */
+static int load_conf(struct recv *r)
+{
+	vps_param *p;
+
+	r->param = init_vps_param();
+	p = init_vps_param();
+	vps_parse_config(r->veid, GLOBAL_CFG, r->param, NULL);
+	if (vps_parse_config(r->veid, r->conf, p, NULL)) {
+		logger(-1, 0, "Error in config file %s", r->conf);
+		free_vps_param(p);
+		return MIG_ERR_APPLY_CONFIG;
+	}
+	merge_vps_param(r->param, p);
+	free_vps_param(p);
+	r->private = r->param->res.fs.private;
+	r->root = r->param->res.fs.root;
+	if (r->private == NULL || r->root == NULL) {
+		logger(-1, 0, "VE_PRIVATE or VE_ROOT is not set");
+		return MIG_ERR_APPLY_CONFIG;
+	}
+	snprintf(r->manifest, sizeof(r->manifest), "%s.vzmigrate",
+		r->private);
+	get_dump_file(r->veid, r->param->res.cpt.dumpdir, r->dumpfile,
+		sizeof(r->dumpfile) - 8);
+	strcat(r->dumpfile, ".migrate");
+	return 0;
+}
+
+/* Write config, with VE_PRIVATE and VE_ROOT set as asked */
+static int write_conf(struct recv *r, const char *conf, size_t len)
+{
+	char tmp[PATH_LEN + 16];
+	const char *p, *end = conf + len, *nl;
+	int set_private = r->opt_private != NULL;
+	int set_root = r->opt_root != NULL;
+	FILE *fp;
+
+	snprintf(tmp, sizeof(tmp), "%s.migrating", r->conf);
+	if ((fp = fopen(tmp, "w")) == NULL) {
+		logger(-1, errno, "Can not create %s", tmp);
+		return MIG_ERR_COPY;
+	}
+	for (p = conf; p < end; p = nl) {
+		if ((nl = memchr(p, '\n', end - p)) == NULL)
+			nl = end;
+		else
+			nl++;
+		if (set_private && !strncmp(p, "VE_PRIVATE=", 11)) {
+			fprintf(fp, "VE_PRIVATE=\"%s\"\n", r->opt_private);
+			set_private = 0;
+		} else if (set_root && !strncmp(p, "VE_ROOT=", 8)) {
+			fprintf(fp, "VE_ROOT=\"%s\"\n", r->opt_root);
+			set_root = 0;
+		} else {
+			fwrite(p, 1, nl - p, fp);
+		}
+	}
+	if (set_private)
+		fprintf(fp, "VE_PRIVATE=\"%s\"\n", r->opt_private);
+	if (set_root)
+		fprintf(fp, "VE_ROOT=\"%s\"\n", r->opt_root);
+	if (fclose(fp) || rename(tmp, r->conf)) {
+		logger(-1, errno, "Can not write %s", r->conf);
+		unlink(tmp);
+		return MIG_ERR_COPY;
+	}
+	return 0;
+}
+
+static int check_ips(struct recv *r)
+{
+	ip_param *ip;
+	char buf[STR_SIZE], pat[STR_SIZE];
+	FILE *fp;
+	int ret = 0;
+
+	if (list_empty(&r->param->res.net.ip))
+		return 0;
+	if ((fp = fopen("/proc/vz/veip", "r")) == NULL)
+		return 0;
+	while (!ret && fgets(buf, sizeof(buf), fp) != NULL) {
+		list_for_each(ip, &r->param->res.net.ip, list) {
+			snprintf(pat, sizeof(pat), " %s ", ip->val);
+			if (strstr(buf, pat) != NULL) {
+				logger(-1, 0, "IP address %s already in use"
+					" on destination node", ip->val);
+				ret = MIG_ERR_IP_IN_USE;
+				break;
+			}
+		}
+	}
+	fclose(fp);
+	return ret;
+}
+
+static int do_check(struct recv *r, void *data, size_t len)
+{
+	struct mig_check chk;
+	const char *name;
+	int ret;
+
+	if (len < sizeof(chk))
+		return MIG_ERR_PROTO;
+	memcpy(&chk, data, sizeof(chk));
+	r->flags = chk.flags;
+	if ((r->flags & MIG_F_NEED_VZ) && !stat_file("/proc/vz")) {
+		logger(-1, 0, "OpenVZ is not running on the target machine");
+		return MIG_ERR_OVZ_NOT_RUNNING;
+	}
+	if ((r->flags & MIG_F_ONLINE) && !stat_file("/proc/rst")) {
+		logger(-1, 0, "vzrst module is not loaded on the destination"
+			" node");
+		return MIG_ERR_OVZ_NOT_RUNNING;
+	}
+	/* Config and private area of an interrupted migration
+	 * are reused, the manifest tells what is there already
+	 */
+	if (stat_file(r->conf)) {
+		ret = load_conf(r);
+		if (ret == 0 && stat_file(r->private) &&
+				!stat_file(r->manifest)) {
+			logger(-1, 0, "CT %d already exists on destination"
+				" node", r->veid);
+			return MIG_ERR_EXISTS;
+		}
+		free_vps_param(r->param);
+		r->param = NULL;
+	}
+	if ((ret = write_conf(r, (char *) data + sizeof(chk),
+			len - sizeof(chk))))
+		return ret;
+	r->done |= DONE_CONF;
+	if ((ret = load_conf(r)) || (ret = check_ips(r)))
+		return ret;
+	name = r->param->res.name.name;
+	if (name != NULL && (r->flags & MIG_F_NEED_VZ)) {
+		ret = run_vzctl(r, "set", "--applyconfig_map", "name",
+			"--save", SPAWN_NULL);
+		if (ret != 0 && ret != VZ_INVALID_PARAMETER_SYNTAX &&
+				ret != VZ_INVALID_PARAMETER_VALUE) {
+			logger(-1, 0, "Failed to apply config on destination"
+				" node");
+			return MIG_ERR_APPLY_CONFIG;
+		}
+		r->done |= DONE_NAME;
+	}
+	return 0;
+}
+
+static int do_script(struct recv *r, void *data, size_t len)
+{
+	char path[PATH_LEN];
+	const char *sfx;
+	uint32_t mode;
+	size_t slen;
+	int fd, ret = 0;
+
+	if (len < sizeof(mode) + 2 || r->nscripts == MAX_SCRIPTS)
+		return MIG_ERR_PROTO;
+	memcpy(&mode, data, sizeof(mode));
+	sfx = (char *) data + sizeof(mode);
+	slen = strnlen(sfx, len - sizeof(mode));
+	if (slen == len - sizeof(mode) || strchr(sfx, '/') != NULL)
+		return MIG_ERR_PROTO;
+	snprintf(path, sizeof(path), "%s/%d.%s", r->confdir, r->veid, sfx);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode & 07777);
+	if (fd < 0) {
+		logger(-1, errno, "Failed to copy action script %s", path);
+		return MIG_ERR_COPY;
+	}
+	r->scripts[r->nscripts++] = strdup(path);
+	r->done |= DONE_SCRIPTS;
+	if (mig_write(fd, sfx + slen + 1, len - sizeof(mode) - slen - 1))
+		ret = MIG_ERR_COPY;
+	close(fd);
+	return ret;
+}
+
+static int do_prepare(struct recv *r)
+{
+	if (!stat_file(r->root) && make_dir(r->root, 1)) {
+		logger(-1, errno, "Failed to make container root directory");
+		return MIG_ERR_COPY;
+	}
+	r->done |= DONE_DIRS;
+	if (!stat_file(r->private) && make_dir(r->private, 1)) {
+		logger(-1, errno, "Failed to make container private area"
+			" directory");
+		return MIG_ERR_COPY;
+	}
+	if (!(r->flags & MIG_F_QUOTA))
+		return 0;
+	if (run_vzctl(r, "quotainit", NULL, NULL, NULL, SPAWN_NULL)) {
+		logger(-1, 0, "Failed to initialize quota");
+		return MIG_ERR_QUOTA;
+	}
+	r->done |= DONE_QUOTA_INIT;
+	if (run_vzctl(r, "quotaon", NULL, NULL, NULL, SPAWN_NULL)) {
+		logger(-1, 0, "Failed to turn quota on");
+		return MIG_ERR_QUOTA;
+	}
+	r->done |= DONE_QUOTA_ON;
+	return 0;
+}
+
+/* Tree */
+
+static struct mig_tree *sort_tree;
+
+static int ent_cmp(const void *a, const void *b)
+{
+	return strcmp(sort_tree->ent[*(const int *) a].path,
+		sort_tree->ent[*(const int *) b].path);
+}
+
+static int ent_find(struct recv *r, const char *path)
+{
+	int lo = 0, hi = r->tree.n - 1, mid, c;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		c = strcmp(path, r->tree.ent[r->order[mid]].path);
+		if (c == 0)
+			return r->order[mid];
+		if (c < 0)
+			hi = mid - 1;
+		else
+			lo = mid + 1;
+	}
+	return -1;
+}
+
+/* Remove an entry, a directory with all in it. Not rm -rf by path,
+ * that would follow a symlink on the way.
+ */
+static int remove_ent(int dfd, const char *name, struct stat *st)
+{
+	struct dirent *de;
+	struct stat cst;
+	DIR *dp;
+	int fd, ret = 0;
+
+	if (!S_ISDIR(st->st_mode))
+		return unlinkat(dfd, name, 0);
+	if ((fd = openat(dfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+			O_CLOEXEC)) < 0)
+		return -1;
+	if ((dp = fdopendir(fd)) == NULL) {
+		close(fd);
+		return -1;
+	}
+	while (!ret && (de = readdir(dp)) != NULL) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		if (fstatat(dirfd(dp), de->d_name, &cst,
+				AT_SYMLINK_NOFOLLOW) == 0)
+			ret = remove_ent(dirfd(dp), de->d_name, &cst);
+	}
+	closedir(dp);
+	if (ret)
+		return ret;
+	return unlinkat(dfd, name, AT_REMOVEDIR);
+}
+
+/* Remove what is not on the source, fd is directory path */
+static int prune_dir(struct recv *r, int fd, char *path, size_t plen)
+{
+	struct dirent *de;
+	struct stat st;
+	size_t len;
+	DIR *dp;
+	int cfd, ret = 0;
+
+	if ((dp = fdopendir(fd)) == NULL) {
+		logger(-1, errno, "Can not read directory %s", path);
+		close(fd);
+		return -1;
+	}
+	while (!ret && (de = readdir(dp)) != NULL) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		len = strlen(de->d_name);
+		if (plen + len + 2 > PATH_MAX)
+			continue;
+		if (plen)
+			path[plen] = '/';
+		memcpy(path + plen + (plen ? 1 : 0), de->d_name, len + 1);
+		if (fstatat(dirfd(dp), de->d_name, &st,
+				AT_SYMLINK_NOFOLLOW) == 0) {
+			if (ent_find(r, path) < 0) {
+				logger(2, 0, "Removing %s", path);
+				if ((ret = remove_ent(dirfd(dp), de->d_name,
+						&st)))
+					logger(-1, errno, "Can not remove %s",
+						path);
+			} else if (S_ISDIR(st.st_mode)) {
+				cfd = openat(dirfd(dp), de->d_name, O_RDONLY |
+					O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+				if (cfd < 0) {
+					logger(-1, errno, "Can not read "
+						"directory %s", path);
+					ret = -1;
+				} else {
+					ret = prune_dir(r, cfd, path,
+						plen + len + (plen ? 1 : 0));
+				}
+			}
+		}
+		path[plen] = '\0';
+	}
+	closedir(dp);
+	return ret;
+}
+
+/* Paths are looked up by w, hard link targets by tw */
+static int apply_ent(struct mig_walk *w, struct mig_walk *tw,
+	struct mig_ent *e, uint8_t *todo, int i)
+{
+	struct stat st, tst;
+	char buf[PATH_MAX];
+	const char *name, *tname;
+	ssize_t n;
+	int exists, dfd, tdfd = -1, fd;
+
+	/* A part of the path is not a directory, the tree is broken */
+	if ((dfd = mig_walk(w, e->path, &name)) < 0)
+		goto err;
+	if (e->h.type == MIG_ENT_LINK &&
+			(tdfd = mig_walk(tw, e->target, &tname)) < 0)
+		goto err;
+	exists = fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0;
+	switch (e->h.type) {
+	case MIG_ENT_DIR:
+		if (exists && S_ISDIR(st.st_mode))
+			return 0;
+		break;
+	case MIG_ENT_FILE:
+		/* Linked to a path it should not be linked to */
+		if (exists && S_ISREG(st.st_mode) &&
+				st.st_nlink <= (nlink_t) e->h.nlink)
+		{
+			if ((uint64_t) st.st_size != e->h.size) {
+				fd = openat(dfd, name,
+					O_WRONLY | O_NOFOLLOW | O_CLOEXEC);
+				if (fd < 0 || ftruncate(fd, e->h.size))
+					goto err;
+				close(fd);
+			} else if (st.st_mtim.tv_sec == e->h.mtime &&
+				(uint32_t) st.st_mtim.tv_nsec == e->h.mtime_ns)
+			{
+				return 0;
+			}
+			todo[i / 8] |= 1 << (i % 8);
+			return 0;
+		}
+		break;
+	case MIG_ENT_LINK:
+		if (exists && fstatat(tdfd, tname, &tst,
+				AT_SYMLINK_NOFOLLOW) == 0 &&
+				st.st_ino == tst.st_ino && st.st_dev == tst.st_dev)
+			return 0;
+		break;
+	case MIG_ENT_SYMLINK:
+		if (exists && S_ISLNK(st.st_mode) &&
+			(n = readlinkat(dfd, name, buf, sizeof(buf) - 1)) >= 0)
+		{
+			buf[n] = '\0';
+			if (!strcmp(buf, e->target))
+				return 0;
+		}
+		break;
+	case MIG_ENT_SPECIAL:
+		if (exists && (st.st_mode & S_IFMT) == (e->h.mode & S_IFMT) &&
+				st.st_rdev == e->h.rdev)
+			return 0;
+		break;
+	default:
+		logger(-1, 0, "Migration protocol error: bad entry type %d",
+			e->h.type);
+		return MIG_ERR_PROTO;
+	}
+	if (exists) {
+		if (remove_ent(dfd, name, &st))
+			goto err;
+		/* Directories kept open could be gone with it */
+		if (S_ISDIR(st.st_mode)) {
+			mig_walk_done(tw);
+			if (e->h.type == MIG_ENT_LINK &&
+				(tdfd = mig_walk(tw, e->target, &tname)) < 0)
+				goto err;
+		}
+	}
+	switch (e->h.type) {
+	case MIG_ENT_DIR:
+		if (mkdirat(dfd, name, 0700))
+			goto err;
+		break;
+	case MIG_ENT_FILE:
+		fd = openat(dfd, name, O_WRONLY | O_CREAT | O_EXCL |
+			O_NOFOLLOW | O_CLOEXEC, 0600);
+		if (fd < 0 || ftruncate(fd, e->h.size))
+			goto err;
+		close(fd);
+		todo[i / 8] |= 1 << (i % 8);
+		break;
+	case MIG_ENT_LINK:
+		if (linkat(tdfd, tname, dfd, name, 0))
+			goto err;
+		break;
+	case MIG_ENT_SYMLINK:
+		if (symlinkat(e->target, dfd, name))
+			goto err;
+		break;
+	case MIG_ENT_SPECIAL:
+		if (mknodat(dfd, name, e->h.mode & (S_IFMT | 0700),
+				e->h.rdev))
+			goto err;
+		break;
+	}
+	return 0;
+err:
+	logger(-1, errno, "Can not create %s", e->path);
+	return MIG_ERR_COPY;
+}
+
+/* Remove paths gone on the source since the last pass */
+static int do_delete(struct recv *r, void *data, size_t len)
+{
+	char *path, *end = (char *) data + len;
+	const char *name;
+	struct mig_walk w;
+	struct stat st;
+	int dfd, fd, ret = 0;
+
+	if (len == 0 || end[-1] != '\0')
+		return MIG_ERR_PROTO;
+	if ((fd = open(r->private, O_RDONLY | O_DIRECTORY)) < 0) {
+		logger(-1, errno, "Can not open %s", r->private);
+		return MIG_ERR_COPY;
+	}
+	mig_walk_init(&w, fd);
+	for (path = data; !ret && path < end; path += strlen(path) + 1) {
+		if (mig_bad_path(path)) {
+			logger(-1, 0, "Migration protocol error: bad path");
+			ret = MIG_ERR_PROTO;
+		} else if ((dfd = mig_walk(&w, path, &name)) < 0 ||
+				fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW))
+		{
+			/* Gone with its directory, or never synced */
+			if (errno != ENOENT && errno != ENOTDIR) {
+				logger(-1, errno, "Can not stat %s", path);
+				ret = MIG_ERR_COPY;
+			}
+		} else {
+			logger(2, 0, "Removing %s", path);
+			if (remove_ent(dfd, name, &st)) {
+				logger(-1, errno, "Can not remove %s", path);
+				ret = MIG_ERR_COPY;
+			}
+			if (S_ISDIR(st.st_mode))
+				mig_walk_done(&w);
+		}
+	}
+	mig_walk_done(&w);
+	close(fd);
+	return ret;
+}
+
+/* Make the tree as on the source, reply with files to sync */
+static int do_tree(struct recv *r, void *data, size_t len)
+{
+	char path[PATH_MAX];
+	struct mig_walk w, tw;
+	uint32_t flags = 0;
+	uint8_t *todo;
+	int i, j, dfd, fd, ret = MIG_ERR_COPY;
+
+	if (len == sizeof(flags))
+		memcpy(&flags, data, sizeof(flags));
+	free(r->order);
+	r->order = malloc(r->tree.n * sizeof(int) + 1);
+	todo = calloc(r->tree.n / 8 + 1, 1);
+	if (r->order == NULL || todo == NULL) {
+		logger(-1, ENOMEM, "Can not apply tree");
+		goto out;
+	}
+	for (i = 0; i < r->tree.n; i++)
+		r->order[i] = i;
+	sort_tree = &r->tree;
+	qsort(r->order, r->tree.n, sizeof(int), ent_cmp);
+	/* Link targets go first, so they are there to link to */
+	for (i = 0; i < r->tree.n; i++) {
+		if (r->tree.ent[i].h.type != MIG_ENT_LINK)
+			continue;
+		if ((j = ent_find(r, r->tree.ent[i].target)) < 0 || j >= i ||
+				r->tree.ent[j].h.type != MIG_ENT_FILE) {
+			logger(-1, 0, "Migration protocol error: bad link %s",
+				r->tree.ent[i].path);
+			ret = MIG_ERR_PROTO;
+			goto out;
+		}
+	}
+	if ((dfd = open(r->private, O_RDONLY | O_DIRECTORY)) < 0) {
+		logger(-1, errno, "Can not open %s", r->private);
+		goto out;
+	}
+	path[0] = '\0';
+	ret = 0;
+	/* A delta has changed entries only, removed ones come by MIG_DELETE */
+	if (!(flags & MIG_TREE_DELTA)) {
+		if ((fd = openat(dfd, ".", O_RDONLY | O_DIRECTORY |
+				O_CLOEXEC)) < 0 || prune_dir(r, fd, path, 0))
+			ret = MIG_ERR_COPY;
+	}
+	mig_walk_init(&w, dfd);
+	mig_walk_init(&tw, dfd);
+	for (i = 0; !ret && i < r->tree.n; i++)
+		ret = apply_ent(&w, &tw, &r->tree.ent[i], todo, i);
+	mig_walk_done(&w);
+	mig_walk_done(&tw);
+	close(dfd);
+out:
+	if (ret == 0)
+		ret = mig_send(&r->ch, MIG_TODO, todo, r->tree.n / 8 + 1) ?
+			MIG_ERR_PROTO : 0;
+	free(todo);
+	return ret;
+}
+
+static int do_attrs(struct recv *r)
+{
+	struct timespec ts[2];
+	struct mig_ent *e;
+	struct mig_walk w;
+	const char *name;
+	int i, fd, dfd, ret = 0;
+
+	if ((fd = open(r->private, O_RDONLY | O_DIRECTORY)) < 0) {
+		logger(-1, errno, "Can not open %s", r->private);
+		return MIG_ERR_COPY;
+	}
+	mig_walk_init(&w, fd);
+	/* Children first, not to change the time of their directory */
+	for (i = r->tree.n - 1; i >= 0; i--) {
+		e = &r->tree.ent[i];
+		if (e->h.type == MIG_ENT_LINK)
+			continue;
+		if ((dfd = mig_walk(&w, e->path, &name)) < 0)
+			goto err;
+		if (fchownat(dfd, name, e->h.uid, e->h.gid,
+				AT_SYMLINK_NOFOLLOW))
+			goto err;
+		if (e->h.type != MIG_ENT_SYMLINK &&
+				fchmodat(dfd, name, e->h.mode & 07777, 0))
+			goto err;
+		ts[0].tv_sec = 0;
+		ts[0].tv_nsec = UTIME_OMIT;
+		ts[1].tv_sec = e->h.mtime;
+		ts[1].tv_nsec = e->h.mtime_ns;
+		if (utimensat(dfd, name, ts, AT_SYMLINK_NOFOLLOW))
+			goto err;
+	}
+	mig_walk_done(&w);
+	close(fd);
+	return ret;
+err:
+	logger(-1, errno, "Can not set attributes of %s", e->path);
+	mig_walk_done(&w);
+	close(fd);
+	return MIG_ERR_COPY;
+}
+
+static int do_quota(struct recv *r, void *data, size_t len)
+{
+	char veid[16];
+	char *argv[] = {"vzdqload", veid, "-U", "-G", "-T", NULL};
+	char path[PATH_LEN];
+	int fds[2], ret;
+
+	if (r->quota_pid == 0) {
+		snprintf(veid, sizeof(veid), "%d", r->veid);
+		if (spawn_find("vzdqload", path, sizeof(path))) {
+			logger(-1, 0, "vzdqload not found");
+			return MIG_ERR_QUOTA;
+		}
+		if (pipe2(fds, O_CLOEXEC)) {
+			logger(-1, errno, "Unable to create pipe");
+			return MIG_ERR_QUOTA;
+		}
+		r->quota_pid = spawn_prog(path, argv, environ, fds[0],
+			SPAWN_KEEP, SPAWN_KEEP);
+		close(fds[0]);
+		r->quota_fd = fds[1];
+		if (r->quota_pid < 0) {
+			r->quota_pid = 0;
+			close(fds[1]);
+			return MIG_ERR_QUOTA;
+		}
+	}
+	if (data == NULL) {
+		close(r->quota_fd);
+		ret = spawn_wait(r->quota_pid, "vzdqload");
+		r->quota_pid = 0;
+		if (ret != 0 || run_vzquota(r, "reload2")) {
+			logger(-1, 0, "Failed to load 2nd level quota");
+			return MIG_ERR_QUOTA;
+		}
+		return 0;
+	}
+	return mig_write(r->quota_fd, data, len) ? MIG_ERR_QUOTA : 0;
+}
+
+static int do_restore(struct recv *r)
+{
+	int fd, ret;
+
+	if ((fd = open(r->dumpfile, O_RDONLY | O_CLOEXEC)) < 0) {
+		logger(-1, errno, "Can not open %s", r->dumpfile);
+		return MIG_ERR_RESTORE_VPS;
+	}
+	ret = run_vzctl(r, "restore", "--undump", "--from-fd=0",
+		"--skip_arpdetect", fd);
+	close(fd);
+	unlink(r->dumpfile);
+	if (ret) {
+		logger(-1, 0, "Failed to undump container");
+		return MIG_ERR_RESTORE_VPS;
+	}
+	r->done |= DONE_UNDUMP;
+	if (run_vzctl(r, "restore", "--resume", NULL, NULL, SPAWN_NULL)) {
+		logger(-1, 0, "Failed to resume container");
+		return MIG_ERR_RESTORE_VPS;
+	}
+	return 0;
+}
+
+static int do_start(struct recv *r, void *data, size_t len)
+{
+	int32_t state;
+
+	if (len != sizeof(state))
+		return MIG_ERR_PROTO;
+	memcpy(&state, data, sizeof(state));
+	if (state & CT_ST_RUNNING) {
+		if (run_vzctl(r, "start", NULL, NULL, NULL, SPAWN_NULL)) {
+			logger(-1, 0, "Failed to start container");
+			return MIG_ERR_START_VPS;
+		}
+	} else if (state & CT_ST_MOUNTED) {
+		if (run_vzctl(r, "mount", NULL, NULL, NULL, SPAWN_NULL)) {
+			logger(-1, 0, "Failed to mount container");
+			return MIG_ERR_MOUNT_VPS;
+		}
+	} else if (r->flags & MIG_F_QUOTA) {
+		if (run_vzquota(r, "off")) {
+			logger(-1, 0, "Failed to turn quota off");
+			return MIG_ERR_QUOTA;
+		}
+	}
+	return 0;
+}
+
+static void undo(struct recv *r)
+{
+	int i;
+
+	logger(0, 0, "Cleaning up the destination");
+	if (r->quota_pid > 0) {
+		close(r->quota_fd);
+		spawn_wait(r->quota_pid, "vzdqload");
+	}
+	if (r->done & DONE_UNDUMP)
+		run_vzctl(r, "restore", "--kill", NULL, NULL, SPAWN_NULL);
+	if (r->dumpfile[0] != '\0')
+		unlink(r->dumpfile);
+	if (r->done & DONE_QUOTA_ON)
+		run_vzquota(r, "off");
+	if ((r->done & DONE_QUOTA_INIT) && !(r->flags & MIG_F_KEEP_DST))
+		run_vzquota(r, "drop");
+	if (r->done & DONE_DIRS) {
+		rmdir(r->root);
+		if (!(r->flags & MIG_F_KEEP_DST)) {
+			del_dir(r->private);
+			unlink(r->manifest);
+		}
+	}
+	for (i = 0; i < r->nscripts; i++)
+		unlink(r->scripts[i]);
+	if (r->done & DONE_NAME)
+		run_vzctl(r, "set", "--name", "", "--save", SPAWN_NULL);
+	if (r->done & DONE_CONF)
+		unlink(r->conf);
+}
+
+static int recv_ctl(struct recv *r)
+{
+	void *data;
+	size_t len;
+	int type, ret;
+
+	for (;;) {
+		if (mig_recv(&r->ch, &type, &data, &len)) {
+			undo(r);
+			return MIG_ERR_PROTO;
+		}
+		ret = 0;
+		switch (type) {
+		case MIG_CHECK:
+			ret = do_check(r, data, len);
+			break;
+		case MIG_SCRIPT:
+			ret = do_script(r, data, len);
+			break;
+		case MIG_PREPARE:
+			ret = do_prepare(r);
+			break;
+		/* Streamed: the first error is replied at the end */
+		case MIG_DELETE:
+			if (!r->err)
+				r->err = do_delete(r, data, len);
+			continue;
+		case MIG_TREE:
+			if (!r->err && mig_unpack_tree(data, len, &r->tree))
+				r->err = MIG_ERR_PROTO;
+			continue;
+		case MIG_TREE_END:
+			if ((ret = r->err) == 0)
+				ret = do_tree(r, data, len);
+			r->err = 0;
+			/* MIG_TODO is the reply */
+			if (ret == 0)
+				continue;
+			mig_free_tree(&r->tree);
+			break;
+		case MIG_ATTRS:
+			ret = do_attrs(r);
+			break;
+		case MIG_QUOTA:
+			if (!r->err)
+				r->err = do_quota(r, data, len);
+			continue;
+		case MIG_QUOTA_END:
+			if ((ret = r->err) == 0)
+				ret = do_quota(r, NULL, 0);
+			r->err = 0;
+			break;
+		case MIG_RESTORE:
+			ret = do_restore(r);
+			break;
+		case MIG_START:
+			ret = do_start(r, data, len);
+			break;
+		case MIG_DONE:
+			unlink(r->manifest);
+			mig_reply(&r->ch, 0);
+			return 0;
+		case MIG_ABORT:
+			undo(r);
+			mig_reply(&r->ch, 0);
+			return 0;
+		default:
+			logger(-1, 0, "Migration protocol error: unexpected"
+				" message %d", type);
+			ret = MIG_ERR_PROTO;
+			break;
+		}
+		if (mig_reply(&r->ch, ret)) {
+			undo(r);
+			return MIG_ERR_PROTO;
+		}
+		/* Drop the tree sent before pass 2 */
+		if (type == MIG_ATTRS)
+			mig_free_tree(&r->tree);
+	}
+}
+
+/* Save the dump as it comes, it is checked on undump */
+static int recv_dump(struct recv *r)
+{
+	char buf[MIG_BLOCK];
+	ssize_t n;
+	int fd, ret = 0;
+
+	fd = open(r->dumpfile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		logger(-1, errno, "Can not create %s", r->dumpfile);
+		return mig_reply(&r->ch, MIG_ERR_COPY);
+	}
+	while ((n = read(r->ch.rd, buf, sizeof(buf))) != 0) {
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			logger(-1, errno, "Failed to receive dump");
+			ret = MIG_ERR_COPY;
+			break;
+		}
+		if (!ret && mig_write(fd, buf, n))
+			ret = MIG_ERR_COPY;
+	}
+	if (fsync(fd) || close(fd))
+		ret = MIG_ERR_COPY;
+	if (ret)
+		unlink(r->dumpfile);
+	return mig_reply(&r->ch, ret);
+}
+
+int mig_receiver(char *private, char *root, char *confdir)
+{
+	struct mig_hello hello;
+	struct recv r;
+	void *data;
+	size_t len;
+	int fd, ret = 0;
+
+	memset(&r, 0, sizeof(r));
+	r.opt_private = private;
+	r.opt_root = root;
+	r.confdir = confdir != NULL ? confdir : VZ_DIR "conf";
+	/* stdout is the channel, messages go to stderr */
+	r.ch.rd = dup(STDIN_FILENO);
+	r.ch.wr = dup(STDOUT_FILENO);
+	if (r.ch.rd < 0 || r.ch.wr < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+		return MIG_ERR_CANT_CONNECT;
+	if ((fd = open("/dev/null", O_RDONLY)) >= 0) {
+		dup2(fd, STDIN_FILENO);
+		close(fd);
+	}
+	fcntl(r.ch.rd, F_SETFD, FD_CLOEXEC);
+	fcntl(r.ch.wr, F_SETFD, FD_CLOEXEC);
+
+	if (mig_expect(&r.ch, MIG_HELLO, &data, &len))
+		return MIG_ERR_PROTO;
+	if (len != sizeof(hello)) {
+		mig_reply(&r.ch, MIG_ERR_PROTO);
+		return MIG_ERR_PROTO;
+	}
+	memcpy(&hello, data, sizeof(hello));
+	if (hello.version != MIG_VERSION) {
+		logger(-1, 0, "Migration protocol version %d is not supported",
+			hello.version);
+		mig_reply(&r.ch, MIG_ERR_PROTO);
+		return MIG_ERR_PROTO;
+	}
+	r.veid = hello.veid;
+	snprintf(r.conf, sizeof(r.conf), "%s/%d.conf", r.confdir, r.veid);
+	/* Other channels are opened after the config is in place */
+	if (hello.role != MIG_CH_CTL)
+		ret = load_conf(&r);
+	if (mig_reply(&r.ch, ret) || ret)
+		return ret ? : MIG_ERR_PROTO;
+
+	switch (hello.role) {
+	case MIG_CH_CTL:
+		ret = recv_ctl(&r);
+		break;
+	case MIG_CH_SYNC:
+		ret = mig_sync_recv(&r.ch, r.private, r.manifest) ?
+			MIG_ERR_COPY : 0;
+		break;
+	case MIG_CH_DUMP:
+		ret = recv_dump(&r) ? MIG_ERR_PROTO : 0;
+		break;
+	default:
+		ret = MIG_ERR_PROTO;
+	}
+	mig_free_tree(&r.tree);
+	free(r.order);
+	while (r.nscripts > 0)
+		free(r.scripts[--r.nscripts]);
+	if (r.param != NULL)
+		free_vps_param(r.param);
+	mig_close(&r.ch);
+	return ret;
+}
@@ -0,0 +1,1037 @@
+/*
+ *  Copyright (C) 2000-2011, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Private area transfer for vzmigrate
+ *
+ * The tree (directories, links, file sizes and attributes) goes over the
+ * control channel. File contents are moved by sync channels, in units
+ * (ranges of up to MIG_UNIT bytes of a file), which are spread over the
+ * channels. A unit is synced in batches of three steps, so that the two
+ * sides never write at the same time:
+ *  - the sender asks for the units of a batch;
+ *  - the receiver hashes its copy of each unit by MIG_BLOCK blocks and
+ *    sends the hashes, or none if the unit is in its manifest already;
+ *  - the sender sends the blocks which differ.
+ * The receiver syncs the file system and records the units in the
+ * manifest after each batch, so an interrupted migration can resume
+ * without going over those units again.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "vzmigrate.h"
+#include "logger.h"
+#include "util.h"
+
+/* Units in one batch, and data to hash at once */
+#define BATCH_UNITS		4096
+#define BATCH_BYTES		(256ULL * 1024 * 1024)
+#define IO_BUF			(16 * MIG_BLOCK)
+
+/* MurmurHash3 x64 128-bit */
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+void mig_hash_block(const void *buf, size_t len, struct mig_hash *h)
+{
+	const uint8_t *data = buf;
+	const uint64_t c1 = 0x87c37b91114253d5ULL;
+	const uint64_t c2 = 0x4cf5ad432745937fULL;
+	uint64_t h1 = 0, h2 = 0, k1, k2;
+	size_t i, nblocks = len / 16;
+
+	for (i = 0; i < nblocks; i++) {
+		memcpy(&k1, data + i * 16, 8);
+		memcpy(&k2, data + i * 16 + 8, 8);
+		k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+		h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+		k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+		h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+	}
+	/* Tail is zero padded, both sides do the same */
+	if (len & 15) {
+		uint8_t tail[16] = { 0 };
+
+		memcpy(tail, data + nblocks * 16, len & 15);
+		memcpy(&k1, tail, 8);
+		memcpy(&k2, tail + 8, 8);
+		k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+		k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+	}
+	h1 ^= len;
+	h2 ^= len;
+	h1 += h2;
+	h2 += h1;
+	h1 = fmix64(h1);
+	h2 = fmix64(h2);
+	h1 += h2;
+	h2 += h1;
+	h->h1 = h1;
+	h->h2 = h2;
+}
+
+/* Tree */
+
+static int tree_add(struct mig_tree *tree, struct stat *st, int type,
+	const char *path, const char *target)
+{
+	struct mig_ent *e;
+
+	if (tree->n == tree->size) {
+		int size = tree->size ? tree->size * 2 : 1024;
+
+		e = realloc(tree->ent, size * sizeof(*e));
+		if (e == NULL)
+			goto err;
+		tree->ent = e;
+		tree->size = size;
+	}
+	e = &tree->ent[tree->n];
+	memset(e, 0, sizeof(*e));
+	e->h.type = type;
+	if (st != NULL) {
+		e->h.mode = st->st_mode;
+		e->h.uid = st->st_uid;
+		e->h.gid = st->st_gid;
+		e->h.size = S_ISREG(st->st_mode) ? st->st_size : 0;
+		e->h.mtime = st->st_mtim.tv_sec;
+		e->h.mtime_ns = st->st_mtim.tv_nsec;
+		e->h.rdev = st->st_rdev;
+		e->h.nlink = st->st_nlink;
+	}
+	if ((e->path = strdup(path)) == NULL)
+		goto err;
+	if (target != NULL && (e->target = strdup(target)) == NULL) {
+		free(e->path);
+		goto err;
+	}
+	e->h.path_len = strlen(path);
+	e->h.target_len = target != NULL ? strlen(target) : 0;
+	tree->n++;
+	return 0;
+err:
+	logger(-1, ENOMEM, "Can not scan private area");
+	return -1;
+}
+
+static struct mig_inode *inode_find(struct mig_inodes *m, struct stat *st)
+{
+	struct mig_inode *tab;
+	unsigned int i, size;
+
+	if (m->n * 2 >= m->size) {
+		size = m->size ? m->size * 2 : 256;
+		if ((tab = calloc(size, sizeof(*tab))) == NULL)
+			return NULL;
+		for (i = 0; i < m->size; i++) {
+			struct mig_inode *o = &m->tab[i];
+			unsigned int j;
+
+			if (o->path == NULL)
+				continue;
+			for (j = o->ino % size; tab[j].path; j = (j + 1) % size)
+				;
+			tab[j] = *o;
+		}
+		free(m->tab);
+		m->tab = tab;
+		m->size = size;
+	}
+	for (i = st->st_ino % m->size; m->tab[i].path; i = (i + 1) % m->size)
+		if (m->tab[i].ino == st->st_ino && m->tab[i].dev == st->st_dev)
+			break;
+	return &m->tab[i];
+}
+
+void mig_free_inodes(struct mig_inodes *m)
+{
+	unsigned int i;
+
+	for (i = 0; i < m->size; i++)
+		free(m->tab[i].path);
+	free(m->tab);
+	memset(m, 0, sizeof(*m));
+}
+
+/* Add entry name in dfd, which is path. If lw is not NULL, a hard link
+ * is only made to a first path seen which is still the same file.
+ */
+int mig_add_ent(struct mig_tree *tree, struct mig_inodes *inodes, int dfd,
+	const char *name, const char *path, struct stat *st,
+	struct mig_walk *lw)
+{
+	struct mig_inode *ie;
+	struct stat lst;
+	const char *lname;
+	int ldfd;
+	char target[PATH_MAX];
+	ssize_t n;
+
+	if (S_ISDIR(st->st_mode))
+		return tree_add(tree, st, MIG_ENT_DIR, path, NULL);
+	if (S_ISLNK(st->st_mode)) {
+		n = readlinkat(dfd, name, target, sizeof(target) - 1);
+		/* Running CT could remove it */
+		if (n < 0)
+			return 0;
+		target[n] = '\0';
+		return tree_add(tree, st, MIG_ENT_SYMLINK, path, target);
+	}
+	if (!S_ISREG(st->st_mode))
+		return tree_add(tree, st, MIG_ENT_SPECIAL, path, NULL);
+	if (st->st_nlink == 1)
+		return tree_add(tree, st, MIG_ENT_FILE, path, NULL);
+
+	/* Hard link to the first path seen, which must be still there */
+	if ((ie = inode_find(inodes, st)) == NULL) {
+		logger(-1, ENOMEM, "Can not scan private area");
+		return -1;
+	}
+	if (ie->path != NULL && strcmp(ie->path, path) &&
+		(lw == NULL || ((ldfd = mig_walk(lw, ie->path, &lname)) >= 0 &&
+			!fstatat(ldfd, lname, &lst, AT_SYMLINK_NOFOLLOW) &&
+			lst.st_ino == st->st_ino && lst.st_dev == st->st_dev)))
+	{
+		return tree_add(tree, st, MIG_ENT_LINK, path, ie->path);
+	}
+	if (ie->path == NULL) {
+		ie->dev = st->st_dev;
+		ie->ino = st->st_ino;
+		inodes->n++;
+	} else if (strcmp(ie->path, path)) {
+		free(ie->path);
+		ie->path = NULL;
+	}
+	if (ie->path == NULL && (ie->path = strdup(path)) == NULL) {
+		logger(-1, ENOMEM, "Can not scan private area");
+		return -1;
+	}
+	return tree_add(tree, st, MIG_ENT_FILE, path, NULL);
+}
+
+static int scan_dir(int dfd, char *path, size_t plen, struct mig_tree *tree,
+	struct mig_inodes *inodes, struct mig_track *track)
+{
+	struct dirent *de;
+	struct stat st;
+	size_t len;
+	DIR *dp;
+	int fd, ret = 0;
+
+	/* Changes from now on are seen by the tracker */
+	if (track != NULL) {
+		mig_track_dir(track, path);
+		mig_track_poll(track);
+	}
+	if ((dp = fdopendir(dfd)) == NULL) {
+		logger(-1, errno, "Can not read directory %s", path);
+		close(dfd);
+		return -1;
+	}
+	while (!ret && (de = readdir(dp)) != NULL) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		len = strlen(de->d_name);
+		if (plen + len + 2 > PATH_MAX) {
+			logger(-1, ENAMETOOLONG, "Can not scan %s", path);
+			ret = -1;
+			break;
+		}
+		if (plen)
+			path[plen] = '/';
+		memcpy(path + plen + (plen ? 1 : 0), de->d_name, len + 1);
+		if (fstatat(dirfd(dp), de->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+			/* Running CT could remove it */
+			if (errno != ENOENT) {
+				logger(-1, errno, "Can not stat %s", path);
+				ret = -1;
+			}
+		} else {
+			ret = mig_add_ent(tree, inodes, dirfd(dp), de->d_name,
+				path, &st, NULL);
+			fd = -1;
+			if (!ret && S_ISDIR(st.st_mode))
+				fd = openat(dirfd(dp), de->d_name,
+					O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+			if (fd >= 0)
+				ret = scan_dir(fd, path,
+					plen + len + (plen ? 1 : 0),
+					tree, inodes, track);
+		}
+		path[plen] = '\0';
+	}
+	closedir(dp);
+	return ret;
+}
+
+int mig_scan_tree(const char *dir, struct mig_tree *tree,
+	struct mig_inodes *inodes, struct mig_track *track)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	memset(tree, 0, sizeof(*tree));
+	mig_free_inodes(inodes);
+	if (track != NULL)
+		mig_track_reset(track);
+	if ((fd = open(dir, O_RDONLY | O_DIRECTORY)) < 0) {
+		logger(-1, errno, "Can not open %s", dir);
+		return -1;
+	}
+	path[0] = '\0';
+	return scan_dir(fd, path, 0, tree, inodes, track);
+}
+
+void mig_free_tree(struct mig_tree *tree)
+{
+	int i;
+
+	for (i = 0; i < tree->n; i++) {
+		free(tree->ent[i].path);
+		free(tree->ent[i].target);
+	}
+	free(tree->ent);
+	memset(tree, 0, sizeof(*tree));
+}
+
+/* flags are MIG_TREE_*, for MIG_TREE_END */
+int mig_pack_tree(struct mig_chan *ch, struct mig_tree *tree, uint32_t flags)
+{
+	struct mig_ent *e;
+	char *buf, *p;
+	int i, ret = -1;
+
+	if ((buf = malloc(MIG_MSG_MAX)) == NULL) {
+		logger(-1, ENOMEM, "Can not send tree");
+		return -1;
+	}
+	p = buf;
+	for (i = 0; i < tree->n; i++) {
+		e = &tree->ent[i];
+		if ((size_t) (p - buf) + sizeof(e->h) + e->h.path_len +
+			e->h.target_len > MIG_MSG_MAX)
+		{
+			if (mig_send(ch, MIG_TREE, buf, p - buf))
+				goto out;
+			p = buf;
+		}
+		memcpy(p, &e->h, sizeof(e->h));
+		p += sizeof(e->h);
+		memcpy(p, e->path, e->h.path_len);
+		p += e->h.path_len;
+		if (e->h.target_len) {
+			memcpy(p, e->target, e->h.target_len);
+			p += e->h.target_len;
+		}
+	}
+	if (p > buf && mig_send(ch, MIG_TREE, buf, p - buf))
+		goto out;
+	ret = mig_send(ch, MIG_TREE_END, &flags, sizeof(flags));
+out:
+	free(buf);
+	return ret;
+}
+
+/* Paths gone since the last pass, '\0' separated */
+int mig_pack_delete(struct mig_chan *ch, char **paths, int n)
+{
+	char *buf, *p;
+	size_t len;
+	int i, ret = -1;
+
+	if ((buf = malloc(MIG_MSG_MAX)) == NULL) {
+		logger(-1, ENOMEM, "Can not send tree");
+		return -1;
+	}
+	p = buf;
+	for (i = 0; i < n; i++) {
+		len = strlen(paths[i]) + 1;
+		if ((size_t) (p - buf) + len > MIG_MSG_MAX) {
+			if (mig_send(ch, MIG_DELETE, buf, p - buf))
+				goto out;
+			p = buf;
+		}
+		memcpy(p, paths[i], len);
+		p += len;
+	}
+	ret = 0;
+	if (p > buf)
+		ret = mig_send(ch, MIG_DELETE, buf, p - buf);
+out:
+	free(buf);
+	return ret;
+}
+
+/* Paths must stay inside the private area */
+int mig_bad_path(const char *path)
+{
+	const char *p;
+
+	if (*path == '/' || *path == '\0')
+		return 1;
+	for (p = path; p != NULL; p = strchr(p, '/')) {
+		if (*p == '/')
+			p++;
+		if (!strncmp(p, "..", 2) && (p[2] == '/' || p[2] == '\0'))
+			return 1;
+	}
+	return 0;
+}
+
+void mig_walk_init(struct mig_walk *w, int root)
+{
+	w->root = root;
+	w->fd = -1;
+	w->dir[0] = '\0';
+}
+
+void mig_walk_done(struct mig_walk *w)
+{
+	if (w->fd >= 0)
+		close(w->fd);
+	w->fd = -1;
+}
+
+/* Find the directory path is in. Returns its descriptor, owned by w,
+ * and the last part of path in name; or -1 with errno set to ENOTDIR
+ * if a part before the last one is not a real directory.
+ */
+int mig_walk(struct mig_walk *w, const char *path, const char **name)
+{
+	char part[NAME_MAX + 1];
+	const char *p, *s, *last;
+	size_t len;
+	int fd, nfd;
+
+	if ((last = strrchr(path, '/')) == NULL) {
+		*name = path;
+		return w->root;
+	}
+	*name = last + 1;
+	len = last - path;
+	if (w->fd >= 0 && strlen(w->dir) == len && !memcmp(w->dir, path, len))
+		return w->fd;
+	mig_walk_done(w);
+	if (len >= sizeof(w->dir)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	for (fd = w->root, p = path; p <= last; p = s + 1) {
+		s = strchr(p, '/');
+		if ((len = s - p) == 0)
+			continue;
+		if (len > NAME_MAX) {
+			errno = ENAMETOOLONG;
+			goto err;
+		}
+		memcpy(part, p, len);
+		part[len] = '\0';
+		nfd = openat(fd, part, O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+			O_CLOEXEC);
+		if (nfd < 0) {
+			/* A symlink */
+			if (errno == ELOOP)
+				errno = ENOTDIR;
+			goto err;
+		}
+		if (fd != w->root)
+			close(fd);
+		fd = nfd;
+	}
+	w->fd = fd;
+	memcpy(w->dir, path, last - path);
+	w->dir[last - path] = '\0';
+	return fd;
+err:
+	if (fd != w->root) {
+		int err = errno;
+
+		close(fd);
+		errno = err;
+	}
+	return -1;
+}
+
+/* openat() of a path inside the private area, the last part is not
+ * followed either
+ */
+int mig_walk_open(struct mig_walk *w, const char *path, int flags,
+	mode_t mode)
+{
+	const char *name;
+	int dfd;
+
+	if ((dfd = mig_walk(w, path, &name)) < 0)
+		return -1;
+	return openat(dfd, name, flags | O_NOFOLLOW | O_CLOEXEC, mode);
+}
+
+int mig_unpack_tree(const void *data, size_t len, struct mig_tree *tree)
+{
+	const char *p = data, *end = p + len;
+	struct mig_ent_hdr h;
+	char *path, *target = NULL;
+	int ret;
+
+	while (p < end) {
+		if ((size_t) (end - p) < sizeof(h))
+			goto err;
+		memcpy(&h, p, sizeof(h));
+		p += sizeof(h);
+		if ((size_t) (end - p) < (size_t) h.path_len + h.target_len)
+			goto err;
+		path = strndup(p, h.path_len);
+		p += h.path_len;
+		if (h.target_len)
+			target = strndup(p, h.target_len);
+		p += h.target_len;
+		if (path == NULL || mig_bad_path(path) ||
+			(h.type == MIG_ENT_LINK &&
+				(target == NULL || mig_bad_path(target))))
+		{
+			free(path);
+			free(target);
+			goto err;
+		}
+		ret = tree_add(tree, NULL, h.type, path, target);
+		if (!ret)
+			tree->ent[tree->n - 1].h = h;
+		free(path);
+		free(target);
+		target = NULL;
+		if (ret)
+			return -1;
+	}
+	return 0;
+err:
+	logger(-1, 0, "Migration protocol error: bad tree entry");
+	return -1;
+}
+
+/* Sender side of a sync channel */
+
+static int send_unit(struct mig_chan *ch, int fd, uint32_t idx,
+	struct mig_unit *u, struct mig_hash *sums, int nsums, char *buf,
+	unsigned long long *sent)
+{
+	struct mig_hash h;
+	uint64_t off, end = u->h.offset + u->h.len;
+	uint64_t run_off = 0;
+	size_t run_len = 0, blen;
+	char dhdr[12];
+	ssize_t n;
+	int i;
+
+	memcpy(dhdr, &idx, 4);
+	for (off = u->h.offset; off < end; off += IO_BUF) {
+		size_t want = end - off < IO_BUF ? end - off : IO_BUF;
+
+		n = pread(fd, buf, want, off);
+		if (n < 0) {
+			logger(-1, errno, "Can not read %s", u->path);
+			return -1;
+		}
+		/* File shrank, will be fixed by the next pass */
+		if ((size_t) n < want)
+			memset(buf + n, 0, want - n);
+		for (i = 0; (size_t) i * MIG_BLOCK < want; i++) {
+			uint64_t boff = off + (uint64_t) i * MIG_BLOCK;
+			int b = (boff - u->h.offset) / MIG_BLOCK;
+
+			blen = want - (size_t) i * MIG_BLOCK;
+			if (blen > MIG_BLOCK)
+				blen = MIG_BLOCK;
+			mig_hash_block(buf + (size_t) i * MIG_BLOCK, blen, &h);
+			if (b < nsums && h.h1 == sums[b].h1 &&
+					h.h2 == sums[b].h2)
+				continue;
+			/* Changed: send with adjacent changed blocks */
+			if (run_len && run_off + run_len == boff &&
+					run_len + blen <= IO_BUF) {
+				run_len += blen;
+				continue;
+			}
+			if (run_len) {
+				memcpy(dhdr + 4, &run_off, 8);
+				if (mig_send2(ch, MIG_DATA, dhdr, sizeof(dhdr),
+					buf + (run_off - off), run_len))
+					return -1;
+				*sent += run_len;
+			}
+			run_off = boff;
+			run_len = blen;
+		}
+		if (run_len) {
+			memcpy(dhdr + 4, &run_off, 8);
+			if (mig_send2(ch, MIG_DATA, dhdr, sizeof(dhdr),
+					buf + (run_off - off), run_len))
+				return -1;
+			*sent += run_len;
+			run_len = 0;
+		}
+	}
+	return mig_send(ch, MIG_UNIT_END, &idx, sizeof(idx));
+}
+
+static int send_batch(struct mig_chan *ch, struct mig_walk *w,
+	struct mig_unit *units, int n, char *buf, unsigned long long *sent)
+{
+	struct mig_hash **sums;
+	int *nsums;
+	void *data;
+	size_t len;
+	uint32_t idx;
+	int i, fd, ret = -1;
+
+	sums = calloc(n, sizeof(*sums));
+	nsums = calloc(n, sizeof(*nsums));
+	if (sums == NULL || nsums == NULL) {
+		logger(-1, ENOMEM, "Can not sync files");
+		goto out;
+	}
+	for (i = 0; i < n; i++)
+		if (mig_send2(ch, MIG_UNIT_REQ, &units[i].h,
+			sizeof(units[i].h), units[i].path, units[i].h.path_len))
+			goto out;
+	if (mig_send(ch, MIG_BATCH, NULL, 0))
+		goto out;
+	for (i = 0; i < n; i++) {
+		if (mig_expect(ch, MIG_SUMS, &data, &len))
+			goto out;
+		if (len < sizeof(idx) || (len - sizeof(idx)) %
+				sizeof(struct mig_hash))
+			goto err_proto;
+		memcpy(&idx, data, sizeof(idx));
+		if (idx != (uint32_t) i)
+			goto err_proto;
+		/* No hashes for units the receiver has already */
+		nsums[i] = (len - sizeof(idx)) / sizeof(struct mig_hash);
+		if (nsums[i] == 0) {
+			nsums[i] = -1;
+			continue;
+		}
+		if ((sums[i] = malloc(len - sizeof(idx))) == NULL) {
+			logger(-1, ENOMEM, "Can not sync files");
+			goto out;
+		}
+		memcpy(sums[i], (char *) data + sizeof(idx),
+			len - sizeof(idx));
+	}
+	for (i = 0; i < n; i++) {
+		if (nsums[i] < 0)
+			continue;
+		fd = mig_walk_open(w, units[i].path, O_RDONLY, 0);
+		if (fd < 0) {
+			/* Removed in running CT, next pass will see it */
+			if (errno == ENOENT || errno == ENOTDIR ||
+					errno == ELOOP)
+				continue;
+			logger(-1, errno, "Can not open %s", units[i].path);
+			goto out;
+		}
+		ret = send_unit(ch, fd, i, &units[i], sums[i], nsums[i], buf,
+			sent);
+		close(fd);
+		if (ret)
+			goto out;
+		ret = -1;
+	}
+	if (mig_send(ch, MIG_BATCH_END, NULL, 0))
+		goto out;
+	ret = mig_wait_reply(ch) ? -1 : 0;
+	goto out;
+
+err_proto:
+	logger(-1, 0, "Migration protocol error: bad block hashes");
+out:
+	if (sums != NULL)
+		for (i = 0; i < n; i++)
+			free(sums[i]);
+	free(sums);
+	free(nsums);
+	return ret;
+}
+
+int mig_sync_send(struct mig_chan *ch, const char *dir,
+	struct mig_unit *units, int n)
+{
+	unsigned long long bytes, sent = 0;
+	struct mig_walk w;
+	char *buf;
+	int i, cnt, dfd, ret = 0;
+
+	if ((dfd = open(dir, O_RDONLY | O_DIRECTORY)) < 0) {
+		logger(-1, errno, "Can not open %s", dir);
+		return -1;
+	}
+	if ((buf = malloc(IO_BUF)) == NULL) {
+		logger(-1, ENOMEM, "Can not sync files");
+		close(dfd);
+		return -1;
+	}
+	mig_walk_init(&w, dfd);
+	for (i = 0; !ret && i < n; i += cnt) {
+		bytes = 0;
+		for (cnt = 0; i + cnt < n && cnt < BATCH_UNITS &&
+				bytes < BATCH_BYTES; cnt++)
+			bytes += units[i + cnt].h.len;
+		ret = send_batch(ch, &w, units + i, cnt, buf, &sent);
+	}
+	mig_walk_done(&w);
+	if (!ret)
+		ret = mig_send(ch, MIG_BYE, NULL, 0);
+	if (!ret)
+		logger(2, 0, "Stream done: %d units, %llu MB sent", n,
+			sent >> 20);
+	free(buf);
+	close(dfd);
+	return ret;
+}
+
+/* Receiver side of a sync channel */
+
+struct manifest {
+	char *data;		/* records, each mig_unit_hdr and path */
+	const char **rec;	/* sorted */
+	int n;
+	int fd;
+};
+
+static int rec_cmp(const void *a, const void *b)
+{
+	const struct mig_unit_hdr *h1 = *(const void * const *) a;
+	const struct mig_unit_hdr *h2 = *(const void * const *) b;
+	size_t len = h1->path_len < h2->path_len ? h1->path_len : h2->path_len;
+	int ret;
+
+	if ((ret = memcmp(h1 + 1, h2 + 1, len)))
+		return ret;
+	if (h1->path_len != h2->path_len)
+		return h1->path_len < h2->path_len ? -1 : 1;
+	/* Same path, compare the rest of the header */
+	return memcmp(h1, h2, sizeof(*h1));
+}
+
+static int manifest_open(struct manifest *m, const char *file)
+{
+	struct mig_unit_hdr h;
+	struct stat st;
+	size_t off;
+	int n;
+
+	memset(m, 0, sizeof(*m));
+	m->fd = open(file, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+	if (m->fd < 0 || fstat(m->fd, &st)) {
+		logger(-1, errno, "Can not open %s", file);
+		return -1;
+	}
+	if (st.st_size == 0)
+		return 0;
+	if ((m->data = malloc(st.st_size)) == NULL ||
+			mig_read(m->fd, m->data, st.st_size))
+		return -1;
+	/* Count complete records, a torn one at the end is ignored */
+	for (off = 0, n = 0; off + sizeof(h) <= (size_t) st.st_size; n++) {
+		memcpy(&h, m->data + off, sizeof(h));
+		if (off + sizeof(h) + h.path_len > (size_t) st.st_size)
+			break;
+		off += sizeof(h) + h.path_len;
+	}
+	if ((m->rec = malloc(n * sizeof(*m->rec) + 1)) == NULL)
+		return -1;
+	for (off = 0; m->n < n; m->n++) {
+		m->rec[m->n] = m->data + off;
+		memcpy(&h, m->data + off, sizeof(h));
+		off += sizeof(h) + h.path_len;
+	}
+	/* Records are not aligned, sort copies of pointers only */
+	qsort(m->rec, m->n, sizeof(*m->rec), rec_cmp);
+	return 0;
+}
+
+static char *make_rec(struct mig_unit *u, size_t *len)
+{
+	char *rec;
+
+	*len = sizeof(u->h) + u->h.path_len;
+	if ((rec = malloc(*len)) == NULL)
+		return NULL;
+	memcpy(rec, &u->h, sizeof(u->h));
+	memcpy(rec + sizeof(u->h), u->path, u->h.path_len);
+	return rec;
+}
+
+static int manifest_has(struct manifest *m, struct mig_unit *u)
+{
+	char *key;
+	size_t len;
+	int found;
+
+	if (m->n == 0 || (key = make_rec(u, &len)) == NULL)
+		return 0;
+	found = bsearch(&key, m->rec, m->n, sizeof(*m->rec), rec_cmp) != NULL;
+	free(key);
+	return found;
+}
+
+static void manifest_close(struct manifest *m)
+{
+	if (m->fd >= 0)
+		close(m->fd);
+	free(m->rec);
+	free(m->data);
+}
+
+/* Hash the receiver's copy of a unit */
+static int hash_unit(struct mig_walk *w, struct mig_unit *u,
+	struct mig_hash *sums, char *buf)
+{
+	uint64_t off, end = u->h.offset + u->h.len;
+	ssize_t n;
+	size_t i, blen;
+	int fd, b = 0;
+
+	if ((fd = mig_walk_open(w, u->path, O_RDONLY, 0)) < 0) {
+		logger(-1, errno, "Can not open %s", u->path);
+		return -1;
+	}
+	for (off = u->h.offset; off < end; off += IO_BUF) {
+		size_t want = end - off < IO_BUF ? end - off : IO_BUF;
+
+		if ((n = pread(fd, buf, want, off)) < 0) {
+			logger(-1, errno, "Can not read %s", u->path);
+			close(fd);
+			return -1;
+		}
+		if ((size_t) n < want)
+			memset(buf + n, 0, want - n);
+		for (i = 0; i * MIG_BLOCK < want; i++, b++) {
+			blen = want - i * MIG_BLOCK;
+			if (blen > MIG_BLOCK)
+				blen = MIG_BLOCK;
+			mig_hash_block(buf + i * MIG_BLOCK, blen, &sums[b]);
+		}
+	}
+	close(fd);
+	return 0;
+}
+
+struct recv_unit {
+	struct mig_unit u;
+	int fd;
+	int done;
+};
+
+static void free_units(struct recv_unit *units, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (units[i].fd >= 0)
+			close(units[i].fd);
+		free(units[i].u.path);
+	}
+}
+
+static int recv_batch(struct mig_chan *ch, struct mig_walk *w,
+	struct manifest *m, struct recv_unit *units, int n, char *buf)
+{
+	struct mig_hash *sums;
+	struct recv_unit *ru;
+	uint32_t idx;
+	uint64_t off;
+	void *data;
+	size_t len, rlen;
+	char *rec;
+	int i, type, nb;
+
+	/* Reply with hashes */
+	if ((sums = malloc((MIG_UNIT / MIG_BLOCK) * sizeof(*sums) +
+			sizeof(idx))) == NULL) {
+		logger(-1, ENOMEM, "Can not sync files");
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		idx = i;
+		nb = 0;
+		if (!manifest_has(m, &units[i].u)) {
+			if (hash_unit(w, &units[i].u, sums, buf)) {
+				free(sums);
+				return -1;
+			}
+			nb = (units[i].u.h.len + MIG_BLOCK - 1) / MIG_BLOCK;
+		} else {
+			units[i].done = 1;
+		}
+		if (mig_send2(ch, MIG_SUMS, &idx, sizeof(idx), sums,
+				nb * sizeof(*sums))) {
+			free(sums);
+			return -1;
+		}
+	}
+	free(sums);
+	/* Take the changed blocks */
+	for (;;) {
+		if (mig_recv(ch, &type, &data, &len))
+			return -1;
+		if (type == MIG_BATCH_END)
+			break;
+		if (len < sizeof(idx))
+			goto err_proto;
+		memcpy(&idx, data, sizeof(idx));
+		if (idx >= (uint32_t) n)
+			goto err_proto;
+		ru = &units[idx];
+		if (type == MIG_UNIT_END) {
+			ru->done = 1;
+			continue;
+		}
+		if (type != MIG_DATA || len < sizeof(idx) + sizeof(off))
+			goto err_proto;
+		memcpy(&off, (char *) data + sizeof(idx), sizeof(off));
+		len -= sizeof(idx) + sizeof(off);
+		if (off < ru->u.h.offset ||
+				off + len > ru->u.h.offset + ru->u.h.len)
+			goto err_proto;
+		if (ru->fd < 0) {
+			ru->fd = mig_walk_open(w, ru->u.path, O_WRONLY, 0);
+			if (ru->fd < 0) {
+				logger(-1, errno, "Can not open %s",
+					ru->u.path);
+				return -1;
+			}
+		}
+		if (pwrite(ru->fd, (char *) data + sizeof(idx) + sizeof(off),
+				len, off) != (ssize_t) len) {
+			logger(-1, errno, "Can not write %s", ru->u.path);
+			return -1;
+		}
+	}
+	/* Units are recorded only after their data is on disk */
+	if (syncfs(w->root))
+		logger(-1, errno, "Warning: syncfs failed");
+	for (i = 0; i < n; i++) {
+		if (!units[i].done)
+			continue;
+		if ((rec = make_rec(&units[i].u, &rlen)) == NULL)
+			continue;
+		if (write(m->fd, rec, rlen) != (ssize_t) rlen)
+			logger(-1, errno, "Warning: can not update manifest");
+		free(rec);
+	}
+	return 0;
+
+err_proto:
+	logger(-1, 0, "Migration protocol error: bad data message");
+	return -1;
+}
+
+int mig_sync_recv(struct mig_chan *ch, const char *dir, const char *manifest)
+{
+	struct recv_unit *units;
+	struct mig_unit_hdr h;
+	struct mig_walk w;
+	struct manifest m;
+	void *data;
+	size_t len;
+	char *buf = NULL;
+	int type, n = 0, dfd = -1, ret = -1;
+
+	units = calloc(BATCH_UNITS, sizeof(*units));
+	if (units == NULL || (buf = malloc(IO_BUF)) == NULL) {
+		logger(-1, ENOMEM, "Can not sync files");
+		goto out;
+	}
+	if (manifest_open(&m, manifest))
+		goto out_m;
+	if ((dfd = open(dir, O_RDONLY | O_DIRECTORY)) < 0) {
+		logger(-1, errno, "Can not open %s", dir);
+		goto out_m;
+	}
+	mig_walk_init(&w, dfd);
+	for (;;) {
+		if (mig_recv(ch, &type, &data, &len))
+			break;
+		if (type == MIG_BYE) {
+			ret = 0;
+			break;
+		}
+		if (type == MIG_BATCH) {
+			ret = recv_batch(ch, &w, &m, units, n, buf);
+			free_units(units, n);
+			n = 0;
+			if (ret)
+				break;
+			if ((ret = mig_reply(ch, 0)))
+				break;
+			ret = -1;
+			continue;
+		}
+		if (type != MIG_UNIT_REQ || len < sizeof(h) || n == BATCH_UNITS)
+			goto err_proto;
+		memcpy(&h, data, sizeof(h));
+		if (len != sizeof(h) + h.path_len || h.len > MIG_UNIT ||
+				h.len == 0)
+			goto err_proto;
+		units[n].u.h = h;
+		units[n].u.path = strndup((char *) data + sizeof(h),
+			h.path_len);
+		units[n].fd = -1;
+		units[n].done = 0;
+		if (units[n].u.path == NULL)
+			break;
+		n++;
+		if (mig_bad_path(units[n - 1].u.path))
+			goto err_proto;
+	}
+	goto out_m;
+
+err_proto:
+	logger(-1, 0, "Migration protocol error: bad unit request");
+out_m:
+	if (dfd >= 0)
+		mig_walk_done(&w);
+	free_units(units, n);
+	manifest_close(&m);
+out:
+	if (dfd >= 0)
+		close(dfd);
+	free(units);
+	free(buf);
+	return ret;
+}
@@ -0,0 +1,582 @@
+/*
+ *  Copyright (C) 2000-2011, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Change tracking of the private area for vzmigrate
+ *
+ * Every directory of the private area gets an inotify watch as the tree
+ * scan reaches it, so all changes made after a file was scanned are
+ * seen. Changed paths are kept in a set; a later pass sends just those
+ * instead of the whole tree. Whatever the tracker can not follow (event
+ * queue overflow, directory renames, out of watches) makes the next
+ * pass a full one.
+ *
+ * Writes through a shared mapping give no events, so for the final pass
+ * of online migration files mapped or open for writing by the CT are
+ * taken as changed as well.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include "vzmigrate.h"
+#include "logger.h"
+#include "util.h"
+
+#define TRACK_MASK	(IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | \
+			IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+			IN_DELETE_SELF | IN_MOVE_SELF | IN_DONT_FOLLOW | \
+			IN_ONLYDIR | TRACK_EXCL_UNLINK)
+#ifdef IN_EXCL_UNLINK
+#define TRACK_EXCL_UNLINK	IN_EXCL_UNLINK
+#else
+#define TRACK_EXCL_UNLINK	0
+#endif
+
+/* Events which change the directory itself */
+#define DIR_CHANGE	(IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+
+#define PROBE_FILE	".vzmigrate-probe"
+
+struct mig_track {
+	int fd;			/* inotify */
+	int dfd;		/* private area */
+	char *dir;
+	char **wd_path;		/* directory by watch descriptor */
+	int wd_size;
+	char **dirty;		/* hash set of changed paths */
+	unsigned int dirty_size;
+	unsigned int ndirty;
+	int overflow;		/* lost track of something */
+	int failed;		/* out of watches */
+};
+
+static unsigned int str_hash(const char *s)
+{
+	unsigned int h = 5381;
+
+	while (*s != '\0')
+		h = h * 33 + (unsigned char) *s++;
+	return h;
+}
+
+static char **dirty_find(struct mig_track *t, const char *path)
+{
+	unsigned int i;
+
+	for (i = str_hash(path) % t->dirty_size; t->dirty[i] != NULL;
+			i = (i + 1) % t->dirty_size)
+		if (!strcmp(t->dirty[i], path))
+			break;
+	return &t->dirty[i];
+}
+
+static int is_dirty(struct mig_track *t, const char *path)
+{
+	return t->dirty_size && *dirty_find(t, path) != NULL;
+}
+
+static void mark_dirty(struct mig_track *t, const char *path)
+{
+	char **p, **tab;
+	unsigned int i, size;
+
+	if (t->overflow)
+		return;
+	if (t->ndirty * 2 >= t->dirty_size) {
+		size = t->dirty_size ? t->dirty_size * 2 : 1024;
+		if ((tab = calloc(size, sizeof(*tab))) == NULL) {
+			t->overflow = 1;
+			return;
+		}
+		for (i = 0; i < t->dirty_size; i++) {
+			unsigned int j;
+
+			if (t->dirty[i] == NULL)
+				continue;
+			for (j = str_hash(t->dirty[i]) % size; tab[j] != NULL;
+					j = (j + 1) % size)
+				;
+			tab[j] = t->dirty[i];
+		}
+		free(t->dirty);
+		t->dirty = tab;
+		t->dirty_size = size;
+	}
+	p = dirty_find(t, path);
+	if (*p != NULL)
+		return;
+	if ((*p = strdup(path)) == NULL) {
+		t->overflow = 1;
+		return;
+	}
+	t->ndirty++;
+}
+
+void mig_track_clear(struct mig_track *t)
+{
+	unsigned int i;
+
+	for (i = 0; i < t->dirty_size; i++)
+		free(t->dirty[i]);
+	free(t->dirty);
+	t->dirty = NULL;
+	t->dirty_size = 0;
+	t->ndirty = 0;
+}
+
+/* Watch a directory, path is relative to the private area */
+int mig_track_dir(struct mig_track *t, const char *path)
+{
+	char full[PATH_MAX];
+	char **p;
+	int wd;
+
+	snprintf(full, sizeof(full), "%s/%s", t->dir, path);
+	if ((wd = inotify_add_watch(t->fd, full, TRACK_MASK)) < 0) {
+		if (errno == ENOENT || errno == ENOTDIR)
+			return 0;
+		if (!t->failed)
+			logger(0, errno, "Warning: can not track changes of"
+				" %s, see fs.inotify.max_user_watches", full);
+		t->failed = 1;
+		return -1;
+	}
+	if (wd >= t->wd_size) {
+		int size = wd + 1024;
+
+		if ((p = realloc(t->wd_path, size * sizeof(*p))) == NULL) {
+			t->failed = 1;
+			return -1;
+		}
+		memset(p + t->wd_size, 0, (size - t->wd_size) * sizeof(*p));
+		t->wd_path = p;
+		t->wd_size = size;
+	}
+	/* Same directory under a new name, after a rename */
+	free(t->wd_path[wd]);
+	if ((t->wd_path[wd] = strdup(path)) == NULL)
+		t->failed = 1;
+	return 0;
+}
+
+/* New directory: watch it and everything below, it is all changed */
+static void track_new_dir(struct mig_track *t, char *path)
+{
+	struct dirent *de;
+	size_t len = strlen(path);
+	struct mig_walk w;
+	DIR *dp;
+	int fd;
+
+	mig_track_dir(t, path);
+	mig_walk_init(&w, t->dfd);
+	fd = mig_walk_open(&w, path, O_RDONLY | O_DIRECTORY, 0);
+	mig_walk_done(&w);
+	if (fd < 0)
+		return;
+	if ((dp = fdopendir(fd)) == NULL) {
+		close(fd);
+		return;
+	}
+	while ((de = readdir(dp)) != NULL) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		if (len + strlen(de->d_name) + 2 > PATH_MAX) {
+			t->overflow = 1;
+			break;
+		}
+		sprintf(path + len, "/%s", de->d_name);
+		mark_dirty(t, path);
+		if (de->d_type == DT_DIR || de->d_type == DT_UNKNOWN)
+			track_new_dir(t, path);
+		path[len] = '\0';
+	}
+	closedir(dp);
+}
+
+static void track_event(struct mig_track *t, struct inotify_event *ev)
+{
+	char path[PATH_MAX];
+	const char *dir;
+
+	if (ev->mask & IN_Q_OVERFLOW) {
+		logger(1, 0, "Change tracking queue overflow");
+		t->overflow = 1;
+		return;
+	}
+	if (ev->wd < 0 || ev->wd >= t->wd_size ||
+			(dir = t->wd_path[ev->wd]) == NULL)
+		return;
+	if (ev->mask & IN_IGNORED) {
+		free(t->wd_path[ev->wd]);
+		t->wd_path[ev->wd] = NULL;
+		return;
+	}
+	/* Paths below a renamed directory are not known anymore */
+	if ((ev->mask & IN_MOVE_SELF) ||
+		((ev->mask & IN_MOVED_FROM) && (ev->mask & IN_ISDIR)))
+	{
+		if (!t->overflow)
+			logger(1, 0, "Directory renamed, full pass needed");
+		t->overflow = 1;
+		return;
+	}
+	if (ev->len == 0 || ev->name[0] == '\0') {
+		if (*dir != '\0' && !(ev->mask & IN_DELETE_SELF))
+			mark_dirty(t, dir);
+		return;
+	}
+	if (snprintf(path, sizeof(path), "%s%s%s", dir, *dir ? "/" : "",
+			ev->name) >= (int) sizeof(path)) {
+		t->overflow = 1;
+		return;
+	}
+	mark_dirty(t, path);
+	if ((ev->mask & DIR_CHANGE) && *dir != '\0')
+		mark_dirty(t, dir);
+	if ((ev->mask & (IN_CREATE | IN_MOVED_TO)) && (ev->mask & IN_ISDIR))
+		track_new_dir(t, path);
+}
+
+/* Read the events queued so far */
+void mig_track_poll(struct mig_track *t)
+{
+	char buf[64 * 1024] __attribute__ ((aligned(8)));
+	struct inotify_event *ev;
+	ssize_t n;
+	char *p;
+
+	for (;;) {
+		if ((n = read(t->fd, buf, sizeof(buf))) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				t->overflow = 1;
+			return;
+		}
+		for (p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *) p;
+			track_event(t, ev);
+		}
+	}
+}
+
+int mig_track_fd(struct mig_track *t)
+{
+	return t->fd;
+}
+
+/* Before a full scan, which watches all directories again */
+void mig_track_reset(struct mig_track *t)
+{
+	mig_track_poll(t);
+	mig_track_clear(t);
+	t->overflow = 0;
+	t->failed = 0;
+}
+
+/* Changes made through the CT root should show up on the private area */
+static int track_probe(struct mig_track *t, const char *root)
+{
+	char file[PATH_MAX];
+	struct pollfd pfd;
+	int fd, ok;
+
+	snprintf(file, sizeof(file), "%s/" PROBE_FILE, root);
+	if ((fd = open(file, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+			0600)) < 0)
+		return 0;
+	close(fd);
+	unlink(file);
+	pfd.fd = t->fd;
+	pfd.events = POLLIN;
+	poll(&pfd, 1, 1000);
+	mig_track_poll(t);
+	ok = is_dirty(t, PROBE_FILE);
+	mig_track_clear(t);
+	return ok;
+}
+
+/* root is the mounted CT root, or NULL */
+struct mig_track *mig_track_init(const char *dir, const char *root)
+{
+	struct mig_track *t;
+
+	if ((t = calloc(1, sizeof(*t))) == NULL)
+		return NULL;
+	t->dfd = -1;
+	if ((t->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+		logger(0, errno, "Warning: can not track changes");
+		goto err;
+	}
+	if ((t->dir = strdup(dir)) == NULL)
+		goto err;
+	if ((t->dfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+		logger(-1, errno, "Can not open %s", dir);
+		goto err;
+	}
+	if (mig_track_dir(t, ""))
+		goto err;
+	if (root != NULL && !track_probe(t, root)) {
+		logger(0, 0, "Warning: changes in %s are not seen on %s,"
+			" not tracking changes", root, dir);
+		goto err;
+	}
+	return t;
+err:
+	mig_track_free(t);
+	return NULL;
+}
+
+void mig_track_free(struct mig_track *t)
+{
+	int i;
+
+	if (t == NULL)
+		return;
+	mig_track_clear(t);
+	for (i = 0; i < t->wd_size; i++)
+		free(t->wd_path[i]);
+	free(t->wd_path);
+	if (t->fd >= 0)
+		close(t->fd);
+	if (t->dfd >= 0)
+		close(t->dfd);
+	free(t->dir);
+	free(t);
+}
+
+void mig_free_delta(struct mig_delta *d)
+{
+	int i;
+
+	mig_free_tree(&d->tree);
+	for (i = 0; i < d->ndel; i++)
+		free(d->del[i]);
+	free(d->del);
+	memset(d, 0, sizeof(*d));
+}
+
+static int str_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* Paths are looked up by w, hard link targets by lw */
+static int ent_add(struct mig_walk *w, struct mig_walk *lw,
+	struct mig_inodes *inodes, struct mig_delta *d, const char *path)
+{
+	const char *name;
+	struct stat st;
+	char **del;
+	int dfd;
+
+	if ((dfd = mig_walk(w, path, &name)) >= 0 &&
+			fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+		return mig_add_ent(&d->tree, inodes, dfd, name, path, &st,
+			lw);
+	/* A directory on the way is not one anymore. It is changed
+	 * itself, so it is in the delta, and replaces all below it.
+	 */
+	if (errno == ENOTDIR)
+		return 0;
+	if (errno != ENOENT) {
+		logger(-1, errno, "Can not stat %s", path);
+		return -1;
+	}
+	if ((d->ndel % 1024) == 0) {
+		del = realloc(d->del, (d->ndel + 1024) * sizeof(*del));
+		if (del == NULL)
+			goto err;
+		d->del = del;
+	}
+	if ((d->del[d->ndel] = strdup(path)) == NULL)
+		goto err;
+	d->ndel++;
+	return 0;
+err:
+	logger(-1, ENOMEM, "Can not scan private area");
+	return -1;
+}
+
+/* Changed entries since the last mig_track_clear(), parents first and
+ * hard links last. Returns 1 if a full pass is needed instead.
+ */
+int mig_track_delta(struct mig_track *t, struct mig_inodes *inodes,
+	struct mig_delta *d)
+{
+	struct mig_ent *e, *ent;
+	struct mig_walk w, lw;
+	char **paths;
+	unsigned int i, n = 0;
+	int j, k, ret = 0;
+
+	memset(d, 0, sizeof(*d));
+	mig_track_poll(t);
+	if (t->overflow || t->failed)
+		return 1;
+	if ((paths = malloc((t->ndirty + 1) * sizeof(*paths))) == NULL) {
+		logger(-1, ENOMEM, "Can not scan private area");
+		return -1;
+	}
+	for (i = 0; i < t->dirty_size; i++)
+		if (t->dirty[i] != NULL)
+			paths[n++] = t->dirty[i];
+	/* A directory goes before what is in it */
+	qsort(paths, n, sizeof(*paths), str_cmp);
+	/* Not kept between passes: a directory could be made anew */
+	mig_walk_init(&w, t->dfd);
+	mig_walk_init(&lw, t->dfd);
+	for (i = 0; i < n; i++) {
+		j = d->tree.n;
+		if ((ret = ent_add(&w, &lw, inodes, d, paths[i])))
+			break;
+		if (d->tree.n == j)
+			continue;
+		/* Hard link target gets its data from here */
+		e = &d->tree.ent[j];
+		if (e->h.type == MIG_ENT_LINK && !is_dirty(t, e->target)) {
+			mark_dirty(t, e->target);
+			if ((ret = ent_add(&w, &lw, inodes, d, e->target)))
+				break;
+		}
+	}
+	mig_walk_done(&w);
+	mig_walk_done(&lw);
+	free(paths);
+	if (ret) {
+		mig_free_delta(d);
+		return -1;
+	}
+	/* Hard links after all their targets */
+	if ((ent = malloc(d->tree.size * sizeof(*ent))) == NULL) {
+		logger(-1, ENOMEM, "Can not scan private area");
+		mig_free_delta(d);
+		return -1;
+	}
+	for (j = 0, k = 0; j < d->tree.n; j++) {
+		e = &d->tree.ent[j];
+		if (e->h.type == MIG_ENT_FILE)
+			d->bytes += e->h.size;
+		if (e->h.type != MIG_ENT_LINK)
+			ent[k++] = *e;
+	}
+	for (j = 0; j < d->tree.n; j++)
+		if (d->tree.ent[j].h.type == MIG_ENT_LINK)
+			ent[k++] = d->tree.ent[j];
+	free(d->tree.ent);
+	d->tree.ent = ent;
+	return 0;
+}
+
+/* Path as seen by the host, under root */
+static void mark_ct_path(struct mig_track *t, const char *root, size_t rlen,
+	const char *path)
+{
+	size_t len = strlen(path);
+
+	if (len <= rlen + 1 || strncmp(path, root, rlen) || path[rlen] != '/')
+		return;
+	/* Removed already, nothing to sync */
+	if (len > 10 && !strcmp(path + len - 10, " (deleted)"))
+		return;
+	mark_dirty(t, path + rlen + 1);
+}
+
+/* Files the CT has mapped shared or open for writing */
+void mig_track_open_files(struct mig_track *t, envid_t veid,
+	const char *root)
+{
+	char file[PATH_MAX], link[PATH_MAX], line[PATH_MAX + 128];
+	struct dirent *de, *fde;
+	size_t rlen = strlen(root);
+	DIR *proc, *fdd;
+	FILE *fp;
+	char *p;
+	ssize_t n;
+	int id, flags;
+
+	if ((proc = opendir("/proc")) == NULL)
+		return;
+	while ((de = readdir(proc)) != NULL) {
+		if (de->d_name[0] < '0' || de->d_name[0] > '9')
+			continue;
+		snprintf(file, sizeof(file), "/proc/%s/status", de->d_name);
+		if ((fp = fopen(file, "r")) == NULL)
+			continue;
+		id = -1;
+		while (fgets(line, sizeof(line), fp) != NULL)
+			if (sscanf(line, "envID: %d", &id) == 1)
+				break;
+		fclose(fp);
+		if (id != (int) veid)
+			continue;
+
+		snprintf(file, sizeof(file), "/proc/%s/fd", de->d_name);
+		if ((fdd = opendir(file)) != NULL) {
+			while ((fde = readdir(fdd)) != NULL) {
+				snprintf(file, sizeof(file), "/proc/%s/fd/%s",
+					de->d_name, fde->d_name);
+				n = readlink(file, link, sizeof(link) - 1);
+				if (n <= (ssize_t) rlen + 1)
+					continue;
+				link[n] = '\0';
+				if (strncmp(link, root, rlen))
+					continue;
+				snprintf(file, sizeof(file),
+					"/proc/%s/fdinfo/%s",
+					de->d_name, fde->d_name);
+				if ((fp = fopen(file, "r")) == NULL)
+					continue;
+				flags = O_RDONLY;
+				while (fgets(line, sizeof(line), fp) != NULL)
+					if (sscanf(line, "flags: %o",
+							&flags) == 1)
+						break;
+				fclose(fp);
+				if ((flags & O_ACCMODE) != O_RDONLY)
+					mark_ct_path(t, root, rlen, link);
+			}
+			closedir(fdd);
+		}
+
+		/* 00400000-0040b000 rw-s 00000000 08:01 1234 /path */
+		snprintf(file, sizeof(file), "/proc/%s/maps", de->d_name);
+		if ((fp = fopen(file, "r")) == NULL)
+			continue;
+		while (fgets(line, sizeof(line), fp) != NULL) {
+			if ((p = strchr(line, ' ')) == NULL ||
+					strncmp(p + 1, "rw-s", 4))
+				continue;
+			if ((p = strchr(line, '/')) == NULL)
+				continue;
+			p[strcspn(p, "\n")] = '\0';
+			mark_ct_path(t, root, rlen, p);
+		}
+		fclose(fp);
+	}
+	closedir(proc);
+}
@@ -0,0 +1,970 @@
+/*
+ *  Copyright (C) 2000-2011, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* vzmigrate: migrate a container to another node
+ *
+ * The source drives the migration over a control channel to a receiver
+ * (vzmigrate --receiver) on the destination. The private area is synced
+ * by several sync channels in parallel. While a running CT keeps
+ * changing it, pre-copy rounds move just the files changed during the
+ * previous round, as seen by the change tracker, until the changes get
+ * small or stop shrinking. The last pass, after the CT is stopped or
+ * suspended, then moves only what has changed since. For online
+ * migration the checkpoint dump is streamed to the destination as it
+ * is made.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "vzmigrate.h"
+#include "config.h"
+#include "cpt.h"
+#include "env.h"
+#include "status.h"
+#include "spawnprog.h"
+#include "span.h"
+#include "logger.h"
+#include "vzerror.h"
+#include "util.h"
+
+#define DEF_JOBS		4
+#define MAX_JOBS		64
+#define DEF_ROUNDS		5
+/* Changes small enough to move with the CT stopped */
+#define CONVERGED_BYTES		(8ULL * 1024 * 1024)
+#define CONVERGED_ENTRIES	1024
+
+extern char **environ;
+
+struct migrate {
+	envid_t veid;
+	vps_param *param;
+	vps_handler *h;
+	char *private;
+	int state;		/* CT_ST_* of the source */
+	int online;
+	int keep_dst;
+	int remove_area;
+	int jobs;
+	int compress;
+	int verbose;
+	struct mig_transport *tr;
+	struct mig_dest dest;
+	char *rargv[16];
+	struct mig_chan ctl;
+	int stopped;		/* source is stopped or unmounted */
+	int suspended;		/* source is suspended */
+	int rounds;		/* max pre-copy rounds */
+	int no_track;
+	struct mig_track *tracker;
+	struct mig_inodes inodes;	/* hard links, as of the last scan */
+};
+
+static char *action_scripts[] = {"start", "stop", "mount", "umount",
+	"premount", "postumount", NULL};
+
+static void usage(int rc)
+{
+	fprintf(rc ? stderr : stdout,
+"This program is used for container migration to another node.\n"
+"Usage:\n"
+"vzmigrate [-r yes|no] [--ssh=<options>] [--keep-dst] [--online] [-v]\n"
+"	[--jobs N] [--precopy-rounds N] [--no-track]\n"
+"	[--compress none|lz4|zstd|gzip] [--transport ssh|local]\n"
+"	[--dst-private PATH] [--dst-root PATH] [--dst-confdir DIR]\n"
+"	destination_address <CTID>\n"
+"Options:\n"
+"-r, --remove-area yes|no\n"
+"	Whether to remove container on source host after successful migration.\n"
+"--ssh=<ssh options>\n"
+"	Additional options that will be passed to ssh while establishing\n"
+"	connection to destination host. Please be careful with options\n"
+"	passed, DO NOT pass destination hostname.\n"
+"--keep-dst\n"
+"	Do not clean synced destination container private area in case of some\n"
+"	error. A next migration attempt resumes the transfer where it stopped.\n"
+"--online\n"
+"	Perform online (zero-downtime) migration: during the migration the\n"
+"	container freezes for some time and after the migration it\n"
+"	keeps working as though nothing has happened.\n"
+"-j, --jobs N\n"
+"	Number of parallel streams to sync container private area (default %d).\n"
+"--precopy-rounds N\n"
+"	Max number of rounds syncing files changed by running container\n"
+"	before it is stopped or suspended (default %d).\n"
+"--no-track\n"
+"	Do not track changes of running container private area, sync it\n"
+"	all over again after it is stopped or suspended.\n"
+"--compress none|lz4|zstd|gzip\n"
+"	Compress checkpoint dump sent to destination node.\n"
+"--transport ssh|local\n"
+"	How to reach the destination node. With \"local\", the container is\n"
+"	migrated on this node, to the paths given by --dst-* options.\n"
+"--dst-private PATH, --dst-root PATH, --dst-confdir DIR\n"
+"	Container private area, root and config directory on destination.\n"
+"-v\n"
+"	Verbose mode. Causes vzmigrate to print debugging messages about\n"
+"	its progress (including some time statistics). Multiple -v options\n"
+"	increase the verbosity. The maximum is 3.\n"
+"Examples:\n"
+"	Online migration of CT #101 to foo.com:\n"
+"		vzmigrate --online foo.com 101\n"
+"	Migration of CT #102 to foo.com with downtime:\n"
+"		vzmigrate foo.com 102\n"
+"Notes:\n"
+"	This program uses ssh as a transport layer. You need to put ssh\n"
+"	public key to destination node and be able to connect without\n"
+"	entering a password.\n", DEF_JOBS, DEF_ROUNDS);
+	exit(rc);
+}
+
+/* Run vzctl on this node */
+static int run_vzctl(struct migrate *m, char *cmd, char *arg)
+{
+	char veid[16];
+	char *argv[] = {"vzctl", cmd, veid, arg, NULL};
+	pid_t pid;
+
+	snprintf(veid, sizeof(veid), "%d", m->veid);
+	pid = spawn_prog(SBINDIR "/vzctl", argv, environ, SPAWN_NULL,
+		m->verbose ? SPAWN_KEEP : SPAWN_NULL, SPAWN_KEEP);
+	if (pid < 0)
+		return VZ_SYSTEM_ERROR;
+	return spawn_wait(pid, SBINDIR "/vzctl");
+}
+
+/* Send a control message, wait for the receiver to do it */
+static int ctl_call(struct migrate *m, int type, void *d1, size_t len1,
+	void *d2, size_t len2)
+{
+	if (mig_send2(&m->ctl, type, d1, len1, d2, len2))
+		return MIG_ERR_PROTO;
+	return mig_wait_reply(&m->ctl);
+}
+
+static int read_file(const char *file, char **buf, size_t *len)
+{
+	struct stat st;
+	int fd, ret = -1;
+
+	if ((fd = open(file, O_RDONLY)) < 0)
+		return -1;
+	if (!fstat(fd, &st) && (*buf = malloc(st.st_size + 1)) != NULL) {
+		*len = st.st_size;
+		if (!(ret = mig_read(fd, *buf, *len)))
+			(*buf)[*len] = '\0';
+		else
+			free(*buf);
+	}
+	close(fd);
+	return ret;
+}
+
+static int send_config(struct migrate *m)
+{
+	struct mig_check chk;
+	char file[PATH_LEN], *buf, *sfx;
+	struct stat st;
+	size_t len;
+	uint32_t mode;
+	int i, ret;
+
+	chk.flags = 0;
+	if (m->online)
+		chk.flags |= MIG_F_ONLINE;
+	if (m->keep_dst)
+		chk.flags |= MIG_F_KEEP_DST;
+	if (m->param->res.dq.enable != NO)
+		chk.flags |= MIG_F_QUOTA;
+	/* Destination runs vzctl for these */
+	if (m->online || m->state || (chk.flags & MIG_F_QUOTA))
+		chk.flags |= MIG_F_NEED_VZ;
+	get_vps_conf_path(m->veid, file, sizeof(file));
+	if (read_file(file, &buf, &len)) {
+		logger(-1, errno, "Failed to read config file %s", file);
+		return MIG_ERR_COPY;
+	}
+	logger(1, 0, "Copying config file");
+	ret = ctl_call(m, MIG_CHECK, &chk, sizeof(chk), buf, len);
+	free(buf);
+	if (ret)
+		return ret;
+	for (i = 0; action_scripts[i] != NULL; i++) {
+		sfx = action_scripts[i];
+		snprintf(file, sizeof(file), VPS_CONF_DIR "%d.%s", m->veid, sfx);
+		if (stat(file, &st))
+			continue;
+		if (read_file(file, &buf, &len)) {
+			logger(-1, errno, "Failed to copy action script %s",
+				file);
+			return MIG_ERR_COPY;
+		}
+		logger(1, 0, "Copying action script %s", file);
+		mode = st.st_mode;
+		if ((buf = realloc(buf, len + strlen(sfx) + 5)) == NULL)
+			return MIG_ERR_COPY;
+		/* mode, suffix and contents */
+		memmove(buf + sizeof(mode) + strlen(sfx) + 1, buf, len);
+		memcpy(buf, &mode, sizeof(mode));
+		strcpy(buf + sizeof(mode), sfx);
+		ret = ctl_call(m, MIG_SCRIPT, buf,
+			len + sizeof(mode) + strlen(sfx) + 1, NULL, 0);
+		free(buf);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/* Units are spread over jobs by size, largest first */
+static int unit_cmp_len(const void *a, const void *b)
+{
+	const struct mig_unit *u1 = a, *u2 = b;
+
+	if (u1->h.len != u2->h.len)
+		return u1->h.len > u2->h.len ? -1 : 1;
+	return 0;
+}
+
+static int sync_worker(struct migrate *m, struct mig_unit *units, int n)
+{
+	struct mig_chan ch;
+	int ret;
+
+	/* Control channel belongs to the parent */
+	close(m->ctl.rd);
+	close(m->ctl.wr);
+	if ((ret = mig_open(m->tr, &ch, m->rargv, &m->dest, MIG_CH_SYNC,
+			m->veid)) == 0)
+		ret = mig_sync_send(&ch, m->private, units, n) ? MIG_ERR_COPY : 0;
+	mig_close(&ch);
+	return ret;
+}
+
+static int sync_units(struct migrate *m, struct mig_unit *units, int n)
+{
+	struct mig_unit **job_units;
+	unsigned long long load[MAX_JOBS];
+	int cnt[MAX_JOBS];
+	pid_t pids[MAX_JOBS];
+	struct pollfd pfd;
+	pid_t pid;
+	int i, j, jobs, left, status, ret = 0;
+
+	jobs = n < m->jobs ? n : m->jobs;
+	qsort(units, n, sizeof(*units), unit_cmp_len);
+	if ((job_units = calloc(jobs, sizeof(*job_units))) == NULL)
+		return MIG_ERR_COPY;
+	for (j = 0; j < jobs; j++) {
+		load[j] = 0;
+		cnt[j] = 0;
+		if ((job_units[j] = malloc(n * sizeof(**job_units))) == NULL) {
+			ret = MIG_ERR_COPY;
+			goto out;
+		}
+	}
+	for (i = 0; i < n; i++) {
+		int min = 0;
+
+		for (j = 1; j < jobs; j++)
+			if (load[j] < load[min])
+				min = j;
+		job_units[min][cnt[min]++] = units[i];
+		load[min] += units[i].h.len;
+	}
+	fflush(stdout);
+	fflush(stderr);
+	for (j = 0; j < jobs; j++) {
+		logger(2, 0, "Stream %d: %d units, %llu MB", j, cnt[j],
+			load[j] >> 20);
+		if ((pids[j] = fork()) < 0) {
+			logger(-1, errno, "Unable to fork");
+			ret = MIG_ERR_COPY;
+			jobs = j;
+			break;
+		} else if (pids[j] == 0) {
+			_exit(sync_worker(m, job_units[j], cnt[j]));
+		}
+	}
+	/* Changes keep coming while the streams work, not to overflow */
+	for (left = jobs; left > 0; ) {
+		if (m->tracker != NULL) {
+			pfd.fd = mig_track_fd(m->tracker);
+			pfd.events = POLLIN;
+			poll(&pfd, 1, 200);
+			mig_track_poll(m->tracker);
+		}
+		for (j = 0; j < jobs; j++) {
+			if (pids[j] <= 0)
+				continue;
+			pid = waitpid(pids[j], &status,
+				m->tracker != NULL ? WNOHANG : 0);
+			if (pid == 0 || (pid < 0 && errno == EINTR))
+				continue;
+			if (pid < 0 || !WIFEXITED(status) ||
+					WEXITSTATUS(status))
+				ret = MIG_ERR_COPY;
+			pids[j] = 0;
+			left--;
+		}
+	}
+out:
+	for (j = 0; j < jobs; j++)
+		free(job_units[j]);
+	free(job_units);
+	return ret;
+}
+
+/* One pass over the private area, or over the changes in d */
+static int sync_pass(struct migrate *m, struct mig_delta *d)
+{
+	struct mig_tree scan, *tree = &scan;
+	struct mig_unit *units = NULL;
+	struct mig_ent *e;
+	unsigned long long total = 0;
+	uint32_t flags = 0;
+	uint64_t off;
+	uint8_t *todo;
+	void *data;
+	size_t len;
+	int i, n = 0, size = 0, type, ret = MIG_ERR_COPY;
+
+	memset(&scan, 0, sizeof(scan));
+	if (d != NULL) {
+		if (d->tree.n == 0 && d->ndel == 0)
+			return 0;
+		tree = &d->tree;
+		flags = MIG_TREE_DELTA;
+	} else {
+		span_begin("scan");
+		ret = mig_scan_tree(m->private, &scan, &m->inodes,
+			m->tracker) ? MIG_ERR_COPY : 0;
+		span_end();
+		if (ret)
+			goto out;
+	}
+	span_begin("tree");
+	ret = 0;
+	if ((d != NULL && mig_pack_delete(&m->ctl, d->del, d->ndel)) ||
+			mig_pack_tree(&m->ctl, tree, flags) ||
+			mig_recv(&m->ctl, &type, &data, &len)) {
+		ret = MIG_ERR_PROTO;
+	} else if (type == MIG_REPLY) {
+		/* Receiver failed to make the tree */
+		ret = len == sizeof(int32_t) ? *(int32_t *) data :
+			MIG_ERR_PROTO;
+	} else if (type != MIG_TODO || len != (size_t) tree->n / 8 + 1) {
+		logger(-1, 0, "Migration protocol error: bad file list");
+		ret = MIG_ERR_PROTO;
+	}
+	span_end();
+	if (ret)
+		goto out;
+	todo = data;
+	for (i = 0; i < tree->n; i++) {
+		e = &tree->ent[i];
+		if (!(todo[i / 8] & (1 << (i % 8))))
+			continue;
+		for (off = 0; off < e->h.size; off += MIG_UNIT) {
+			if (n == size) {
+				struct mig_unit *u;
+
+				size = size ? size * 2 : 1024;
+				u = realloc(units, size * sizeof(*units));
+				if (u == NULL) {
+					logger(-1, ENOMEM, "Can not sync files");
+					ret = MIG_ERR_COPY;
+					goto out;
+				}
+				units = u;
+			}
+			units[n].h.offset = off;
+			units[n].h.len = e->h.size - off < MIG_UNIT ?
+				e->h.size - off : MIG_UNIT;
+			units[n].h.size = e->h.size;
+			units[n].h.mtime = e->h.mtime;
+			units[n].h.mtime_ns = e->h.mtime_ns;
+			units[n].h.path_len = e->h.path_len;
+			units[n].path = e->path;
+			total += units[n].h.len;
+			n++;
+		}
+	}
+	logger(1, 0, "%d entries, %llu MB in changed files", tree->n,
+		total >> 20);
+	span_begin("data");
+	if (n > 0)
+		ret = sync_units(m, units, n);
+	span_end();
+	if (ret)
+		goto out;
+	span_begin("attrs");
+	ret = ctl_call(m, MIG_ATTRS, NULL, 0, NULL, 0);
+	span_end();
+out:
+	free(units);
+	mig_free_tree(&scan);
+	return ret;
+}
+
+static double elapsed(struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) +
+		(now.tv_usec - start->tv_usec) / 1e6;
+}
+
+/* Pre-copy rounds while the CT runs: each one moves what has changed
+ * during the previous one, until the changes are small or do not
+ * shrink anymore, which leaves as little as possible for the downtime.
+ */
+static int precopy(struct migrate *m, double secs)
+{
+	struct mig_delta d;
+	struct timeval start;
+	unsigned long long prev_bytes = 0;
+	int round, prev_n = 0, ret;
+
+	for (round = 1; round <= m->rounds; round++) {
+		if ((ret = mig_track_delta(m->tracker, &m->inodes, &d)) < 0)
+			return MIG_ERR_COPY;
+		gettimeofday(&start, NULL);
+		if (ret > 0) {
+			logger(0, 0, "Pre-copy round %d: changes not tracked,"
+				" syncing all", round);
+			span_begin("precopy");
+			ret = sync_pass(m, NULL);
+			span_end();
+			if (ret)
+				return ret;
+			secs = elapsed(&start);
+			prev_n = 0;
+			continue;
+		}
+		logger(0, 0, "Pre-copy round %d: %d entries, %llu MB dirty"
+			" (%.1f MB/s)", round, d.tree.n + d.ndel, d.bytes >> 20,
+			secs > 0 ? d.bytes / secs / (1024 * 1024) : 0);
+		if (d.bytes <= CONVERGED_BYTES &&
+				d.tree.n + d.ndel <= CONVERGED_ENTRIES) {
+			logger(1, 0, "Changes converged");
+			mig_free_delta(&d);
+			break;
+		}
+		/* Changing as fast as it is synced, more rounds won't help */
+		if (prev_n && d.bytes > prev_bytes / 5 * 4 &&
+				d.tree.n + d.ndel > prev_n / 5 * 4) {
+			logger(1, 0, "Changes do not converge");
+			mig_free_delta(&d);
+			break;
+		}
+		prev_bytes = d.bytes;
+		prev_n = d.tree.n + d.ndel;
+		mig_track_clear(m->tracker);
+		span_begin("precopy");
+		ret = sync_pass(m, &d);
+		span_end();
+		mig_free_delta(&d);
+		if (ret)
+			return ret;
+		secs = elapsed(&start);
+	}
+	return 0;
+}
+
+/* Pass with the CT stopped or suspended */
+static int final_pass(struct migrate *m)
+{
+	struct mig_delta d;
+	int ret;
+
+	if (m->tracker == NULL)
+		return sync_pass(m, NULL);
+	/* Writes to shared mappings are not seen by the tracker */
+	if (m->suspended)
+		mig_track_open_files(m->tracker, m->veid,
+			m->param->res.fs.root);
+	if ((ret = mig_track_delta(m->tracker, &m->inodes, &d)) < 0)
+		return MIG_ERR_COPY;
+	if (ret > 0) {
+		logger(1, 0, "Changes not tracked, syncing all");
+		return sync_pass(m, NULL);
+	}
+	logger(1, 0, "%d entries, %llu MB dirty", d.tree.n + d.ndel,
+		d.bytes >> 20);
+	ret = sync_pass(m, &d);
+	mig_free_delta(&d);
+	return ret;
+}
+
+/* Stream the dump of suspended CT to the destination */
+static int send_dump(struct migrate *m)
+{
+	struct mig_chan ch;
+	cpt_param cpt;
+	int ret;
+
+	if ((ret = mig_open(m->tr, &ch, m->rargv, &m->dest, MIG_CH_DUMP,
+			m->veid)))
+		goto out;
+	memset(&cpt, 0, sizeof(cpt));
+	cpt.cmd = CMD_DUMP;
+	cpt.compress = m->compress;
+	cpt.stream_fd = ch.wr;
+	ret = vps_chkpnt(m->h, m->veid, m->param, CMD_DUMP, &cpt);
+	/* Receiver sees the end of the dump */
+	close(ch.wr);
+	ch.wr = -1;
+	if (ret) {
+		logger(-1, 0, "Failed to dump container");
+		ret = MIG_ERR_CHECKPOINT;
+	} else if ((ret = mig_wait_reply(&ch))) {
+		logger(-1, 0, "Failed to copy dump");
+	}
+out:
+	mig_close(&ch);
+	return ret;
+}
+
+static int send_quota(struct migrate *m)
+{
+	char veid[16], path[PATH_LEN];
+	char *argv[] = {"vzdqdump", veid, "-U", "-G", "-T", NULL};
+	char buf[MIG_BLOCK];
+	int fds[2], ret = 0;
+	ssize_t n;
+	pid_t pid;
+
+	if (m->param->res.dq.enable == NO) {
+		logger(1, 0, "VZ disk quota disabled -- skipping quota"
+			" migration");
+		return 0;
+	}
+	logger(0, 0, "Syncing 2nd level quota");
+	snprintf(veid, sizeof(veid), "%d", m->veid);
+	if (spawn_find("vzdqdump", path, sizeof(path))) {
+		logger(-1, 0, "vzdqdump not found");
+		return MIG_ERR_QUOTA;
+	}
+	if (pipe2(fds, O_CLOEXEC)) {
+		logger(-1, errno, "Unable to create pipe");
+		return MIG_ERR_QUOTA;
+	}
+	pid = spawn_prog(path, argv, environ, SPAWN_NULL, fds[1], SPAWN_KEEP);
+	close(fds[1]);
+	if (pid < 0) {
+		close(fds[0]);
+		return MIG_ERR_QUOTA;
+	}
+	/* Loaded on the destination as it comes */
+	while ((n = read(fds[0], buf, sizeof(buf))) != 0) {
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = MIG_ERR_QUOTA;
+			break;
+		}
+		if (mig_send(&m->ctl, MIG_QUOTA, buf, n)) {
+			ret = MIG_ERR_PROTO;
+			break;
+		}
+	}
+	close(fds[0]);
+	if (spawn_wait(pid, path) && !ret) {
+		logger(-1, 0, "Failed to dump 2nd level quota");
+		ret = MIG_ERR_QUOTA;
+	}
+	if (ret)
+		return ret;
+	return ctl_call(m, MIG_QUOTA_END, NULL, 0, NULL, 0);
+}
+
+static int stop_source(struct migrate *m)
+{
+	if (m->online) {
+		logger(0, 0, "Live migrating container...");
+		logger(1, 0, "Suspending container");
+		if (run_vzctl(m, "chkpnt", "--suspend")) {
+			logger(-1, 0, "Failed to suspend container");
+			return MIG_ERR_CHECKPOINT;
+		}
+		m->suspended = 1;
+		logger(1, 0, "Dumping container");
+		return send_dump(m);
+	}
+	if (m->state & CT_ST_RUNNING) {
+		logger(0, 0, "Stopping container");
+		if (run_vzctl(m, "stop", NULL)) {
+			logger(-1, 0, "Failed to stop container");
+			return MIG_ERR_STOP_SOURCE;
+		}
+	} else if (m->state & CT_ST_MOUNTED) {
+		logger(0, 0, "Unmounting container");
+		if (run_vzctl(m, "umount", NULL)) {
+			logger(-1, 0, "Failed to umount container");
+			return MIG_ERR_STOP_SOURCE;
+		}
+	}
+	m->stopped = 1;
+	return 0;
+}
+
+static void undo_source(struct migrate *m)
+{
+	if (m->suspended) {
+		run_vzctl(m, "chkpnt", "--resume");
+	} else if (m->stopped) {
+		if (m->state & CT_ST_RUNNING)
+			run_vzctl(m, "start", NULL);
+		else if (m->state & CT_ST_MOUNTED)
+			run_vzctl(m, "mount", NULL);
+	}
+}
+
+static int migrate(struct migrate *m)
+{
+	char conf[PATH_LEN], migrated[PATH_LEN + 16];
+	int32_t state = m->state;
+	struct timeval start;
+	int ret;
+
+	logger(0, 0, "Starting %smigration of CT %d to %s",
+		m->online ? "online " : "", m->veid, m->dest.host);
+	if ((ret = mig_open(m->tr, &m->ctl, m->rargv, &m->dest, MIG_CH_CTL,
+			m->veid)))
+	{
+		logger(-1, 0, "Can't connect to destination node %s",
+			m->dest.host);
+		mig_close(&m->ctl);
+		return ret;
+	}
+	logger(0, 0, "Preparing remote node");
+	span_begin("prepare");
+	if (!(ret = send_config(m)))
+		ret = ctl_call(m, MIG_PREPARE, NULL, 0, NULL, 0);
+	span_end();
+	if (ret)
+		goto err;
+
+	/* Changes made from now on are not missed */
+	if ((m->state & CT_ST_RUNNING) && !m->no_track && m->rounds > 0)
+		m->tracker = mig_track_init(m->private,
+			m->param->res.fs.root);
+	logger(0, 0, "Syncing private");
+	span_begin("sync");
+	gettimeofday(&start, NULL);
+	ret = sync_pass(m, NULL);
+	span_end();
+	if (!ret && m->tracker != NULL)
+		ret = precopy(m, elapsed(&start));
+	if (ret) {
+		logger(-1, 0, "Failed to sync container private areas");
+		goto err;
+	}
+
+	/* Downtime starts here */
+	span_begin("stop");
+	ret = stop_source(m);
+	span_end();
+	if (ret)
+		goto err;
+	if (m->state & CT_ST_RUNNING) {
+		logger(1, 0, "Syncing private (final pass)");
+		span_begin("sync2");
+		ret = final_pass(m);
+		span_end();
+		if (ret) {
+			logger(-1, 0, "Failed to sync container private areas");
+			goto err;
+		}
+	}
+	span_begin("quota");
+	ret = send_quota(m);
+	span_end();
+	if (ret)
+		goto err;
+	if (m->online) {
+		logger(1, 0, "Undumping container");
+		span_begin("undump");
+		ret = ctl_call(m, MIG_RESTORE, NULL, 0, NULL, 0);
+		span_end();
+		if (ret)
+			goto err;
+		logger(0, 0, "Cleanup");
+		logger(1, 0, "Killing container");
+		run_vzctl(m, "chkpnt", "--kill");
+		run_vzctl(m, "umount", NULL);
+	} else {
+		if (state & CT_ST_RUNNING)
+			logger(0, 0, "Starting container");
+		else if (state & CT_ST_MOUNTED)
+			logger(0, 0, "Mounting container");
+		span_begin("start");
+		ret = ctl_call(m, MIG_START, &state, sizeof(state), NULL, 0);
+		span_end();
+		if (ret)
+			goto err;
+		logger(0, 0, "Cleanup");
+	}
+	ctl_call(m, MIG_DONE, NULL, 0, NULL, 0);
+	mig_close(&m->ctl);
+
+	if (m->remove_area) {
+		logger(1, 0, "Destroying container");
+		run_vzctl(m, "destroy", NULL);
+	} else {
+		/* Config as veid.migrated allows backward migration */
+		get_vps_conf_path(m->veid, conf, sizeof(conf));
+		snprintf(migrated, sizeof(migrated), "%s.migrated", conf);
+		rename(conf, migrated);
+	}
+	return 0;
+
+err:
+	undo_source(m);
+	if (ret != MIG_ERR_PROTO)
+		ctl_call(m, MIG_ABORT, NULL, 0, NULL, 0);
+	mig_close(&m->ctl);
+	return ret;
+}
+
+static struct option options[] = {
+	{"remove-area",	required_argument, NULL, 'r'},
+	{"ssh",		required_argument, NULL, 's'},
+	{"rsync",	required_argument, NULL, 'R'},
+	{"keep-dst",	no_argument, NULL, 'k'},
+	{"online",	no_argument, NULL, 'o'},
+	{"jobs",	required_argument, NULL, 'j'},
+	{"precopy-rounds", required_argument, NULL, 'p'},
+	{"no-track",	no_argument, NULL, 'n'},
+	{"compress",	required_argument, NULL, 'c'},
+	{"transport",	required_argument, NULL, 't'},
+	{"dst-private",	required_argument, NULL, 'P'},
+	{"dst-root",	required_argument, NULL, 'T'},
+	{"dst-confdir",	required_argument, NULL, 'C'},
+	{"receiver",	no_argument, NULL, 'X'},
+	{"verbose",	no_argument, NULL, 'v'},
+	{"help",	no_argument, NULL, 'h'},
+	{ NULL, 0, NULL, 0 }
+};
+
+int main(int argc, char **argv)
+{
+	struct migrate m;
+	vps_param *vps_p;
+	char *dst_private = NULL, *dst_root = NULL, *dst_confdir = NULL;
+	char *transport = "ssh";
+	char conf[PATH_LEN], self[PATH_LEN];
+	int c, i, veid, receiver = 0, ret;
+	ssize_t n;
+
+	memset(&m, 0, sizeof(m));
+	m.remove_area = 1;
+	m.jobs = DEF_JOBS;
+	m.rounds = DEF_ROUNDS;
+	/* Lost channel shows up as a write error */
+	signal(SIGPIPE, SIG_IGN);
+	while ((c = getopt_long(argc, argv, "r:j:vh", options, NULL)) != -1) {
+		switch (c) {
+		case 'r':
+			if (!strcmp(optarg, "yes"))
+				m.remove_area = 1;
+			else if (!strcmp(optarg, "no"))
+				m.remove_area = 0;
+			else
+				usage(MIG_ERR_USAGE);
+			break;
+		case 's':
+			m.dest.ssh_opts = optarg;
+			break;
+		case 'R':
+			fprintf(stderr, "Warning: rsync is not used, --rsync"
+				" is ignored\n");
+			break;
+		case 'k':
+			m.keep_dst = 1;
+			break;
+		case 'o':
+			m.online = 1;
+			break;
+		case 'j':
+			if (parse_int(optarg, &m.jobs) || m.jobs < 1 ||
+					m.jobs > MAX_JOBS) {
+				fprintf(stderr, "Invalid number of jobs: %s\n",
+					optarg);
+				usage(MIG_ERR_USAGE);
+			}
+			break;
+		case 'p':
+			if (parse_int(optarg, &m.rounds) || m.rounds < 0) {
+				fprintf(stderr, "Invalid number of rounds: %s\n",
+					optarg);
+				usage(MIG_ERR_USAGE);
+			}
+			break;
+		case 'n':
+			m.no_track = 1;
+			break;
+		case 'c':
+			if ((m.compress = cpt_compress_id(optarg)) < 0) {
+				fprintf(stderr, "Unknown compression: %s\n",
+					optarg);
+				usage(MIG_ERR_USAGE);
+			}
+			break;
+		case 't':
+			transport = optarg;
+			break;
+		case 'P':
+			dst_private = optarg;
+			break;
+		case 'T':
+			dst_root = optarg;
+			break;
+		case 'C':
+			dst_confdir = optarg;
+			break;
+		case 'X':
+			receiver = 1;
+			break;
+		case 'v':
+			m.verbose++;
+			break;
+		case 'h':
+			usage(0);
+			break;
+		default:
+			usage(MIG_ERR_USAGE);
+		}
+	}
+	if (receiver) {
+		init_log(NULL, 0, 1, m.verbose, 0, "vzmigrate");
+		return mig_receiver(dst_private, dst_root, dst_confdir);
+	}
+	if (argc - optind != 2)
+		usage(MIG_ERR_USAGE);
+	m.dest.host = argv[optind];
+	if ((m.tr = mig_find_transport(transport)) == NULL) {
+		fprintf(stderr, "Unknown transport: %s\n", transport);
+		usage(MIG_ERR_USAGE);
+	}
+	/* CT names are supported as well */
+	if (parse_int(argv[optind + 1], &veid)) {
+		init_log(NULL, 0, 0, 0, 0, "vzmigrate");
+		if ((veid = get_veid_by_name(argv[optind + 1])) < 0) {
+			fprintf(stderr, "Unable to find container by name %s\n",
+				argv[optind + 1]);
+			return MIG_ERR_NOEXIST;
+		}
+	}
+	m.veid = veid;
+
+	m.param = init_vps_param();
+	if (vps_parse_config(m.veid, GLOBAL_CFG, m.param, NULL)) {
+		fprintf(stderr, "Error: Can't read global config file %s\n",
+			GLOBAL_CFG);
+		return MIG_ERR_NOEXIST;
+	}
+	init_log(m.param->log.log_file, m.veid, m.param->log.enable != NO,
+		m.param->log.level, 0, "vzmigrate");
+	set_log_verbose(m.verbose);
+	get_vps_conf_path(m.veid, conf, sizeof(conf));
+	vps_p = init_vps_param();
+	if (!stat_file(conf) || vps_parse_config(m.veid, conf, vps_p, NULL)) {
+		logger(-1, 0, "CT #%d doesn't exist", m.veid);
+		return MIG_ERR_NOEXIST;
+	}
+	merge_vps_param(m.param, vps_p);
+	free_vps_param(vps_p);
+	m.private = m.param->res.fs.private;
+	if (m.private == NULL || !stat_file(m.private)) {
+		logger(-1, 0, "CT #%d doesn't exist", m.veid);
+		return MIG_ERR_NOEXIST;
+	}
+
+	/* Without OpenVZ running nothing can run */
+	if (stat_file("/proc/vz"))
+		m.h = vz_open(m.veid);
+	m.state = ct_status_probe(m.h, m.veid, m.param->res.fs.root,
+		m.param->res.cpt.dumpdir);
+	if (m.online) {
+		if (!(m.state & CT_ST_RUNNING)) {
+			logger(-1, 0, "Can't perform online migration of"
+				" a stopped container");
+			return MIG_ERR_VPS_IS_STOPPED;
+		}
+		if (!stat_file("/proc/cpt")) {
+			logger(-1, 0, "vzcpt module is not loaded on the"
+				" source node");
+			return MIG_ERR_OVZ_NOT_RUNNING;
+		}
+	}
+
+	/* Receiver is this same program, on the other side */
+	i = 0;
+	if (!strcmp(transport, "local")) {
+		if ((n = readlink("/proc/self/exe", self,
+				sizeof(self) - 1)) < 0) {
+			logger(-1, errno, "Can not find vzmigrate binary");
+			return MIG_ERR_CANT_CONNECT;
+		}
+		self[n] = '\0';
+		m.rargv[i++] = self;
+	} else {
+		m.rargv[i++] = SBINDIR "/vzmigrate";
+	}
+	m.rargv[i++] = "--receiver";
+	if (m.verbose)
+		m.rargv[i++] = "-v";
+	if (dst_private != NULL) {
+		m.rargv[i++] = "--dst-private";
+		m.rargv[i++] = dst_private;
+	}
+	if (dst_root != NULL) {
+		m.rargv[i++] = "--dst-root";
+		m.rargv[i++] = dst_root;
+	}
+	if (dst_confdir != NULL) {
+		m.rargv[i++] = "--dst-confdir";
+		m.rargv[i++] = dst_confdir;
+	}
+	m.rargv[i] = NULL;
+
+	span_start(m.veid, "migrate", m.param->opt.timing_log);
+	ret = migrate(&m);
+	span_finish(ret);
+	mig_track_free(m.tracker);
+	mig_free_inodes(&m.inodes);
+	if (m.h != NULL)
+		vz_close(m.h);
+	free_vps_param(m.param);
+	return ret;
+}
@@ -0,0 +1,184 @@
+/*
+ *  Copyright (C) 2000-2011, Parallels, Inc. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Latency benchmark for starting host helper programs
+ *
+ * Runs a program (/bin/true by default) over and over, with
+ * RLIMIT_NOFILE raised, in three ways:
+ *   fork-loop	fork(), close() of every possible fd, exec
+ *		(how helpers used to be started)
+ *   fork	fork(), close_fds(), exec
+ *   spawn	spawn_prog(), as run_script() does
+ *
+ * Not installed, build with "make vzspawnbench".
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "types.h"
+#include "spawnprog.h"
+#include "logger.h"
+#include "util.h"
+
+#define DEF_NOFILE	(1024 * 1024)
+#define DEF_RUNS	200
+
+static char *envp[] = {ENV_PATH, NULL};
+
+static void usage(int rc)
+{
+	fprintf(rc ? stderr : stdout,
+"Usage: vzspawnbench [-f <nofile>] [-n <runs>] [program]\n"
+"  -f	RLIMIT_NOFILE to set (default %d)\n"
+"  -n	runs of each mode (default %d)\n",
+		DEF_NOFILE, DEF_RUNS);
+	exit(rc);
+}
+
+static double tv_diff(struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) +
+		(now.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+/* close_fds() as it was, one close() per possible fd */
+static void close_loop(void)
+{
+	int fd, max;
+
+	max = sysconf(_SC_OPEN_MAX);
+	for (fd = 3; fd < max; fd++)
+		close(fd);
+}
+
+static int run_fork(char *argv[], int loop)
+{
+	pid_t pid;
+	int status;
+
+	if ((pid = fork()) < 0) {
+		logger(-1, errno, "Unable to fork");
+		return -1;
+	} else if (pid == 0) {
+		if (loop)
+			close_loop();
+		else
+			close_fds(0, -1);
+		execve(argv[0], argv, envp);
+		_exit(127);
+	}
+	while (waitpid(pid, &status, 0) < 0)
+		if (errno != EINTR)
+			return -1;
+	return !WIFEXITED(status) || WEXITSTATUS(status);
+}
+
+static int run_spawn(char *argv[])
+{
+	pid_t pid;
+
+	if ((pid = spawn_prog(argv[0], argv, envp,
+			SPAWN_KEEP, SPAWN_KEEP, SPAWN_KEEP)) < 0)
+		return -1;
+	return spawn_wait(pid, argv[0]);
+}
+
+static int run_mode(const char *name, int mode, char *argv[], int runs)
+{
+	struct timeval start;
+	double t;
+	int i, ret;
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < runs; i++) {
+		ret = mode == 2 ? run_spawn(argv) : run_fork(argv, mode == 0);
+		if (ret) {
+			fprintf(stderr, "%s: %s failed\n", name, argv[0]);
+			return 1;
+		}
+	}
+	t = tv_diff(&start);
+	printf("%-10s %8d %12.1f\n", name, runs, t * 1000000 / runs);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct rlimit rl;
+	unsigned long nofile = DEF_NOFILE;
+	int runs = DEF_RUNS;
+	char *prog[] = {"/bin/true", NULL};
+	int c;
+
+	while ((c = getopt(argc, argv, "f:n:h")) > 0) {
+		switch (c) {
+		case 'f':
+			if (parse_ul(optarg, &nofile) || nofile < 64) {
+				fprintf(stderr, "Invalid nofile: %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'n':
+			if (parse_int(optarg, &runs) || runs <= 0) {
+				fprintf(stderr, "Invalid runs: %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'h':
+			usage(0);
+			break;
+		default:
+			usage(1);
+		}
+	}
+	if (optind < argc)
+		prog[0] = argv[optind];
+	init_log(NULL, 0, 1, 0, 0, "vzspawnbench");
+	rl.rlim_cur = rl.rlim_max = nofile;
+	if (setrlimit(RLIMIT_NOFILE, &rl)) {
+		/* Not allowed to raise the hard limit, go up to it */
+		logger(0, errno, "Unable to set RLIMIT_NOFILE to %lu",
+			nofile);
+		if (getrlimit(RLIMIT_NOFILE, &rl))
+			exit(1);
+		rl.rlim_cur = rl.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &rl))
+			exit(1);
+	}
+	printf("RLIMIT_NOFILE %lu\n", (unsigned long) rl.rlim_cur);
+	printf("%-10s %8s %12s\n", "MODE", "RUNS", "USEC/SPAWN");
+	fflush(stdout);
+	if (run_mode("fork-loop", 0, prog, runs) ||
+		run_mode("fork", 1, prog, runs) ||
+		run_mode("spawn", 2, prog, runs))
+	{
+		exit(1);
+	}
+	exit(0);
+}
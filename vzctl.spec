@@ -43,9 +43,9 @@ Requires: fileutils
 Requires: vzctl-lib = %{version}-%{release}
 Requires: tar
 
-# requires for vzmigrate purposes
-Requires: rsync
 Requires: gawk
+
+# requires for vzmigrate purposes
 Requires: openssh
 
 # Virtual provides for newer RHEL6 kernel
@@ -110,6 +110,7 @@ rm -rf $RPM_BUILD_ROOT
 %attr(755,root,root) %{_sbindir}/vzcalc
 %attr(755,root,root) %{_sbindir}/vzpid
 %attr(755,root,root) %{_sbindir}/vzcfgvalidate
+%attr(755,root,root) %{_sbindir}/vzcfgscale
 %attr(755,root,root) %{_sbindir}/vzmigrate
 %attr(755,root,root) %{_sbindir}/vzifup-post
 %attr(755,root,root) %{_sbindir}/vzubc
@@ -128,6 +129,7 @@ rm -rf $RPM_BUILD_ROOT
 %attr(644, root, root) %{_mandir}/man8/ndsend.8.*
 %attr(644, root, root) %{_mandir}/man8/vzsplit.8.*
 %attr(644, root, root) %{_mandir}/man8/vzcfgvalidate.8.*
+%attr(644, root, root) %{_mandir}/man8/vzcfgscale.8.*
 %attr(644, root, root) %{_mandir}/man8/vzmemcheck.8.*
 %attr(644, root, root) %{_mandir}/man8/vzcalc.8.*
 %attr(644, root, root) %{_mandir}/man8/vzpid.8.*